@@ -632,7 +632,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, int value) {
             params.n_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-ps", "--p-split"}, "N",
         format("speculative decoding split probability (default: %.1f)", (double)params.p_split),
@@ -646,14 +646,21 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
         [](gpt_params & params, const std::string & value) {
             params.lookup_cache_dynamic = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--lookup"},
+        format("draft tokens for speculative decoding by looking up n-grams in the context (default: %s)", params.lookup ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.lookup = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-c", "--ctx-size"}, "N",
         format("size of the prompt context (default: %d, 0 = loaded from model)", params.n_ctx),
@@ -1311,6 +1318,21 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(llama_arg(
+        {"--kv-block-size"}, "N",
+        format("KV cache block size for paged allocation, the context size must be a multiple of it (default: %d, 0 = contiguous)", params.kv_block_size),
+        [](gpt_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(llama_arg(
+        {"--output-top-k"}, "N",
+        format("select the top N tokens of each output in the compute graph and sample from them only, instead of copying the full logits (default: %d, 0 = disabled)\n"
+               "the full logits are still used with a grammar, logit biases, penalties or n_probs > N", params.output_top_k),
+        [](gpt_params & params, int value) {
+            params.output_top_k = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_PARALLEL}).set_env("LLAMA_ARG_OUTPUT_TOP_K"));
     add_opt(llama_arg(
         {"-np", "--parallel"}, "N",
         format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -1376,6 +1398,46 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(llama_arg(
+        {"--lazy-load"},
+        "with --no-mmap, start once the first layer is loaded and load the other layers in the background,\n"
+        "the evaluation waits for the layers that are not loaded yet",
+        [](gpt_params & params) {
+            params.lazy_load = true;
+        }
+    ).set_env("LLAMA_ARG_LAZY_LOAD"));
+    add_opt(llama_arg(
+        {"--no-repack"},
+        "do not repack Q4_0 weights of CPU layers into the interleaved layout of the CPU matrix multiplication kernels (they are only repacked with --no-mmap, --repack-cache or --shm)",
+        [](gpt_params & params) {
+            params.use_repack = false;
+        }
+    ).set_env("LLAMA_ARG_NO_REPACK"));
+    add_opt(llama_arg(
+        {"--repack-cache"},
+        "save the repacked weights to a cache file next to the model on the first load, and map them from it on the next loads",
+        [](gpt_params & params) {
+            params.use_repack_cache = true;
+        }
+    ).set_env("LLAMA_ARG_REPACK_CACHE"));
+    add_opt(llama_arg(
+        {"--huge-pages"},
+        "allocate the CPU buffers of the model, the KV cache and the compute buffers with huge pages (Linux only),\n"
+        "use with --no-mmap to also back the model weights with huge pages",
+        [](gpt_params & params) {
+            params.use_huge_pages = true;
+        }
+    ).set_env("LLAMA_ARG_HUGE_PAGES"));
+    add_opt(llama_arg(
+        {"--shm"}, "NAME",
+        "share the CPU weights between the processes through the shared memory object NAME (Linux only):\n"
+        "the first process writes its loaded weights to it, the next ones map them read-only,\n"
+        "the first process holds both copies while writing, up to twice the size of the CPU weights in memory,\n"
+        "an object owned by another user or writable by the other users is not used",
+        [](gpt_params & params, const std::string & value) {
+            params.shm_name = value;
+        }
+    ).set_env("LLAMA_ARG_SHM"));
     add_opt(llama_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
@@ -1412,7 +1474,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
                 fprintf(stderr, "warning: see main README.md for information on enabling GPU BLAS support\n");
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-sm", "--split-mode"}, "{none,layer,row}",
         "how to split the model across multiple GPUs, one of:\n"
@@ -1557,7 +1619,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, const std::string & value) {
             params.model_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-mu", "--model-url"}, "MODEL_URL",
         "model download url (default: unused)",
@@ -1879,6 +1941,63 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.slot_prompt_similarity = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--prefix-cache"}, "N",
+        format("number of extra KV sequences used to keep the prompts of finished requests, so that any slot can reuse their longest common prefix (default: %d, 0 = disabled)", params.n_prefix_cache),
+        [](gpt_params & params, int value) {
+            params.n_prefix_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE"));
+    add_opt(llama_arg(
+        {"--prefix-cache-ram"}, "N",
+        format("host memory in MiB used to keep the KV state of cached prompts that are evicted from the KV cache (default: %d, 0 = disabled)", params.prefix_cache_ram),
+        [](gpt_params & params, int value) {
+            params.prefix_cache_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_RAM"));
+    add_opt(llama_arg(
+        {"--prefix-cache-disk"}, "N",
+        format("disk space in MiB used to keep the KV state of cached prompts that are evicted from host memory, in files mapped from --slot-save-path (not supported on Windows) (default: %d, 0 = disabled)", params.prefix_cache_disk),
+        [](gpt_params & params, int value) {
+            params.prefix_cache_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_DISK"));
+    add_opt(llama_arg(
+        {"--prefill-chunk"}, "N",
+        format("max number of prompt tokens processed for a slot in one step, longer prompts are split across steps (default: %d, 0 = n_batch)", params.n_prefill_chunk),
+        [](gpt_params & params, int value) {
+            params.n_prefill_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_CHUNK"));
+    add_opt(llama_arg(
+        {"--step-budget"}, "N",
+        format("max number of tokens decoded in one step, generated tokens are admitted first and prompt tokens fill the rest (default: %d, 0 = n_batch)", params.n_step_budget),
+        [](gpt_params & params, int value) {
+            params.n_step_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_STEP_BUDGET"));
+    add_opt(llama_arg(
+        {"--lora-model"}, "NAME", "FNAME",
+        "serve the base model with the LoRA adapter FNAME to the requests for model NAME, the adapter is loaded on first use\n"
+        "can be repeated to serve several models, or to stack several adapters under one name",
+        [](gpt_params & params, const std::string & name, const std::string & fname) {
+            auto it = std::find_if(params.lora_models.begin(), params.lora_models.end(), [&](const llama_lora_model_info & m) {
+                return m.name == name;
+            });
+            if (it == params.lora_models.end()) {
+                params.lora_models.push_back({ name, {} });
+                it = params.lora_models.end() - 1;
+            }
+            it->adapters.push_back({ fname, 1.0f });
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--lora-models-mem"}, "N",
+        format("memory in MiB for the adapters of --lora-model, the least recently used ones are unloaded when it is exceeded (default: %d, 0 = unlimited)", params.lora_models_mem),
+        [](gpt_params & params, int value) {
+            params.lora_models_mem = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_LORA_MODELS_MEM"));
     add_opt(llama_arg(
         {"--lora-init-without-apply"},
         format("load LoRA adapters without applying them (apply later via POST /lora-adapters) (default: %s)", params.lora_init_without_apply ? "enabled" : "disabled"),
@@ -4,6 +4,7 @@
 
 #include "common.h"
 #include "log.h"
+#include "sampling.h"
 // Change JSON_ASSERT from assert() to GGML_ASSERT:
 #define JSON_ASSERT GGML_ASSERT
 #include "json.hpp"
@@ -847,6 +848,13 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
         return iparams;
     }
 
+    if (params.output_top_k > 0 && gpt_sampler_needs_full_logits(params.sparams, params.output_top_k)) {
+        LOG_WRN("%s: --output-top-k is not used with a grammar, logit biases, penalties or n_probs > %d\n", __func__, params.output_top_k);
+    } else if (params.output_top_k > 0) {
+        // the samplers apply the temperature
+        llama_set_output_top_k(lctx, params.output_top_k, 1.0f);
+    }
+
     if (!params.control_vectors.empty()) {
         if (params.control_vector_layer_start <= 0) params.control_vector_layer_start = 1;
         if (params.control_vector_layer_end   <= 0) params.control_vector_layer_end   = llama_n_layer(model);
@@ -949,12 +957,17 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
         mparams.n_gpu_layers = params.n_gpu_layers;
     }
     mparams.rpc_servers     = params.rpc_servers.c_str();
+    mparams.shm_name        = params.shm_name.c_str();
     mparams.main_gpu        = params.main_gpu;
     mparams.split_mode      = params.split_mode;
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.use_repack      = params.use_repack;
+    mparams.use_repack_cache = params.use_repack_cache;
+    mparams.lazy_load       = params.lazy_load;
+    mparams.use_huge_pages  = params.use_huge_pages;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -990,6 +1003,12 @@ static ggml_type kv_cache_type_from_str(const std::string & s) {
     if (s == "q5_1") {
         return GGML_TYPE_Q5_1;
     }
+    if (s == "q2_1") {
+        return GGML_TYPE_Q2_1;
+    }
+    if (s == "q3_1") {
+        return GGML_TYPE_Q3_1;
+    }
 
     throw std::runtime_error("Invalid cache type: " + s);
 }
@@ -1017,6 +1036,7 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.kv_block_size     = params.kv_block_size;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1513,6 +1533,31 @@ std::string llama_detokenize(llama_context * ctx, const std::vector<llama_token>
     return text;
 }
 
+std::string llama_detokenizer_push(struct llama_detokenizer * detok, llama_token token) {
+    std::string text;
+    text.resize(std::max(text.capacity(), (size_t) 16));
+    int32_t n_chars = llama_detokenizer_push(detok, token, &text[0], (int32_t) text.size());
+    if (n_chars < 0) {
+        text.resize(-n_chars);
+        n_chars = llama_detokenizer_push(detok, token, &text[0], (int32_t) text.size());
+        GGML_ASSERT(n_chars == (int32_t) text.size());
+    }
+
+    text.resize(n_chars);
+
+    return text;
+}
+
+std::string llama_detokenizer_flush(struct llama_detokenizer * detok) {
+    std::string text(4, '\0'); // at most the first bytes of a single character are pending
+    const int32_t n_chars = llama_detokenizer_flush(detok, &text[0], (int32_t) text.size());
+    GGML_ASSERT(n_chars >= 0);
+
+    text.resize(n_chars);
+
+    return text;
+}
+
 //
 // Chat template utils
 //
@@ -1982,6 +2027,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "grammar-file: # never logged, see grammar instead. Can still be specified for input.\n");
     fprintf(stream, "hellaswag: %s # default: false\n", params.hellaswag ? "true" : "false");
     fprintf(stream, "hellaswag_tasks: %zu # default: 400\n", params.hellaswag_tasks);
+    fprintf(stream, "huge_pages: %s # default: false\n", params.use_huge_pages ? "true" : "false");
     fprintf(stream, "ignore_eos: %s # default: false\n", sparams.ignore_eos ? "true" : "false");
 
     yaml_dump_string_multiline(stream, "in_prefix", params.input_prefix.c_str());
@@ -1990,6 +2036,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "interactive: %s # default: false\n", params.interactive ? "true" : "false");
     fprintf(stream, "interactive_first: %s # default: false\n", params.interactive_first ? "true" : "false");
     fprintf(stream, "keep: %d # default: 0\n", params.n_keep);
+    fprintf(stream, "lazy_load: %s # default: false\n", params.lazy_load ? "true" : "false");
     fprintf(stream, "logdir: %s # default: unset (no logging)\n", params.logdir.c_str());
 
     fprintf(stream, "logit_bias:\n");
@@ -2023,6 +2070,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "n_predict: %d # default: -1 (unlimited)\n", params.n_predict);
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", sparams.n_probs);
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
+    fprintf(stream, "no_repack: %s # default: false\n", !params.use_repack ? "true" : "false");
     fprintf(stream, "penalize_nl: %s # default: false\n", sparams.penalize_nl ? "true" : "false");
     fprintf(stream, "ppl_output_type: %d # default: 0\n", params.ppl_output_type);
     fprintf(stream, "ppl_stride: %d # default: 0\n", params.ppl_stride);
@@ -2032,6 +2080,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "prompt_cache_all: %s # default: false\n", params.prompt_cache_all ? "true" : "false");
     fprintf(stream, "prompt_cache_ro: %s # default: false\n", params.prompt_cache_ro ? "true" : "false");
     yaml_dump_vector_int(stream, "prompt_tokens", prompt_tokens);
+    fprintf(stream, "repack_cache: %s # default: false\n", params.use_repack_cache ? "true" : "false");
     fprintf(stream, "repeat_penalty: %f # default: 1.1\n", sparams.penalty_repeat);
 
     fprintf(stream, "reverse_prompt:\n");
@@ -2047,6 +2096,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
 
     fprintf(stream, "rope_freq_base: %f # default: 10000.0\n", params.rope_freq_base);
     fprintf(stream, "rope_freq_scale: %f # default: 1.0\n", params.rope_freq_scale);
+    fprintf(stream, "shm: %s # default: unset\n", params.shm_name.c_str());
     fprintf(stream, "simple_io: %s # default: false\n", params.simple_io ? "true" : "false");
     fprintf(stream, "cont_batching: %s # default: false\n", params.cont_batching ? "true" : "false");
     fprintf(stream, "flash_attn: %s # default: false\n", params.flash_attn ? "true" : "false");
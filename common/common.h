@@ -33,6 +33,12 @@ struct llama_lora_adapter_container : llama_lora_adapter_info {
     struct llama_lora_adapter * adapter;
 };
 
+// a named stack of LoRA adapters served on top of the base model
+struct llama_lora_model_info {
+    std::string name;
+    std::vector<llama_lora_adapter_info> adapters;
+};
+
 // build info
 extern int LLAMA_BUILD_NUMBER;
 extern char const * LLAMA_COMMIT;
@@ -167,6 +173,8 @@ struct gpt_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // KV cache block size for paged allocation (0 = contiguous)
+    int32_t output_top_k          =     0; // candidates per output selected in the compute graph (0 = full logits)
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -202,6 +210,7 @@ struct gpt_params {
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding          // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
     std::string rpc_servers          = ""; // comma separated list of RPC servers                           // NOLINT
+    std::string shm_name             = ""; // shared memory object holding the CPU weights                  // NOLINT
 
     std::vector<std::string> in_files;   // all input files
     std::vector<std::string> antiprompt; // strings upon which more user input is prompted (a.k.a. reverse prompts)
@@ -258,6 +267,10 @@ struct gpt_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool use_repack        = true;  // repack weights into an interleaved layout for the CPU kernels (not with mmap alone)
+    bool use_repack_cache  = false; // map the repacked weights from a cache file next to the model
+    bool lazy_load         = false; // load the layers in the background, without mmap
+    bool use_huge_pages    = false; // back the CPU buffers with huge pages
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
@@ -299,6 +312,18 @@ struct gpt_params {
 
     float slot_prompt_similarity = 0.5f;
 
+    int32_t n_prefix_cache = 0; // number of extra KV sequences that keep prompt prefixes of finished requests (0 = disabled)
+    int32_t prefix_cache_ram  = 0; // host memory budget in MiB for prompt prefixes evicted from the KV cache (0 = disabled)
+    int32_t prefix_cache_disk = 0; // disk budget in MiB for prompt prefixes spilled from host memory to slot_save_path (0 = disabled)
+
+    int32_t n_prefill_chunk = 0; // max prompt tokens processed per slot in one server step (0 = n_batch)
+    int32_t n_step_budget   = 0; // max tokens, generated and prompt, decoded in one server step (0 = n_batch)
+
+    bool lookup = false; // draft tokens for speculative decoding from n-grams in the context
+
+    std::vector<llama_lora_model_info> lora_models; // models selected by the "model" field of a request, they share the weights of the base model
+    int32_t lora_models_mem = 0; // memory budget in MiB for the adapters of the LoRA models, unused ones are unloaded (0 = unlimited)
+
     // batched-bench params
     bool is_pp_shared = false;
 
@@ -463,6 +488,15 @@ std::string llama_detokenize(
         const std::vector<llama_token> & tokens,
                                   bool   special = true);
 
+// appends a token to a streaming detokenizer and returns the text that became complete
+// the result is empty while the text ends with an incomplete UTF-8 character
+std::string llama_detokenizer_push(
+        struct llama_detokenizer * detok,
+                     llama_token   token);
+
+// returns the pending bytes of an incomplete UTF-8 character
+std::string llama_detokenizer_flush(struct llama_detokenizer * detok);
+
 //
 // Chat template utils
 //
@@ -111,12 +111,19 @@ struct gpt_sampler {
     llama_token_data_array cur_p;
 
     void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
-
         const int n_vocab = llama_n_vocab(llama_get_model(ctx));
 
         cur.resize(n_vocab);
 
+        // the candidates selected in the graph, if enabled, are already sorted
+        const int32_t n_top_k = llama_get_output_top_k_ith(ctx, idx, cur.data());
+        if (n_top_k >= 0) {
+            cur_p = { cur.data(), (size_t) n_top_k, -1, true };
+            return;
+        }
+
+        const auto * logits = llama_get_logits_ith(ctx, idx);
+
         for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
             cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
         }
@@ -318,6 +325,49 @@ llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context
     return cur_p.data[cur_p.selected].id;
 }
 
+std::vector<llama_token> gpt_sampler_sample_batch(
+        const std::vector<struct gpt_sampler *> & gsmpls,
+        struct llama_context * ctx,
+        const std::vector<int> & idxs,
+        bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size());
+
+    const int n_idxs = (int) idxs.size();
+
+    std::vector<llama_token> result(n_idxs);
+
+    if (n_idxs == 0) {
+        return result;
+    }
+
+    // after this, reading the outputs does not modify the context and can be done from the workers
+    llama_synchronize(ctx);
+
+    struct job {
+        const std::vector<struct gpt_sampler *> & gsmpls;
+        struct llama_context * ctx;
+        const std::vector<int> & idxs;
+        bool grammar_first;
+        std::vector<llama_token> & result;
+    } data = { gsmpls, ctx, idxs, grammar_first, result };
+
+    // each sampler owns its candidates buffer, so the workers share nothing else
+    llama_parallel_for(ctx, n_idxs, [](int32_t i, void * user_data) {
+        auto * data = (job *) user_data;
+
+        data->result[i] = gpt_sampler_sample(data->gsmpls[i], data->ctx, data->idxs[i], data->grammar_first);
+    }, &data);
+
+    return result;
+}
+
+bool gpt_sampler_needs_full_logits(const struct gpt_sampler_params & params, int32_t n_top_k) {
+    const bool penalties = params.penalty_last_n != 0 &&
+        (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f);
+
+    return !params.grammar.empty() || !params.logit_bias.empty() || penalties || params.n_probs > n_top_k;
+}
+
 uint32_t gpt_sampler_get_seed(const struct gpt_sampler * gsmpl) {
     return llama_sampler_get_seed(gsmpl->chain);
 }
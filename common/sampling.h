@@ -60,8 +60,25 @@ void gpt_perf_print(const struct llama_context * ctx, const struct gpt_sampler *
 //
 llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// sample from several outputs of the last evaluation at once, each output with its own sampler
+// the result is the same as calling gpt_sampler_sample(gsmpls[i], ctx, idxs[i], grammar_first) for each i,
+// but the outputs are sampled in parallel on llama_n_threads(ctx) threads
+//
+// the samplers must be distinct and, like with gpt_sampler_sample, the sampled tokens are not accepted
+//
+std::vector<llama_token> gpt_sampler_sample_batch(
+        const std::vector<struct gpt_sampler *> & gsmpls,
+        struct llama_context * ctx,
+        const std::vector<int> & idxs,
+        bool grammar_first = false);
+
 uint32_t gpt_sampler_get_seed(const struct gpt_sampler * gsmpl);
 
+// check if sampling with these parameters needs the logits of the whole vocabulary, instead of the n_top_k candidates
+// selected in the graph (see llama_set_output_top_k): the grammar, the logit biases and the penalties must see all the
+// tokens, the grammar resampling could otherwise find no valid candidate
+bool gpt_sampler_needs_full_logits(const struct gpt_sampler_params & params, int32_t n_top_k);
+
 // helpers
 
 // access the internal list of current candidate tokens
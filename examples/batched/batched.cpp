@@ -66,12 +66,19 @@ int main(int argc, char ** argv) {
 
     auto sparams = llama_sampler_chain_default_params();
 
-    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+    // one sampler per parallel sequence, so that all sequences can be sampled at once
+    std::vector<llama_sampler *> smpls(n_parallel);
 
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(params.sparams.top_k));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.sparams.top_p, params.sparams.min_keep));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp (params.sparams.temp));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist (params.sparams.seed));
+    for (int32_t i = 0; i < n_parallel; ++i) {
+        const uint32_t seed = params.sparams.seed == LLAMA_DEFAULT_SEED ? LLAMA_DEFAULT_SEED : params.sparams.seed + i;
+
+        smpls[i] = llama_sampler_chain_init(sparams);
+
+        llama_sampler_chain_add(smpls[i], llama_sampler_init_top_k(params.sparams.top_k));
+        llama_sampler_chain_add(smpls[i], llama_sampler_init_top_p(params.sparams.top_p, params.sparams.min_keep));
+        llama_sampler_chain_add(smpls[i], llama_sampler_init_temp (params.sparams.temp));
+        llama_sampler_chain_add(smpls[i], llama_sampler_init_dist (seed));
+    }
 
     if (ctx == NULL) {
         LOG_ERR("%s: error: failed to create the llama_context\n" , __func__);
@@ -163,14 +170,28 @@ int main(int argc, char ** argv) {
         // prepare the next batch
         llama_batch_clear(batch);
 
-        // sample the next token for each parallel sequence / stream
+        // sample the next token for all parallel sequences / streams that have not finished yet
+        std::vector<llama_sampler *> smpls_cur;
+        std::vector<int32_t>         idxs_cur;
+
         for (int32_t i = 0; i < n_parallel; ++i) {
+            if (i_batch[i] >= 0) {
+                smpls_cur.push_back(smpls[i]);
+                idxs_cur.push_back(i_batch[i]);
+            }
+        }
+
+        std::vector<llama_token> tokens_cur(idxs_cur.size());
+
+        llama_sampler_sample_batch(smpls_cur.data(), ctx, idxs_cur.data(), idxs_cur.size(), tokens_cur.data());
+
+        for (int32_t i = 0, k = 0; i < n_parallel; ++i) {
             if (i_batch[i] < 0) {
                 // the stream has already finished
                 continue;
             }
 
-            const llama_token new_token_id = llama_sampler_sample(smpl, ctx, i_batch[i]);
+            const llama_token new_token_id = tokens_cur[k++];
 
             // is it an end of generation? -> mark the stream as finished
             if (llama_token_is_eog(model, new_token_id) || n_cur == n_predict) {
@@ -226,14 +247,16 @@ int main(int argc, char ** argv) {
             __func__, n_decode, (t_main_end - t_main_start) / 1000000.0f, n_decode / ((t_main_end - t_main_start) / 1000000.0f));
 
     LOG("\n");
-    llama_perf_sampler_print(smpl);
+    llama_perf_sampler_print(smpls[0]);
     llama_perf_context_print(ctx);
 
     fprintf(stderr, "\n");
 
     llama_batch_free(batch);
 
-    llama_sampler_free(smpl);
+    for (auto * smpl : smpls) {
+        llama_sampler_free(smpl);
+    }
     llama_free(ctx);
     llama_free_model(model);
 
@@ -345,6 +345,12 @@ static ggml_type ggml_type_from_name(const std::string & s) {
     if (s == "q5_1") {
         return GGML_TYPE_Q5_1;
     }
+    if (s == "q2_1") {
+        return GGML_TYPE_Q2_1;
+    }
+    if (s == "q3_1") {
+        return GGML_TYPE_Q3_1;
+    }
     if (s == "iq4_nl") {
         return GGML_TYPE_IQ4_NL;
     }
@@ -332,15 +332,30 @@ int main(int argc, char ** argv) {
 
             LOG_DBG("%s : decoded batch of %d tokens\n", __func__, n_tokens);
 
+            // sample the tokens of all clients in this batch at once
+            std::vector<client *>      clients_cur;
+            std::vector<gpt_sampler *> smpls_cur;
+            std::vector<int>           idxs_cur;
+
             for (auto & client : clients) {
                 if (client.i_batch < (int) i || client.i_batch >= (int) (i + n_tokens)) {
                     continue;
                 }
 
+                clients_cur.push_back(&client);
+                smpls_cur.push_back(client.smpl);
+                idxs_cur.push_back(client.i_batch - i);
+            }
+
+            const std::vector<llama_token> ids_cur = gpt_sampler_sample_batch(smpls_cur, ctx, idxs_cur);
+
+            for (size_t k = 0; k < clients_cur.size(); ++k) {
+                auto & client = *clients_cur[k];
+
                 //printf("client %d, seq %d, token %d, pos %d, batch %d\n",
                 //        client.id, client.seq_id, client.sampled, client.n_decoded, client.i_batch);
 
-                const llama_token id = gpt_sampler_sample(client.smpl, ctx, client.i_batch - i);
+                const llama_token id = ids_cur[k];
 
                 gpt_sampler_accept(client.smpl, id, true);
 
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "ggml.h"
+#include "llama.h"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// radix tree over token sequences
+// each entry is a token sequence identified by an id (e.g. the KV cache sequence that holds it)
+// a lookup returns the longest prefix of the input that is shared with any of the entries
+struct token_prefix_tree {
+    struct node {
+        std::vector<llama_token> edge; // tokens on the edge from the parent to this node
+
+        std::map<llama_token, std::unique_ptr<node>> children;
+
+        std::set<int32_t> ids; // entries that pass through this node
+    };
+
+    node root;
+
+    std::unordered_map<int32_t, std::vector<llama_token>> entries;
+
+    bool contains(int32_t id) const {
+        return entries.find(id) != entries.end();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    const std::vector<llama_token> & get(int32_t id) const {
+        return entries.at(id);
+    }
+
+    void clear() {
+        root.children.clear();
+        entries.clear();
+    }
+
+    void insert(int32_t id, const std::vector<llama_token> & tokens) {
+        remove(id);
+
+        if (tokens.empty()) {
+            return;
+        }
+
+        entries[id] = tokens;
+
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto child = std::make_unique<node>();
+                child->edge.assign(tokens.begin() + i, tokens.end());
+                child->ids.insert(id);
+
+                cur->children[tokens[i]] = std::move(child);
+                return;
+            }
+
+            node * next = it->second.get();
+
+            size_t n = 0;
+            while (n < next->edge.size() && i + n < tokens.size() && next->edge[n] == tokens[i + n]) {
+                n++;
+            }
+
+            if (n < next->edge.size()) {
+                split(next, n);
+            }
+
+            next->ids.insert(id);
+
+            cur = next;
+            i  += n;
+        }
+    }
+
+    void remove(int32_t id) {
+        auto it_entry = entries.find(id);
+        if (it_entry == entries.end()) {
+            return;
+        }
+
+        const std::vector<llama_token> & tokens = it_entry->second;
+
+        std::vector<node *> path;
+
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            GGML_ASSERT(it != cur->children.end());
+
+            node * next = it->second.get();
+            next->ids.erase(id);
+
+            i += next->edge.size();
+
+            if (next->ids.empty()) {
+                // no other entry goes through here
+                cur->children.erase(it);
+                break;
+            }
+
+            path.push_back(next);
+            cur = next;
+        }
+
+        // merge nodes that are no longer branching
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            node * nd = *it;
+            if (nd->children.size() != 1) {
+                continue;
+            }
+
+            std::unique_ptr<node> child = std::move(nd->children.begin()->second);
+            if (child->ids != nd->ids) {
+                nd->children.begin()->second = std::move(child);
+                continue;
+            }
+
+            nd->edge.insert(nd->edge.end(), child->edge.begin(), child->edge.end());
+            nd->children = std::move(child->children);
+        }
+
+        entries.erase(it_entry);
+    }
+
+    // returns the length of the longest prefix of tokens that is found in the tree
+    // ids receives the entries that share that prefix
+    size_t find(const std::vector<llama_token> & tokens, std::set<int32_t> & ids) const {
+        ids.clear();
+
+        const node * cur  = &root;
+        const node * best = nullptr;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * next = it->second.get();
+
+            size_t n = 0;
+            while (n < next->edge.size() && i + n < tokens.size() && next->edge[n] == tokens[i + n]) {
+                n++;
+            }
+
+            best = next;
+            i   += n;
+
+            if (n < next->edge.size()) {
+                break;
+            }
+
+            cur = next;
+        }
+
+        if (best != nullptr) {
+            ids = best->ids;
+        }
+
+        return i;
+    }
+
+private:
+    // split the edge of nd after n tokens
+    static void split(node * nd, size_t n) {
+        auto child = std::make_unique<node>();
+        child->edge.assign(nd->edge.begin() + n, nd->edge.end());
+        child->children = std::move(nd->children);
+        child->ids      = nd->ids;
+
+        nd->edge.resize(n);
+        nd->children.clear();
+        nd->children[child->edge[0]] = std::move(child);
+    }
+};
@@ -3,6 +3,7 @@
 #include "arg.h"
 #include "common.h"
 #include "log.h"
+#include "ngram-cache.h"
 #include "sampling.h"
 #include "json-schema-to-grammar.h"
 #include "llama.h"
@@ -13,6 +14,11 @@
 // mime type for sending response
 #define MIMETYPE_JSON "application/json; charset=utf-8"
 
+// speculative decoding with a draft model
+#define SERVER_DRAFT_VOCAB_MAX_SIZE_DIFFERENCE 100
+#define SERVER_DRAFT_VOCAB_CHECK_START         5
+#define SERVER_DRAFT_P_MIN                     0.5f // stop drafting when the draft model is less confident than this
+
 // auto generated files (update with ./deps.sh)
 #include "colorthemes.css.hpp"
 #include "style.css.hpp"
@@ -33,16 +39,27 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <cstring>
 #include <cstddef>
 #include <cinttypes>
+#include <cstdio>
 #include <deque>
+#include <fstream>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <signal.h>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #define SLT_INF(slot, fmt, ...) LOG_INF("slot %12.*s: id %2d | task %d | " fmt, 12, __func__, (slot).id, (slot).id_task, __VA_ARGS__)
 #define SLT_WRN(slot, fmt, ...) LOG_WRN("slot %12.*s: id %2d | task %d | " fmt, 12, __func__, (slot).id, (slot).id_task, __VA_ARGS__)
 #define SLT_ERR(slot, fmt, ...) LOG_ERR("slot %12.*s: id %2d | task %d | " fmt, 12, __func__, (slot).id, (slot).id_task, __VA_ARGS__)
@@ -60,11 +77,6 @@
 
 using json = nlohmann::ordered_json;
 
-enum stop_type {
-    STOP_TYPE_FULL,
-    STOP_TYPE_PARTIAL,
-};
-
 // state diagram: https://github.com/ggerganov/llama.cpp/pull/9283
 enum slot_state {
     SLOT_STATE_IDLE,
@@ -131,6 +143,7 @@ struct slot_params {
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t  n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t  n_predict = -1; // new tokens to predict
+    int32_t  n_draft   =  0; // max tokens to draft per step for speculative decoding, 0 = disabled
 
     std::vector<std::string> antiprompt;
 
@@ -170,6 +183,13 @@ struct server_slot {
 
     std::string generated_text;
     std::vector<llama_token> cache_tokens;
+
+    // incremental detokenization and stop string matching of the generated text
+    struct llama_detokenizer * detok = nullptr;
+    stop_string_matcher stop_matcher;
+    size_t n_pending_text = 0;                  // bytes of an incomplete UTF-8 character held by the detokenizer
+    size_t stop_pos_full  = std::string::npos;  // position of the earliest complete stop string in generated_text
+    std::string stop_word_full;
     std::vector<completion_token_output> generated_token_probs;
 
     server_task_cmpl_type cmpl_type = SERVER_TASK_CMPL_TYPE_NORMAL;
@@ -185,6 +205,8 @@ struct server_slot {
     std::string oaicompat_model;
     std::string stopping_word;
 
+    std::string lora_model; // the --lora-model whose adapters are applied to the sequence of the slot, empty for the base model
+
     // sampling
     json json_schema;
 
@@ -199,10 +221,20 @@ struct server_slot {
 
     int32_t n_past_se = 0; // self-extend
 
+    // speculative decoding
+    std::vector<llama_token> drafted;          // draft tokens that are verified in the current batch
+    std::vector<llama_token> cache_tokens_dft; // tokens in the KV cache of the draft model, including the system prompt
+
+    llama_ngram_cache nc_context; // n-grams of cache_tokens, for lookup decoding
+    size_t n_nc_tokens = 0;       // number of cache_tokens added to nc_context
+
     // stats
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int32_t n_draft_total    = 0; // number of drafted tokens
+    int32_t n_draft_accepted = 0; // number of drafted tokens that were accepted
+
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
@@ -227,8 +259,26 @@ struct server_slot {
         cmpl_type          = SERVER_TASK_CMPL_TYPE_NORMAL;
         ga_i               = 0;
         n_past_se          = 0;
+        n_nc_tokens        = 0;
+        n_draft_total      = 0;
+        n_draft_accepted   = 0;
 
         generated_token_probs.clear();
+        drafted.clear();
+        nc_context.clear();
+
+        if (detok) {
+            llama_detokenizer_reset(detok);
+        }
+        stop_matcher.reset();
+        n_pending_text = 0;
+        stop_pos_full  = std::string::npos;
+        stop_word_full.clear();
+    }
+
+    // the tokens in the KV cache are tracked for prompt caching and for drafting
+    bool need_cache_tokens() const {
+        return params.cache_prompt || params.n_draft > 0;
     }
 
     bool has_budget(gpt_params &global_params) {
@@ -270,7 +320,7 @@ struct server_slot {
     }
 
     json get_formated_timings() const {
-        return json {
+        json timings = {
             {"prompt_n",               n_prompt_tokens_processed},
             {"prompt_ms",              t_prompt_processing},
             {"prompt_per_token_ms",    t_prompt_processing / n_prompt_tokens_processed},
@@ -281,34 +331,13 @@ struct server_slot {
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
         };
-    }
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, const stop_type type) {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string & word : params.antiprompt) {
-            size_t pos;
-
-            if (type == STOP_TYPE_FULL) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-
-                pos = text.find(word, from_pos);
-            } else {
-                pos = find_partial_stop_string(word, text);
-            }
-
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (type == STOP_TYPE_FULL) {
-                    stopped_word   = true;
-                    stopping_word  = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
-            }
+        if (params.n_draft > 0) {
+            timings["draft_n"]          = n_draft_total;
+            timings["draft_n_accepted"] = n_draft_accepted;
         }
 
-        return stop_pos;
+        return timings;
     }
 
     void print_timings() const {
@@ -326,6 +355,11 @@ struct server_slot {
                 t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
                 t_token_generation, n_decoded, t_gen, n_gen_second,
                 t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+
+        if (n_draft_total > 0) {
+            SLT_INF(*this, "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n",
+                    (double) n_draft_accepted / n_draft_total, n_draft_accepted, n_draft_total);
+        }
     }
 };
 
@@ -346,6 +380,9 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_draft_total          = 0;
+    uint64_t n_draft_accepted_total = 0;
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -362,6 +399,8 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+        n_draft_total              += slot.n_draft_total;
+        n_draft_accepted_total     += slot.n_draft_accepted;
     }
 
     void on_decoded(const std::vector<server_slot> & slots) {
@@ -381,6 +420,24 @@ struct server_metrics {
     }
 };
 
+// sequence state of a prompt evicted from the KV cache
+struct prefix_cache_blob {
+    std::vector<uint8_t> data; // empty once spilled to disk
+    std::string          path; // spill file, empty while in host memory
+    void *               addr = nullptr; // shared mapping of the spill file
+
+    size_t  size   = 0;
+    int64_t t_used = 0;
+};
+
+// LoRA adapter of a model served on top of the base model
+struct server_lora_adapter {
+    llama_lora_adapter * adapter = nullptr;
+
+    uint64_t size   = 0;
+    int64_t  t_used = 0;
+};
+
 struct server_queue {
     int id = 0;
     bool running;
@@ -613,10 +670,27 @@ struct server_context {
     llama_context * ctx = nullptr;
     std::vector<llama_lora_adapter_container> loras;
 
+    // the models of --lora-model share the weights and the context of the base model
+    // each slot applies the adapters of the model of its request to its own sequence
+    std::map<std::string, server_lora_adapter> lora_cache; // adapter path -> loaded adapter
+
+    uint64_t lora_cache_size = 0;
+
     gpt_params params;
 
     llama_batch batch = {};
 
+    // speculative decoding - tokens are drafted with a small model, or looked up in the context
+    llama_model   * model_dft = nullptr;
+    llama_context * ctx_dft   = nullptr;
+
+    llama_batch batch_dft = {};
+
+    llama_ngram_cache nc_dynamic; // n-grams of previous generations
+    llama_ngram_cache nc_static;  // n-grams of a large corpus
+
+    bool use_draft = false;
+
     bool clean_kv_cache = true;
     bool add_bos_token  = true;
     bool has_eos_token  = false;
@@ -641,7 +715,35 @@ struct server_context {
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // slot that is offered the prompt budget first in the next update
+    int32_t id_slot_prompt_next = 0;
+
+    // prompt prefixes that can be reused by any slot, keyed by the KV cache sequence that holds them
+    // idle slots hold their last prompt in their own sequence, evicted prompts are moved to spare sequences
+    token_prefix_tree prefix_cache;
+
+    std::vector<llama_seq_id>         prefix_cache_seqs_free;
+    std::map<llama_seq_id, int64_t>   prefix_cache_t_used; // spare sequences in use -> last time used
+
+    // prompts evicted from the KV cache are kept as sequence states in host memory, then on disk
+    // they use negative ids in the prefix tree
+    std::map<int32_t, prefix_cache_blob> prefix_cache_blobs;
+
+    int32_t prefix_cache_blob_next = -1;
+
+    size_t prefix_cache_ram_used  = 0;
+    size_t prefix_cache_disk_used = 0;
+
+    bool use_prefix_cache = false;
+
     ~server_context() {
+        // remove the spill files
+        prefix_cache_clear();
+
+        if (use_draft && !ctx_dft && !params.lookup_cache_dynamic.empty()) {
+            llama_ngram_cache_save(nc_dynamic, params.lookup_cache_dynamic);
+        }
+
         if (ctx) {
             llama_free(ctx);
             ctx = nullptr;
@@ -652,14 +754,27 @@ struct server_context {
             model = nullptr;
         }
 
+        if (ctx_dft) {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+
+        if (model_dft) {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
+
         // Clear any sampling context
         for (server_slot & slot : slots) {
             if (slot.smpl != nullptr) {
                 gpt_sampler_free(slot.smpl);
             }
+
+            llama_detokenizer_free(slot.detok);
         }
 
         llama_batch_free(batch);
+        llama_batch_free(batch_dft);
     }
 
     bool load_model(const gpt_params & params_) {
@@ -686,6 +801,115 @@ struct server_context {
         add_bos_token = llama_add_bos_token(model);
         has_eos_token = !llama_add_eos_token(model);
 
+        if (!params.lora_models.empty()) {
+            if (params.flash_attn) {
+                SRV_ERR("%s", "--lora-model is not supported with flash attention\n");
+                return false;
+            }
+
+            // the adapters are applied to the sequence of each slot, the base model ones included
+            llama_lora_adapter_clear(ctx);
+        }
+
+        for (const auto & m : params.lora_models) {
+            SRV_INF("model '%s' is served with %zu LoRA adapter(s) on top of the base model\n", m.name.c_str(), m.adapters.size());
+        }
+
+        if (!params.model_draft.empty()) {
+            SRV_INF("loading draft model '%s'\n", params.model_draft.c_str());
+
+            gpt_params params_dft = params;
+
+            params_dft.model        = params.model_draft;
+            params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+            params_dft.n_parallel   = params.n_parallel + 1;
+            params_dft.lora_adapters.clear();
+            params_dft.control_vectors.clear();
+            params_dft.output_top_k = 0; // the drafting reads the full logits
+
+            if (params.draft_cpuparams.n_threads > 0) {
+                params_dft.cpuparams.n_threads       = params.draft_cpuparams.n_threads;
+                params_dft.cpuparams_batch.n_threads = params.draft_cpuparams_batch.n_threads;
+            }
+
+            llama_init_result llama_init_dft = llama_init_from_gpt_params(params_dft);
+
+            model_dft = llama_init_dft.model;
+            ctx_dft   = llama_init_dft.context;
+
+            if (model_dft == nullptr) {
+                SRV_ERR("failed to load draft model, '%s'\n", params.model_draft.c_str());
+                return false;
+            }
+
+            if (!validate_draft_model()) {
+                return false;
+            }
+
+            batch_dft = llama_batch_init(llama_n_batch(ctx_dft), 0, 1);
+        }
+
+        if (params.lookup) {
+            if (!params.lookup_cache_static.empty()) {
+                try {
+                    nc_static = llama_ngram_cache_load(params.lookup_cache_static);
+                } catch (std::ifstream::failure const &) {
+                    SRV_ERR("failed to open static lookup cache: %s\n", params.lookup_cache_static.c_str());
+                    return false;
+                }
+            }
+
+            if (!params.lookup_cache_dynamic.empty()) {
+                try {
+                    nc_dynamic = llama_ngram_cache_load(params.lookup_cache_dynamic);
+                } catch (std::ifstream::failure const &) {
+                    SRV_WRN("failed to open dynamic lookup cache: %s\n", params.lookup_cache_dynamic.c_str());
+                }
+            }
+
+            if (ctx_dft) {
+                SRV_WRN("%s", "both a draft model and lookup decoding are enabled - drafting with the model\n");
+            }
+        }
+
+        return true;
+    }
+
+    // the draft tokens are fed to the target model, so both models must use the same vocab
+    bool validate_draft_model() const {
+        if (llama_vocab_type(model) != llama_vocab_type(model_dft)) {
+            SRV_ERR("%s", "the draft model vocab type must match the target model\n");
+            return false;
+        }
+
+        if (llama_add_bos_token(model) != llama_add_bos_token(model_dft) ||
+            llama_add_eos_token(model) != llama_add_eos_token(model_dft) ||
+            llama_token_bos(model)     != llama_token_bos(model_dft) ||
+            llama_token_eos(model)     != llama_token_eos(model_dft)) {
+            SRV_ERR("%s", "the draft model special tokens must match the target model\n");
+            return false;
+        }
+
+        const int n_vocab     = llama_n_vocab(model);
+        const int n_vocab_dft = llama_n_vocab(model_dft);
+
+        if (std::abs(n_vocab - n_vocab_dft) > SERVER_DRAFT_VOCAB_MAX_SIZE_DIFFERENCE) {
+            SRV_ERR("the draft model vocab must closely match the target model, n_vocab = %d, n_vocab_dft = %d\n", n_vocab, n_vocab_dft);
+            return false;
+        }
+
+        for (int i = SERVER_DRAFT_VOCAB_CHECK_START; i < std::min(n_vocab, n_vocab_dft); ++i) {
+            const char * text     = llama_token_get_text(model,     i);
+            const char * text_dft = llama_token_get_text(model_dft, i);
+
+            if (std::strcmp(text, text_dft) != 0) {
+                SRV_ERR("draft model vocab differs from the target model at token %d: '%s' vs '%s'\n", i,
+                        llama_token_to_piece(ctx,     i).c_str(),
+                        llama_token_to_piece(ctx_dft, i).c_str());
+                return false;
+            }
+        }
+
         return true;
     }
 
@@ -708,6 +932,7 @@ struct server_context {
             slot.id = i;
             slot.n_ctx = n_ctx_slot;
             slot.n_predict = params.n_predict;
+            slot.detok = llama_detokenizer_init(model, params.special);
 
             SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
 
@@ -729,7 +954,19 @@ struct server_context {
 
             slot.sparams = params.sparams;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id_slot) {
+                prefix_cache_insert(slots[id_slot]);
+
+                // the n-grams of the finished task are looked up by the next ones
+                if (use_draft && !ctx_dft && !params.lookup_cache_dynamic.empty()) {
+                    llama_ngram_cache_merge(nc_dynamic, slots[id_slot].nc_context);
+                }
+
+                // the adapters may be unloaded while the slot is idle
+                if (!params.lora_models.empty()) {
+                    llama_lora_adapter_clear_seq(ctx, id_slot + 1);
+                }
+
                 queue_tasks.pop_deferred_task();
             };
 
@@ -750,6 +987,53 @@ struct server_context {
             batch = llama_batch_init(std::max(n_batch, params.n_parallel), 0, 1);
         }
 
+        if (params.n_step_budget > 0 && params.n_step_budget <= params.n_parallel) {
+            // each generating slot adds one token per step - leave room for prompt processing
+            SRV_WRN("step budget %d is too small for %d slots, using %d\n", params.n_step_budget, params.n_parallel, params.n_parallel + 1);
+            params.n_step_budget = params.n_parallel + 1;
+        }
+
+        if (params.n_prefix_cache > 0 || params.prefix_cache_ram > 0 || params.prefix_cache_disk > 0) {
+            if (llama_model_is_recurrent(model)) {
+                SRV_WRN("%s", "prefix cache is not supported for recurrent models - disabling\n");
+            } else {
+                use_prefix_cache = true;
+
+                // the spare sequences come after the slots and are never decoded, so they do not count towards n_seq_max
+                for (int32_t i = params.n_prefix_cache - 1; i >= 0; --i) {
+                    prefix_cache_seqs_free.push_back(params.n_parallel + 1 + i);
+                }
+
+                if (params.prefix_cache_disk > 0 && params.slot_save_path.empty()) {
+                    SRV_WRN("%s", "prefix cache disk tier requires --slot-save-path - disabling it\n");
+                    params.prefix_cache_disk = 0;
+                }
+#ifdef _WIN32
+                if (params.prefix_cache_disk > 0) {
+                    SRV_WRN("%s", "prefix cache disk tier is not supported on this system - disabling it\n");
+                    params.prefix_cache_disk = 0;
+                }
+#else
+                if (params.prefix_cache_disk > 0) {
+                    prefix_cache_remove_stale_spills();
+                }
+#endif
+
+                SRV_INF("prefix cache enabled, n_seqs = %d, ram = %d MiB, disk = %d MiB\n", params.n_prefix_cache, params.prefix_cache_ram, params.prefix_cache_disk);
+            }
+        }
+
+        if (ctx_dft || params.lookup) {
+            if (llama_model_is_recurrent(model)) {
+                // rejected draft tokens cannot be removed from the state of a recurrent model
+                SRV_WRN("%s", "speculative decoding is not supported for recurrent models - disabling\n");
+            } else {
+                use_draft = true;
+
+                SRV_INF("speculative decoding enabled, drafting with %s, n_draft = %d\n", ctx_dft ? "a draft model" : "n-gram lookup", params.n_draft);
+            }
+        }
+
         metrics.init();
     }
 
@@ -804,6 +1088,126 @@ struct server_context {
         return nullptr;
     }
 
+    // the --lora-model entry selected by the "model" field of a request, nullptr for the base model
+    const llama_lora_model_info * lora_model_find(const std::string & name) const {
+        for (const auto & m : params.lora_models) {
+            if (m.name == name) {
+                return &m;
+            }
+        }
+        return nullptr;
+    }
+
+    // the adapters of a model, loading them if needed
+    bool lora_model_load(const std::string & name, std::vector<llama_lora_adapter_container> & lora_set) {
+        if (name.empty()) {
+            lora_set = loras;
+            return true;
+        }
+
+        const int64_t t_now = ggml_time_us();
+
+        lora_set.clear();
+        for (const auto & info : lora_model_find(name)->adapters) {
+            auto it = lora_cache.find(info.path);
+            if (it == lora_cache.end()) {
+                server_lora_adapter entry;
+                entry.adapter = llama_lora_adapter_init(model, info.path.c_str());
+                if (entry.adapter == nullptr) {
+                    SRV_ERR("failed to load LoRA adapter '%s' of model '%s'\n", info.path.c_str(), name.c_str());
+                    return false;
+                }
+                entry.size = llama_lora_adapter_size(entry.adapter);
+
+                SRV_INF("loaded LoRA adapter '%s' of model '%s', size = %.2f MiB\n", info.path.c_str(), name.c_str(), entry.size / 1024.0 / 1024.0);
+
+                lora_cache_size += entry.size;
+                it = lora_cache.emplace(info.path, entry).first;
+            }
+
+            it->second.t_used = t_now;
+
+            llama_lora_adapter_container lora;
+            lora.path    = info.path;
+            lora.scale   = info.scale;
+            lora.adapter = it->second.adapter;
+            lora_set.push_back(lora);
+        }
+
+        return true;
+    }
+
+    // apply the adapters of a model to the sequence of a slot - the other slots keep their own adapters
+    bool lora_model_apply(server_slot & slot, const std::string & name) {
+        std::vector<llama_lora_adapter_container> lora_set;
+        if (!lora_model_load(name, lora_set)) {
+            return false;
+        }
+
+        // the KV cache of the slot holds a prompt processed with the adapters of another model
+        if (slot.lora_model != name) {
+            SLT_INF(slot, "switching model from '%s' to '%s'\n", slot.lora_model.c_str(), name.c_str());
+
+            slot.cache_tokens.clear();
+            slot.lora_model = name;
+        }
+
+        const llama_seq_id seq_id = slot.id + 1;
+
+        llama_lora_adapter_clear_seq(ctx, seq_id);
+        for (const auto & lora : lora_set) {
+            if (lora.scale != 0.0f && llama_lora_adapter_set_seq(ctx, lora.adapter, lora.scale, seq_id) != 0) {
+                llama_lora_adapter_clear_seq(ctx, seq_id);
+                return false;
+            }
+        }
+
+        lora_cache_trim(slot);
+
+        return true;
+    }
+
+    // unload the least recently used adapters that no slot uses until they fit in the memory budget
+    void lora_cache_trim(const server_slot & slot_new) {
+        const uint64_t size_max = (uint64_t) params.lora_models_mem * 1024 * 1024;
+        if (size_max == 0) {
+            return;
+        }
+
+        // the adapters of the processing slots and of the slot that is being launched
+        std::set<std::string> paths_used;
+        for (const server_slot & slot : slots) {
+            if (slot.lora_model.empty() || (!slot.is_processing() && &slot != &slot_new)) {
+                continue;
+            }
+            for (const auto & info : lora_model_find(slot.lora_model)->adapters) {
+                paths_used.insert(info.path);
+            }
+        }
+
+        while (lora_cache_size > size_max) {
+            auto lru = lora_cache.end();
+            for (auto it = lora_cache.begin(); it != lora_cache.end(); ++it) {
+                if (paths_used.count(it->first) > 0) {
+                    continue;
+                }
+                if (lru == lora_cache.end() || it->second.t_used < lru->second.t_used) {
+                    lru = it;
+                }
+            }
+
+            if (lru == lora_cache.end()) {
+                break;
+            }
+
+            SRV_INF("unloading LoRA adapter '%s', size = %.2f MiB\n", lru->first.c_str(), lru->second.size / 1024.0 / 1024.0);
+
+            lora_cache_size -= lru->second.size;
+            llama_lora_adapter_free(lru->second.adapter);
+            lora_cache.erase(lru);
+        }
+    }
+
     server_slot * get_available_slot(const std::string & prompt) {
         server_slot * ret = nullptr;
 
@@ -906,6 +1310,7 @@ struct server_context {
         slot.sparams.penalize_nl       = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
         slot.params.n_keep             = json_value(data, "n_keep",            slot.params.n_keep);
         slot.params.n_discard          = json_value(data, "n_discard",         default_params.n_discard);
+        slot.params.n_draft            = json_value(data, "n_draft",           use_draft ? params.n_draft : 0);
         slot.sparams.seed              = json_value(data, "seed",              default_sparams.seed);
         slot.sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
         slot.sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
@@ -932,6 +1337,11 @@ struct server_context {
             SLT_WRN(slot, "%s", "group-attention is not supported with prompt caching. disabling cache\n");
         }
 
+        if (slot.params.n_draft > 0 && (!use_draft || slot.ga_n != 1)) {
+            slot.params.n_draft = 0;
+            SLT_WRN(slot, "%s", "speculative decoding is not enabled on the server or not supported with group-attention. disabling drafting\n");
+        }
+
         if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
             // Might be better to reject the request with a 400 ?
             slot.params.n_predict = slot.n_predict;
@@ -1020,6 +1430,8 @@ struct server_context {
                     }
                 }
             }
+
+            slot.stop_matcher.init(slot.params.antiprompt);
         }
 
         {
@@ -1050,6 +1462,18 @@ struct server_context {
             }
         }
 
+        if (!params.lora_models.empty()) {
+            std::string lora_model = json_value(data, "model", std::string());
+            if (!lora_model_find(lora_model)) {
+                lora_model.clear();
+            }
+
+            if (!lora_model_apply(slot, lora_model)) {
+                send_error(task, "failed to load model '" + lora_model + "'", ERROR_TYPE_SERVER);
+                return false;
+            }
+        }
+
         slot.state = SLOT_STATE_PROCESSING_PROMPT;
         slot.prompt_tokens.clear();
 
@@ -1064,6 +1488,341 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        prefix_cache_clear();
+    }
+
+    void prefix_cache_clear() {
+        prefix_cache.clear();
+
+        for (const auto & it : prefix_cache_t_used) {
+            prefix_cache_seqs_free.push_back(it.first);
+        }
+        prefix_cache_t_used.clear();
+
+        for (auto & it : prefix_cache_blobs) {
+            if (!it.second.path.empty()) {
+                prefix_cache_blob_unmap(it.second);
+            }
+        }
+        prefix_cache_blobs.clear();
+
+        prefix_cache_ram_used  = 0;
+        prefix_cache_disk_used = 0;
+    }
+
+    // make the prompt of an idle slot available to the other slots
+    // the prompts processed with the adapters of a --lora-model are not shared
+    void prefix_cache_insert(const server_slot & slot) {
+        if (!use_prefix_cache || !slot.params.cache_prompt || slot.cache_tokens.empty() || !slot.lora_model.empty()) {
+            return;
+        }
+
+        prefix_cache.insert(slot.id + 1, slot.cache_tokens);
+    }
+
+    void prefix_cache_blob_drop(int32_t id) {
+        auto it = prefix_cache_blobs.find(id);
+
+        if (it->second.path.empty()) {
+            prefix_cache_ram_used -= it->second.size;
+        } else {
+            prefix_cache_disk_used -= it->second.size;
+            prefix_cache_blob_unmap(it->second);
+        }
+
+        prefix_cache.remove(id);
+        prefix_cache_blobs.erase(it);
+    }
+
+#ifndef _WIN32
+    // the spill files are named prefix-cache-<pid>-<id>.bin, so that several servers can share the spill directory
+    // remove the files left by the servers that are no longer running, and by a previous process with this pid
+    void prefix_cache_remove_stale_spills() {
+        DIR * dir = opendir(params.slot_save_path.c_str());
+        if (dir == nullptr) {
+            return;
+        }
+
+        while (const struct dirent * entry = readdir(dir)) {
+            long pid = 0;
+            int  id  = 0;
+            char end = 0;
+            if (sscanf(entry->d_name, "prefix-cache-%ld-%d.bi%c", &pid, &id, &end) != 3 || end != 'n') {
+                continue;
+            }
+            if (pid == (long) getpid() || (kill((pid_t) pid, 0) != 0 && errno == ESRCH)) {
+                const std::string path = params.slot_save_path + entry->d_name;
+                SRV_INF("removing stale prefix cache spill file '%s'\n", path.c_str());
+                std::remove(path.c_str());
+            }
+        }
+
+        closedir(dir);
+    }
+#endif
+
+    // move the state of a host blob to a spill file mapped in memory and release the host memory
+    // the copy only dirties page cache pages, the kernel writes them back in the background and can reclaim them
+    bool prefix_cache_blob_spill(int32_t id, prefix_cache_blob & blob) {
+#ifndef _WIN32
+        const std::string path = params.slot_save_path + "prefix-cache-" + std::to_string((long) getpid()) + "-" + std::to_string(-id) + ".bin";
+
+        const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            SRV_WRN("failed to create prefix cache spill file '%s': %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+#ifdef __linux__
+        // allocate the blocks now, a write to the mapping of a sparse file on a full disk raises SIGBUS
+        int err = posix_fallocate(fd, 0, (off_t) blob.size);
+#else
+        int err = ftruncate(fd, (off_t) blob.size) == 0 ? 0 : errno;
+#endif
+        void * addr = MAP_FAILED;
+        if (err == 0) {
+            addr = mmap(nullptr, blob.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            err  = errno;
+        }
+        close(fd);
+
+        if (addr == MAP_FAILED) {
+            SRV_WRN("failed to map prefix cache spill file '%s': %s\n", path.c_str(), strerror(err));
+            std::remove(path.c_str());
+            return false;
+        }
+
+        memcpy(addr, blob.data.data(), blob.size);
+
+        prefix_cache_ram_used  -= blob.size;
+        prefix_cache_disk_used += blob.size;
+
+        blob.path = path;
+        blob.addr = addr;
+        blob.data.clear();
+        blob.data.shrink_to_fit();
+
+        return true;
+#else
+        GGML_UNUSED(id);
+        GGML_UNUSED(blob);
+        return false;
+#endif
+    }
+
+    void prefix_cache_blob_unmap(prefix_cache_blob & blob) {
+#ifndef _WIN32
+        munmap(blob.addr, blob.size);
+#endif
+        std::remove(blob.path.c_str());
+
+        blob.addr = nullptr;
+        blob.path.clear();
+    }
+
+    // keep the host and disk tiers within their budgets, moving the least recently used blobs down a tier
+    void prefix_cache_blobs_trim() {
+        const size_t ram_max  = (size_t) params.prefix_cache_ram  * 1024 * 1024;
+        const size_t disk_max = (size_t) params.prefix_cache_disk * 1024 * 1024;
+
+        while (prefix_cache_ram_used > ram_max || prefix_cache_disk_used > disk_max) {
+            const bool in_ram = prefix_cache_ram_used > ram_max;
+
+            auto lru = prefix_cache_blobs.end();
+            for (auto it = prefix_cache_blobs.begin(); it != prefix_cache_blobs.end(); ++it) {
+                if (it->second.path.empty() != in_ram) {
+                    continue;
+                }
+                if (lru == prefix_cache_blobs.end() || it->second.t_used < lru->second.t_used) {
+                    lru = it;
+                }
+            }
+
+            GGML_ASSERT(lru != prefix_cache_blobs.end());
+
+            if (in_ram && disk_max > 0 && lru->second.size <= disk_max && prefix_cache_blob_spill(lru->first, lru->second)) {
+                SRV_DBG("spilled cached prefix to disk, id = %d, size = %zu\n", lru->first, lru->second.size);
+                continue;
+            }
+
+            SRV_DBG("dropping cached prefix, id = %d, size = %zu\n", lru->first, lru->second.size);
+
+            prefix_cache_blob_drop(lru->first);
+        }
+    }
+
+    // copy the state of a KV cache sequence to the host tier
+    void prefix_cache_offload(llama_seq_id seq_id, const std::vector<llama_token> & tokens) {
+        if (params.prefix_cache_ram <= 0 && params.prefix_cache_disk <= 0) {
+            return;
+        }
+
+        prefix_cache_blob blob;
+        blob.size   = llama_state_seq_get_size(ctx, seq_id);
+        blob.t_used = ggml_time_us();
+        blob.data.resize(blob.size);
+
+        if (llama_state_seq_get_data(ctx, blob.data.data(), blob.size, seq_id) != blob.size) {
+            SRV_WRN("failed to offload cached prefix, seq_id = %d\n", seq_id);
+            return;
+        }
+
+        const int32_t id = prefix_cache_blob_next--;
+
+        SRV_DBG("offloaded cached prefix, seq_id = %d, id = %d, n_tokens = %zu, size = %zu\n", seq_id, id, tokens.size(), blob.size);
+
+        prefix_cache_ram_used += blob.size;
+        prefix_cache_blobs[id] = std::move(blob);
+        prefix_cache.insert(id, tokens);
+
+        prefix_cache_blobs_trim();
+    }
+
+    // drop the least recently used prefix held by a spare sequence, moving it to the host tier if enabled
+    bool prefix_cache_evict() {
+        if (prefix_cache_t_used.empty()) {
+            return false;
+        }
+
+        auto lru = prefix_cache_t_used.begin();
+        for (auto it = prefix_cache_t_used.begin(); it != prefix_cache_t_used.end(); ++it) {
+            if (it->second < lru->second) {
+                lru = it;
+            }
+        }
+
+        const llama_seq_id seq_id = lru->first;
+
+        SRV_DBG("evicting cached prefix, seq_id = %d, n_tokens = %zu\n", seq_id, prefix_cache.get(seq_id).size());
+
+        prefix_cache_offload(seq_id, prefix_cache.get(seq_id));
+
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        prefix_cache.remove(seq_id);
+
+        prefix_cache_t_used.erase(lru);
+        prefix_cache_seqs_free.push_back(seq_id);
+
+        return true;
+    }
+
+    // the slot is about to overwrite its sequence past n_keep tokens - move its cached prompt to a spare sequence
+    // the copy only adds the spare sequence to the existing KV cells, no data is duplicated
+    // without spare sequences, the prompt goes straight to the host tier
+    void prefix_cache_detach(const server_slot & slot, size_t n_keep) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        if (!prefix_cache.contains(seq_id)) {
+            return;
+        }
+
+        const std::vector<llama_token> tokens = prefix_cache.get(seq_id);
+        prefix_cache.remove(seq_id);
+
+        if (tokens.size() <= n_keep) {
+            // the slot keeps all of it
+            return;
+        }
+
+        if (prefix_cache_seqs_free.empty() && !prefix_cache_evict()) {
+            prefix_cache_offload(seq_id, tokens);
+            return;
+        }
+
+        const llama_seq_id seq_id_dst = prefix_cache_seqs_free.back();
+        prefix_cache_seqs_free.pop_back();
+
+        llama_kv_cache_seq_rm(ctx, seq_id_dst, -1, -1);
+        llama_kv_cache_seq_cp(ctx, seq_id, seq_id_dst, -1, -1);
+
+        prefix_cache.insert(seq_id_dst, tokens);
+        prefix_cache_t_used[seq_id_dst] = ggml_time_us();
+
+        SLT_DBG(slot, "moved cached prompt to seq_id = %d, n_tokens = %zu\n", seq_id_dst, tokens.size());
+    }
+
+    // load the state of a host blob into the sequence of the slot
+    bool prefix_cache_restore(server_slot & slot, int32_t id) {
+        prefix_cache_blob & blob = prefix_cache_blobs.at(id);
+
+        blob.t_used = ggml_time_us();
+
+        // a spilled blob is read from its mapping, the pages evicted from memory are read back from the spill file
+        const uint8_t * src = blob.path.empty() ? blob.data.data() : (const uint8_t *) blob.addr;
+
+        return llama_state_seq_set_data(ctx, src, blob.size, slot.id + 1) == blob.size;
+    }
+
+    // replace the slot cache with the longest prefix of the prompt found in the prefix cache, if it is longer
+    void prefix_cache_reuse(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        std::set<int32_t> ids;
+
+        const int n_match = prefix_cache.find(prompt_tokens, ids);
+        if (n_match <= slot.n_past) {
+            return;
+        }
+
+        // prefer a prefix that is already in the KV cache: the most recently used spare sequence, then an idle slot
+        // otherwise restore the most recently used prefix from the host tier
+        const auto rank = [this](int32_t id) {
+            if (id < 0) {
+                return std::make_pair(0, prefix_cache_blobs.at(id).t_used);
+            }
+            const auto it = prefix_cache_t_used.find(id);
+            if (it == prefix_cache_t_used.end()) {
+                return std::make_pair(1, (int64_t) 0);
+            }
+            return std::make_pair(2, it->second);
+        };
+
+        int32_t id_src = *ids.begin();
+        for (const int32_t id : ids) {
+            if (rank(id) > rank(id_src)) {
+                id_src = id;
+            }
+        }
+
+        const int n_system_tokens = system_tokens.size();
+
+        if (id_src < 0) {
+            const int64_t t_start = ggml_time_us();
+
+            if (!prefix_cache_restore(slot, id_src)) {
+                // the sequence may have been partially cleared - start over from the system prompt
+                SLT_WRN(slot, "failed to restore cached prefix, id = %d\n", id_src);
+
+                llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+                if (n_system_tokens > 0) {
+                    llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+                }
+
+                slot.cache_tokens.clear();
+                slot.n_past = 0;
+
+                return;
+            }
+
+            // the restored state covers the whole entry, the part that does not match is removed later
+            slot.cache_tokens = prefix_cache.get(id_src);
+            slot.n_past = n_match;
+
+            SLT_INF(slot, "restored %d prompt tokens from the prefix cache, id = %d, t = %.2f ms\n", n_match, id_src, (ggml_time_us() - t_start) / 1e3);
+
+            return;
+        }
+
+        if (prefix_cache_t_used.count(id_src)) {
+            prefix_cache_t_used[id_src] = ggml_time_us();
+        }
+
+        llama_kv_cache_seq_rm(ctx, slot.id + 1, n_system_tokens, -1);
+        llama_kv_cache_seq_cp(ctx, id_src, slot.id + 1, n_system_tokens, n_system_tokens + n_match);
+
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_match);
+        slot.n_past = n_match;
+
+        SLT_INF(slot, "reusing %d prompt tokens from the prefix cache, seq_id = %d\n", n_match, id_src);
     }
 
     void system_prompt_update() {
@@ -1121,48 +1880,50 @@ struct server_context {
         const std::string token_str = llama_token_to_piece(ctx, result.tok, params.special);
         slot.sampled = result.tok;
 
+        // the text is appended once it ends with a complete UTF-8 character
+        const std::string text = llama_detokenizer_push(slot.detok, result.tok);
+        slot.n_pending_text = slot.n_pending_text + token_str.size() - text.size();
+
         // search stop word and delete it
-        slot.generated_text += token_str;
+        slot.generated_text += text;
         slot.has_next_token = true;
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = false;
-        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i) {
-            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
-            if ((c & 0xC0) == 0x80) {
-                // continuation byte: 10xxxxxx
-                continue;
-            }
-            if ((c & 0xE0) == 0xC0) {
-                // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
-            } else if ((c & 0xF0) == 0xE0) {
-                // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
-            } else if ((c & 0xF8) == 0xF0) {
-                // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
+        {
+            std::string word;
+            const size_t pos = slot.stop_matcher.feed(text, slot.generated_text.size() - text.size(), word);
+            if (pos < slot.stop_pos_full) {
+                slot.stop_pos_full  = pos;
+                slot.stop_word_full = word;
             }
-            // else 1-byte character or invalid byte
-            break;
         }
 
+        // check if there is incomplete UTF-8 character at the end
+        const bool incomplete = slot.n_pending_text > 0;
+
         if (!incomplete) {
             size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
 
-            const std::string str_test = slot.generated_text.substr(pos);
             bool is_stop_full = false;
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_FULL);
-            if (stop_pos != std::string::npos) {
+            size_t stop_pos = std::string::npos;
+            if (slot.stop_pos_full != std::string::npos) {
                 is_stop_full = true;
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
+
+                slot.stopped_word   = true;
+                slot.stopping_word  = slot.stop_word_full;
+                slot.has_next_token = false;
+
+                stop_pos = slot.stop_pos_full - std::min(pos, slot.stop_pos_full);
+                slot.generated_text.erase(slot.stop_pos_full);
                 pos = std::min(slot.n_sent_text, slot.generated_text.size());
             } else {
                 is_stop_full = false;
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_PARTIAL);
+
+                // a stop string may start in the text that is not sent yet
+                const size_t n_partial = std::min(slot.stop_matcher.partial(), slot.generated_text.size() - pos);
+                if (n_partial > 0) {
+                    stop_pos = slot.generated_text.size() - n_partial - pos;
+                }
             }
 
             // check if there is any token to predict
@@ -1220,6 +1981,12 @@ struct server_context {
                     slot.params.n_predict, n_ctx_train);
         }
 
+        if (!slot.has_next_token && slot.n_pending_text > 0) {
+            // the generation ends with an incomplete UTF-8 character, keep its bytes in the final text
+            slot.generated_text += llama_detokenizer_flush(slot.detok);
+            slot.n_pending_text = 0;
+        }
+
         SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: '%s'\n", slot.n_decoded, slot.n_remaining, token_str.c_str());
 
         return slot.has_next_token; // continue
@@ -1258,6 +2025,7 @@ struct server_context {
             {"max_tokens",                slot.params.n_predict}, // User configured n_predict
             {"n_keep",                    slot.params.n_keep},
             {"n_discard",                 slot.params.n_discard},
+            {"n_draft",                   slot.params.n_draft},
             {"ignore_eos",                slot.sparams.ignore_eos},
             {"stream",                    slot.params.stream},
           //{"logit_bias",                slot.sparams.logit_bias},
@@ -1628,6 +2396,12 @@ struct server_context {
                     }
 
                     if (task.data.contains("system_prompt")) {
+                        // the system prompt is shared by all slots, whatever the adapters of their sequence
+                        if (!params.lora_models.empty()) {
+                            send_error(task, "\"system_prompt\" is not supported with --lora-model", ERROR_TYPE_NOT_SUPPORTED);
+                            break;
+                        }
+
                         std::string sys_prompt = json_value(task.data, "system_prompt", std::string());
                         system_prompt_set(sys_prompt);
 
@@ -1718,6 +2492,9 @@ struct server_context {
                         { "n_decode_total",                  metrics.n_decode_total},
                         { "n_busy_slots_total",              metrics.n_busy_slots_total},
 
+                        { "n_draft_total",                   metrics.n_draft_total},
+                        { "n_draft_accepted_total",          metrics.n_draft_accepted_total},
+
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
@@ -1790,6 +2567,8 @@ struct server_context {
                     std::string filename = task.data.at("filename");
                     std::string filepath = task.data.at("filepath");
 
+                    prefix_cache.remove(slot->id + 1);
+
                     slot->cache_tokens.resize(slot->n_ctx);
                     size_t token_count = 0;
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
@@ -1800,6 +2579,10 @@ struct server_context {
                     }
                     slot->cache_tokens.resize(token_count);
 
+                    if (use_prefix_cache) {
+                        prefix_cache.insert(slot->id + 1, slot->cache_tokens);
+                    }
+
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
 
@@ -1835,6 +2618,7 @@ struct server_context {
 
                     // Erase token cache
                     const size_t n_erased = slot->cache_tokens.size();
+                    prefix_cache.remove(slot->id + 1);
                     llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
                     slot->cache_tokens.clear();
 
@@ -1850,7 +2634,10 @@ struct server_context {
                 } break;
             case SERVER_TASK_TYPE_SET_LORA:
                 {
-                    llama_lora_adapters_apply(ctx, loras);
+                    // otherwise the scales are applied to the sequences of the next base model requests
+                    if (params.lora_models.empty()) {
+                        llama_lora_adapters_apply(ctx, loras);
+                    }
                     server_task_result result;
                     result.id = task.id;
                     result.stop = true;
@@ -1861,6 +2648,112 @@ struct server_context {
         }
     }
 
+    // draft up to n_draft tokens that are likely to follow the cache tokens of the slot
+    std::vector<llama_token> draft_tokens(server_slot & slot, int n_draft) {
+        std::vector<llama_token> draft;
+
+        if (ctx_dft) {
+            draft_tokens_model(slot, n_draft, draft);
+        } else {
+            draft_tokens_lookup(slot, n_draft, draft);
+        }
+
+        return draft;
+    }
+
+    void draft_tokens_lookup(server_slot & slot, int n_draft, std::vector<llama_token> & draft) {
+        // the cache tokens were rewritten (e.g. by a context shift) - rebuild the n-grams
+        if (slot.n_nc_tokens > slot.cache_tokens.size()) {
+            slot.nc_context.clear();
+            slot.n_nc_tokens = 0;
+        }
+
+        llama_ngram_cache_update(slot.nc_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.cache_tokens, slot.cache_tokens.size() - slot.n_nc_tokens, false);
+        slot.n_nc_tokens = slot.cache_tokens.size();
+
+        // the draft starts with the last token of the context
+        draft.push_back(slot.cache_tokens.back());
+        llama_ngram_cache_draft(slot.cache_tokens, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.nc_context, nc_dynamic, nc_static);
+        draft.erase(draft.begin());
+    }
+
+    void draft_tokens_model(server_slot & slot, int n_draft, std::vector<llama_token> & draft) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        std::vector<llama_token> inp = system_tokens;
+        inp.insert(inp.end(), slot.cache_tokens.begin(), slot.cache_tokens.end());
+
+        // keep the common part of the draft KV cache, but always evaluate the last token to get its logits
+        const size_t n_common = std::min(common_part(slot.cache_tokens_dft, inp), inp.size() - 1);
+
+        llama_kv_cache_seq_rm(ctx_dft, seq_id, n_common, -1);
+        slot.cache_tokens_dft.resize(n_common);
+
+        const int32_t n_batch_dft = llama_n_batch(ctx_dft);
+
+        for (size_t i = n_common; i < inp.size(); i += n_batch_dft) {
+            const size_t n_tokens = std::min(inp.size() - i, (size_t) n_batch_dft);
+
+            llama_batch_clear(batch_dft);
+            for (size_t j = 0; j < n_tokens; ++j) {
+                llama_batch_add(batch_dft, inp[i + j], i + j, { seq_id }, i + j == inp.size() - 1);
+            }
+
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                SLT_WRN(slot, "failed to decode the draft batch, n_tokens = %d\n", (int) n_tokens);
+
+                llama_kv_cache_seq_rm(ctx_dft, seq_id, -1, -1);
+                slot.cache_tokens_dft.clear();
+                return;
+            }
+
+            slot.cache_tokens_dft.insert(slot.cache_tokens_dft.end(), inp.begin() + i, inp.begin() + i + n_tokens);
+        }
+
+        const int n_vocab = llama_n_vocab(model);
+
+        int32_t i_logits = batch_dft.n_tokens - 1;
+
+        // greedy drafting, as long as the draft model is confident enough
+        for (int i = 0; i < n_draft; ++i) {
+            const float * logits = llama_get_logits_ith(ctx_dft, i_logits);
+            const int n_vocab_dft = llama_n_vocab(model_dft);
+
+            llama_token id = 0;
+            for (llama_token t = 1; t < n_vocab_dft; ++t) {
+                if (logits[t] > logits[id]) {
+                    id = t;
+                }
+            }
+
+            float sum = 0.0f;
+            for (llama_token t = 0; t < n_vocab_dft; ++t) {
+                sum += expf(logits[t] - logits[id]);
+            }
+
+            if (1.0f / sum < SERVER_DRAFT_P_MIN || id >= n_vocab) {
+                break;
+            }
+
+            draft.push_back(id);
+
+            if (i == n_draft - 1) {
+                break;
+            }
+
+            llama_batch_clear(batch_dft);
+            llama_batch_add(batch_dft, id, slot.cache_tokens_dft.size(), { seq_id }, true);
+
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                break;
+            }
+
+            slot.cache_tokens_dft.push_back(id);
+
+            i_logits = 0;
+        }
+    }
+
     void update_slots() {
         if (system_need_update) {
             system_prompt_update();
@@ -1920,12 +2813,16 @@ struct server_context {
                     llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
                     llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
 
-                    if (slot.params.cache_prompt) {
+                    if (slot.need_cache_tokens()) {
                         for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
                             slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
                         }
 
                         slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+
+                        // the n-grams of the discarded tokens are no longer in the context
+                        slot.nc_context.clear();
+                        slot.n_nc_tokens = 0;
                     }
 
                     slot.n_past -= n_discard;
@@ -1938,6 +2835,12 @@ struct server_context {
         // start populating the batch for this iteration
         llama_batch_clear(batch);
 
+        // the draft tokens must leave room in the batch for the sampled tokens of all generating slots
+        int32_t n_generating = 0;
+        for (const auto & slot : slots) {
+            n_generating += slot.state == SLOT_STATE_GENERATING;
+        }
+
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
             if (slot.state != SLOT_STATE_GENERATING) {
@@ -1953,11 +2856,36 @@ struct server_context {
             llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id + 1 }, true);
 
             slot.n_past += 1;
+            n_generating -= 1;
 
-            if (slot.params.cache_prompt) {
+            if (slot.need_cache_tokens()) {
                 slot.cache_tokens.push_back(slot.sampled);
             }
 
+            // speculative decoding: add the draft tokens after the sampled token, they are verified after the decode
+            if (slot.params.n_draft > 0) {
+                int32_t n_draft = slot.params.n_draft;
+
+                n_draft = std::min(n_draft, (int32_t) llama_n_batch(ctx) - batch.n_tokens - n_generating);
+                n_draft = std::min(n_draft, slot.n_ctx - 1 - (int32_t) system_tokens.size() - slot.n_past);
+
+                // the last verified token yields one more token
+                const int32_t n_predict = slot.params.n_predict != -1 ? slot.params.n_predict : params.n_predict;
+                if (n_predict != -1) {
+                    n_draft = std::min(n_draft, n_predict - slot.n_decoded - 1);
+                }
+
+                if (n_draft > 0) {
+                    slot.drafted = draft_tokens(slot, n_draft);
+
+                    for (size_t j = 0; j < slot.drafted.size(); ++j) {
+                        llama_batch_add(batch, slot.drafted[j], system_tokens.size() + slot.n_past + j, { slot.id + 1 }, true);
+                    }
+
+                    slot.n_draft_total += slot.drafted.size();
+                }
+            }
+
             SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_system_tokens = %d, n_cache_tokens = %d, truncated = %d\n",
                     slot.n_ctx, slot.n_past, (int) system_tokens.size(), (int) slot.cache_tokens.size(), slot.truncated);
         }
@@ -1972,9 +2900,19 @@ struct server_context {
         // TODO: make enum
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
+        // prompt tokens are admitted after the sampled tokens, up to the step budget
+        // a single long prompt is processed in chunks, so that it does not stall the slots that are generating
+        const int32_t n_budget = params.n_step_budget > 0 ? std::min(params.n_step_budget, n_batch) : n_batch;
+        const int32_t n_chunk  = params.n_prefill_chunk > 0 ? params.n_prefill_chunk : n_batch;
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            // visit the slots round-robin, starting after the last slot that received prompt tokens
+            int32_t id_slot_prompt_last = -1;
+
+            for (size_t k = 0; k < slots.size(); ++k) {
+                auto & slot = slots[(id_slot_prompt_next + k) % slots.size()];
+
                 // this slot still has a prompt to be processed
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
                     auto & prompt_tokens = slot.prompt_tokens;
@@ -2112,12 +3050,21 @@ struct server_context {
                             if (!slot.params.cache_prompt) {
                                 slot.n_past_se = 0;
                                 slot.ga_i      = 0;
+
+                                prefix_cache_detach(slot, 0);
                             } else {
                                 GGML_ASSERT(slot.ga_n == 1);
 
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                                if (use_prefix_cache) {
+                                    prefix_cache_detach(slot, slot.n_past);
+                                    if (slot.lora_model.empty()) {
+                                        prefix_cache_reuse(slot, prompt_tokens);
+                                    }
+                                }
+
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
                                     gpt_sampler_accept(slot.smpl, slot.cache_tokens[i], false);
@@ -2180,6 +3127,10 @@ struct server_context {
                     // remove the non-common part from the cache
                     slot.cache_tokens.resize(slot.n_past);
 
+                    // non-causal tasks are processed in one go
+                    const int32_t n_batch_slot = slot_type ? n_batch : n_budget;
+                    const int32_t n_past_end   = slot_type ? slot.n_prompt_tokens : std::min(slot.n_prompt_tokens, slot.n_past + n_chunk);
+
                     SLT_INF(slot, "kv cache rm [%d, end)\n", p0);
 
                     int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
@@ -2190,7 +3141,7 @@ struct server_context {
 
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    for (; slot.n_past < n_past_end && batch.n_tokens < n_batch_slot; ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2201,12 +3152,14 @@ struct server_context {
 
                         llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id + 1 }, false);
 
-                        if (slot.params.cache_prompt) {
+                        if (slot.need_cache_tokens()) {
                             slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
                         }
 
                         slot.n_prompt_tokens_processed++;
                         slot_npast++;
+
+                        id_slot_prompt_last = slot.id;
                     }
 
                     SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
@@ -2227,10 +3180,14 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_budget) {
                     break;
                 }
             }
+
+            if (id_slot_prompt_last >= 0) {
+                id_slot_prompt_next = (id_slot_prompt_last + 1) % slots.size();
+            }
         }
 
         if (batch.n_tokens == 0) {
@@ -2243,6 +3200,18 @@ struct server_context {
         // make sure we're in the right embedding mode
         llama_set_embeddings(ctx, batch_type == 1);
 
+        // the candidates selected in the graph are not enough for the grammar, logit biases, penalties or n_probs of some slots
+        if (params.output_top_k > 0) {
+            bool full_logits = false;
+            for (const auto & slot : slots) {
+                if (slot.is_processing() && gpt_sampler_needs_full_logits(slot.sparams, params.output_top_k)) {
+                    full_logits = true;
+                    break;
+                }
+            }
+            llama_set_output_top_k(ctx, full_logits ? 0 : params.output_top_k, 1.0f);
+        }
+
         // process the created batch of tokens
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
@@ -2289,12 +3258,35 @@ struct server_context {
             const int ret = llama_decode(ctx, batch_view);
             metrics.on_decoded(slots);
 
+            if (ret > 0 && prefix_cache_evict()) {
+                // make room by dropping cached prefixes before reducing the batch size
+                i -= n_batch;
+
+                SRV_DBG("failed to find free space in the KV cache, evicted a cached prefix and retrying, i = %d, n_batch = %d\n", i, n_batch);
+
+                continue;
+            }
+
             if (ret != 0) {
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
                     SRV_ERR("failed to decode the batch: KV cache is full - try increasing it via the context size, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
+
+                    // only the slots with tokens in this view or in the next ones were not decoded
+                    std::set<llama_seq_id> seq_ids_failed;
+                    for (int32_t j = i; j < batch.n_tokens; j++) {
+                        for (int32_t s = 0; s < batch.n_seq_id[j]; s++) {
+                            seq_ids_failed.insert(batch.seq_id[j][s]);
+                        }
+                    }
+
                     for (auto & slot : slots) {
+                        if (seq_ids_failed.count(slot.id + 1) == 0) {
+                            continue;
+                        }
                         slot.release();
+                        // the batch was not decoded, so the slot cache does not match the KV cache
+                        prefix_cache.remove(slot.id + 1);
                         send_error(slot, "Input prompt is too big compared to KV size. Please try increasing KV size.");
                     }
                     break; // break loop of n_batch
@@ -2309,6 +3301,11 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            // the generating slots of this batch view and the outputs of their next token
+            std::vector<server_slot *> slots_gen;
+            std::vector<gpt_sampler *> smpls_gen;
+            std::vector<int>           idxs_gen;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2336,30 +3333,83 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
-                const llama_token id = gpt_sampler_sample(slot.smpl, ctx, slot.i_batch - i);
+                slots_gen.push_back(&slot);
+                smpls_gen.push_back(slot.smpl);
+                idxs_gen.push_back(slot.i_batch - i);
+            }
+
+            // sample the next token of all generating slots at once
+            const std::vector<llama_token> ids_gen = gpt_sampler_sample_batch(smpls_gen, ctx, idxs_gen);
 
-                gpt_sampler_accept(slot.smpl, id, true);
+            for (size_t k = 0; k < slots_gen.size(); ++k) {
+                server_slot & slot = *slots_gen[k];
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
+                bool stop  = false;
+                bool split = false; // the next draft tokens are in the next batch view
+
+                // the first token follows the sampled token, the next ones follow the draft tokens
+                // keep sampling as long as the draft tokens match the sampled tokens
+                for (size_t j = 0; ; ++j) {
+                    completion_token_output result;
+                    const llama_token id = j == 0 ? ids_gen[k] : gpt_sampler_sample(slot.smpl, ctx, slot.i_batch - i + j);
+
+                    gpt_sampler_accept(slot.smpl, id, true);
+
+                    slot.n_decoded += 1;
+                    if (slot.n_decoded == 1) {
+                        slot.t_start_generation = ggml_time_us();
+                        slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                        metrics.on_prompt_eval(slot);
+                    }
+
+                    result.tok = id;
+
+                    const auto * cur_p = gpt_sampler_get_candidates(slot.smpl);
+
+                    for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
+                        result.probs.push_back({
+                            cur_p->data[i].id,
+                            i >= cur_p->size ? 0.0f : cur_p->data[i].p,
+                        });
+                    }
+
+                    if (!process_token(result, slot)) {
+                        stop = true;
+                        break;
+                    }
+
+                    if (j >= slot.drafted.size() || slot.drafted[j] != id) {
+                        break;
+                    }
+
+                    // the draft token is accepted, its KV cell becomes part of the sequence
+                    slot.n_past += 1;
+                    slot.n_draft_accepted += 1;
+
+                    slot.cache_tokens.push_back(id);
+
+                    if (slot.i_batch + (int) j + 1 >= (int) (i + n_tokens)) {
+                        // the batch was split in the middle of the draft tokens after a decode retry with a smaller
+                        // n_batch - continue the verification from the accepted token once the next view is decoded
+                        slot.i_batch += j + 1;
+                        slot.drafted.erase(slot.drafted.begin(), slot.drafted.begin() + j + 1);
+                        split = true;
+                        break;
+                    }
                 }
 
-                result.tok = id;
+                if (split) {
+                    continue;
+                }
 
-                const auto * cur_p = gpt_sampler_get_candidates(slot.smpl);
+                if (!slot.drafted.empty()) {
+                    // remove the rejected draft tokens from the KV cache
+                    llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.n_past, -1);
 
-                for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
-                    result.probs.push_back({
-                        cur_p->data[i].id,
-                        i >= cur_p->size ? 0.0f : cur_p->data[i].p,
-                    });
+                    slot.drafted.clear();
                 }
 
-                if (!process_token(result, slot)) {
+                if (stop) {
                     // release slot because of stop condition
                     slot.release();
                     slot.print_timings();
@@ -2430,6 +3480,11 @@ int main(int argc, char ** argv) {
     server_context ctx_server;
 
     if (!params.system_prompt.empty()) {
+        if (!params.lora_models.empty()) {
+            LOG_ERR("%s: --system-prompt-file is not supported with --lora-model\n", __func__);
+            return 1;
+        }
+
         ctx_server.system_prompt_set(params.system_prompt);
     }
 
@@ -2679,6 +3734,9 @@ int main(int argc, char ** argv) {
         const uint64_t n_decode_total     = data.at("n_decode_total");
         const uint64_t n_busy_slots_total = data.at("n_busy_slots_total");
 
+        const uint64_t n_draft_total          = data.at("n_draft_total");
+        const uint64_t n_draft_accepted_total = data.at("n_draft_accepted_total");
+
         const int32_t kv_cache_used_cells = data.at("kv_cache_used_cells");
 
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
@@ -2707,6 +3765,14 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) n_busy_slots_total / (float) n_decode_total}
+            }, {
+                    {"name",  "n_draft_total"},
+                    {"help",  "Number of tokens drafted for speculative decoding."},
+                    {"value",  n_draft_total}
+            }, {
+                    {"name",  "n_draft_accepted_total"},
+                    {"help",  "Number of drafted tokens accepted by the model."},
+                    {"value",  n_draft_accepted_total}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3018,6 +4084,25 @@ int main(int argc, char ** argv) {
              }}
         };
 
+        for (const auto & m : params.lora_models) {
+            json adapters = json::array();
+            for (const auto & lora : m.adapters) {
+                adapters.push_back({
+                    {"path",  lora.path},
+                    {"scale", lora.scale},
+                });
+            }
+
+            models.at("data").push_back({
+                {"id",       m.name},
+                {"object",   "model"},
+                {"created",  std::time(0)},
+                {"owned_by", "llamacpp"},
+                {"parent",   params.model_alias},
+                {"lora",     adapters},
+            });
+        }
+
         res.set_content(models.dump(), MIMETYPE_JSON);
     };
 
@@ -3377,10 +4462,7 @@ int main(int argc, char ** argv) {
         ctx_server.queue_tasks.terminate();
     };
 
-    LOG_INF("%s: server is listening on %s:%d - starting the main loop\n", __func__, params.hostname.c_str(), params.port);
-
-    ctx_server.queue_tasks.start_loop();
-
+    // install the handlers before the main loop, so that a signal stops the loop and the server is destroyed properly
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
     struct sigaction sigint_action;
     sigint_action.sa_handler = signal_handler;
@@ -3395,6 +4477,10 @@ int main(int argc, char ** argv) {
     SetConsoleCtrlHandler(reinterpret_cast<PHANDLER_ROUTINE>(console_ctrl_handler), true);
 #endif
 
+    LOG_INF("%s: server is listening on %s:%d - starting the main loop\n", __func__, params.hostname.c_str(), params.port);
+
+    ctx_server.queue_tasks.start_loop();
+
     clean_up();
     t.join();
 
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Aho-Corasick automaton over the stop strings
+// the generated text is fed as it grows, one transition per byte, so the cost per token does not depend on the
+// length of the text that was generated so far
+struct stop_string_matcher {
+    struct node {
+        int32_t next[256]; // transitions, including the ones that follow the failure links
+        int32_t depth;     // length of the stop string prefix that the node represents
+        int32_t word;      // longest stop string that is a suffix of the prefix, -1 if none
+    };
+
+    std::vector<std::string> words;
+    std::vector<node>        nodes;
+
+    int32_t state = 0;
+
+    void init(const std::vector<std::string> & stop_words) {
+        words = stop_words;
+        nodes.assign(1, node{});
+        std::fill(std::begin(nodes[0].next), std::end(nodes[0].next), -1);
+        nodes[0].word = -1;
+
+        // trie of the stop strings
+        for (size_t i = 0; i < words.size(); ++i) {
+            int32_t cur = 0;
+            for (const char c : words[i]) {
+                const uint8_t b = c;
+                if (nodes[cur].next[b] < 0) {
+                    nodes[cur].next[b] = nodes.size();
+                    nodes.push_back(node{});
+                    std::fill(std::begin(nodes.back().next), std::end(nodes.back().next), -1);
+                    nodes.back().depth = nodes[cur].depth + 1;
+                    nodes.back().word  = -1;
+                }
+                cur = nodes[cur].next[b];
+            }
+            if (nodes[cur].word < 0) {
+                nodes[cur].word = i;
+            }
+        }
+
+        // complete the transitions in breadth-first order, through the failure links
+        std::vector<int32_t> fail(nodes.size(), 0);
+        std::vector<int32_t> queue;
+        for (int b = 0; b < 256; ++b) {
+            int32_t & v = nodes[0].next[b];
+            if (v < 0) {
+                v = 0;
+            } else {
+                queue.push_back(v);
+            }
+        }
+        for (size_t i = 0; i < queue.size(); ++i) {
+            const int32_t u = queue[i];
+
+            // the longest stop string that ends here can also come from the failure link
+            const int32_t w = nodes[fail[u]].word;
+            if (nodes[u].word < 0 || (w >= 0 && words[w].size() > words[nodes[u].word].size())) {
+                nodes[u].word = w;
+            }
+
+            for (int b = 0; b < 256; ++b) {
+                int32_t & v = nodes[u].next[b];
+                if (v < 0) {
+                    v = nodes[fail[u]].next[b];
+                } else {
+                    fail[v] = nodes[fail[u]].next[b];
+                    queue.push_back(v);
+                }
+            }
+        }
+
+        state = 0;
+    }
+
+    void reset() {
+        state = 0;
+    }
+
+    // feed the text that was appended to the generated text at position pos
+    // returns the position of the earliest stop string that ends in the new text and sets word, or std::string::npos
+    size_t feed(const std::string & text, size_t pos, std::string & word) {
+        size_t result = std::string::npos;
+
+        if (words.empty()) {
+            return result;
+        }
+
+        for (size_t i = 0; i < text.size(); ++i) {
+            state = nodes[state].next[(uint8_t) text[i]];
+
+            const int32_t w = nodes[state].word;
+            if (w >= 0) {
+                const size_t start = pos + i + 1 - words[w].size();
+                if (start < result) {
+                    result = start;
+                    word   = words[w];
+                }
+            }
+        }
+
+        return result;
+    }
+
+    // length of the longest suffix of the fed text that is a prefix of a stop string
+    size_t partial() const {
+        return nodes.empty() ? 0 : nodes[state].depth;
+    }
+};
@@ -3,6 +3,8 @@
 #include "common.h"
 #include "log.h"
 #include "llama.h"
+#include "prefix-tree.hpp"
+#include "stop-strings.hpp"
 
 #ifndef NDEBUG
 // crash the server in debug mode, otherwise send an http 500 error
@@ -16,9 +18,15 @@
 #define JSON_ASSERT GGML_ASSERT
 #include "json.hpp"
 
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo-0613"
@@ -196,26 +204,6 @@ static size_t common_part(const std::string & a, const std::string & b) {
     return i;
 }
 
-static bool ends_with(const std::string & str, const std::string & suffix) {
-    return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
-
-static size_t find_partial_stop_string(const std::string &stop, const std::string &text) {
-    if (!text.empty() && !stop.empty()) {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--) {
-            if (stop[char_index] == text_last_char) {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial)) {
-                    return text.size() - char_index - 1;
-                }
-            }
-        }
-    }
-
-    return std::string::npos;
-}
-
 static bool json_is_array_of_numbers(const json & data) {
     if (data.is_array()) {
         for (const auto & e : data) {
@@ -191,7 +191,16 @@ int main(int argc, char ** argv) {
     }
 
     llama_batch batch_dft = llama_batch_init(params.n_ctx, 0, 1);
-    llama_batch batch_tgt = llama_batch_init(params.n_ctx, 0, n_seq_dft);
+    llama_batch batch_tgt = llama_batch_init(params.n_ctx, 0, 1);
+
+    // the drafts are verified as a token tree in a single target sequence: parent_tgt[i] is the parent of token i of batch_tgt
+    std::vector<int32_t> parent_tgt;
+
+    // a tree batch must fit in a single ubatch
+    if (n_draft + n_seq_dft > (int) llama_n_ubatch(ctx_tgt)) {
+        LOG_ERR("%s: n_draft + n_parallel (%d) must not exceed the ubatch size (%d)\n", __func__, n_draft + n_seq_dft, (int) llama_n_ubatch(ctx_tgt));
+        return 1;
+    }
 
     const auto t_dec_start = ggml_time_us();
 
@@ -414,10 +423,8 @@ int main(int argc, char ** argv) {
                 llama_kv_cache_seq_cp  (ctx_dft, s_keep, 0, -1, -1);
                 llama_kv_cache_seq_keep(ctx_dft, 0);
 
-                llama_kv_cache_seq_rm  (ctx_tgt, s_keep, n_past_tgt, -1);
-                llama_kv_cache_seq_keep(ctx_tgt, s_keep);
-                llama_kv_cache_seq_cp  (ctx_tgt, s_keep, 0, -1, -1);
-                llama_kv_cache_seq_keep(ctx_tgt, 0);
+                // keep the accepted path of the tree: its root and the accepted draft tokens
+                llama_kv_cache_tree_accept(ctx_tgt, drafts[s_keep].i_batch_tgt.data(), i_dft + 1);
             }
 
             for (int s = 0; s < n_seq_dft; ++s) {
@@ -464,6 +471,9 @@ int main(int argc, char ** argv) {
         llama_batch_clear(batch_tgt);
         llama_batch_add  (batch_tgt, drafts[0].tokens[0], n_past_tgt, { 0 }, true);
 
+        parent_tgt.clear();
+        parent_tgt.push_back(-1);
+
         // sample n_draft tokens from the draft model using tree-based sampling
         for (int i = 0; i < n_draft; ++i) {
             batch_dft.n_tokens = 0;
@@ -496,16 +506,7 @@ int main(int argc, char ** argv) {
                         llama_kv_cache_seq_rm(ctx_dft,    n_seq_cur, -1, -1);
                         llama_kv_cache_seq_cp(ctx_dft, s, n_seq_cur, -1, -1);
 
-                        // all previous tokens from this branch are now also part of the new branch
-                        for (int t = 0; t < batch_tgt.n_tokens; ++t) {
-                            for (int p = 0; p < batch_tgt.n_seq_id[t]; ++p) {
-                                if (batch_tgt.seq_id[t][p] == s) {
-                                    batch_tgt.seq_id[t][batch_tgt.n_seq_id[t]] = n_seq_cur;
-                                    batch_tgt.n_seq_id[t]++;
-                                    break;
-                                }
-                            }
-                        }
+                        // the new branch shares the previous target tokens of this branch through i_batch_tgt
 
                         // copy the draft state
                         drafts[n_seq_cur].active   = true;
@@ -542,10 +543,11 @@ int main(int argc, char ** argv) {
                     // save cur_p.data into drafts[s].dists
                     drafts[s].dists.push_back({cur_p->data, cur_p->data + cur_p->size});
 
-                    // add unique drafted tokens to the target batch
+                    // add unique drafted tokens to the target batch, as children of the last token of the branch
+                    parent_tgt.push_back(drafts[s].i_batch_tgt.back());
                     drafts[s].i_batch_tgt.push_back(batch_tgt.n_tokens);
 
-                    llama_batch_add(batch_tgt, id, n_past_tgt + i + 1, { s }, true);
+                    llama_batch_add(batch_tgt, id, n_past_tgt + i + 1, { 0 }, true);
 
                     // add the token to the batch for batched decoding with the draft model
                     drafts[s].i_batch_dft = batch_dft.n_tokens;
@@ -575,12 +577,8 @@ int main(int argc, char ** argv) {
 
         // evaluate the target model on the drafted tokens
         {
-            llama_kv_cache_seq_keep(ctx_tgt, 0);
-            for (int s = 1; s < n_seq_dft; ++s) {
-                llama_kv_cache_seq_cp(ctx_tgt, 0, s, -1, -1);
-            }
-
             // LOG_DBG("target batch: %s\n", LOG_BATCH_TOSTR_PRETTY(ctx_tgt, batch_tgt).c_str());
+            llama_set_tree(ctx_tgt, parent_tgt.data(), batch_tgt.n_tokens);
             llama_decode(ctx_tgt, batch_tgt);
             ++n_past_tgt;
         }
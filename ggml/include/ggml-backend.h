@@ -312,8 +312,19 @@ extern "C" {
     GGML_API ggml_backend_buffer_t      ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_buffer_type(void);
 
+    // CPU buffer type that allocates the buffers of at least 2 MiB with huge pages: explicit huge pages if some are
+    // reserved, transparent huge pages otherwise - NULL if not supported on this platform
+    GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_huge_page_buffer_type(void);
+
     GGML_API ggml_backend_reg_t ggml_backend_cpu_reg(void);
 
+    // Buffer type that repacks Q4_0 weights into an interleaved layout for faster matrix multiplication on this CPU
+    // the repacked tensors can only be used as src0 of GGML_OP_MUL_MAT and GGML_OP_MUL_MAT_ID on the CPU backend
+    GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_repack_buffer_type(void);
+    GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_repack_huge_page_buffer_type(void); // with huge pages, NULL if not supported
+    GGML_API bool                       ggml_backend_buft_is_cpu_repack(ggml_backend_buffer_type_t buft);
+    GGML_API bool                       ggml_backend_cpu_repack_supported(const struct ggml_tensor * tensor);
+
 #ifdef GGML_USE_CPU_HBM
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void);
 #endif
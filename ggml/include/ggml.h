@@ -390,6 +390,8 @@ extern "C" {
         GGML_TYPE_Q4_0_8_8 = 33,
         GGML_TYPE_TQ1_0   = 34,
         GGML_TYPE_TQ2_0   = 35,
+        GGML_TYPE_Q2_1    = 36,
+        GGML_TYPE_Q3_1    = 37,
         GGML_TYPE_COUNT,
     };
 
@@ -500,6 +502,7 @@ extern "C" {
         GGML_OP_ARANGE,
         GGML_OP_TIMESTEP_EMBEDDING,
         GGML_OP_ARGSORT,
+        GGML_OP_ARGSORT_TOP_K,
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN_EXT,
@@ -703,6 +706,7 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API void    ggml_numa_distribute_tensor(const struct ggml_tensor * tensor); // place the rows of a matrix on the nodes whose threads compute them
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -1793,6 +1797,13 @@ extern "C" {
             struct ggml_tensor  * a,
             int                   k);
 
+    // indices of the top k elements per row, in descending order of the values
+    // same result as ggml_top_k, but selects the elements without sorting the whole rows - use for long rows (e.g. logits)
+    GGML_API struct ggml_tensor * ggml_argsort_top_k(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            int                   k);
+
 #define GGML_KQ_MASK_PAD 32
 
     // q:    [n_embd, n_batch,     n_head,    1]
@@ -2528,6 +2539,7 @@ extern "C" {
     typedef void (*ggml_from_float_t)(const float * GGML_RESTRICT x, void  * GGML_RESTRICT y, int64_t k);
     typedef void (*ggml_from_float_to_mat_t)
                                      (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t nr, int64_t k, int64_t bs);
+    typedef void (*ggml_vec_mad_t)   (const void  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k, float v);
     typedef void (*ggml_vec_dot_t)  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT x, size_t bx,
                                        const void * GGML_RESTRICT y, size_t by, int nrc);
     typedef void (*ggml_gemv_t)     (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT x,
@@ -2545,6 +2557,7 @@ extern "C" {
         ggml_from_float_t        from_float;
         ggml_from_float_t        from_float_ref;
         ggml_from_float_to_mat_t from_float_to_mat;
+        ggml_vec_mad_t           vec_mad; // y += v*x, dequantizing x on the fly
         ggml_vec_dot_t           vec_dot;
         enum ggml_type           vec_dot_type;
         int64_t                  nrows; // number of rows to process simultaneously
@@ -915,14 +915,89 @@ void ggml_gemv_q4_0_8x8_q8_0(int n, float * restrict s, size_t bs, const void *
     const block_q4_0x8 * b_ptr_start = (const block_q4_0x8 *)vx;
     const block_q8_0 * a_ptr_start = (const block_q8_0 *)vy;
 
+#if defined(__AVX512F__)
+    // Mask to mask out nibbles from packed bytes expanded to 512 bit length
+    const __m512i m4bexpanded = _mm512_set1_epi8(0x0F);
+    // Lookup table to convert signed nibbles to signed bytes expanded to 512 bit length
+    const __m512i signextendlutexpanded = _mm512_inserti32x8(_mm512_castsi256_si512(signextendlut), signextendlut, 1);
+    // Final permute mask applied separately to each 256 bit half
+    const __m512i finalpermutemaskexpanded = _mm512_set_epi32(15, 13, 11, 9, 14, 12, 10, 8, 7, 5, 3, 1, 6, 4, 2, 0);
+#endif
+
     // Process Q8_0 blocks one by one
     for (int64_t y = 0; y < nr; y++) {
 
         // Pointers to LHS blocks of block_q8_0 format
         const block_q8_0 * a_ptr = a_ptr_start + (y * nb);
 
+        int64_t x = 0;
+
+#if defined(__AVX512F__)
+        // Take group of two block_q4_0x8 structures at each pass of the loop, one in each 256 bit half of the 512 bit vectors
+        // The computation within each half is the same as in the AVX2 loop below
+        for (; x + 1 < nc / 8; x += 2) {
+
+            // Pointers to RHS blocks
+            const block_q4_0x8 * b_ptr_0 = b_ptr_start + ((x)     * b_nb);
+            const block_q4_0x8 * b_ptr_1 = b_ptr_start + ((x + 1) * b_nb);
+
+            // Master FP accumulator
+            __m512 acc_row = _mm512_setzero_ps();
+
+            for (int64_t b = 0; b < nb; b++) {
+                // Load 8 blocks of Q4_0 interleaved as 8 bytes (B0 - B7) from the first and (B8 - BF) from the second structure
+                const __m512i rhs_raw_vec_0123_0 = _mm512_inserti32x8(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)(b_ptr_0[b].qs))),     _mm256_loadu_si256((const __m256i *)(b_ptr_1[b].qs)),     1);
+                const __m512i rhs_raw_vec_4567_0 = _mm512_inserti32x8(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)(b_ptr_0[b].qs) + 1)), _mm256_loadu_si256((const __m256i *)(b_ptr_1[b].qs) + 1), 1);
+                const __m512i rhs_raw_vec_0123_1 = _mm512_inserti32x8(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)(b_ptr_0[b].qs) + 2)), _mm256_loadu_si256((const __m256i *)(b_ptr_1[b].qs) + 2), 1);
+                const __m512i rhs_raw_vec_4567_1 = _mm512_inserti32x8(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)(b_ptr_0[b].qs) + 3)), _mm256_loadu_si256((const __m256i *)(b_ptr_1[b].qs) + 3), 1);
+
+                // 4-bit -> 8-bit - Sign is maintained
+                const __m512i rhs_vec_0123_0 = _mm512_shuffle_epi8(signextendlutexpanded, _mm512_and_si512(rhs_raw_vec_0123_0, m4bexpanded)); // B0(0-7) B1(0-7) B2(0-7) B3(0-7) B8(0-7) B9(0-7) BA(0-7) BB(0-7)
+                const __m512i rhs_vec_4567_0 = _mm512_shuffle_epi8(signextendlutexpanded, _mm512_and_si512(rhs_raw_vec_4567_0, m4bexpanded)); // B4(0-7) B5(0-7) B6(0-7) B7(0-7) BC(0-7) BD(0-7) BE(0-7) BF(0-7)
+                const __m512i rhs_vec_0123_1 = _mm512_shuffle_epi8(signextendlutexpanded, _mm512_and_si512(rhs_raw_vec_0123_1, m4bexpanded)); // B0(8-15) B1(8-15) B2(8-15) B3(8-15) B8(8-15) B9(8-15) BA(8-15) BB(8-15)
+                const __m512i rhs_vec_4567_1 = _mm512_shuffle_epi8(signextendlutexpanded, _mm512_and_si512(rhs_raw_vec_4567_1, m4bexpanded)); // B4(8-15) B5(8-15) B6(8-15) B7(8-15) BC(8-15) BD(8-15) BE(8-15) BF(8-15)
+
+                const __m512i rhs_vec_0123_2 = _mm512_shuffle_epi8(signextendlutexpanded, _mm512_and_si512(_mm512_srli_epi16(rhs_raw_vec_0123_0, 4), m4bexpanded)); // B0(16-23) ... BB(16-23)
+                const __m512i rhs_vec_4567_2 = _mm512_shuffle_epi8(signextendlutexpanded, _mm512_and_si512(_mm512_srli_epi16(rhs_raw_vec_4567_0, 4), m4bexpanded)); // B4(16-23) ... BF(16-23)
+                const __m512i rhs_vec_0123_3 = _mm512_shuffle_epi8(signextendlutexpanded, _mm512_and_si512(_mm512_srli_epi16(rhs_raw_vec_0123_1, 4), m4bexpanded)); // B0(24-31) ... BB(24-31)
+                const __m512i rhs_vec_4567_3 = _mm512_shuffle_epi8(signextendlutexpanded, _mm512_and_si512(_mm512_srli_epi16(rhs_raw_vec_4567_1, 4), m4bexpanded)); // B4(24-31) ... BF(24-31)
+
+                // Load the scale values for the 16 blocks interleaved in the two block_q4_0x8
+                const __m512 col_scale_f32 = _mm512_insertf32x8(_mm512_castps256_ps512(GGML_F32Cx8_REARRANGE_LOAD(b_ptr_0[b].d, changemask)), GGML_F32Cx8_REARRANGE_LOAD(b_ptr_1[b].d, changemask), 1);
+
+                // Load and convert to FP32 scale from block_q8_0
+                const __m512 row_scale_f32 = _mm512_set1_ps(GGML_FP16_TO_FP32(a_ptr[b].d));
+
+                // Load the block values in block_q8_0 in batches of 16 bytes and replicate the same across 512 bit vector
+                const __m512i lhs_vec_0 = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)a_ptr[b].qs));        // A0(0-15) A0(0-15) A0(0-15) A0(0-15)
+                const __m512i lhs_vec_1 = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(a_ptr[b].qs + 16))); // A0(16-31) A0(16-31) A0(16-31) A0(16-31)
+
+                __m512i iacc = _mm512_setzero_si512();
+
+                iacc = _mm512_add_epi32(iacc, mul_sum_i8_pairs_int32x16(_mm512_mask_blend_epi32(0xAAAA, rhs_vec_0123_0, _mm512_shuffle_epi32(rhs_vec_4567_0, 177)), _mm512_shuffle_epi32(lhs_vec_0, 0)));
+                iacc = _mm512_add_epi32(iacc, mul_sum_i8_pairs_int32x16(_mm512_mask_blend_epi32(0xAAAA, _mm512_shuffle_epi32(rhs_vec_0123_0, 177), rhs_vec_4567_0), _mm512_shuffle_epi32(lhs_vec_0, 85)));
+
+                iacc = _mm512_add_epi32(iacc, mul_sum_i8_pairs_int32x16(_mm512_mask_blend_epi32(0xAAAA, rhs_vec_0123_1, _mm512_shuffle_epi32(rhs_vec_4567_1, 177)), _mm512_shuffle_epi32(lhs_vec_0, 170)));
+                iacc = _mm512_add_epi32(iacc, mul_sum_i8_pairs_int32x16(_mm512_mask_blend_epi32(0xAAAA, _mm512_shuffle_epi32(rhs_vec_0123_1, 177), rhs_vec_4567_1), _mm512_shuffle_epi32(lhs_vec_0, 255)));
+
+                iacc = _mm512_add_epi32(iacc, mul_sum_i8_pairs_int32x16(_mm512_mask_blend_epi32(0xAAAA, rhs_vec_0123_2, _mm512_shuffle_epi32(rhs_vec_4567_2, 177)), _mm512_shuffle_epi32(lhs_vec_1, 0)));
+                iacc = _mm512_add_epi32(iacc, mul_sum_i8_pairs_int32x16(_mm512_mask_blend_epi32(0xAAAA, _mm512_shuffle_epi32(rhs_vec_0123_2, 177), rhs_vec_4567_2), _mm512_shuffle_epi32(lhs_vec_1, 85)));
+
+                iacc = _mm512_add_epi32(iacc, mul_sum_i8_pairs_int32x16(_mm512_mask_blend_epi32(0xAAAA, rhs_vec_0123_3, _mm512_shuffle_epi32(rhs_vec_4567_3, 177)), _mm512_shuffle_epi32(lhs_vec_1, 170)));
+                iacc = _mm512_add_epi32(iacc, mul_sum_i8_pairs_int32x16(_mm512_mask_blend_epi32(0xAAAA, _mm512_shuffle_epi32(rhs_vec_0123_3, 177), rhs_vec_4567_3), _mm512_shuffle_epi32(lhs_vec_1, 255)));
+
+                // Accumulated values multipled with appropriate scales
+                acc_row = _mm512_fmadd_ps(_mm512_cvtepi32_ps(iacc), _mm512_mul_ps(col_scale_f32, row_scale_f32), acc_row);
+            }
+
+            // Accumulated output values permuted so as to be stored in appropriate order post accumulation
+            acc_row = _mm512_permutexvar_ps(finalpermutemaskexpanded, acc_row);
+            _mm512_storeu_ps(s + (y * nr + x * 8), acc_row);
+        }
+#endif
+
         // Take group of eight block_q4_0x8 structures at each pass of the loop and perform dot product operation
-        for (int64_t x = 0; x < nc / 8; x++) {
+        for (; x < nc / 8; x++) {
 
             // Pointers to RHS blocks
             const block_q4_0x8 * b_ptr = b_ptr_start + (x * b_nb);
@@ -3207,3 +3282,92 @@ void ggml_gemm_q4_0_8x8_q8_0(int n, float * restrict s, size_t bs, const void *
         }
     }
 }
+
+// Repacking of standard Q4_0 weights into the interleaved layouts at load time
+
+static int repack_q4_0_to_q4_0_nr_bl(struct ggml_tensor * t, int nrows_interleaved, int blck_size_interleave, const void * restrict data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q4_0);
+    GGML_ASSERT(nrows_interleaved == 4 || nrows_interleaved == 8);
+
+    const block_q4_0 * src = (const block_q4_0 *) data;
+    block_q4_0 dst_tmp[8];
+
+    const int64_t nrow    = ggml_nrows(t);
+    const int64_t nblocks = t->ne[0] / QK4_0;
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q4_0));
+
+    if (nrow % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    if (nrows_interleaved == 8) {
+        block_q4_0x8 * dst = (block_q4_0x8 *) t->data;
+        for (int64_t b = 0; b < nrow; b += nrows_interleaved) {
+            for (int64_t x = 0; x < nblocks; x++) {
+                for (int i = 0; i < nrows_interleaved; i++) {
+                    dst_tmp[i] = src[x + i * nblocks];
+                }
+                *dst++ = make_block_q4_0x8(dst_tmp, blck_size_interleave, 0x88);
+            }
+            src += nrows_interleaved * nblocks;
+        }
+    } else {
+        block_q4_0x4 * dst = (block_q4_0x4 *) t->data;
+        for (int64_t b = 0; b < nrow; b += nrows_interleaved) {
+            for (int64_t x = 0; x < nblocks; x++) {
+                for (int i = 0; i < nrows_interleaved; i++) {
+                    dst_tmp[i] = src[x + i * nblocks];
+                }
+                *dst++ = make_block_q4_0x4(dst_tmp, blck_size_interleave, 0x88);
+            }
+            src += nrows_interleaved * nblocks;
+        }
+    }
+
+    return 0;
+}
+
+int ggml_aarch64_repack_tensor(struct ggml_tensor * cur, enum ggml_type repack_type, const void * restrict data, size_t data_size) {
+    GGML_ASSERT(cur->type == GGML_TYPE_Q4_0);
+
+    int ret = -1;
+
+    switch (repack_type) {
+        case GGML_TYPE_Q4_0_4_4: ret = repack_q4_0_to_q4_0_nr_bl(cur, 4, 4, data, data_size); break;
+        case GGML_TYPE_Q4_0_4_8: ret = repack_q4_0_to_q4_0_nr_bl(cur, 4, 8, data, data_size); break;
+        case GGML_TYPE_Q4_0_8_8: ret = repack_q4_0_to_q4_0_nr_bl(cur, 8, 8, data, data_size); break;
+        default: GGML_ABORT("Unsupported type");
+    }
+
+    if (ret == 0) {
+        cur->type = repack_type;
+    }
+
+    return ret;
+}
+
+enum ggml_type ggml_aarch64_get_optimal_repack_type(const struct ggml_tensor * cur) {
+    if (cur->type != GGML_TYPE_Q4_0 || !ggml_is_matrix(cur) || cur->ne[0] % 8 != 0) {
+        return cur->type;
+    }
+
+    // prefer the widest layout that has a vectorized gemv and gemm for this CPU
+    if (ggml_cpu_has_avx2() || (ggml_cpu_has_sve() && ggml_cpu_has_matmul_int8() && ggml_cpu_get_sve_cnt() == QK8_0)) {
+        if (cur->ne[1] % 8 == 0) {
+            return GGML_TYPE_Q4_0_8_8;
+        }
+    }
+    if (ggml_cpu_has_neon() && ggml_cpu_has_matmul_int8()) {
+        if (cur->ne[1] % 4 == 0) {
+            return GGML_TYPE_Q4_0_4_8;
+        }
+    }
+    if (ggml_cpu_has_neon()) {
+        if (cur->ne[1] % 4 == 0) {
+            return GGML_TYPE_Q4_0_4_4;
+        }
+    }
+
+    return cur->type;
+}
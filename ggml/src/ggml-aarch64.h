@@ -1,8 +1,11 @@
 // SPDX-FileCopyrightText: Copyright 2024 Arm Ltd.
 #pragma once
 
+// the block types are only declared for C, ggml-backend.cpp includes this header for the repacking functions only
+#ifndef __cplusplus
 #define GGML_COMMON_DECL_C
 #include "ggml-common.h"
+#endif
 
 #include "ggml.h"
 
@@ -33,6 +36,13 @@ void ggml_gemm_q4_0_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const vo
 void ggml_gemm_q4_0_4x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc);
 void ggml_gemm_q4_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc);
 
+// Repacking
+// repack the Q4_0 data in data into the layout of repack_type and store it in cur (a Q4_0 tensor)
+// on success cur->type is changed to repack_type and 0 is returned
+int ggml_aarch64_repack_tensor(struct ggml_tensor * cur, enum ggml_type repack_type, const void * data, size_t data_size);
+// the interleaved type with vectorized kernels on this CPU, or cur->type if cur cannot be repacked
+enum ggml_type ggml_aarch64_get_optimal_repack_type(const struct ggml_tensor * cur);
+
 #ifdef __cplusplus
 }
 #endif
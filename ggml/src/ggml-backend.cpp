@@ -11,8 +11,10 @@
 #include "ggml-backend-impl.h"
 #include "ggml-alloc.h"
 #include "ggml-impl.h"
+#include "ggml-aarch64.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -21,6 +23,10 @@
 #include <string>
 #include <vector>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 #ifdef __APPLE__
 #include <sys/types.h>
 #include <sys/sysctl.h>
@@ -733,6 +739,66 @@ static const struct ggml_backend_buffer_i ggml_backend_cpu_buffer_from_ptr_i = {
     /* .reset           = */ NULL,
 };
 
+// huge pages
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+#define GGML_CPU_HUGE_PAGES
+#define GGML_CPU_HUGE_PAGE_SIZE (2*1024*1024)
+
+// returns memory aligned to a huge page, with the pages faulted in so that they are huge pages if the kernel has some
+static void * ggml_backend_cpu_huge_page_alloc(size_t size) {
+    GGML_ASSERT(size % GGML_CPU_HUGE_PAGE_SIZE == 0);
+
+    // explicit huge pages, only available if reserved with /proc/sys/vm/nr_hugepages
+    char * data = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (data == MAP_FAILED) {
+        // transparent huge pages, the mapping is aligned by trimming an extra huge page
+        char * raw = (char *) mmap(NULL, size + GGML_CPU_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+        data = (char *) GGML_PAD((uintptr_t) raw, GGML_CPU_HUGE_PAGE_SIZE);
+        if (data > raw) {
+            munmap(raw, data - raw);
+        }
+        munmap(data + size, raw + GGML_CPU_HUGE_PAGE_SIZE - data);
+        if (madvise(data, size, MADV_HUGEPAGE) != 0) {
+            GGML_LOG_DEBUG("%s: madvise(MADV_HUGEPAGE) failed: %s\n", __func__, strerror(errno));
+        }
+    }
+
+    for (size_t i = 0; i < size; i += GGML_CPU_HUGE_PAGE_SIZE) {
+        data[i] = 0;
+    }
+
+    return data;
+}
+
+static void ggml_backend_cpu_huge_page_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    munmap(buffer->context, buffer->size);
+}
+
+static const char * ggml_backend_cpu_huge_page_buffer_get_name(ggml_backend_buffer_t buffer) {
+    return "CPU_HUGE";
+
+    GGML_UNUSED(buffer);
+}
+
+static const struct ggml_backend_buffer_i ggml_backend_cpu_huge_page_buffer_i = {
+    /* .get_name        = */ ggml_backend_cpu_huge_page_buffer_get_name,
+    /* .free_buffer     = */ ggml_backend_cpu_huge_page_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_buffer_get_base,
+    /* .init_tensor     = */ NULL, // no initialization required
+    /* .memset_tensor   = */ ggml_backend_cpu_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_cpu_buffer_get_tensor,
+    /* .cpy_tensor      = */ ggml_backend_cpu_buffer_cpy_tensor,
+    /* .clear           = */ ggml_backend_cpu_buffer_clear,
+    /* .reset           = */ NULL,
+};
+#endif
+
 static const char * ggml_backend_cpu_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
     return "CPU";
 
@@ -779,6 +845,147 @@ ggml_backend_buffer_type_t ggml_backend_cpu_buffer_type(void) {
     return &ggml_backend_cpu_buffer_type;
 }
 
+// buffer type HUGE
+// the buffers of at least a huge page are allocated with huge pages, the smaller ones with malloc
+
+#ifdef GGML_CPU_HUGE_PAGES
+static const char * ggml_backend_cpu_huge_page_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_HUGE";
+
+    GGML_UNUSED(buft);
+}
+
+static ggml_backend_buffer_t ggml_backend_cpu_huge_page_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    if (size >= GGML_CPU_HUGE_PAGE_SIZE) {
+        const size_t size_huge = GGML_PAD(size, GGML_CPU_HUGE_PAGE_SIZE);
+        void * data = ggml_backend_cpu_huge_page_alloc(size_huge);
+        if (data != NULL) {
+            return ggml_backend_buffer_init(buft, ggml_backend_cpu_huge_page_buffer_i, data, size_huge);
+        }
+        GGML_LOG_WARN("%s: failed to allocate %zu bytes with huge pages, falling back to malloc\n", __func__, size_huge);
+    }
+
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+    if (buffer != NULL) {
+        buffer->buft = buft;
+    }
+
+    return buffer;
+}
+#endif
+
+ggml_backend_buffer_type_t ggml_backend_cpu_huge_page_buffer_type(void) {
+#ifdef GGML_CPU_HUGE_PAGES
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_huge_page = {
+        /* .iface    = */ {
+            /* .get_name         = */ ggml_backend_cpu_huge_page_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_cpu_huge_page_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .is_host          = */ ggml_backend_cpu_buffer_type_is_host,
+        },
+        /* .device  = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+        /* .context = */ NULL,
+    };
+
+    return &ggml_backend_cpu_buffer_type_huge_page;
+#else
+    return NULL;
+#endif
+}
+
+// buffer type REPACK
+// weights are converted to an interleaved layout with vectorized gemv/gemm kernels when they are uploaded
+// tensors that cannot be repacked are stored unchanged
+
+static const char * ggml_backend_cpu_repack_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_REPACK";
+
+    GGML_UNUSED(buft);
+}
+
+static const char * ggml_backend_cpu_repack_buffer_get_name(ggml_backend_buffer_t buf) {
+    return "CPU_REPACK";
+
+    GGML_UNUSED(buf);
+}
+
+static void ggml_backend_cpu_repack_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    const enum ggml_type repack_type = ggml_aarch64_get_optimal_repack_type(tensor);
+
+    if (repack_type != tensor->type && offset == 0 && size == ggml_nbytes(tensor)) {
+        if (ggml_aarch64_repack_tensor(tensor, repack_type, data, size) == 0) {
+            return;
+        }
+    }
+
+    memcpy((char *)tensor->data + offset, data, size);
+
+    GGML_UNUSED(buffer);
+}
+
+static ggml_backend_buffer_t ggml_backend_cpu_repack_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    // the context is the buffer type that allocates the memory
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer((ggml_backend_buffer_type_t) buft->context, size);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    buffer->buft = buft;
+    buffer->iface.get_name   = ggml_backend_cpu_repack_buffer_get_name;
+    buffer->iface.set_tensor = ggml_backend_cpu_repack_buffer_set_tensor;
+    buffer->iface.cpy_tensor = NULL;
+
+    return buffer;
+}
+
+static bool ggml_backend_cpu_repack_buffer_type_is_host(ggml_backend_buffer_type_t buft) {
+    // the data is not in the layout of the tensor type it was written as, so it must go through set_tensor
+    return false;
+
+    GGML_UNUSED(buft);
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_repack_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_repack = {
+        /* .iface    = */ {
+            /* .get_name         = */ ggml_backend_cpu_repack_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_cpu_repack_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .is_host          = */ ggml_backend_cpu_repack_buffer_type_is_host,
+        },
+        /* .device  = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+        /* .context = */ ggml_backend_cpu_buffer_type(),
+    };
+
+    return &ggml_backend_cpu_buffer_type_repack;
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_repack_huge_page_buffer_type(void) {
+    if (ggml_backend_cpu_huge_page_buffer_type() == NULL) {
+        return NULL;
+    }
+
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_repack_huge_page = {
+        /* .iface    = */ ggml_backend_cpu_repack_buffer_type()->iface,
+        /* .device  = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+        /* .context = */ ggml_backend_cpu_huge_page_buffer_type(),
+    };
+
+    return &ggml_backend_cpu_buffer_type_repack_huge_page;
+}
+
+bool ggml_backend_buft_is_cpu_repack(ggml_backend_buffer_type_t buft) {
+    return buft != NULL && buft->iface.alloc_buffer == ggml_backend_cpu_repack_buffer_type_alloc_buffer;
+}
+
+bool ggml_backend_cpu_repack_supported(const struct ggml_tensor * tensor) {
+    return ggml_aarch64_get_optimal_repack_type(tensor) != tensor->type;
+}
+
 #ifdef GGML_USE_CPU_HBM
 
 // buffer type HBM
@@ -1168,7 +1375,7 @@ static bool ggml_backend_cpu_device_supports_op(ggml_backend_dev_t dev, const st
 }
 
 static bool ggml_backend_cpu_device_supports_buft(ggml_backend_dev_t dev, ggml_backend_buffer_type_t buft) {
-    return ggml_backend_buft_is_host(buft);
+    return ggml_backend_buft_is_host(buft) || ggml_backend_buft_is_cpu_repack(buft);
 
     GGML_UNUSED(dev);
 }
@@ -203,6 +203,38 @@ typedef struct {
 } block_q8_1;
 static_assert(sizeof(block_q8_1) == 2*sizeof(ggml_half) + QK8_1, "wrong q8_1 block size/padding");
 
+// 2-bit and 3-bit quants with a min, small enough for the rows of the KV cache
+// byte j of qs holds the low bits of the elements j, j + 8, j + 16 and j + 24
+
+// 3.0 bpw
+#define QK2_1 32
+typedef struct {
+    union {
+        struct {
+            ggml_half d; // delta
+            ggml_half m; // min
+        } GGML_COMMON_AGGR;
+        ggml_half2 dm;
+    };
+    uint8_t qs[QK2_1 / 4]; // 2-bit quants
+} block_q2_1;
+static_assert(sizeof(block_q2_1) == 2 * sizeof(ggml_half) + QK2_1 / 4, "wrong q2_1 block size/padding");
+
+// 4.0 bpw
+#define QK3_1 32
+typedef struct {
+    union {
+        struct {
+            ggml_half d; // delta
+            ggml_half m; // min
+        } GGML_COMMON_AGGR;
+        ggml_half2 dm;
+    };
+    uint8_t qh[4];         // 3-rd bit of quants
+    uint8_t qs[QK3_1 / 4]; // low 2 bits of quants
+} block_q3_1;
+static_assert(sizeof(block_q3_1) == 2 * sizeof(ggml_half) + sizeof(uint32_t) + QK3_1 / 4, "wrong q3_1 block size/padding");
+
 typedef struct {
     ggml_half d[4];        // deltas for 4 q4_0 blocks
     uint8_t qs[QK4_0 * 2]; // nibbles / quants for 4 q4_0 blocks
@@ -3498,6 +3498,178 @@ void dequantize_row_tq2_0(const block_tq2_0 * restrict x, float * restrict y, in
     }
 }
 
+// ====================== 2-bit and 3-bit (de)-quantization with a min (KV cache)
+
+// quantize n values to L in [0, nmax] with x ~ d*L + min, starting from the range of the values
+// and refitting d and min by least squares - with so few levels the range alone wastes most of them
+static float make_qx1_quants(int n, int nmax, const float * restrict x, uint8_t * restrict L, float * the_min) {
+    float min = x[0];
+    float max = x[0];
+    for (int i = 1; i < n; ++i) {
+        min = MIN(min, x[i]);
+        max = MAX(max, x[i]);
+    }
+
+    float d = (max - min) / nmax;
+
+    for (int itry = 0; itry < 3; ++itry) {
+        const float id = d ? 1.0f/d : 0.0f;
+
+        float sum_l = 0, sum_l2 = 0, sum_x = 0, sum_xl = 0;
+        for (int i = 0; i < n; ++i) {
+            const int l = MAX(0, MIN(nmax, nearest_int((x[i] - min)*id)));
+            L[i] = l;
+            sum_l  += l;
+            sum_l2 += l*l;
+            sum_x  += x[i];
+            sum_xl += x[i]*l;
+        }
+
+        const float det = n*sum_l2 - sum_l*sum_l;
+        if (itry == 2 || det <= 0) {
+            break;
+        }
+
+        d   = (n*sum_xl - sum_l*sum_x)/det;
+        min = (sum_x - d*sum_l)/n;
+
+        if (d <= 0) {
+            // degenerate fit - fall back to the range
+            min = x[0];
+            for (int i = 1; i < n; ++i) {
+                min = MIN(min, x[i]);
+            }
+            d = (max - min) / nmax;
+        }
+    }
+
+    *the_min = min;
+    return d;
+}
+
+void quantize_row_q2_1_ref(const float * restrict x, block_q2_1 * restrict y, int64_t k) {
+    const int qk = QK2_1;
+
+    assert(k % qk == 0);
+
+    const int nb = k / qk;
+
+    uint8_t L[QK2_1];
+
+    for (int i = 0; i < nb; i++) {
+        float min;
+        const float d = make_qx1_quants(qk, 3, x + i*qk, L, &min);
+
+        y[i].d = GGML_FP32_TO_FP16(d);
+        y[i].m = GGML_FP32_TO_FP16(min);
+
+        memset(y[i].qs, 0, sizeof(y[i].qs));
+
+        for (int j = 0; j < qk; ++j) {
+            y[i].qs[j % (qk/4)] |= L[j] << 2*(j / (qk/4));
+        }
+    }
+}
+
+void quantize_row_q3_1_ref(const float * restrict x, block_q3_1 * restrict y, int64_t k) {
+    const int qk = QK3_1;
+
+    assert(k % qk == 0);
+
+    const int nb = k / qk;
+
+    uint8_t L[QK3_1];
+
+    for (int i = 0; i < nb; i++) {
+        float min;
+        const float d = make_qx1_quants(qk, 7, x + i*qk, L, &min);
+
+        y[i].d = GGML_FP32_TO_FP16(d);
+        y[i].m = GGML_FP32_TO_FP16(min);
+
+        memset(y[i].qs, 0, sizeof(y[i].qs));
+
+        uint32_t qh = 0;
+
+        for (int j = 0; j < qk; ++j) {
+            y[i].qs[j % (qk/4)] |= (L[j] & 3) << 2*(j / (qk/4));
+
+            // get the 3-rd bit and store it in qh at the right position
+            qh |= ((uint32_t)(L[j] >> 2)) << j;
+        }
+
+        memcpy(&y[i].qh, &qh, sizeof(qh));
+    }
+}
+
+void quantize_row_q2_1(const float * restrict x, void * restrict y, int64_t k) {
+    quantize_row_q2_1_ref(x, y, k);
+}
+
+void quantize_row_q3_1(const float * restrict x, void * restrict y, int64_t k) {
+    quantize_row_q3_1_ref(x, y, k);
+}
+
+size_t quantize_q2_1(const float * restrict src, void * restrict dst, int64_t nrow, int64_t n_per_row, const float * quant_weights) {
+    (void)quant_weights; // not used
+    const size_t row_size = ggml_row_size(GGML_TYPE_Q2_1, n_per_row);
+    quantize_row_q2_1_ref(src, dst, (int64_t)nrow*n_per_row);
+    return nrow * row_size;
+}
+
+size_t quantize_q3_1(const float * restrict src, void * restrict dst, int64_t nrow, int64_t n_per_row, const float * quant_weights) {
+    (void)quant_weights; // not used
+    const size_t row_size = ggml_row_size(GGML_TYPE_Q3_1, n_per_row);
+    quantize_row_q3_1_ref(src, dst, (int64_t)nrow*n_per_row);
+    return nrow * row_size;
+}
+
+void dequantize_row_q2_1(const block_q2_1 * restrict x, float * restrict y, int64_t k) {
+    static const int qk = QK2_1;
+
+    assert(k % qk == 0);
+
+    const int nb = k / qk;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = GGML_FP16_TO_FP32(x[i].d);
+        const float m = GGML_FP16_TO_FP32(x[i].m);
+
+        for (int l = 0; l < 4; ++l) {
+            for (int j = 0; j < qk/4; ++j) {
+                const int x0 = (x[i].qs[j] >> 2*l) & 3;
+
+                y[i*qk + l*(qk/4) + j] = x0*d + m;
+            }
+        }
+    }
+}
+
+void dequantize_row_q3_1(const block_q3_1 * restrict x, float * restrict y, int64_t k) {
+    static const int qk = QK3_1;
+
+    assert(k % qk == 0);
+
+    const int nb = k / qk;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = GGML_FP16_TO_FP32(x[i].d);
+        const float m = GGML_FP16_TO_FP32(x[i].m);
+
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        for (int l = 0; l < 4; ++l) {
+            for (int j = 0; j < qk/4; ++j) {
+                const int idx = l*(qk/4) + j;
+                const int x0  = ((x[i].qs[j] >> 2*l) & 3) | (((qh >> idx) & 1) << 2);
+
+                y[i*qk + idx] = x0*d + m;
+            }
+        }
+    }
+}
+
 // ====================== "True" 2-bit (de)-quantization
 
 void dequantize_row_iq2_xxs(const block_iq2_xxs * restrict x, float * restrict y, int64_t k) {
@@ -6351,6 +6523,285 @@ void ggml_vec_dot_tq2_0_q8_K(int n, float * restrict s, size_t bs, const void *
 #endif
 }
 
+#if defined(__AVX2__)
+// unpack the low 2 bits of 32 quants of a q2_1/q3_1 block into 32 bytes
+static inline __m256i bytes_from_crumbs_32(const uint8_t * qs) {
+    uint64_t q64;
+    memcpy(&q64, qs, sizeof(q64));
+    const __m256i shift = _mm256_set_epi64x(6, 4, 2, 0);
+    return _mm256_and_si256(_mm256_srlv_epi64(_mm256_set1_epi64x(q64), shift), _mm256_set1_epi8(3));
+}
+#endif
+
+void ggml_vec_dot_q2_1_q8_1(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by, int nrc) {
+    const int qk = QK8_1;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    assert(qk == QK2_1);
+    assert(nrc == 1);
+    UNUSED(nrc);
+    UNUSED(bx);
+    UNUSED(by);
+    UNUSED(bs);
+
+    const block_q2_1 * restrict x = vx;
+    const block_q8_1 * restrict y = vy;
+
+    int ib = 0;
+    float sumf = 0;
+
+#if defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+
+    float summs = 0;
+
+    for (; ib < nb; ++ib) {
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[ib].d) * GGML_FP16_TO_FP32(y[ib].d));
+
+        summs += GGML_FP16_TO_FP32(x[ib].m) * GGML_FP16_TO_FP32(y[ib].s);
+
+        const __m256i qx = bytes_from_crumbs_32(x[ib].qs);
+        const __m256i qy = _mm256_loadu_si256((const __m256i *) y[ib].qs);
+
+        acc = _mm256_fmadd_ps(d, mul_sum_us8_pairs_float(qx, qy), acc);
+    }
+
+    sumf = hsum_float_8(acc) + summs;
+#endif
+    for (; ib < nb; ++ib) {
+        int sumi = 0;
+
+        for (int l = 0; l < 4; ++l) {
+            for (int j = 0; j < qk/4; ++j) {
+                sumi += ((x[ib].qs[j] >> 2*l) & 3) * y[ib].qs[l*(qk/4) + j];
+            }
+        }
+
+        sumf += (GGML_FP16_TO_FP32(x[ib].d)*GGML_FP16_TO_FP32(y[ib].d))*sumi + GGML_FP16_TO_FP32(x[ib].m)*GGML_FP16_TO_FP32(y[ib].s);
+    }
+
+    *s = sumf;
+}
+
+void ggml_vec_dot_q3_1_q8_1(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by, int nrc) {
+    const int qk = QK8_1;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    assert(qk == QK3_1);
+    assert(nrc == 1);
+    UNUSED(nrc);
+    UNUSED(bx);
+    UNUSED(by);
+    UNUSED(bs);
+
+    const block_q3_1 * restrict x = vx;
+    const block_q8_1 * restrict y = vy;
+
+    int ib = 0;
+    float sumf = 0;
+
+#if defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+
+    float summs = 0;
+
+    for (; ib < nb; ++ib) {
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[ib].d) * GGML_FP16_TO_FP32(y[ib].d));
+
+        summs += GGML_FP16_TO_FP32(x[ib].m) * GGML_FP16_TO_FP32(y[ib].s);
+
+        __m256i qx = bytes_from_crumbs_32(x[ib].qs);
+        __m256i bxhi = bytes_from_bits_32(x[ib].qh);
+        bxhi = _mm256_and_si256(bxhi, _mm256_set1_epi8(4));
+        qx = _mm256_or_si256(qx, bxhi);
+
+        const __m256i qy = _mm256_loadu_si256((const __m256i *) y[ib].qs);
+
+        acc = _mm256_fmadd_ps(d, mul_sum_us8_pairs_float(qx, qy), acc);
+    }
+
+    sumf = hsum_float_8(acc) + summs;
+#endif
+    for (; ib < nb; ++ib) {
+        uint32_t qh;
+        memcpy(&qh, x[ib].qh, sizeof(qh));
+
+        int sumi = 0;
+
+        for (int l = 0; l < 4; ++l) {
+            for (int j = 0; j < qk/4; ++j) {
+                const int idx = l*(qk/4) + j;
+                sumi += (((x[ib].qs[j] >> 2*l) & 3) | (((qh >> idx) & 1) << 2)) * y[ib].qs[idx];
+            }
+        }
+
+        sumf += (GGML_FP16_TO_FP32(x[ib].d)*GGML_FP16_TO_FP32(y[ib].d))*sumi + GGML_FP16_TO_FP32(x[ib].m)*GGML_FP16_TO_FP32(y[ib].s);
+    }
+
+    *s = sumf;
+}
+
+//===================================== Fused dequantization and accumulation =================================
+// y += v*x for the V rows of the flash attention, without a temporary dequantized row
+
+#if defined(__AVX2__)
+// y[0..31] += d*q[0..31] + m, q are 32 signed bytes
+static inline void mad_bytes_32_float(float * restrict y, const __m256i q, const float d, const float m) {
+    const __m256 dv = _mm256_set1_ps(d);
+    const __m256 mv = _mm256_set1_ps(m);
+
+    const __m128i q0 = _mm256_castsi256_si128(q);
+    const __m128i q1 = _mm256_extracti128_si256(q, 1);
+
+    const __m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q0));
+    const __m256 f1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q0, 8)));
+    const __m256 f2 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q1));
+    const __m256 f3 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q1, 8)));
+
+    _mm256_storeu_ps(y +  0, _mm256_fmadd_ps(dv, f0, _mm256_add_ps(_mm256_loadu_ps(y +  0), mv)));
+    _mm256_storeu_ps(y +  8, _mm256_fmadd_ps(dv, f1, _mm256_add_ps(_mm256_loadu_ps(y +  8), mv)));
+    _mm256_storeu_ps(y + 16, _mm256_fmadd_ps(dv, f2, _mm256_add_ps(_mm256_loadu_ps(y + 16), mv)));
+    _mm256_storeu_ps(y + 24, _mm256_fmadd_ps(dv, f3, _mm256_add_ps(_mm256_loadu_ps(y + 24), mv)));
+}
+#endif
+
+void ggml_vec_mad_q4_0(const void * restrict vx, float * restrict y, int64_t k, float v) {
+    static const int qk = QK4_0;
+
+    assert(k % qk == 0);
+
+    const block_q4_0 * restrict x = vx;
+
+    const int nb = k / qk;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+
+#if defined(__AVX2__)
+        mad_bytes_32_float(y + i*qk, bytes_from_nibbles_32(x[i].qs), d, -8.0f*d);
+#else
+        for (int j = 0; j < qk/2; ++j) {
+            const int x0 = (x[i].qs[j] & 0x0F) - 8;
+            const int x1 = (x[i].qs[j] >>   4) - 8;
+
+            y[i*qk + j + 0   ] += x0*d;
+            y[i*qk + j + qk/2] += x1*d;
+        }
+#endif
+    }
+}
+
+void ggml_vec_mad_q4_1(const void * restrict vx, float * restrict y, int64_t k, float v) {
+    static const int qk = QK4_1;
+
+    assert(k % qk == 0);
+
+    const block_q4_1 * restrict x = vx;
+
+    const int nb = k / qk;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+        const float m = v*GGML_FP16_TO_FP32(x[i].m);
+
+#if defined(__AVX2__)
+        mad_bytes_32_float(y + i*qk, bytes_from_nibbles_32(x[i].qs), d, m);
+#else
+        for (int j = 0; j < qk/2; ++j) {
+            const int x0 = (x[i].qs[j] & 0x0F);
+            const int x1 = (x[i].qs[j] >>   4);
+
+            y[i*qk + j + 0   ] += x0*d + m;
+            y[i*qk + j + qk/2] += x1*d + m;
+        }
+#endif
+    }
+}
+
+void ggml_vec_mad_q8_0(const void * restrict vx, float * restrict y, int64_t k, float v) {
+    static const int qk = QK8_0;
+
+    assert(k % qk == 0);
+
+    const block_q8_0 * restrict x = vx;
+
+    const int nb = k / qk;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+
+#if defined(__AVX2__)
+        mad_bytes_32_float(y + i*qk, _mm256_loadu_si256((const __m256i *) x[i].qs), d, 0.0f);
+#else
+        for (int j = 0; j < qk; ++j) {
+            y[i*qk + j] += x[i].qs[j]*d;
+        }
+#endif
+    }
+}
+
+void ggml_vec_mad_q2_1(const void * restrict vx, float * restrict y, int64_t k, float v) {
+    static const int qk = QK2_1;
+
+    assert(k % qk == 0);
+
+    const block_q2_1 * restrict x = vx;
+
+    const int nb = k / qk;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+        const float m = v*GGML_FP16_TO_FP32(x[i].m);
+
+#if defined(__AVX2__)
+        mad_bytes_32_float(y + i*qk, bytes_from_crumbs_32(x[i].qs), d, m);
+#else
+        for (int l = 0; l < 4; ++l) {
+            for (int j = 0; j < qk/4; ++j) {
+                const int x0 = (x[i].qs[j] >> 2*l) & 3;
+
+                y[i*qk + l*(qk/4) + j] += x0*d + m;
+            }
+        }
+#endif
+    }
+}
+
+void ggml_vec_mad_q3_1(const void * restrict vx, float * restrict y, int64_t k, float v) {
+    static const int qk = QK3_1;
+
+    assert(k % qk == 0);
+
+    const block_q3_1 * restrict x = vx;
+
+    const int nb = k / qk;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+        const float m = v*GGML_FP16_TO_FP32(x[i].m);
+
+#if defined(__AVX2__)
+        const __m256i qh = _mm256_and_si256(bytes_from_bits_32(x[i].qh), _mm256_set1_epi8(4));
+
+        mad_bytes_32_float(y + i*qk, _mm256_or_si256(bytes_from_crumbs_32(x[i].qs), qh), d, m);
+#else
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        for (int l = 0; l < 4; ++l) {
+            for (int j = 0; j < qk/4; ++j) {
+                const int idx = l*(qk/4) + j;
+                const int x0  = ((x[i].qs[j] >> 2*l) & 3) | (((qh >> idx) & 1) << 2);
+
+                y[i*qk + idx] += x0*d + m;
+            }
+        }
+#endif
+    }
+}
+
 void ggml_vec_dot_q2_K_q8_K(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by, int nrc) {
     assert(nrc == 1);
     UNUSED(nrc);
@@ -15680,6 +16131,14 @@ bool ggml_validate_row_data(enum ggml_type type, const void * data, size_t nbyte
             {
                 VALIDATE_ROW_DATA_D_F16_IMPL(block_tq2_0, data, nb);
             } break;
+        case GGML_TYPE_Q2_1:
+            {
+                VALIDATE_ROW_DATA_DM_F16_IMPL(block_q2_1, data, nb, d, m);
+            } break;
+        case GGML_TYPE_Q3_1:
+            {
+                VALIDATE_ROW_DATA_DM_F16_IMPL(block_q3_1, data, nb, d, m);
+            } break;
         case GGML_TYPE_IQ1_S:
             {
                 VALIDATE_ROW_DATA_D_F16_IMPL(block_iq1_s, data, nb);
@@ -790,6 +790,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .to_float                 = (ggml_to_float_t) dequantize_row_q4_0,
         .from_float               = quantize_row_q4_0,
         .from_float_ref           = (ggml_from_float_t) quantize_row_q4_0_ref,
+        .vec_mad                  = ggml_vec_mad_q4_0,
         .vec_dot                  = ggml_vec_dot_q4_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
 #if defined (__ARM_FEATURE_MATMUL_INT8)
@@ -806,6 +807,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .to_float                 = (ggml_to_float_t) dequantize_row_q4_1,
         .from_float               = quantize_row_q4_1,
         .from_float_ref           = (ggml_from_float_t) quantize_row_q4_1_ref,
+        .vec_mad                  = ggml_vec_mad_q4_1,
         .vec_dot                  = ggml_vec_dot_q4_1_q8_1,
         .vec_dot_type             = GGML_TYPE_Q8_1,
 #if defined (__ARM_FEATURE_MATMUL_INT8)
@@ -871,6 +873,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float               = quantize_row_q8_0,
         .from_float_ref           = (ggml_from_float_t) quantize_row_q8_0_ref,
         .from_float_to_mat        = quantize_mat_q8_0,
+        .vec_mad                  = ggml_vec_mad_q8_0,
         .vec_dot                  = ggml_vec_dot_q8_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
 #if defined (__ARM_FEATURE_MATMUL_INT8)
@@ -1148,6 +1151,32 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .vec_dot_type             = GGML_TYPE_Q8_K,
         .nrows                    = 1,
     },
+    [GGML_TYPE_Q2_1] = {
+        .type_name                = "q2_1",
+        .blck_size                = QK2_1,
+        .type_size                = sizeof(block_q2_1),
+        .is_quantized             = true,
+        .to_float                 = (ggml_to_float_t) dequantize_row_q2_1,
+        .from_float               = quantize_row_q2_1,
+        .from_float_ref           = (ggml_from_float_t) quantize_row_q2_1_ref,
+        .vec_mad                  = ggml_vec_mad_q2_1,
+        .vec_dot                  = ggml_vec_dot_q2_1_q8_1,
+        .vec_dot_type             = GGML_TYPE_Q8_1,
+        .nrows                    = 1,
+    },
+    [GGML_TYPE_Q3_1] = {
+        .type_name                = "q3_1",
+        .blck_size                = QK3_1,
+        .type_size                = sizeof(block_q3_1),
+        .is_quantized             = true,
+        .to_float                 = (ggml_to_float_t) dequantize_row_q3_1,
+        .from_float               = quantize_row_q3_1,
+        .from_float_ref           = (ggml_from_float_t) quantize_row_q3_1_ref,
+        .vec_mad                  = ggml_vec_mad_q3_1,
+        .vec_dot                  = ggml_vec_dot_q3_1_q8_1,
+        .vec_dot_type             = GGML_TYPE_Q8_1,
+        .nrows                    = 1,
+    },
 };
 
 // For internal test use
@@ -3038,6 +3067,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "ARANGE",
     "TIMESTEP_EMBEDDING",
     "ARGSORT",
+    "ARGSORT_TOP_K",
     "LEAKY_RELU",
 
     "FLASH_ATTN_EXT",
@@ -3068,7 +3098,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "OPT_STEP_ADAMW",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3133,6 +3163,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "arange(start, stop, step)",
     "timestep_embedding(timesteps, dim, max_period)",
     "argsort(x)",
+    "argsort_top_k(x)",
     "leaky_relu(x)",
 
     "flash_attn_ext(x)",
@@ -3163,7 +3194,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "adamw(x)",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -3401,6 +3432,83 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// with the distribute strategy, node k owns rows [k*nr/n_nodes, (k+1)*nr/n_nodes) of the large matrices
+// threads are assigned to nodes round-robin (see set_numa_thread_affinity), so they are split among the rows of their node
+static bool ggml_numa_split_rows(int ith, int nth, int64_t nr, int64_t * ir_start, int64_t * ir_end) {
+    const int n_nodes = g_state.numa.n_nodes;
+
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_DISTRIBUTE || n_nodes < 2 || nth < n_nodes) {
+        return false;
+    }
+
+    const int node = ith % n_nodes;
+
+    // number of threads on this node and index of the thread among them
+    const int node_nth = (nth - node + n_nodes - 1) / n_nodes;
+    const int node_ith = ith / n_nodes;
+
+    const int64_t node_start = (node       * nr) / n_nodes;
+    const int64_t node_end   = ((node + 1) * nr) / n_nodes;
+
+    *ir_start = node_start + (node_ith       * (node_end - node_start)) / node_nth;
+    *ir_end   = node_start + ((node_ith + 1) * (node_end - node_start)) / node_nth;
+
+    return true;
+}
+
+void ggml_numa_distribute_tensor(const struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__) && defined(SYS_mbind)
+    const int n_nodes = g_state.numa.n_nodes;
+
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_DISTRIBUTE || n_nodes < 2) {
+        return;
+    }
+
+    if (tensor->data == NULL || ggml_n_dims(tensor) != 2 || !ggml_is_contiguous(tensor)) {
+        return;
+    }
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    const int64_t nr = tensor->ne[1];
+
+    // only split matrices that span at least a page per node
+    if (ggml_nbytes(tensor) < page_size * n_nodes) {
+        return;
+    }
+
+    // pages are assigned to the node that owns the row at the start of the page
+    const uintptr_t data = (uintptr_t) tensor->data;
+
+    for (int node = 0; node < n_nodes; ++node) {
+        uintptr_t p0 = data + ((node       * nr) / n_nodes) * tensor->nb[1];
+        uintptr_t p1 = data + (((node + 1) * nr) / n_nodes) * tensor->nb[1];
+
+        p0 = node == 0 ? p0 & ~(page_size - 1) : (p0 + page_size - 1) & ~(page_size - 1);
+        p1 = (p1 + page_size - 1) & ~(page_size - 1);
+
+        if (p0 >= p1) {
+            continue;
+        }
+
+        unsigned long mask[GGML_NUMA_MAX_NODES / (8*sizeof(unsigned long)) + 1] = { 0 };
+        mask[node / (8*sizeof(unsigned long))] |= 1UL << (node % (8*sizeof(unsigned long)));
+
+        // MPOL_BIND, MPOL_MF_MOVE - the policy places the anonymous pages (the buffers loaded without mmap) that are
+        // faulted later, and the pages already mapped by this process only are migrated
+        // the pages of a file mapping (mmap) are not placed by the policy: the page cache allocates them on the node of
+        // the thread that first reads them, the threads of the node if the file is not cached yet - the pages already
+        // in the page cache and not mapped yet, or mapped by other processes, stay where they are
+        const long rv = syscall(SYS_mbind, (void *) p0, p1 - p0, 2, mask, GGML_NUMA_MAX_NODES + 1, 1 << 1);
+        if (rv != 0 && errno != EIO) {
+            GGML_PRINT_DEBUG("%s: mbind failed for %s: %s\n", __func__, tensor->name, strerror(errno));
+        }
+    }
+#else
+    GGML_UNUSED(tensor);
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -7094,6 +7202,22 @@ struct ggml_tensor * ggml_top_k(
     return result;
 }
 
+// ggml_argsort_top_k
+
+struct ggml_tensor * ggml_argsort_top_k(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   k) {
+    GGML_ASSERT(k > 0 && a->ne[0] >= k);
+
+    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, GGML_TYPE_I32, k, a->ne[1], a->ne[2], a->ne[3]);
+
+    result->op     = GGML_OP_ARGSORT_TOP_K;
+    result->src[0] = a;
+
+    return result;
+}
+
 // ggml_flash_attn_ext
 
 struct ggml_tensor * ggml_flash_attn_ext(
@@ -9019,6 +9143,54 @@ static void ggml_compute_forward_dup_bytes(
     }
 }
 
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const enum ggml_type type = src0->type;
+    ggml_to_float_t const dequantize_row_q = type_traits[type].to_float;
+
+    const int64_t qk = ggml_blck_size(type);
+    const int64_t nr = ggml_nelements(dst)/qk;
+
+    // dequantize whole blocks into a destination with contiguous rows
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(ne00 % qk == 0 && ne0 % qk == 0);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // blocks per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // block range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i = ir*qk;
+
+        const int64_t i03 = i/(ne00*ne01*ne02);
+        const int64_t i02 = (i - i03*ne00*ne01*ne02)/(ne00*ne01);
+        const int64_t i01 = (i - i03*ne00*ne01*ne02 - i02*ne00*ne01)/ne00;
+        const int64_t i00 =  i - i03*ne00*ne01*ne02 - i02*ne00*ne01 - i01*ne00;
+
+        const int64_t i3 = i/(ne0*ne1*ne2);
+        const int64_t i2 = (i - i3*ne0*ne1*ne2)/(ne0*ne1);
+        const int64_t i1 = (i - i3*ne0*ne1*ne2 - i2*ne0*ne1)/ne0;
+        const int64_t i0 =  i - i3*ne0*ne1*ne2 - i2*ne0*ne1 - i1*ne0;
+
+        dequantize_row_q(
+                (const char *) src0->data + (i00/qk)*nb00 + i01*nb01 + i02*nb02 + i03*nb03,
+                (float *) ((char *) dst->data + i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3), qk);
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
@@ -9045,6 +9217,10 @@ static void ggml_compute_forward_dup(
             } break;
         default:
             {
+                if (ggml_is_quantized(src0->type) && dst->type == GGML_TYPE_F32) {
+                    ggml_compute_forward_dup_q(params, dst);
+                    break;
+                }
                 GGML_ABORT("fatal error");
             }
     }
@@ -9510,6 +9686,8 @@ static void ggml_compute_forward_add(
         case GGML_TYPE_Q6_K:
         case GGML_TYPE_TQ1_0:
         case GGML_TYPE_TQ2_0:
+        case GGML_TYPE_Q2_1:
+        case GGML_TYPE_Q3_1:
         case GGML_TYPE_IQ2_XXS:
         case GGML_TYPE_IQ2_XS:
         case GGML_TYPE_IQ3_XXS:
@@ -9890,6 +10068,8 @@ static void ggml_compute_forward_add1(
         case GGML_TYPE_Q6_K:
         case GGML_TYPE_TQ1_0:
         case GGML_TYPE_TQ2_0:
+        case GGML_TYPE_Q2_1:
+        case GGML_TYPE_Q3_1:
         case GGML_TYPE_IQ2_XXS:
         case GGML_TYPE_IQ2_XS:
         case GGML_TYPE_IQ3_XXS:
@@ -10020,6 +10200,8 @@ static void ggml_compute_forward_acc(
         case GGML_TYPE_Q6_K:
         case GGML_TYPE_TQ1_0:
         case GGML_TYPE_TQ2_0:
+        case GGML_TYPE_Q2_1:
+        case GGML_TYPE_Q3_1:
         case GGML_TYPE_IQ2_XXS:
         case GGML_TYPE_IQ2_XS:
         case GGML_TYPE_IQ3_XXS:
@@ -12611,6 +12793,7 @@ UseGgmlGemm2:;
         const size_t src1_col_stride = ggml_is_contiguous(src1) || src1->type != vec_dot_type ? ggml_row_size(vec_dot_type, ne10) : nb11;
         int64_t src0_start = (ith * ne01) / nth;
         int64_t src0_end   = ((ith + 1) * ne01) / nth;
+        ggml_numa_split_rows(ith, nth, ne01, &src0_start, &src0_end);
         src0_start = (src0_start % matmul_num_cols) ? src0_start + matmul_num_cols - (src0_start % matmul_num_cols): src0_start;
         src0_end   = (src0_end   % matmul_num_cols) ? src0_end   + matmul_num_cols - (src0_end   % matmul_num_cols): src0_end;
         if (src0_start >= src0_end) return;
@@ -12628,6 +12811,21 @@ UseGgmlGemm2:;
         return;
     }
 
+    // read only the src0 rows that live on the NUMA node of this thread
+    if (nr0 > nr1 && ggml_n_dims(src0) == 2) {
+        int64_t ir0_start;
+        int64_t ir0_end;
+        if (ggml_numa_split_rows(ith, nth, nr0, &ir0_start, &ir0_end)) {
+            if (ir0_start < ir0_end) {
+                if (num_rows_per_vec_dot > 1 && ((ir0_start | ir0_end) & 1)) {
+                    num_rows_per_vec_dot = 1;
+                }
+                ggml_compute_forward_mul_mat_one_chunk(params, dst, num_rows_per_vec_dot, ir0_start, ir0_end, 0, nr1);
+            }
+            return;
+        }
+    }
+
     // The first chunk comes from our thread_id, the rest will get auto-assigned.
     int current_chunk = ith;
 
@@ -13086,6 +13284,8 @@ static void ggml_compute_forward_out_prod(
         case GGML_TYPE_Q6_K:
         case GGML_TYPE_TQ1_0:
         case GGML_TYPE_TQ2_0:
+        case GGML_TYPE_Q2_1:
+        case GGML_TYPE_Q3_1:
         case GGML_TYPE_IQ2_XXS:
         case GGML_TYPE_IQ2_XS:
         case GGML_TYPE_IQ3_XXS:
@@ -13276,6 +13476,8 @@ static void ggml_compute_forward_set(
         case GGML_TYPE_Q6_K:
         case GGML_TYPE_TQ1_0:
         case GGML_TYPE_TQ2_0:
+        case GGML_TYPE_Q2_1:
+        case GGML_TYPE_Q3_1:
         case GGML_TYPE_IQ2_XXS:
         case GGML_TYPE_IQ2_XS:
         case GGML_TYPE_IQ3_XXS:
@@ -13540,6 +13742,8 @@ static void ggml_compute_forward_get_rows(
         case GGML_TYPE_Q6_K:
         case GGML_TYPE_TQ1_0:
         case GGML_TYPE_TQ2_0:
+        case GGML_TYPE_Q2_1:
+        case GGML_TYPE_Q3_1:
         case GGML_TYPE_IQ2_XXS:
         case GGML_TYPE_IQ2_XS:
         case GGML_TYPE_IQ3_XXS:
@@ -14131,6 +14335,8 @@ static void ggml_compute_forward_clamp(
         case GGML_TYPE_Q6_K:
         case GGML_TYPE_TQ1_0:
         case GGML_TYPE_TQ2_0:
+        case GGML_TYPE_Q2_1:
+        case GGML_TYPE_Q3_1:
         case GGML_TYPE_IQ2_XXS:
         case GGML_TYPE_IQ2_XS:
         case GGML_TYPE_IQ3_XXS:
@@ -15607,6 +15813,106 @@ static void ggml_compute_forward_argsort(
     }
 }
 
+// ggml_compute_forward_argsort_top_k
+
+// orders the indices by value, ties broken by the lower index
+static inline bool ggml_top_k_less(const float * src, int32_t a, int32_t b) {
+    return src[a] < src[b] || (src[a] == src[b] && a > b);
+}
+
+// restores the min-heap property of heap[0..n) below position i
+static void ggml_top_k_sift_down(const float * src, int32_t * heap, int64_t n, int64_t i) {
+    while (true) {
+        const int64_t l = 2*i + 1;
+        const int64_t r = l + 1;
+
+        int64_t m = i;
+        if (l < n && ggml_top_k_less(src, heap[l], heap[m])) {
+            m = l;
+        }
+        if (r < n && ggml_top_k_less(src, heap[r], heap[m])) {
+            m = r;
+        }
+        if (m == i) {
+            break;
+        }
+
+        const int32_t tmp = heap[i];
+        heap[i] = heap[m];
+        heap[m] = tmp;
+
+        i = m;
+    }
+}
+
+static void ggml_compute_forward_argsort_top_k_f32(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    GGML_ASSERT(nb00 == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nr = ggml_nrows(src0);
+    const int64_t k  = ne0;
+
+    for (int64_t i = ith; i < nr; i += nth) {
+        const int64_t i3 = i/(ne01*ne02);
+        const int64_t i2 = (i - i3*ne01*ne02)/ne01;
+        const int64_t i1 = (i - i3*ne01*ne02 - i2*ne01);
+
+        int32_t * dst_data = (int32_t *)((char *) dst->data + i1*nb1 + i2*nb2 + i3*nb3);
+        const float * src_data = (float *)((char *) src0->data + i1*nb01 + i2*nb02 + i3*nb03);
+
+        // min-heap of the k largest elements seen so far, built in the destination row
+        for (int64_t j = 0; j < k; j++) {
+            dst_data[j] = j;
+        }
+        for (int64_t j = k/2 - 1; j >= 0; j--) {
+            ggml_top_k_sift_down(src_data, dst_data, k, j);
+        }
+
+        for (int64_t j = k; j < ne00; j++) {
+            if (ggml_top_k_less(src_data, dst_data[0], j)) {
+                dst_data[0] = j;
+                ggml_top_k_sift_down(src_data, dst_data, k, 0);
+            }
+        }
+
+        // heap sort - moving the smallest element to the back leaves the row in descending order
+        for (int64_t n = k - 1; n > 0; n--) {
+            const int32_t tmp = dst_data[0];
+            dst_data[0] = dst_data[n];
+            dst_data[n] = tmp;
+
+            ggml_top_k_sift_down(src_data, dst_data, n, 0);
+        }
+    }
+}
+
+static void ggml_compute_forward_argsort_top_k(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_argsort_top_k_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 // ggml_compute_forward_flash_attn_ext
 
 static void ggml_compute_forward_flash_attn_ext_f16(
@@ -15694,6 +16000,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     ggml_from_float_t const q_to_vec_dot   = type_traits[k_vec_dot_type].from_float;
     ggml_vec_dot_t    const kq_vec_dot     = type_traits[k->type].vec_dot;
     ggml_to_float_t   const v_to_float     = type_traits[v->type].to_float;
+    ggml_vec_mad_t    const v_vec_mad      = type_traits[v->type].vec_mad;
 
     // loop over n_batch and n_head
     for (int ir = ir0; ir < ir1; ++ir) {
@@ -15789,10 +16096,14 @@ static void ggml_compute_forward_flash_attn_ext_f16(
                     vs = expf(s - M);
                 }
 
-                v_to_float(v_data, V32, D);
-
                 // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                if (v_vec_mad) {
+                    // dequantize the quantized V row while accumulating it
+                    v_vec_mad(v_data, VKQ32, D, vs);
+                } else {
+                    v_to_float(v_data, V32, D);
+                    ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                }
             }
 
             S = S*ms + vs; // scale and increment sum with partial sum
@@ -17454,6 +17765,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_argsort(params, tensor);
             } break;
+        case GGML_OP_ARGSORT_TOP_K:
+            {
+                ggml_compute_forward_argsort_top_k(params, tensor);
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 ggml_compute_forward_leaky_relu(params, tensor);
@@ -18530,6 +18845,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_ARGSORT_TOP_K:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_LEAKY_RELU:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -19328,6 +19647,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_ARANGE:
         case GGML_OP_TIMESTEP_EMBEDDING:
         case GGML_OP_ARGSORT:
+        case GGML_OP_ARGSORT_TOP_K:
         case GGML_OP_FLASH_ATTN_EXT:
         case GGML_OP_FLASH_ATTN_BACK:
         case GGML_OP_SSM_CONV:
@@ -19853,6 +20173,124 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// max number of nodes that can run between two barriers
+#define GGML_GRAPH_COMPUTE_MAX_PENDING 16
+
+enum ggml_op_sync {
+    GGML_OP_SYNC_NONE,  // no shared state, can overlap with other nodes
+    GGML_OP_SYNC_WDATA, // uses a per-thread slice of the work buffer, can overlap with nodes of the previous kind
+    GGML_OP_SYNC_FULL,  // shared work buffer, internal barriers or chunk counters - needs a barrier on both sides,
+                        // only independent nodes of the first kind can follow it before the barrier
+};
+
+static bool ggml_op_is_nop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static enum ggml_op_sync ggml_op_get_sync(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SCALE:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_REPEAT:
+        case GGML_OP_CONCAT:
+        case GGML_OP_CLAMP:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_SUM_ROWS:
+        case GGML_OP_MEAN:
+        case GGML_OP_ARGMAX:
+        case GGML_OP_UNARY:
+            return GGML_OP_SYNC_NONE;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            // quantized src0 is dequantized into the work buffer
+            return ggml_is_quantized(node->src[0]->type) ? GGML_OP_SYNC_WDATA : GGML_OP_SYNC_NONE;
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            // f16/bf16 -> quantized goes through the work buffer
+            return node->src[0]->type == GGML_TYPE_F16 || node->src[0]->type == GGML_TYPE_BF16 ? GGML_OP_SYNC_WDATA : GGML_OP_SYNC_NONE;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+        case GGML_OP_FLASH_ATTN_EXT:
+            return GGML_OP_SYNC_WDATA;
+        default:
+            return GGML_OP_SYNC_FULL;
+    }
+}
+
+static bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a->data == NULL || b->data == NULL) {
+        return true;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// check if node can start while the pending nodes (computed since the last barrier) may still be running on other threads
+// all threads take the same decisions, so they call ggml_barrier the same number of times
+static bool ggml_graph_compute_need_barrier(const struct ggml_tensor * node, const struct ggml_tensor ** pending, int n_pending) {
+    if (n_pending == GGML_GRAPH_COMPUTE_MAX_PENDING) {
+        return true;
+    }
+
+    enum ggml_op_sync sync = ggml_op_get_sync(node);
+    if (sync == GGML_OP_SYNC_FULL) {
+        return true;
+    }
+
+    for (int i = 0; i < n_pending; i++) {
+        const struct ggml_tensor * p = pending[i];
+        const enum ggml_op_sync sync_p = ggml_op_get_sync(p);
+
+        // the other threads may still be using the shared work buffer of a pending FULL node
+        if (sync != GGML_OP_SYNC_NONE && sync_p == GGML_OP_SYNC_FULL) {
+            return true;
+        }
+
+        // per-thread work buffer slices of different ops do not line up
+        if (sync == GGML_OP_SYNC_WDATA && sync_p == GGML_OP_SYNC_WDATA) {
+            return true;
+        }
+
+        // write after write
+        if (ggml_tensors_overlap(node, p)) {
+            return true;
+        }
+
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            // read after write
+            if (node->src[j] && ggml_tensors_overlap(node->src[j], p)) {
+                return true;
+            }
+            // write after read
+            if (p->src[j] && ggml_tensors_overlap(node, p->src[j])) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -19870,11 +20308,42 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && !tp->abort; node_n++) {
+    // nodes computed since the last barrier
+    const struct ggml_tensor * pending[GGML_GRAPH_COMPUTE_MAX_PENDING];
+    int n_pending = 0;
+
+    int node_n = 0;
+
+    for (; node_n < cgraph->n_nodes; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
+        if (ggml_op_is_nop(node)) {
+            continue;
+        }
+
+        // only synchronize when the node depends on the pending ones
+        if (n_pending > 0 && ggml_graph_compute_need_barrier(node, pending, n_pending)) {
+            if (state->ith == 0 && cplan->abort_callback &&
+                    cplan->abort_callback(cplan->abort_callback_data)) {
+                tp->abort = true;
+                tp->ec    = GGML_STATUS_ABORTED;
+            }
+
+            ggml_barrier(state->threadpool);
+
+            n_pending = 0;
+
+            if (tp->abort) {
+                break;
+            }
+        }
+
         ggml_compute_forward(&params, node);
 
+        pending[n_pending++] = node;
+    }
+
+    if (node_n == cgraph->n_nodes) {
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
             tp->abort = true;
@@ -21918,6 +22387,8 @@ size_t ggml_quantize_chunk(
         case GGML_TYPE_Q6_K:    result = quantize_q6_K(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_TQ1_0:   result = quantize_tq1_0(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_TQ2_0:   result = quantize_tq2_0(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
+        case GGML_TYPE_Q2_1:    result = quantize_q2_1(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
+        case GGML_TYPE_Q3_1:    result = quantize_q3_1(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_IQ2_XXS: result = quantize_iq2_xxs(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_IQ2_XS:  result = quantize_iq2_xs (src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_IQ3_XXS: result = quantize_iq3_xxs(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
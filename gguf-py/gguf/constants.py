@@ -1397,6 +1397,8 @@ class GGMLQuantizationType(IntEnum):
     Q4_0_8_8 = 33
     TQ1_0   = 34
     TQ2_0   = 35
+    Q2_1    = 36
+    Q3_1    = 37
 
 
 # TODO: add GGMLFileType from ggml_ftype in ggml.h
@@ -1521,6 +1523,8 @@ GGML_QUANT_SIZES: dict[GGMLQuantizationType, tuple[int, int]] = {
     GGMLQuantizationType.Q4_0_8_8:(32, 2 + 16),
     GGMLQuantizationType.TQ1_0:   (256, 2 + 4 * 13),
     GGMLQuantizationType.TQ2_0:   (256, 2 + 64),
+    GGMLQuantizationType.Q2_1:    (32, 2 + 2 + 8),
+    GGMLQuantizationType.Q3_1:    (32, 2 + 2 + 4 + 8),
 }
 
 
@@ -41,7 +41,7 @@
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 10
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
 #define LLAMA_STATE_SEQ_VERSION 2
@@ -59,6 +59,7 @@ extern "C" {
     // struct llama_vocab; // TODO: add in the future
     struct llama_model;
     struct llama_context;
+    struct llama_detokenizer;
     struct llama_sampler;
 
     typedef int32_t llama_pos;
@@ -291,6 +292,10 @@ extern "C" {
         // comma separated list of RPC servers to use for offloading
         const char * rpc_servers;
 
+        // name of a shared memory object holding the CPU weights (Linux only): the first process loading the model
+        // writes them to it, the next processes map them read-only instead of loading their own copy
+        const char * shm_name;
+
         // Called with a progress value between 0.0 and 1.0. Pass NULL to disable.
         // If the provided progress_callback returns true, model loading continues.
         // If it returns false, model loading is immediately aborted.
@@ -307,6 +312,11 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_repack;    // repack weights of CPU layers into an interleaved layout for faster matrix multiplication
+                            // (with use_mmap, only together with use_repack_cache or shm_name)
+        bool use_repack_cache; // map the repacked weights from <model path>.repack, written by the first load
+        bool lazy_load;     // without mmap, return once the first layer is loaded and load the other layers in the background
+        bool use_huge_pages; // back the CPU buffers of the model and of its contexts (KV cache, compute buffers) with huge pages
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -332,6 +342,7 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t kv_block_size;    // KV cache block size for paged allocation, 0 = contiguous (default) [EXPERIMENTAL]
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -515,20 +526,39 @@ extern "C" {
             struct llama_lora_adapter * adapter,
             float scale);
 
-    // Remove a specific LoRA adapter from given context
+    // Remove a specific LoRA adapter from given context and from its sequences
     // Return -1 if the adapter is not present in the context
     LLAMA_API int32_t llama_lora_adapter_remove(
             struct llama_context * ctx,
             struct llama_lora_adapter * adapter);
 
     // Remove all LoRA adapters from given context
+    // The adapters of the sequences are kept, see llama_lora_adapter_clear_seq
     LLAMA_API void llama_lora_adapter_clear(
             struct llama_context * ctx);
 
+    // Add a loaded LoRA adapter to the tokens of one sequence, on top of the adapters of the context
+    // A token that belongs to several sequences uses the adapters of its first sequence
+    // The sequences of a batch can use different adapters: the adapters in use are copied to stacks
+    // of the context, and a gathered matmul per weight applies to each token the adapters of its sequence
+    LLAMA_API int32_t llama_lora_adapter_set_seq(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            float scale,
+            llama_seq_id seq_id);
+
+    // Remove the LoRA adapters of a sequence, or of all sequences if seq_id < 0
+    LLAMA_API void llama_lora_adapter_clear_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id);
+
     // Manually free a LoRA adapter
     // Note: loaded adapters will be free when the associated model is deleted
     LLAMA_API void llama_lora_adapter_free(struct llama_lora_adapter * adapter);
 
+    // Returns the total size of the tensors of a LoRA adapter in bytes
+    LLAMA_API uint64_t llama_lora_adapter_size(const struct llama_lora_adapter * adapter);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -619,6 +649,7 @@ extern "C" {
 
     // Copy all tokens that belong to the specified sequence to another sequence
     // Note that this does not allocate extra KV cache memory - it simply assigns the tokens to the new sequence
+    // The shared cells are copied on write when one of the sequences later moves them with llama_kv_cache_seq_add/div
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
     LLAMA_API void llama_kv_cache_seq_cp(
@@ -634,6 +665,7 @@ extern "C" {
                     llama_seq_id   seq_id);
 
     // Adds relative position "delta" to all tokens that belong to the specified sequence and have positions in [p0, p1)
+    // Tokens shared with other sequences are copied to new cells first, the other sequences are not affected
     // If the KV cache is RoPEd, the KV data is updated accordingly:
     //   - lazily on next llama_decode()
     //   - explicitly with llama_kv_cache_update()
@@ -647,6 +679,7 @@ extern "C" {
                        llama_pos   delta);
 
     // Integer division of the positions by factor of `d > 1`
+    // Tokens shared with other sequences are copied to new cells first, the other sequences are not affected
     // If the KV cache is RoPEd, the KV data is updated accordingly:
     //   - lazily on next llama_decode()
     //   - explicitly with llama_kv_cache_update()
@@ -673,6 +706,14 @@ extern "C" {
     // Apply the KV cache updates (such as K-shifts, defragmentation, etc.)
     LLAMA_API void llama_kv_cache_update(struct llama_context * ctx);
 
+    // Keep only the tokens of the last tree batch (see llama_set_tree) at the given batch indices, usually the
+    // accepted path of a speculative draft, and remove the other tokens of that batch from the KV cache
+    // The kept tokens are compacted lazily on next llama_decode(), like with llama_kv_cache_defrag()
+    LLAMA_API void llama_kv_cache_tree_accept(
+            struct llama_context * ctx,
+                   const int32_t * ids,
+                         int32_t   n_ids);
+
     //
     // State / sessions
     //
@@ -816,6 +857,17 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Tree attention for the next llama_decode() call, for verifying several speculative drafts in one batch
+    // parent[i] is the index in the batch of the parent of token i, or -1 if token i directly follows the KV cache
+    // Each token attends to the KV cache of its sequence and only to its ancestors in the batch, so that the
+    // branches of the tree can share a single sequence and positions
+    // Parents must come before their children and the batch must fit in a single ubatch (n_tokens <= n_ubatch)
+    // Passing nullptr clears the tree. Returns 0 on success, -1 if the tree is invalid
+    LLAMA_API int32_t llama_set_tree(
+            struct llama_context * ctx,
+                   const int32_t * parent,
+                         int32_t   n_tokens);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
@@ -831,6 +883,14 @@ extern "C" {
     // If true, embeddings will be returned but logits will not
     LLAMA_API void llama_set_embeddings(struct llama_context * ctx, bool embeddings);
 
+    // Set the number of candidates selected in the compute graph for each output
+    // If top_k > 0, only the ids and the logits (divided by temp) of the top_k tokens of each output are returned,
+    // instead of the full logits, which saves the transfer of n_vocab logits per output and most of the host-side
+    // sampling work. llama_get_logits* return NULL while it is enabled - use llama_get_output_top_k_ith instead
+    // top_k == 1 is greedy sampling. top_k == 0 returns the full logits (default). Takes effect on the next decode
+    // The candidates are saved in the state, which can then only be loaded by a context with the same top_k
+    LLAMA_API void llama_set_output_top_k(struct llama_context * ctx, int32_t top_k, float temp);
+
     // Set whether to use causal attention or not
     // If set to true, the model will only attend to the past tokens
     LLAMA_API void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn);
@@ -843,6 +903,15 @@ extern "C" {
     // and is not necessary to call it explicitly in most cases
     LLAMA_API void llama_synchronize(struct llama_context * ctx);
 
+    // Call fn(i, user_data) for each i in [0, n), in parallel on llama_n_threads(ctx) threads, the calling thread included
+    // The worker threads are started on the first call and reused by the next ones
+    // Used to sample the outputs of the last evaluation in parallel, after llama_synchronize (see llama_sampler_sample_batch)
+    LLAMA_API void llama_parallel_for(
+            struct llama_context * ctx,
+                         int32_t   n,
+                            void (*fn)(int32_t i, void * user_data),
+                            void * user_data);
+
     // Token logits obtained from the last call to llama_decode()
     // The logits for which llama_batch.logits[i] != 0 are stored contiguously
     // in the order they have appeared in the batch.
@@ -856,6 +925,11 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Candidates of the ith token selected with llama_set_output_top_k, sorted by logit in descending order
+    // Writes the top_k candidates to cur and returns their number
+    // returns -1 if the candidates are not enabled or for invalid ids.
+    LLAMA_API int32_t llama_get_output_top_k_ith(struct llama_context * ctx, int32_t i, llama_token_data * cur);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -923,6 +997,8 @@ extern "C" {
     /// @param add_special Allow to add BOS and EOS tokens if model is configured to do so.
     /// @param parse_special Allow tokenizing special and/or control tokens which otherwise are not exposed and treated
     ///                      as plaintext. Does not insert a leading space.
+    /// Texts of 64 KiB or more are split in chunks tokenized on up to 8 threads, the environment variable
+    /// LLAMA_TOKENIZE_THREADS sets the number of threads (1 = no split).
     LLAMA_API int32_t llama_tokenize(
         const struct llama_model * model,
                       const char * text,
@@ -960,6 +1036,33 @@ extern "C" {
                             bool   remove_special,
                             bool   unparse_special);
 
+    /// @details Streaming detokenizer, for text that is generated one token at a time.
+    /// The pieces of the pushed tokens are returned as soon as they end with a complete UTF-8 character,
+    /// the bytes of an incomplete character are kept until the next tokens complete it.
+    /// @param special If true, special tokens are rendered in the output.
+    LLAMA_API struct llama_detokenizer * llama_detokenizer_init(const struct llama_model * model, bool special);
+
+    LLAMA_API void llama_detokenizer_free(struct llama_detokenizer * detok);
+
+    /// @details Drop the pending bytes, to start a new text.
+    LLAMA_API void llama_detokenizer_reset(struct llama_detokenizer * detok);
+
+    /// @details Append the piece of a token and write the text that became complete to buf.
+    /// @return Returns the number of chars/bytes written, zero if the text ends with an incomplete character.
+    /// @return Returns a negative number if buf is too small - the number of chars/bytes that would have been written - and the token is not consumed.
+    LLAMA_API int32_t llama_detokenizer_push(
+        struct llama_detokenizer * detok,
+                     llama_token   token,
+                            char * buf,
+                         int32_t   length);
+
+    /// @details Write the pending bytes of an incomplete character, e.g. at the end of the generation.
+    /// @return Same as llama_detokenizer_push().
+    LLAMA_API int32_t llama_detokenizer_flush(
+        struct llama_detokenizer * detok,
+                            char * buf,
+                         int32_t   length);
+
     //
     // Chat templates
     //
@@ -1153,6 +1256,20 @@ extern "C" {
     // Returns the sampled token
     LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx);
 
+    /// @details Sample and accept a token from each of n_idxs outputs of the last evaluation, in parallel
+    //
+    // Equivalent to:
+    //    for (int32_t i = 0; i < n_idxs; ++i) {
+    //        tokens[i] = llama_sampler_sample(smpls[i], ctx, idxs[i]);
+    //    }
+    // The outputs are distributed over llama_n_threads(ctx) threads, so each sampler must appear only once
+    LLAMA_API void llama_sampler_sample_batch(
+            struct llama_sampler ** smpls,
+            struct llama_context  * ctx,
+                   const int32_t  * idxs,
+                         int32_t    n_idxs,
+                     llama_token  * tokens);
+
     // TODO: extend in the future
     //LLAMA_API void llama_decode_with_sampler(struct llama_context * ctx, struct llama_sampler * smpl, struct llama_batch batch, ...);
 
@@ -6,6 +6,14 @@
 #include <cmath>
 #include <algorithm>
 #include <stdexcept>
+#include <system_error>
+
+// the allowed tokens are computed from the token trie only if at least n_vocab/LLAMA_GRAMMAR_TRIE_MIN_CANDIDATES_DIV
+// candidates are given - for fewer candidates it is cheaper to match each of them (unless the masks are cached)
+#define LLAMA_GRAMMAR_TRIE_MIN_CANDIDATES_DIV 8
+
+// max number of cached per-stack masks in a grammar
+#define LLAMA_GRAMMAR_MAX_MASKS 256
 
 //
 // helpers
@@ -904,6 +912,349 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+// code points of the pieces of the trie tokens, sorted by code points
+struct llama_grammar_trie_pieces {
+    std::vector<uint32_t>                  code_points; // all pieces, concatenated
+    std::vector<std::pair<size_t, size_t>> spans;       // offset and length of each piece in code_points
+    std::vector<llama_grammar_trie::token> tokens;
+    std::vector<size_t>                    order;       // indices of the pieces in sorted order
+};
+
+// adds the node of the pieces order[begin, end), which share their first depth code points, and its subtree
+static uint32_t llama_grammar_trie_build(
+              llama_grammar_trie        & trie,
+        const llama_grammar_trie_pieces & pieces,
+        size_t begin,
+        size_t end,
+        size_t depth) {
+    const uint32_t node_id = trie.nodes.size();
+    trie.nodes.push_back({});
+
+    // shorter pieces sort first, so the pieces that end at this node come first
+    const uint32_t token_begin = trie.tokens.size();
+    while (begin < end && pieces.spans[pieces.order[begin]].second == depth) {
+        trie.tokens.push_back(pieces.tokens[pieces.order[begin]]);
+        begin++;
+    }
+    const uint32_t token_end = trie.tokens.size();
+
+    auto chr_at = [&](size_t i) {
+        const auto & span = pieces.spans[pieces.order[i]];
+        return pieces.code_points[span.first + depth];
+    };
+
+    // the children of a node are stored together, so reserve them before building the subtrees
+    size_t n_children = 0;
+    for (size_t i = begin; i < end; ++i) {
+        if (i == begin || chr_at(i) != chr_at(i - 1)) {
+            n_children++;
+        }
+    }
+
+    const uint32_t child_begin = trie.children.size();
+    trie.children.resize(child_begin + n_children);
+
+    trie.nodes[node_id] = { child_begin, (uint32_t) (child_begin + n_children), token_begin, token_end };
+
+    for (size_t i = begin, k = child_begin; i < end; ++k) {
+        const uint32_t chr = chr_at(i);
+
+        size_t j = i + 1;
+        while (j < end && chr_at(j) == chr) {
+            j++;
+        }
+
+        const uint32_t child_id = llama_grammar_trie_build(trie, pieces, i, j, depth + 1);
+        trie.children[k] = { chr, child_id };
+
+        i = j;
+    }
+
+    return node_id;
+}
+
+std::shared_ptr<const llama_grammar_trie> llama_grammar_trie_get(const struct llama_vocab & vocab) {
+    std::lock_guard<std::mutex> lock(vocab.grammar_trie_mutex);
+
+    if (vocab.grammar_trie) {
+        return vocab.grammar_trie;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    llama_grammar_trie_pieces pieces;
+
+    for (uint32_t id = 0; id < vocab.n_vocab; ++id) {
+        const std::string & piece = vocab.cache_token_to_piece.at(id);
+
+        // end-of-generation tokens and empty pieces are handled by llama_grammar_apply_impl
+        if (llama_token_is_eog_impl(vocab, id) || piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        const auto   decoded     = decode_utf8(piece, {});
+        const auto & code_points = decoded.first;
+
+        // invalid UTF-8 is never allowed
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+
+        const size_t offset = pieces.code_points.size();
+        for (size_t i = 0; code_points[i] != 0; ++i) {
+            pieces.code_points.push_back(code_points[i]);
+        }
+
+        pieces.spans.emplace_back(offset, pieces.code_points.size() - offset);
+        pieces.tokens.push_back({ (llama_token) id, decoded.second });
+    }
+
+    pieces.order.resize(pieces.tokens.size());
+    for (size_t i = 0; i < pieces.order.size(); ++i) {
+        pieces.order[i] = i;
+    }
+
+    std::sort(pieces.order.begin(), pieces.order.end(), [&](size_t a, size_t b) {
+        const uint32_t * data = pieces.code_points.data();
+        const auto & span_a = pieces.spans[a];
+        const auto & span_b = pieces.spans[b];
+        return std::lexicographical_compare(
+                data + span_a.first, data + span_a.first + span_a.second,
+                data + span_b.first, data + span_b.first + span_b.second);
+    });
+
+    auto trie = std::make_shared<llama_grammar_trie>();
+
+    trie->n_vocab = vocab.n_vocab;
+    trie->tokens.reserve(pieces.tokens.size());
+
+    llama_grammar_trie_build(*trie, pieces, 0, pieces.order.size(), 0);
+
+    LLAMA_LOG_DEBUG("%s: built token trie with %zu nodes in %.2f ms\n", __func__, trie->nodes.size(), (ggml_time_us() - t_start_us) / 1000.0);
+
+    vocab.grammar_trie = trie;
+
+    return vocab.grammar_trie;
+}
+
+// sets the bits of the tokens below the given trie nodes that the stack allows to follow the code points matched so far
+// the nodes are advanced together so that the stack is advanced once per code point, as in llama_grammar_reject_candidates
+static void llama_grammar_trie_walk(
+        const llama_grammar_rules   & rules,
+        const llama_grammar_trie    & trie,
+        const llama_grammar_stack   & stack,
+        const std::vector<uint32_t> & nodes,
+              llama_grammar_mask    & mask) {
+    // tokens with all of their code points matched, accepted iff their trailing partial sequence (if any) can be
+    for (const uint32_t node_id : nodes) {
+        const auto & node = trie.nodes[node_id];
+        for (uint32_t i = node.token_begin; i < node.token_end; ++i) {
+            const auto & tok = trie.tokens[i];
+            if (tok.partial_utf8.n_remain == 0 ||
+                    (!stack.empty() && llama_grammar_match_partial_char(stack.back(), tok.partial_utf8))) {
+                mask[tok.id / 64] |= 1ULL << (tok.id % 64);
+            }
+        }
+    }
+
+    if (stack.empty()) {
+        return;
+    }
+
+    const llama_grammar_element * pos = stack.back();
+
+    // a single char is looked up instead of being matched against every child
+    const bool is_single_char = pos->type == LLAMA_GRETYPE_CHAR &&
+        pos[1].type != LLAMA_GRETYPE_CHAR_RNG_UPPER && pos[1].type != LLAMA_GRETYPE_CHAR_ALT;
+
+    std::vector<uint32_t> next_nodes;
+
+    for (const uint32_t node_id : nodes) {
+        const auto & node = trie.nodes[node_id];
+
+        const auto * child_begin = trie.children.data() + node.child_begin;
+        const auto * child_end   = trie.children.data() + node.child_end;
+
+        if (is_single_char) {
+            const auto * child = std::lower_bound(child_begin, child_end, pos->value,
+                    [](const llama_grammar_trie::child & child, uint32_t chr) { return child.chr < chr; });
+            if (child != child_end && child->chr == pos->value) {
+                next_nodes.push_back(child->node);
+            }
+            continue;
+        }
+
+        for (const auto * child = child_begin; child != child_end; ++child) {
+            if (llama_grammar_match_char(pos, child->chr).first) {
+                next_nodes.push_back(child->node);
+            }
+        }
+    }
+
+    if (next_nodes.empty()) {
+        return;
+    }
+
+    const auto * pos_after = llama_grammar_match_char(pos, 0).second;
+
+    // update top of stack to next element, if any
+    llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+    if (!llama_grammar_is_end_of_sequence(pos_after)) {
+        stack_after.push_back(pos_after);
+    }
+    llama_grammar_stacks next_stacks;
+    llama_grammar_advance_stack(rules, stack_after, next_stacks);
+
+    for (const auto & next_stack : next_stacks) {
+        llama_grammar_trie_walk(rules, trie, next_stack, next_nodes, mask);
+    }
+}
+
+// makes room for n_new masks in the cache, keeping the masks of the current stacks
+static void llama_grammar_masks_reserve(const struct llama_grammar & grammar, size_t n_new) {
+    if (grammar.masks.size() + n_new <= LLAMA_GRAMMAR_MAX_MASKS) {
+        return;
+    }
+
+    decltype(grammar.masks) masks;
+    for (const auto & stack : grammar.stacks) {
+        auto it = grammar.masks.find(stack);
+        if (it != grammar.masks.end()) {
+            masks.emplace(stack, std::move(it->second));
+        }
+    }
+
+    grammar.masks = std::move(masks);
+}
+
+// waits for the masks being computed on the helper thread, if any, and adds them to the cache
+static void llama_grammar_masks_join(const struct llama_grammar & grammar) {
+    if (!grammar.masks_prefetch.valid()) {
+        return;
+    }
+
+    auto prefetch = grammar.masks_prefetch.get();
+
+    if (!grammar.trie) {
+        grammar.trie = std::move(prefetch.trie);
+    }
+
+    llama_grammar_masks_reserve(grammar, prefetch.masks.size());
+
+    for (auto & mask : prefetch.masks) {
+        grammar.masks.emplace(std::move(mask.first), std::move(mask.second));
+    }
+}
+
+// starts computing the missing masks of the current stacks on a helper thread, so that they are ready by the time
+// the logits of the next token are
+static void llama_grammar_masks_start(struct llama_grammar & grammar) {
+    GGML_ASSERT(!grammar.masks_prefetch.valid());
+
+    // the trie holds the pieces decoded from the start of a UTF-8 sequence
+    if (grammar.vocab == nullptr || grammar.partial_utf8.n_remain != 0) {
+        return;
+    }
+
+    std::vector<llama_grammar_stack> stacks;
+    for (const auto & stack : grammar.stacks) {
+        if (grammar.masks.find(stack) == grammar.masks.end() &&
+            std::find(stacks.begin(), stacks.end(), stack) == stacks.end()) {
+            stacks.push_back(stack);
+        }
+    }
+
+    if (stacks.empty()) {
+        return;
+    }
+
+    const llama_grammar_rules & rules = grammar.rules;
+    const llama_vocab         & vocab = *grammar.vocab;
+
+    auto trie = grammar.trie;
+
+    try {
+        grammar.masks_prefetch = std::async(std::launch::async, [&rules, &vocab, trie, stacks]() {
+            llama_grammar_masks_prefetch result;
+            result.trie = trie ? trie : llama_grammar_trie_get(vocab);
+            result.masks.reserve(stacks.size());
+
+            for (const auto & stack : stacks) {
+                llama_grammar_mask mask((result.trie->n_vocab + 63) / 64, 0);
+                llama_grammar_trie_walk(rules, *result.trie, stack, { 0 }, mask);
+                result.masks.emplace_back(stack, std::move(mask));
+            }
+
+            return result;
+        });
+    } catch (const std::system_error & err) {
+        // the masks are computed on first use instead
+        LLAMA_LOG_WARN("%s: failed to start grammar mask thread: %s\n", __func__, err.what());
+    }
+}
+
+// applies the masks of the current stacks to the candidates, computing the missing ones from the vocab trie
+// returns false without changing the candidates if there are too few of them for the trie walk to pay off
+static bool llama_grammar_apply_masks(const struct llama_grammar & grammar, llama_token_data_array * cur_p, bool allow_eog) {
+    llama_grammar_masks_join(grammar);
+
+    size_t n_missing = 0;
+    for (const auto & stack : grammar.stacks) {
+        if (grammar.masks.find(stack) == grammar.masks.end()) {
+            n_missing++;
+        }
+    }
+
+    if (n_missing > 0) {
+        if (cur_p->size < grammar.vocab->n_vocab / LLAMA_GRAMMAR_TRIE_MIN_CANDIDATES_DIV) {
+            return false;
+        }
+
+        if (!grammar.trie) {
+            grammar.trie = llama_grammar_trie_get(*grammar.vocab);
+        }
+
+        llama_grammar_masks_reserve(grammar, n_missing);
+
+        for (const auto & stack : grammar.stacks) {
+            if (grammar.masks.find(stack) == grammar.masks.end()) {
+                llama_grammar_mask mask((grammar.trie->n_vocab + 63) / 64, 0);
+                llama_grammar_trie_walk(grammar.rules, *grammar.trie, stack, { 0 }, mask);
+                grammar.masks.emplace(stack, std::move(mask));
+            }
+        }
+    }
+
+    // a token is allowed if any of the stacks allows it
+    const llama_grammar_mask * mask = &grammar.masks.at(grammar.stacks.front());
+
+    llama_grammar_mask mask_union;
+    if (grammar.stacks.size() > 1) {
+        mask_union = *mask;
+        for (size_t i = 1; i < grammar.stacks.size(); ++i) {
+            const auto & mask_i = grammar.masks.at(grammar.stacks[i]);
+            for (size_t j = 0; j < mask_union.size(); ++j) {
+                mask_union[j] |= mask_i[j];
+            }
+        }
+        mask = &mask_union;
+    }
+
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        const llama_token id = cur_p->data[i].id;
+
+        if (llama_token_is_eog_impl(*grammar.vocab, id)) {
+            if (!allow_eog) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        } else if (((*mask)[id / 64] >> (id % 64) & 1) == 0) {
+            cur_p->data[i].logit = -INFINITY;
+        }
+    }
+
+    return true;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -961,7 +1312,11 @@ struct llama_grammar * llama_grammar_init_impl(
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    auto * result = new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, nullptr, {}, {}, };
+
+    llama_grammar_masks_start(*result);
+
+    return result;
 }
 
 struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab, const char * grammar_str, const char * grammar_root) {
@@ -1039,7 +1394,11 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    auto * result = new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, nullptr, {}, {}, };
+
+    llama_grammar_masks_start(*result);
+
+    return result;
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -1051,7 +1410,7 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
-    llama_grammar * result = new llama_grammar { grammar.vocab, grammar.rules, grammar.stacks, grammar.partial_utf8, };
+    llama_grammar * result = new llama_grammar { grammar.vocab, grammar.rules, grammar.stacks, grammar.partial_utf8, grammar.trie, {}, {}, };
 
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
@@ -1069,16 +1428,41 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
     return result;
 }
 
-void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
-    GGML_ASSERT(grammar.vocab != nullptr);
-
-    bool allow_eog = false;
+// end-of-generation tokens are allowed once a stack is complete
+static bool llama_grammar_allow_eog(const struct llama_grammar & grammar) {
     for (const auto & stack : grammar.stacks) {
         if (stack.empty()) {
-            allow_eog = true;
-            break;
+            return true;
         }
     }
+    return false;
+}
+
+void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
+    GGML_ASSERT(grammar.vocab != nullptr);
+
+    if (llama_grammar_apply_masks_impl(grammar, cur_p)) {
+        return;
+    }
+
+    llama_grammar_apply_candidates_impl(grammar, cur_p);
+}
+
+bool llama_grammar_apply_masks_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
+    GGML_ASSERT(grammar.vocab != nullptr);
+
+    // the trie holds the pieces decoded from the start of a UTF-8 sequence
+    if (grammar.partial_utf8.n_remain != 0) {
+        return false;
+    }
+
+    return llama_grammar_apply_masks(grammar, cur_p, llama_grammar_allow_eog(grammar));
+}
+
+void llama_grammar_apply_candidates_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
+    GGML_ASSERT(grammar.vocab != nullptr);
+
+    const bool allow_eog = llama_grammar_allow_eog(grammar);
 
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
@@ -1111,6 +1495,8 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
 void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
+    llama_grammar_masks_join(grammar);
+
     if (llama_token_is_eog_impl(*grammar.vocab, token)) {
         for (const auto & stack : grammar.stacks) {
             if (stack.empty()) {
@@ -1135,4 +1521,6 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
 
     grammar.partial_utf8 = decoded.second;
     GGML_ASSERT(!grammar.stacks.empty());
+
+    llama_grammar_masks_start(grammar);
 }
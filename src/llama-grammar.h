@@ -2,7 +2,10 @@
 
 #include "llama-impl.h"
 
+#include <future>
 #include <map>
+#include <memory>
+#include <unordered_map>
 
 struct llama_vocab;
 
@@ -76,6 +79,57 @@ std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_stack(
         const llama_grammar_stack      & stack,
         const llama_grammar_candidates & candidates);
 
+// trie over the code points of the pieces of all tokens in the vocab
+// the allowed tokens of a grammar stack are found with a single walk of the trie, which matches the
+// common prefixes of the tokens only once
+struct llama_grammar_trie {
+    struct node {
+        uint32_t child_begin; // children in `children`, sorted by code point
+        uint32_t child_end;
+        uint32_t token_begin; // tokens whose piece ends at this node, in `tokens`
+        uint32_t token_end;
+    };
+
+    struct child {
+        uint32_t chr;
+        uint32_t node;
+    };
+
+    struct token {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8; // incomplete UTF-8 sequence at the end of the piece
+    };
+
+    uint32_t n_vocab = 0;
+
+    std::vector<node>  nodes; // nodes[0] is the root
+    std::vector<child> children;
+    std::vector<token> tokens;
+};
+
+// returns the trie of the vocab, building it on first use
+std::shared_ptr<const llama_grammar_trie> llama_grammar_trie_get(const struct llama_vocab & vocab);
+
+struct llama_grammar_stack_hash {
+    size_t operator()(const llama_grammar_stack & stack) const {
+        size_t seed = stack.size();
+        for (const auto * pos : stack) {
+            seed ^= std::hash<const llama_grammar_element *>{}(pos) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        }
+        return seed;
+    }
+};
+
+// bitmask over the vocab of the tokens allowed by a grammar stack
+using llama_grammar_mask = std::vector<uint64_t>;
+
+// masks computed on a helper thread for the stacks that follow an accepted token
+struct llama_grammar_masks_prefetch {
+    std::shared_ptr<const llama_grammar_trie> trie;
+
+    std::vector<std::pair<llama_grammar_stack, llama_grammar_mask>> masks;
+};
+
 struct llama_grammar_parser {
     std::map<std::string, uint32_t> symbol_ids;
 
@@ -115,6 +169,15 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // allowed tokens of the stacks seen so far, computed from the vocab trie
+    // the keys point into `rules`, so this is not copied when the grammar is cloned
+    mutable std::shared_ptr<const llama_grammar_trie> trie;
+    mutable std::unordered_map<llama_grammar_stack, llama_grammar_mask, llama_grammar_stack_hash> masks;
+
+    // missing masks of the current stacks, computed while the next token is evaluated and added to `masks` on first use
+    // declared last so that it is waited for before `rules` is destroyed
+    mutable std::future<llama_grammar_masks_prefetch> masks_prefetch;
 };
 
 //
@@ -139,6 +202,17 @@ void llama_grammar_apply_impl(
         const struct llama_grammar & grammar,
             llama_token_data_array * cur_p);
 
+// the two ways of applying the grammar, chosen by llama_grammar_apply_impl
+// note: needed for tests, which check that they agree
+// the masks path returns false without changing the candidates when it does not apply (incomplete UTF-8 sequence, too few candidates)
+bool llama_grammar_apply_masks_impl(
+        const struct llama_grammar & grammar,
+            llama_token_data_array * cur_p);
+
+void llama_grammar_apply_candidates_impl(
+        const struct llama_grammar & grammar,
+            llama_token_data_array * cur_p);
+
 void llama_grammar_accept_impl(
               struct llama_grammar & grammar,
                        llama_token   token);
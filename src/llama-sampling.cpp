@@ -63,14 +63,90 @@ static void llama_log_softmax(float * array, size_t size) {
 }
 */
 
+// candidates arrays with at least this many entries are sorted with a radix sort
+#define LLAMA_SAMPLER_RADIX_SORT_MIN 4096
+
+// number of candidates sorted in the first step of top-p on unsorted candidates, doubled on each further step
+#define LLAMA_SAMPLER_TOP_P_CHUNK 256
+
+struct llama_token_data_cmp {
+    bool operator()(const llama_token_data & a, const llama_token_data & b) const {
+        return a.logit > b.logit;
+    }
+};
+
+// sorts the candidates by logit in descending order
+// large arrays use a stable LSD radix sort over the bits of the logits, which is linear in the number of candidates
+static void llama_token_data_sort(llama_token_data * data, size_t size) {
+    if (size < LLAMA_SAMPLER_RADIX_SORT_MIN) {
+        std::sort(data, data + size, llama_token_data_cmp());
+        return;
+    }
+
+    constexpr int nbits    = 11;
+    constexpr int nbuckets = 1 << nbits;
+    constexpr int npasses  = (32 + nbits - 1) / nbits;
+
+    // the upper 32 bits hold a key that orders the logits in descending order, the lower 32 bits the index
+    std::vector<uint64_t> keys(size);
+    std::vector<uint64_t> keys_tmp(size);
+
+    std::vector<uint32_t> histo(npasses * nbuckets, 0);
+
+    for (size_t i = 0; i < size; ++i) {
+        uint32_t bits;
+        std::memcpy(&bits, &data[i].logit, sizeof(bits));
+
+        // -0.0f ties with 0.0f, as with the comparison
+        if (bits == 0x80000000u) {
+            bits = 0;
+        }
+
+        // flip the sign bit of positive values and all bits of negative ones to order them as unsigned ints
+        bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+        bits = ~bits;
+
+        keys[i] = (uint64_t) bits << 32 | i;
+
+        for (int pass = 0; pass < npasses; ++pass) {
+            histo[pass * nbuckets + ((bits >> (pass * nbits)) & (nbuckets - 1))]++;
+        }
+    }
+
+    for (int pass = 0; pass < npasses; ++pass) {
+        uint32_t * h = histo.data() + pass * nbuckets;
+
+        // all keys in the same bucket - nothing to do in this pass
+        if (h[(keys[0] >> (32 + pass * nbits)) & (nbuckets - 1)] == size) {
+            continue;
+        }
+
+        uint32_t offs = 0;
+        for (int b = 0; b < nbuckets; ++b) {
+            const uint32_t n = h[b];
+            h[b] = offs;
+            offs += n;
+        }
+
+        for (size_t i = 0; i < size; ++i) {
+            keys_tmp[h[(keys[i] >> (32 + pass * nbits)) & (nbuckets - 1)]++] = keys[i];
+        }
+
+        keys.swap(keys_tmp);
+    }
+
+    std::vector<llama_token_data> tmp(data, data + size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = tmp[(uint32_t) keys[i]];
+    }
+}
+
 static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
     GGML_ASSERT(cur_p->size > 0);
 
     // Sort the logits in descending order
     if (!cur_p->sorted) {
-        std::sort(cur_p->data, cur_p->data + cur_p->size, [](const llama_token_data & a, const llama_token_data & b) {
-            return a.logit > b.logit;
-        });
+        llama_token_data_sort(cur_p->data, cur_p->size);
         cur_p->sorted = true;
     }
 
@@ -102,25 +178,33 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
 
     // Sort scores in descending order
     if (!cur_p->sorted) {
-        auto comp = [](const llama_token_data & a, const llama_token_data & b) {
-            return a.logit > b.logit;
-        };
         if (k <= 128) {
-            std::partial_sort(cur_p->data, cur_p->data + k, cur_p->data + cur_p->size, comp);
+            std::partial_sort(cur_p->data, cur_p->data + k, cur_p->data + cur_p->size, llama_token_data_cmp());
+        } else if (k == (int) cur_p->size) {
+            llama_token_data_sort(cur_p->data, cur_p->size);
         } else {
-            constexpr int   nbuckets     = 128;
-            constexpr float bucket_low   = -10.0f;
-            constexpr float bucket_high  =  10.0f;
-            constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
-            constexpr float bucket_inter = -bucket_low * bucket_scale;
+            constexpr int nbuckets = 128;
+
+            // the buckets span the range of the finite logits, so that they stay balanced for any scale of the logits
+            float bucket_low  =  INFINITY;
+            float bucket_high = -INFINITY;
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                const float val = cur_p->data[i].logit;
+                if (std::isfinite(val)) {
+                    bucket_low  = std::min(bucket_low,  val);
+                    bucket_high = std::max(bucket_high, val);
+                }
+            }
+
+            const float bucket_scale = bucket_high > bucket_low ? nbuckets/(bucket_high - bucket_low) : 0.0f;
 
             std::vector<int> bucket_idx(cur_p->size);
             std::vector<int> histo(nbuckets, 0);
 
             for (int i = 0; i < (int)cur_p->size; ++i) {
-                const float val = cur_p->data[i].logit;
-                int ib = int(bucket_scale * val + bucket_inter); //nbuckets * (val - bucket_low) / (bucket_high - bucket_low);
-                ib = std::max(0, std::min(nbuckets-1, ib));
+                const float val = bucket_scale * (cur_p->data[i].logit - bucket_low);
+                // written so that -inf and nan end up in the lowest bucket
+                const int ib = val >= 1.0f ? std::min(nbuckets - 1, int(val)) : 0;
                 bucket_idx[i] = ib;
                 ++histo[ib];
             }
@@ -150,11 +234,11 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
             ptr = tmp_tokens.data();
             int ndone = 0;
             for (int j = nbuckets-1; j > ib; --j) {
-                std::sort(ptr, ptr + histo[j], comp);
+                llama_token_data_sort(ptr, histo[j]);
                 ptr += histo[j];
                 ndone += histo[j];
             }
-            std::partial_sort(ptr, ptr + k - ndone, ptr + histo[ib], comp);
+            std::partial_sort(ptr, ptr + k - ndone, ptr + histo[ib], llama_token_data_cmp());
 
             std::memcpy(cur_p->data, tmp_tokens.data(), k*sizeof(llama_token_data));
 
@@ -231,23 +315,30 @@ void llama_sampler_free(struct llama_sampler * smpl) {
     delete smpl;
 }
 
-llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
-    const auto * logits = llama_get_logits_ith(ctx, idx);
-
+// sample and accept a token from the idx-th output, using cur as scratch buffer for the candidates
+static llama_token llama_sampler_sample_impl(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx, std::vector<llama_token_data> & cur) {
     const int n_vocab = llama_n_vocab(llama_get_model(ctx));
 
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    cur.resize(n_vocab);
+
+    // the candidates selected in the graph, if enabled, are already sorted
+    const int32_t n_top_k = llama_get_output_top_k_ith(ctx, idx, cur.data());
+
+    if (n_top_k >= 0) {
+        cur.resize(n_top_k);
+    } else {
+        const auto * logits = llama_get_logits_ith(ctx, idx);
+
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        }
     }
 
     llama_token_data_array cur_p = {
         /* .data       = */ cur.data(),
         /* .size       = */ cur.size(),
         /* .selected   = */ -1,
-        /* .sorted     = */ false,
+        /* .sorted     = */ n_top_k >= 0,
     };
 
     llama_sampler_apply(smpl, &cur_p);
@@ -261,6 +352,37 @@ llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_conte
     return token;
 }
 
+llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
+    std::vector<llama_token_data> cur;
+
+    return llama_sampler_sample_impl(smpl, ctx, idx, cur);
+}
+
+void llama_sampler_sample_batch(struct llama_sampler ** smpls, struct llama_context * ctx, const int32_t * idxs, int32_t n_idxs, llama_token * tokens) {
+    if (n_idxs <= 0) {
+        return;
+    }
+
+    // synchronize once on this thread - after that the outputs can be read concurrently by the workers
+    llama_synchronize(ctx);
+
+    struct job {
+        struct llama_sampler ** smpls;
+        struct llama_context  * ctx;
+        const int32_t         * idxs;
+        llama_token           * tokens;
+    } data = { smpls, ctx, idxs, tokens };
+
+    llama_parallel_for(ctx, n_idxs, [](int32_t i, void * user_data) {
+        const auto * data = (const job *) user_data;
+
+        // each thread reuses its scratch buffer for all of its outputs
+        thread_local std::vector<llama_token_data> cur;
+
+        data->tokens[i] = llama_sampler_sample_impl(data->smpls[i], data->ctx, data->idxs[i], cur);
+    }, &data);
+}
+
 // sampler chain
 
 static const char * llama_sampler_chain_name(const struct llama_sampler * /*smpl*/) {
@@ -561,21 +683,68 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
         return;
     }
 
-    llama_sampler_softmax_impl(cur_p);
+    if (cur_p->sorted || cur_p->size <= LLAMA_SAMPLER_TOP_P_CHUNK) {
+        llama_sampler_softmax_impl(cur_p);
+    }
 
     // Compute the cumulative probabilities
-    float cum_sum = 0.0f;
+    // in double, a float sum over a large vocab is off enough to move the cut by many tokens
+    double cum_sum = 0.0;
     size_t last_idx = cur_p->size;
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        cum_sum += cur_p->data[i].p;
+    if (cur_p->sorted) {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            cum_sum += cur_p->data[i].p;
 
-        // Check if the running sum is at least p or if we have kept at least min_keep tokens
-        // we set the last index to i+1 to indicate that the current iterate should be included in the set
-        if (cum_sum >= ctx->p && i + 1 >= ctx->min_keep) {
-            last_idx = i + 1;
-            break;
+            // Check if the running sum is at least p or if we have kept at least min_keep tokens
+            // we set the last index to i+1 to indicate that the current iterate should be included in the set
+            if (cum_sum >= ctx->p && i + 1 >= ctx->min_keep) {
+                last_idx = i + 1;
+                break;
+            }
         }
+    } else {
+        // the kept tokens are usually a small fraction of the vocab, so only the most probable ones are sorted,
+        // in chunks of growing size, until the running sum reaches p
+        float max_l = -INFINITY;
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            max_l = std::max(max_l, cur_p->data[i].logit);
+        }
+
+        // accumulated in double as the order of the terms differs from the one of the sorted softmax
+        double sum = 0.0;
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const float p = expf(cur_p->data[i].logit - max_l);
+            cur_p->data[i].p = p;
+            sum += p;
+        }
+
+        size_t n_sorted = 0;
+        size_t n_chunk  = LLAMA_SAMPLER_TOP_P_CHUNK;
+
+        while (n_sorted < cur_p->size && last_idx == cur_p->size) {
+            const size_t n_next = std::min(cur_p->size, n_sorted + n_chunk);
+
+            if (n_next < cur_p->size) {
+                std::nth_element(cur_p->data + n_sorted, cur_p->data + n_next, cur_p->data + cur_p->size, llama_token_data_cmp());
+            }
+            llama_token_data_sort(cur_p->data + n_sorted, n_next - n_sorted);
+
+            for (size_t i = n_sorted; i < n_next; ++i) {
+                cur_p->data[i].p /= sum;
+                cum_sum += cur_p->data[i].p;
+
+                if (cum_sum >= ctx->p && i + 1 >= ctx->min_keep) {
+                    last_idx = i + 1;
+                    break;
+                }
+            }
+
+            n_sorted = n_next;
+            n_chunk *= 2;
+        }
+
+        cur_p->sorted = true;
     }
 
     // Resize the output vector to keep only the top-p tokens
@@ -632,24 +801,27 @@ static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_d
 
     // if the cur_p aren't sorted, try the unsorted implementation first
     if (!cur_p->sorted) {
-        std::vector<llama_token_data> filtered_tokens;
-
         float max_logit = -FLT_MAX;
         for (size_t i = 0; i < cur_p->size; ++i) {
             max_logit = std::max(max_logit, cur_p->data[i].logit);
         }
         const float min_logit = max_logit + logf(ctx->p); // min logit for p_i >= p * p_max
 
+        size_t n_filtered = 0;
         for (size_t i = 0; i < cur_p->size; ++i) {
-            if (cur_p->data[i].logit >= min_logit) {
-                filtered_tokens.push_back(cur_p->data[i]);
-            }
+            n_filtered += cur_p->data[i].logit >= min_logit;
         }
 
         // if we have enough values the operation was a success
-        if (filtered_tokens.size() >= ctx->min_keep) {
-            memcpy(cur_p->data, filtered_tokens.data(), filtered_tokens.size()*sizeof(llama_token_data));
-            cur_p->size = filtered_tokens.size();
+        if (n_filtered >= ctx->min_keep) {
+            // compact the matching tokens in place, keeping their order
+            size_t j = 0;
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                if (cur_p->data[i].logit >= min_logit) {
+                    cur_p->data[j++] = cur_p->data[i];
+                }
+            }
+            cur_p->size = n_filtered;
             min_p_applied = true;
         }
     }
@@ -658,9 +830,7 @@ static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_d
     if (!min_p_applied) {
         // Sort the logits in descending order
         if (!cur_p->sorted) {
-            std::sort(cur_p->data, cur_p->data + cur_p->size, [](const llama_token_data & a, const llama_token_data & b) {
-                return a.logit > b.logit;
-            });
+            llama_token_data_sort(cur_p->data, cur_p->size);
             cur_p->sorted = true;
         }
 
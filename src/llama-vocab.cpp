@@ -7,10 +7,13 @@
 #include <cfloat>
 #include <climits>
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 #include <forward_list>
+#include <list>
 #include <queue>
 #include <sstream>
+#include <thread>
 
 //
 // helpers
@@ -366,6 +369,70 @@ struct llm_bigram_bpe {
     size_t size;
 };
 
+// LRU cache of the tokens of the pre-tokenized words
+// the merges of a word do not depend on the neighbouring words, so frequent words are looked up instead of merged again
+// the cache is split in shards with their own lock, to limit the contention between threads tokenizing at the same time
+struct llm_tokenizer_bpe_cache {
+    static constexpr size_t n_shards     = 16;
+    static constexpr size_t shard_size   = 4096;
+    static constexpr size_t max_word_len = 64; // longer words are rare, they are not cached
+
+    using entry = std::pair<std::string, std::vector<llama_vocab::id>>;
+
+    struct shard {
+        std::mutex mutex;
+        std::list<entry> lru; // most recently used first
+        std::unordered_map<std::string, std::list<entry>::iterator> map;
+    };
+
+    shard shards[n_shards];
+
+    shard & get_shard(const std::string & word) {
+        return shards[std::hash<std::string>()(word) % n_shards];
+    }
+
+    // append the cached tokens of the word to output, returns false if the word is not cached
+    bool find(const std::string & word, std::vector<llama_vocab::id> & output) {
+        if (word.size() > max_word_len) {
+            return false;
+        }
+
+        auto & sh = get_shard(word);
+        std::lock_guard<std::mutex> lock(sh.mutex);
+
+        auto it = sh.map.find(word);
+        if (it == sh.map.end()) {
+            return false;
+        }
+
+        sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+        output.insert(output.end(), it->second->second.begin(), it->second->second.end());
+
+        return true;
+    }
+
+    void insert(const std::string & word, const llama_vocab::id * tokens, size_t n_tokens) {
+        if (word.size() > max_word_len) {
+            return;
+        }
+
+        auto & sh = get_shard(word);
+        std::lock_guard<std::mutex> lock(sh.mutex);
+
+        if (sh.map.find(word) != sh.map.end()) {
+            return; // inserted by another thread in the meantime
+        }
+
+        if (sh.lru.size() >= shard_size) {
+            sh.map.erase(sh.lru.back().first);
+            sh.lru.pop_back();
+        }
+
+        sh.lru.emplace_front(word, std::vector<llama_vocab::id>(tokens, tokens + n_tokens));
+        sh.map.emplace(word, sh.lru.begin());
+    }
+};
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) : llm_tokenizer() {
         GGML_ASSERT(vocab.type == LLAMA_VOCAB_TYPE_BPE);
@@ -488,9 +555,32 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        // these expressions never match across an ASCII "<letter> <letter>" boundary and do not look behind,
+        // so a text split there is pre-tokenized into the same words as the whole text
+        static const std::set<std::string> split_safe_exprs = {
+            "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            "[\\p{P}\\$\\+<=>\\^~\\|]+",
+            "[\\p{P}\\$\\+<=>\\^~\\|`]+",
+            "\\p{N}",
+            "\\p{N}+",
+            "[0-9][0-9][0-9]",
+        };
+
+        can_split = true;
+        for (const auto & regex_expr : regex_exprs) {
+            can_split = can_split && split_safe_exprs.count(regex_expr) > 0;
+        }
     }
 
     std::vector<std::string> regex_exprs;
+
+    // long texts can be split in chunks that are tokenized in parallel
+    bool can_split = false;
+
+    mutable llm_tokenizer_bpe_cache cache;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -534,106 +624,168 @@ struct llm_tokenizer_bpe_session {
         }
     }
 
+    // texts of at least this size are split in chunks that are tokenized on multiple threads
+    static constexpr size_t split_min_size = 64*1024;
+
+    // the threads are started by each call, so that several calls at once use at most this many threads each
+    static constexpr int split_max_threads = 8;
+
+    // LLAMA_TOKENIZE_THREADS overrides the number of threads, 1 tokenizes the texts in one piece
+    static int split_n_threads() {
+        const char * env = getenv("LLAMA_TOKENIZE_THREADS");
+        if (env != nullptr && env[0] != '\0') {
+            return std::max(1, atoi(env));
+        }
+        return std::min<int>(std::thread::hardware_concurrency(), split_max_threads);
+    }
+
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-        const auto word_collection = unicode_regex_split(text, bpe_tokenizer->regex_exprs);
+        if (!bpe_tokenizer->can_split || text.size() < split_min_size) {
+            tokenize_text(text, output);
+            return;
+        }
 
-        symbols_final.clear();
+        const int n_threads = split_n_threads();
+        if (n_threads <= 1) {
+            tokenize_text(text, output);
+            return;
+        }
 
-        for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+        // split the text at ASCII "<letter> <letter>" boundaries close to the even split points
+        auto is_letter = [](char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        };
 
-            int index = 0;
-            size_t offset = 0;
+        const size_t n_chunks = std::min<size_t>(n_threads, text.size() / (split_min_size/2));
 
-            if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+        std::vector<size_t> bounds = { 0 };
+        for (size_t i = 1; i < n_chunks; ++i) {
+            size_t pos = std::max(bounds.back() + 1, i*text.size()/n_chunks);
+            while (pos + 1 < text.size() && !(text[pos] == ' ' && is_letter(text[pos - 1]) && is_letter(text[pos + 1]))) {
+                pos++;
             }
-
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
+            if (pos + 1 >= text.size()) {
+                break;
             }
-            for (size_t i = 1; i < symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+            bounds.push_back(pos);
+        }
+        bounds.push_back(text.size());
+
+        std::vector<std::vector<llama_vocab::id>> outputs(bounds.size() - 1);
+
+        std::vector<std::thread> workers;
+        workers.reserve(outputs.size() - 1);
+
+        for (size_t i = 1; i < outputs.size(); ++i) {
+            workers.emplace_back([&, i]() {
+                llm_tokenizer_bpe_session session(vocab);
+                session.tokenize_text(text.substr(bounds[i], bounds[i + 1] - bounds[i]), outputs[i]);
+            });
+        }
+
+        tokenize_text(text.substr(0, bounds[1]), outputs[0]);
+
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        for (const auto & out : outputs) {
+            output.insert(output.end(), out.begin(), out.end());
+        }
+    }
+
+    void tokenize_text(const std::string & text, std::vector<llama_vocab::id> & output) {
+        const auto word_collection = unicode_regex_split(text, bpe_tokenizer->regex_exprs);
+
+        for (const auto & word : word_collection) {
+            if (bpe_tokenizer->cache.find(word, output)) {
+                continue;
             }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+            const size_t n_output = output.size();
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+            tokenize_word(word, output);
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+            bpe_tokenizer->cache.insert(word, output.data() + n_output, output.size() - n_output);
+        }
+    }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+    void tokenize_word(const std::string & word, std::vector<llama_vocab::id> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+        int index = 0;
+        size_t offset = 0;
+
+        if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            offset = word.size();
+        }
+
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (size_t i = 1; i < symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
+
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            std::string left_token = std::string(left_symbol.text, left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
+            if (left_token + right_token != bigram.text) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        // the merged symbols are in order in the symbols array
+        for (const auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.token_to_id.find(str);
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte != vocab.token_to_id.end()) {
-                            output.push_back(token_multibyte->second);
-                        }
+            if (token == vocab.token_to_id.end()) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.token_to_id.find(byte_str);
+                    if (token_multibyte != vocab.token_to_id.end()) {
+                        output.push_back(token_multibyte->second);
                     }
-                } else {
-                    output.push_back((*token).second);
                 }
+            } else {
+                output.push_back((*token).second);
             }
         }
     }
@@ -669,7 +821,6 @@ private:
     const llm_tokenizer_bpe * bpe_tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -1329,6 +1480,8 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
         }
 
         // for each text fragment
+        // the fragment before the current one is tracked as well, so that fragments are erased in constant time
+        std::forward_list<fragment_buffer_variant>::iterator it_prev = buffer.before_begin();
         std::forward_list<fragment_buffer_variant>::iterator it = buffer.begin();
         while (it != buffer.end()) {
             auto & fragment = (*it);
@@ -1343,20 +1496,22 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
                 // loop over the text
                 while (true) {
                     // find the first occurrence of a given special token in this fragment
-                    //  passing offset argument only limit the "search area" but match coordinates
+                    //  the search is limited to the fragment, but match coordinates
                     //  are still relative to the source full raw_text
-                    auto match = raw_text.find(special_token, raw_text_base_offset);
+                    const auto fragment_begin = raw_text.begin() + raw_text_base_offset;
+                    const auto fragment_end   = fragment_begin   + raw_text_base_length;
+                    const auto match_it = std::search(fragment_begin, fragment_end, special_token.begin(), special_token.end());
 
                     // no occurrences found, stop processing this fragment for a given special token
-                    if (match == std::string::npos) break;
+                    if (match_it == fragment_end) break;
 
-                    // check if match is within bounds of offset <-> length
-                    if (match + special_token.length() > raw_text_base_offset + raw_text_base_length) break;
+                    const size_t match = match_it - raw_text.begin();
 
 #ifdef PRETOKENIZERDEBUG
                     LLAMA_LOG_WARN("FF: (%ld %ld %ld) '%s'\n", raw_text->length(), raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
 #endif
-                    auto source = std::distance(buffer.begin(), it);
+                    const auto source      = it;
+                    const auto source_prev = it_prev;
 
                     // if match is further than base offset
                     //  then we have some text to the left of it
@@ -1373,7 +1528,7 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
 
                         if (left_reminder_length > 0) {
                             buffer.emplace_after(it, raw_text, left_reminder_offset, left_reminder_length);
-                            it++;
+                            it_prev = it++;
                         }
 
 #ifdef PRETOKENIZERDEBUG
@@ -1383,7 +1538,7 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
 
                     // special token
                     buffer.emplace_after(it, special_id);
-                    it++;
+                    it_prev = it++;
 
                     // right
                     if (match + special_token.length() < raw_text_base_offset + raw_text_base_length) {
@@ -1399,18 +1554,17 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
 
                         if (right_reminder_length > 0) {
                             buffer.emplace_after(it, raw_text, right_reminder_offset, right_reminder_length);
-                            it++;
+                            it_prev = it++;
                         }
 
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("FR: (%ld %ld) '%s'\n", right_reminder_offset, right_reminder_length, raw_text->substr(right_reminder_offset, right_reminder_length).c_str());
 #endif
 
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
+                        if (it_prev == source) {
+                            it_prev = source_prev;
                         }
+                        buffer.erase_after(source_prev);
 
                         // repeat for the right side
                         raw_text_base_offset = right_reminder_offset;
@@ -1420,16 +1574,15 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
                         LLAMA_LOG_WARN("RR: (%ld %ld) '%s'\n", raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
 #endif
                     } else {
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
+                        if (it_prev == source) {
+                            it_prev = source_prev;
                         }
+                        buffer.erase_after(source_prev);
                         break;
                     }
                 }
             }
-            it++;
+            it_prev = it++;
         }
     }
 }
@@ -1942,3 +2095,64 @@ int32_t llama_detokenize_impl(
 
     return total <= text_len_max ? total : -total;
 }
+
+// length of the prefix of text that does not end with an incomplete UTF-8 character
+// invalid bytes are treated as complete characters, so they are not held back
+static size_t llama_utf8_complete_prefix(const std::string & text) {
+    for (size_t i = 1; i < 5 && i <= text.size(); ++i) {
+        const uint8_t c = text[text.size() - i];
+        if ((c & 0xC0) == 0x80) {
+            // continuation byte: 10xxxxxx
+            continue;
+        }
+        size_t n = 1;
+        if ((c & 0xE0) == 0xC0) {
+            n = 2; // 110xxxxx ...
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 3; // 1110xxxx ...
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 4; // 11110xxx ...
+        }
+        return i < n ? text.size() - i : text.size();
+    }
+    return text.size();
+}
+
+int32_t llama_detokenizer_push_impl(struct llama_detokenizer & detok, llama_token token, char * buf, int32_t length) {
+    std::string text = detok.pending;
+
+    {
+        char piece[128];
+        int32_t n_chars = llama_token_to_piece_impl(detok.vocab, token, piece, sizeof(piece), 0, detok.special);
+        if (n_chars >= 0) {
+            text.append(piece, n_chars);
+        } else {
+            const size_t n_text = text.size();
+            text.resize(n_text - n_chars);
+            n_chars = llama_token_to_piece_impl(detok.vocab, token, &text[n_text], text.size() - n_text, 0, detok.special);
+            GGML_ASSERT(n_chars >= 0 && (size_t) n_chars == text.size() - n_text);
+        }
+    }
+
+    const size_t n_complete = llama_utf8_complete_prefix(text);
+    if (n_complete > (size_t) length) {
+        return -(int32_t) n_complete;
+    }
+
+    memcpy(buf, text.data(), n_complete);
+    detok.pending = text.substr(n_complete);
+
+    return n_complete;
+}
+
+int32_t llama_detokenizer_flush_impl(struct llama_detokenizer & detok, char * buf, int32_t length) {
+    const int32_t n_pending = detok.pending.size();
+    if (n_pending > length) {
+        return -n_pending;
+    }
+
+    memcpy(buf, detok.pending.data(), n_pending);
+    detok.pending.clear();
+
+    return n_pending;
+}
@@ -4,11 +4,14 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <map>
 #include <set>
 
 struct llm_tokenizer;
+struct llama_grammar_trie;
 
 struct llama_vocab {
     using id    = llama_token;
@@ -34,6 +37,10 @@ struct llama_vocab {
     std::vector<id>    cache_special_tokens;
     std::vector<token> cache_token_to_piece; // llama_token_to_piece(special = true);
 
+    // token trie over cache_token_to_piece, built by the first grammar that needs it
+    mutable std::mutex                                grammar_trie_mutex;
+    mutable std::shared_ptr<const llama_grammar_trie> grammar_trie;
+
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
     // default LLaMA special tokens
@@ -144,3 +151,26 @@ int32_t llama_detokenize_impl(
                          int32_t   text_len_max,
                             bool   remove_special,
                             bool   unparse_special);
+
+// streaming detokenizer
+// the pieces of the pushed tokens are returned as soon as they end with a complete UTF-8 character
+struct llama_detokenizer {
+    llama_detokenizer(const llama_vocab & vocab, bool special) : vocab(vocab), special(special) {}
+
+    const llama_vocab & vocab;
+
+    const bool special;
+
+    std::string pending; // the bytes of the last piece that are not returned yet
+};
+
+int32_t llama_detokenizer_push_impl(
+        struct llama_detokenizer & detok,
+                     llama_token   token,
+                            char * buf,
+                         int32_t   length);
+
+int32_t llama_detokenizer_flush_impl(
+        struct llama_detokenizer & detok,
+                            char * buf,
+                         int32_t   length);
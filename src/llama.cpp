@@ -36,6 +36,7 @@
 #ifdef __has_include
     #if __has_include(<unistd.h>)
         #include <unistd.h>
+        #include <sys/stat.h>
         #if defined(_POSIX_MAPPED_FILES)
             #include <sys/mman.h>
             #include <fcntl.h>
@@ -66,6 +67,7 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
@@ -77,6 +79,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <condition_variable>
 #include <ctime>
 #include <fstream>
 #include <functional>
@@ -92,6 +95,7 @@
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -1777,6 +1781,27 @@ public:
         } ;
     }
 
+    // read at an absolute offset, can be called from several threads at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) ((offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -1806,6 +1831,22 @@ public:
         write_raw(&val, sizeof(val));
     }
 
+    // last modification time of the file
+    int64_t mtime() const {
+        FILETIME ft;
+        if (!GetFileTime(fp_win32, NULL, NULL, &ft)) {
+            throw std::runtime_error(format("stat error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+        }
+        return ((int64_t) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    }
+
+    // writes the data to the disk
+    void sync() const {
+        if (!FlushFileBuffers(fp_win32)) {
+            throw std::runtime_error(format("write error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+        }
+    }
+
     ~llama_file() {
         if (fp) {
             std::fclose(fp);
@@ -1864,6 +1905,26 @@ public:
         }
     }
 
+    // read at an absolute offset without moving the file position, can be called from several threads at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -1885,6 +1946,22 @@ public:
         write_raw(&val, sizeof(val));
     }
 
+    // last modification time of the file
+    int64_t mtime() const {
+        struct stat st;
+        if (fstat(fileno(fp), &st) != 0) {
+            throw std::runtime_error(format("stat error: %s", strerror(errno)));
+        }
+        return (int64_t) st.st_mtime;
+    }
+
+    // writes the data to the disk
+    void sync() const {
+        if (std::fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+            throw std::runtime_error(format("write error: %s", strerror(errno)));
+        }
+    }
+
     ~llama_file() {
         if (fp) {
             std::fclose(fp);
@@ -1945,6 +2022,16 @@ struct llama_mmap {
         mapped_fragments.emplace_back(0, file->size);
     }
 
+    // ask for transparent huge pages, only used for files by kernels built with CONFIG_READ_ONLY_THP_FOR_FS
+    void advise_huge_pages() const {
+#ifdef MADV_HUGEPAGE
+        if (madvise(addr, size, MADV_HUGEPAGE)) {
+            LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n",
+                    strerror(errno));
+        }
+#endif
+    }
+
     static void align_range(size_t * first, size_t * last, size_t page_size) {
         // align first to the next page
         size_t offset_in_page = *first & (page_size - 1);
@@ -2068,6 +2155,10 @@ struct llama_mmap {
         GGML_UNUSED(last);
     }
 
+    void advise_huge_pages() const {
+        // not supported
+    }
+
     ~llama_mmap() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -2091,6 +2182,10 @@ struct llama_mmap {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void advise_huge_pages() const {
+        throw std::runtime_error("mmap not supported");
+    }
 #endif
 };
 using llama_mmaps = std::vector<std::unique_ptr<llama_mmap>>;
@@ -2245,6 +2340,51 @@ struct llama_mlock {
 };
 using llama_mlocks = std::vector<std::unique_ptr<llama_mlock>>;
 
+// number of bytes of the range [addr, addr + size) that are backed by huge pages, from /proc/self/smaps
+static size_t llama_huge_page_bytes(const void * addr, size_t size) {
+    size_t total = 0;
+#ifdef __linux__
+    FILE * f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    const uintptr_t first = (uintptr_t) addr;
+    const uintptr_t last  = first + size;
+    uintptr_t vma_first = 0;
+    uintptr_t vma_last  = 0;
+    size_t    vma_huge  = 0;
+    auto flush = [&]() {
+        const uintptr_t lo = std::max(first, vma_first);
+        const uintptr_t hi = std::min(last,  vma_last);
+        if (lo < hi) {
+            total += std::min(vma_huge, (size_t) (hi - lo));
+        }
+        vma_huge = 0;
+    };
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long a, b, kb;
+        char key[64];
+        if (sscanf(line, "%llx-%llx ", &a, &b) == 2) {
+            flush();
+            vma_first = (uintptr_t) a;
+            vma_last  = (uintptr_t) b;
+        } else if (sscanf(line, "%63[^:]: %llu kB", key, &kb) == 2) {
+            if (strcmp(key, "AnonHugePages")   == 0 || strcmp(key, "FilePmdMapped")   == 0 ||
+                strcmp(key, "Shared_Hugetlb")  == 0 || strcmp(key, "Private_Hugetlb") == 0) {
+                vma_huge += (size_t) kb*1024;
+            }
+        }
+    }
+    flush();
+    fclose(f);
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(size);
+#endif
+    return total;
+}
+
 // NOTE: avoid ever using this except for building the token_to_piece caches
 static std::string llama_token_to_piece(const struct llama_model * model, llama_token token, bool special) {
     std::string piece;
@@ -2567,12 +2707,18 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t kv_block_size;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
 
+    // candidates selected in the graph for each output instead of the full logits (see llama_set_output_top_k)
+    int32_t top_k;
+    float   top_k_temp;
+
     enum llama_pooling_type pooling_type;
 
     ggml_backend_sched_eval_callback cb_eval;
@@ -2787,9 +2933,33 @@ struct llama_kv_cache {
 
     std::vector<llama_kv_cell> cells;
 
+    // paged mode: the cells are grouped in blocks of block_size cells and each sequence
+    // has a table of the blocks holding its tokens, so new tokens can be scattered in any
+    // free block instead of requiring a contiguous run of free cells
+    uint32_t block_size = 0; // 0 - contiguous ring buffer
+
+    std::vector<std::set<llama_seq_id>> block_seqs; // sequences referencing each block
+    std::vector<uint32_t>               block_free; // unreferenced blocks, sorted so that the lowest id is at the back
+
+    std::unordered_map<llama_seq_id, std::vector<uint32_t>> block_tables; // per-sequence block table
+
+    // cells assigned to the tokens of the current ubatch (paged mode only)
+    std::vector<int32_t> slot_cells;
+
+    // pending (src, dst) cell copies for the sequences detached from shared cells
+    // applied by llama_kv_cache_update before the K-shift
+    std::vector<std::pair<uint32_t, uint32_t>> cow_copies;
+
+    bool paged() const {
+        return block_size > 0;
+    }
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
+    // Hadamard matrix rotating the heads of K and Q for the low-bit K types, see llm_build_k_rot
+    struct ggml_tensor * k_rot = nullptr;
+
     std::vector<struct ggml_context *> ctxs;
     std::vector<ggml_backend_buffer_t> bufs;
 
@@ -2923,7 +3093,23 @@ struct llama_model {
     // keep track of loaded lora adapters
     std::set<struct llama_lora_adapter *> lora_adapters;
 
+    // lazy loading: the layer of the tensors that are loaded in the background, in the order of the layers
+    std::unordered_map<const ggml_tensor *, int32_t> lazy_layer;
+    std::thread                     lazy_thread;
+    mutable std::mutex              lazy_mutex;
+    mutable std::condition_variable lazy_cv;
+    std::atomic<int32_t>            lazy_n_layer_ready{INT32_MAX}; // the layers [0, lazy_n_layer_ready) are loaded
+    std::atomic<bool>               lazy_failed{false};
+    std::atomic<bool>               lazy_abort{false};
+
+    // the CPU buffers of the model and its contexts are allocated with huge pages, see llama_buffer_type_cpu
+    bool use_huge_pages = false;
+
     ~llama_model() {
+        if (lazy_thread.joinable()) {
+            lazy_abort = true;
+            lazy_thread.join();
+        }
         for (struct ggml_context * ctx : ctxs) {
             ggml_free(ctx);
         }
@@ -3266,6 +3452,149 @@ struct llama_sbatch {
     }
 };
 
+// the LoRA adapters selected per sequence, stacked per base weight so that one gathered matmul applies the adapters of all tokens
+struct llama_lora_stack_weight {
+    struct ggml_tensor * a; // [n_in, rank, n_slots]
+    struct ggml_tensor * b; // [rank, n_out, n_slots], pre-scaled by alpha/rank
+};
+
+struct llama_lora_stack {
+    std::unordered_map<std::string, llama_lora_stack_weight> weights; // base weight name -> stacked adapters
+
+    int64_t rank = 0; // lower ranks are padded with zeros
+
+    enum ggml_type type = GGML_TYPE_F16; // F32 if an adapter has F32 tensors
+
+    std::vector<uint64_t> slots; // slot -> id of the adapter it holds, 0 if never used
+
+    std::vector<struct ggml_context *> ctxs;
+    std::vector<ggml_backend_buffer_t> bufs;
+
+    void clear() {
+        for (struct ggml_context * ctx : ctxs) {
+            ggml_free(ctx);
+        }
+        for (ggml_backend_buffer_t buf : bufs) {
+            ggml_backend_buffer_free(buf);
+        }
+        ctxs.clear();
+        bufs.clear();
+        weights.clear();
+        slots.clear();
+        rank = 0;
+        type = GGML_TYPE_F16;
+    }
+
+    ~llama_lora_stack() {
+        clear();
+    }
+};
+
+// evaluation callback that waits for the weights of the layers that are still being loaded, see llama_lazy_load_prepare
+struct llama_lazy_load_eval {
+    const llama_model * model = nullptr;
+
+    // the callback of the user
+    ggml_backend_sched_eval_callback cb_eval = nullptr;
+    void *                           cb_eval_user_data = nullptr;
+    bool                             user_asked = false;
+
+    // the nodes after which the evaluation stops to wait for the weights of the next layer
+    std::unordered_set<const ggml_tensor *> sync_nodes;
+};
+
+// threads that run the per-output work of llama_parallel_for, such as sampling
+// they are started on first use and wait on a condition variable between the calls
+struct llama_worker_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    // the current job
+    void (*fn)(int32_t i, void * user_data) = nullptr;
+    void * user_data = nullptr;
+    int32_t n = 0;
+    std::atomic<int32_t> next{0};
+
+    int32_t  n_workers = 0; // workers that take part in the current job
+    int32_t  n_pending = 0; // of those, the ones that did not finish yet
+    uint64_t n_jobs    = 0;
+    bool     stop      = false;
+
+    ~llama_worker_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_start.notify_all();
+
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    void work() {
+        for (int32_t i = next++; i < n; i = next++) {
+            fn(i, user_data);
+        }
+    }
+
+    void worker_main(int32_t id, uint64_t n_jobs_seen) {
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv_start.wait(lock, [&] { return stop || n_jobs != n_jobs_seen; });
+            if (stop) {
+                return;
+            }
+            n_jobs_seen = n_jobs;
+
+            if (id >= n_workers) {
+                continue;
+            }
+
+            lock.unlock();
+            work();
+            lock.lock();
+
+            if (--n_pending == 0) {
+                cv_done.notify_one();
+            }
+        }
+    }
+
+    // runs fn on [0, n) with the calling thread and n_threads - 1 workers
+    void run(int32_t n_threads, int32_t n_items, void (*fn_job)(int32_t i, void * user_data), void * user_data_job) {
+        n_threads = std::min(n_threads, n_items);
+
+        // a new worker waits for the next job, the previous ones are done
+        while ((int32_t) workers.size() < n_threads - 1) {
+            const int32_t  id          = workers.size();
+            const uint64_t n_jobs_seen = n_jobs;
+            workers.emplace_back([this, id, n_jobs_seen] { worker_main(id, n_jobs_seen); });
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fn        = fn_job;
+            user_data = user_data_job;
+            n         = n_items;
+            next      = 0;
+            n_workers = std::max(0, n_threads - 1);
+            n_pending = n_workers;
+            n_jobs++;
+        }
+        cv_start.notify_all();
+
+        work();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_pending == 0; });
+    }
+};
+
 struct llama_context {
     llama_context(const llama_model & model)
         : model(model)
@@ -3291,6 +3620,19 @@ struct llama_context {
 
     std::unordered_map<struct llama_lora_adapter *, float> lora_adapters;
 
+    // adapters of each sequence, applied to its tokens on top of lora_adapters
+    std::map<llama_seq_id, std::vector<std::pair<struct llama_lora_adapter *, float>>> lora_adapters_seq;
+
+    struct llama_lora_stack lora_stack;
+
+    struct llama_worker_pool worker_pool;
+
+    bool lora_stack_dirty = false; // a sequence uses an adapter that may not be stacked yet
+
+    // adapters per token in the current ubatch, 0 if no token uses a per-sequence adapter
+    int32_t n_lora_seq = 0;
+    int32_t n_lora_seq_tokens = 0;
+
     std::vector<ggml_backend_t> backends;
 #ifdef GGML_USE_METAL
     ggml_backend_t backend_metal = nullptr;
@@ -3334,6 +3676,12 @@ struct llama_context {
     size_t  embd_size = 0; // capacity (of floats) for embeddings
     float * embd      = nullptr;
 
+    // top-k candidates output, instead of the logits when cparams.top_k > 0 (2-dimensional arrays: [n_outputs][top_k])
+    size_t        top_k_size   = 0; // capacity (of elements) for the candidates
+    int32_t       n_top_k      = 0; // number of candidates per output
+    llama_token * top_k_ids    = nullptr;
+    float       * top_k_logits = nullptr;
+
     // sequence embeddings output (map of [n_embd] vectors)
     // populated only when pooling_type != LLAMA_POOLING_TYPE_NONE
     std::map<llama_seq_id, std::vector<float>> embd_seq;
@@ -3341,6 +3689,12 @@ struct llama_context {
     // whether we are computing encoder output or decoder output
     bool is_encoding = false;
 
+    // tree attention for the next decode (see llama_set_tree)
+    std::vector<int32_t> tree_parent;
+
+    // KV cells of the tokens of the last tree batch, for llama_kv_cache_tree_accept
+    std::vector<int32_t> tree_cells;
+
     // output of the encoder part of the encoder-decoder models
     std::vector<float> embd_enc;
     std::vector<std::set<llama_seq_id>> seq_ids_enc;
@@ -3352,6 +3706,8 @@ struct llama_context {
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    llama_lazy_load_eval lazy_eval;
+
     // input tensors
     struct ggml_tensor * inp_tokens;      // I32 [n_batch]
     struct ggml_tensor * inp_embd;        // F32 [n_embd, n_batch]
@@ -3368,6 +3724,10 @@ struct llama_context {
     struct ggml_tensor * inp_pos_bucket;    // I32 [n_batch|n_kv, n_batch]
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
+    struct ggml_tensor * inp_lora_ids;        // I32 [n_lora_seq, n_batch]
+    struct ggml_tensor * inp_lora_scales;     // F32 [1, n_lora_seq, n_batch]
+    struct ggml_tensor * inp_lora_ids_out;    // I32 [n_lora_seq, n_outputs]
+    struct ggml_tensor * inp_lora_scales_out; // F32 [1, n_lora_seq, n_outputs]
 };
 
 struct llama_lora_weight {
@@ -3386,7 +3746,13 @@ struct llama_lora_adapter {
 
     float alpha;
 
+    // the stacks of the contexts refer to the adapter by id, a freed adapter may be reallocated at the same address
+    uint64_t id;
+
     llama_lora_adapter(struct llama_model * base_model): base_model(base_model) {
+        static std::atomic<uint64_t> n_created{0};
+        id = ++n_created;
+
         base_model->lora_adapters.insert(this);
     }
 
@@ -3435,6 +3801,15 @@ static int llama_get_device_count(const llama_model & model) {
     GGML_UNUSED(model);
 }
 
+// the buffer types of the CPU memory of the model, with huge pages if requested
+static ggml_backend_buffer_type_t llama_buffer_type_cpu(const llama_model & model) {
+    return model.use_huge_pages ? ggml_backend_cpu_huge_page_buffer_type() : ggml_backend_cpu_buffer_type();
+}
+
+static ggml_backend_buffer_type_t llama_buffer_type_cpu_repack(const llama_model & model) {
+    return model.use_huge_pages ? ggml_backend_cpu_repack_huge_page_buffer_type() : ggml_backend_cpu_repack_buffer_type();
+}
+
 static ggml_backend_buffer_type_t llama_default_buffer_type_cpu(const llama_model & model, bool host_buffer) {
     ggml_backend_buffer_type_t buft = nullptr;
 
@@ -3464,7 +3839,7 @@ static ggml_backend_buffer_type_t llama_default_buffer_type_cpu(const llama_mode
 #endif
 
     if (buft == nullptr) {
-        buft = ggml_backend_cpu_buffer_type();
+        buft = llama_buffer_type_cpu(model);
     }
     return buft;
 
@@ -3629,7 +4004,7 @@ static bool llama_kv_cache_init(
     for (auto & it : buft_layer_count) {
         int n_layers = it.second;
         struct ggml_init_params params = {
-            /*.mem_size   =*/ 2u*n_layers*ggml_tensor_overhead(),
+            /*.mem_size   =*/ (2u*n_layers + 1)*ggml_tensor_overhead(),
             /*.mem_buffer =*/ NULL,
             /*.no_alloc   =*/ true,
         };
@@ -3658,6 +4033,17 @@ static bool llama_kv_cache_init(
         cache.v_l.push_back(v);
     }
 
+    // with 2-3 bits per value, the few outlier channels of K would set the scale of every block
+    // the rotation spreads them over the whole head, and Q is rotated alike so that KQ does not change
+    const int64_t n_embd_head_k = hparams.n_embd_head_k;
+
+    cache.k_rot = nullptr;
+    if (!cache.recurrent && (type_k == GGML_TYPE_Q2_1 || type_k == GGML_TYPE_Q3_1) && (n_embd_head_k & (n_embd_head_k - 1)) == 0) {
+        struct ggml_context * ctx = offload ? ctx_map.at(model.buft_layer[0].buft) : cache.ctxs.front();
+        cache.k_rot = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd_head_k, n_embd_head_k);
+        ggml_set_name(cache.k_rot, "cache_k_rot");
+    }
+
     // allocate tensors and initialize the buffers to avoid NaNs in the padding
     for (auto it : ctx_map) {
         ggml_backend_buffer_type_t buft = it.first;
@@ -3672,9 +4058,229 @@ static bool llama_kv_cache_init(
         cache.bufs.push_back(buf);
     }
 
+    if (cache.k_rot) {
+        // normalized Sylvester-Hadamard matrix, symmetric and orthogonal
+        std::vector<float> h(n_embd_head_k*n_embd_head_k);
+        for (int64_t i = 0; i < n_embd_head_k; ++i) {
+            for (int64_t j = 0; j < n_embd_head_k; ++j) {
+                // the sign is the parity of the common bits of i and j
+                int parity = 0;
+                for (int64_t b = i & j; b != 0; b &= b - 1) {
+                    parity ^= 1;
+                }
+                h[i*n_embd_head_k + j] = (parity ? -1.0f : 1.0f)/sqrtf((float) n_embd_head_k);
+            }
+        }
+        ggml_backend_tensor_set(cache.k_rot, h.data(), 0, ggml_nbytes(cache.k_rot));
+
+        LLAMA_LOG_INFO("%s: the K heads are rotated for the %s K cache\n", __func__, ggml_type_name(type_k));
+    }
+
+    cache.block_size = 0;
+    cache.block_seqs.clear();
+    cache.block_free.clear();
+    cache.block_tables.clear();
+    cache.slot_cells.clear();
+
+    if (cparams.kv_block_size > 0 && !cache.recurrent) {
+        bool host = true;
+        for (ggml_backend_buffer_t buf : cache.bufs) {
+            host = host && ggml_backend_buffer_is_host(buf);
+        }
+
+        // the new KV rows are scattered into their cells by the CPU, see llm_build_kv_store
+        if (!host) {
+            LLAMA_LOG_WARN("%s: paged KV cache requires the KV cache in host memory - using a contiguous cache\n", __func__);
+        } else if (kv_size % cparams.kv_block_size != 0) {
+            LLAMA_LOG_WARN("%s: kv_size = %u is not a multiple of kv_block_size = %u - using a contiguous cache\n", __func__, kv_size, cparams.kv_block_size);
+        } else {
+            const uint32_t n_blocks = kv_size / cparams.kv_block_size;
+
+            cache.block_size = cparams.kv_block_size;
+            cache.block_seqs.assign(n_blocks, {});
+            cache.block_free.resize(n_blocks);
+            for (uint32_t i = 0; i < n_blocks; ++i) {
+                cache.block_free[i] = n_blocks - i - 1;
+            }
+
+            LLAMA_LOG_INFO("%s: paged KV cache with %u blocks of %u cells\n", __func__, n_blocks, cache.block_size);
+        }
+    }
+
     return true;
 }
 
+// paged KV cache: recompute the block tables, the reference counts and the free list from the cell metadata
+// a block stays in the table of a sequence as long as at least one of its cells holds that sequence
+static void llama_kv_cache_blocks_rebuild(struct llama_kv_cache & cache) {
+    if (!cache.paged()) {
+        return;
+    }
+
+    const uint32_t n_blocks = cache.size / cache.block_size;
+
+    std::vector<std::set<llama_seq_id>> & block_seqs = cache.block_seqs;
+    for (auto & seqs : block_seqs) {
+        seqs.clear();
+    }
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        for (const llama_seq_id seq_id : cache.cells[i].seq_id) {
+            block_seqs[i / cache.block_size].insert(seq_id);
+        }
+    }
+
+    // drop the blocks that do not hold any cell of the sequence anymore
+    for (auto it = cache.block_tables.begin(); it != cache.block_tables.end(); ) {
+        const llama_seq_id seq_id = it->first;
+        auto & table = it->second;
+
+        table.erase(std::remove_if(table.begin(), table.end(), [&](uint32_t b) {
+            return block_seqs[b].count(seq_id) == 0;
+        }), table.end());
+
+        if (table.empty()) {
+            it = cache.block_tables.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // append the blocks that hold cells of a sequence but are missing from its table (e.g. after llama_kv_cache_seq_cp)
+    std::unordered_map<llama_seq_id, std::vector<bool>> in_table;
+    for (const auto & it : cache.block_tables) {
+        std::vector<bool> & present = in_table[it.first];
+        present.resize(n_blocks, false);
+        for (const uint32_t b : it.second) {
+            present[b] = true;
+        }
+    }
+
+    cache.block_free.clear();
+
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        for (const llama_seq_id seq_id : block_seqs[b]) {
+            std::vector<bool> & present = in_table[seq_id];
+            if (present.empty()) {
+                present.resize(n_blocks, false);
+            }
+            if (!present[b]) {
+                present[b] = true;
+                cache.block_tables[seq_id].push_back(b);
+            }
+        }
+    }
+
+    for (uint32_t b = n_blocks; b > 0; --b) {
+        if (block_seqs[b - 1].empty()) {
+            cache.block_free.push_back(b - 1);
+        }
+    }
+}
+
+// paged KV cache: update the block tables, the reference counts and the free list after the sequences of some cells
+// of the given blocks changed, only these blocks are visited
+static void llama_kv_cache_blocks_update(struct llama_kv_cache & cache, const std::set<uint32_t> & blocks) {
+    if (!cache.paged()) {
+        return;
+    }
+
+    for (const uint32_t b : blocks) {
+        std::set<llama_seq_id> seqs;
+        for (uint32_t i = b*cache.block_size; i < (b + 1)*cache.block_size; ++i) {
+            seqs.insert(cache.cells[i].seq_id.begin(), cache.cells[i].seq_id.end());
+        }
+
+        std::set<llama_seq_id> & seqs_old = cache.block_seqs[b];
+
+        for (const llama_seq_id seq_id : seqs_old) {
+            if (seqs.count(seq_id)) {
+                continue;
+            }
+            auto it = cache.block_tables.find(seq_id);
+            if (it == cache.block_tables.end()) {
+                continue;
+            }
+            auto & table = it->second;
+            table.erase(std::remove(table.begin(), table.end(), b), table.end());
+            if (table.empty()) {
+                cache.block_tables.erase(it);
+            }
+        }
+
+        for (const llama_seq_id seq_id : seqs) {
+            if (!seqs_old.count(seq_id)) {
+                cache.block_tables[seq_id].push_back(b);
+            }
+        }
+
+        if (seqs_old.empty() != seqs.empty()) {
+            auto it = std::lower_bound(cache.block_free.begin(), cache.block_free.end(), b, std::greater<uint32_t>());
+            if (seqs.empty()) {
+                cache.block_free.insert(it, b);
+            } else if (it != cache.block_free.end() && *it == b) {
+                cache.block_free.erase(it);
+            }
+        }
+
+        seqs_old = std::move(seqs);
+    }
+}
+
+// paged KV cache: pick a cell for a token that belongs to the given sequences
+// the tail block of the sequences is reused while it is exclusively owned by exactly these sequences,
+// otherwise a new block is taken from the free list, preferring the block right after the tail
+// returns -1 if the cache is full
+static int32_t llama_kv_cache_blocks_next_cell(
+           struct llama_kv_cache & cache,
+              const llama_seq_id * seq_ids,
+                           int32_t n_seq_id) {
+    const uint32_t bs = cache.block_size;
+
+    int32_t tail = -1;
+
+    {
+        auto it = cache.block_tables.find(seq_ids[0]);
+        if (it != cache.block_tables.end() && !it->second.empty()) {
+            tail = it->second.back();
+        }
+    }
+
+    if (tail >= 0) {
+        bool writable = cache.block_seqs[tail].size() == (size_t) n_seq_id;
+        for (int32_t j = 1; j < n_seq_id && writable; ++j) {
+            auto it = cache.block_tables.find(seq_ids[j]);
+            writable = it != cache.block_tables.end() && !it->second.empty() && it->second.back() == (uint32_t) tail;
+        }
+
+        if (writable) {
+            for (uint32_t i = tail*bs; i < (tail + 1)*bs; ++i) {
+                if (cache.cells[i].pos < 0) {
+                    return i;
+                }
+            }
+        }
+    }
+
+    if (cache.block_free.empty()) {
+        return -1;
+    }
+
+    uint32_t b = cache.block_free.back();
+
+    if (tail >= 0 && (uint32_t) tail + 1 < cache.block_seqs.size() && cache.block_seqs[tail + 1].empty()) {
+        b = tail + 1;
+    }
+
+    cache.block_free.erase(std::find(cache.block_free.begin(), cache.block_free.end(), b));
+
+    for (int32_t j = 0; j < n_seq_id; ++j) {
+        cache.block_tables[seq_ids[j]].push_back(b);
+    }
+    cache.block_seqs[b] = std::set<llama_seq_id>(seq_ids, seq_ids + n_seq_id);
+
+    return b*bs;
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // Note: On success, it's important that cache.head points
@@ -3848,6 +4454,45 @@ static bool llama_kv_cache_find_slot(
     }
     // otherwise, one cell per token.
 
+    if (cache.paged()) {
+        cache.slot_cells.resize(n_tokens);
+
+        for (uint32_t s = 0; s < n_seqs; s++) {
+            for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+                const uint32_t k = s*n_seq_tokens + i;
+
+                const int32_t cell_id = llama_kv_cache_blocks_next_cell(cache, batch.seq_id[s], batch.n_seq_id[s]);
+                if (cell_id < 0) {
+                    // release the cells taken so far
+                    std::set<uint32_t> blocks;
+                    for (uint32_t j = 0; j < k; ++j) {
+                        cache.cells[cache.slot_cells[j]].pos = -1;
+                        cache.cells[cache.slot_cells[j]].seq_id.clear();
+                        blocks.insert(cache.slot_cells[j] / cache.block_size);
+                    }
+                    cache.used -= k;
+                    cache.slot_cells.clear();
+                    llama_kv_cache_blocks_update(cache, blocks);
+                    return false;
+                }
+
+                llama_kv_cell & cell = cache.cells[cell_id];
+
+                cell.pos = batch.pos[k];
+                for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
+                    cell.seq_id.insert(batch.seq_id[s][j]);
+                }
+
+                cache.slot_cells[k] = cell_id;
+                cache.used++;
+            }
+        }
+
+        cache.head = cache.slot_cells[0];
+
+        return true;
+    }
+
     if (n_tokens > cache.size) {
         LLAMA_LOG_ERROR("%s: n_tokens=%d > cache.size=%d\n", __func__, n_tokens, cache.size);
         return false;
@@ -3921,6 +4566,10 @@ static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     cache.head = 0;
     cache.used = 0;
 
+    cache.cow_copies.clear();
+
+    llama_kv_cache_blocks_rebuild(cache);
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf, 0);
     }
@@ -3963,6 +4612,9 @@ static bool llama_kv_cache_seq_rm(
         }
     }
 
+    // blocks of the paged cache with removed cells
+    std::set<uint32_t> blocks;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
@@ -3972,6 +4624,9 @@ static bool llama_kv_cache_seq_rm(
             } else {
                 continue;
             }
+            if (cache.paged()) {
+                blocks.insert(i / cache.block_size);
+            }
             if (cache.cells[i].is_empty()) {
                 // keep count of the number of used cells
                 if (cache.cells[i].pos >= 0) cache.used--;
@@ -3986,6 +4641,8 @@ static bool llama_kv_cache_seq_rm(
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 
+    llama_kv_cache_blocks_update(cache, blocks);
+
     return true;
 }
 
@@ -4029,20 +4686,32 @@ static void llama_kv_cache_seq_cp(
 
     cache.head = 0;
 
+    std::set<uint32_t> blocks;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.cells[i].seq_id.insert(seq_id_dst);
+            if (cache.paged()) {
+                blocks.insert(i / cache.block_size);
+            }
         }
     }
+
+    llama_kv_cache_blocks_update(cache, blocks);
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
+    std::set<uint32_t> blocks;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.recurrent && (llama_seq_id) i != seq_id) {
             cache.cells[i].tail = -1;
         }
+        if (cache.paged() && cache.cells[i].seq_id.size() > (cache.cells[i].has_seq_id(seq_id) ? 1u : 0u)) {
+            blocks.insert(i / cache.block_size);
+        }
         if (!cache.cells[i].has_seq_id(seq_id)) {
             if (cache.cells[i].pos >= 0) cache.used--;
             cache.cells[i].pos = -1;
@@ -4055,8 +4724,58 @@ static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id
         }
     }
 
-    // If we freed up a slot, set head to it so searching can start there.
-    if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    llama_kv_cache_blocks_update(cache, blocks);
+}
+
+// copy-on-write: move seq_id out of the shared cell i into a private copy of the cell at position pos
+// the other sequences keep the original cell untouched, the KV data is copied by llama_kv_cache_update
+// returns false if there is no free cell for the copy
+static bool llama_kv_cache_cow_move(
+        struct llama_kv_cache & cache,
+                     uint32_t   i,
+                 llama_seq_id   seq_id,
+                    llama_pos   pos,
+                     uint32_t & next_free) {
+    if (pos < 0) {
+        // the sequence drops the cell
+        cache.cells[i].seq_id.erase(seq_id);
+        return true;
+    }
+
+    int32_t j = -1;
+
+    if (cache.paged()) {
+        j = llama_kv_cache_blocks_next_cell(cache, &seq_id, 1);
+    } else {
+        for (; next_free < cache.size; ++next_free) {
+            if (cache.cells[next_free].pos < 0 && cache.cells[next_free].is_empty()) {
+                j = next_free++;
+                break;
+            }
+        }
+    }
+
+    if (j < 0) {
+        return false;
+    }
+
+    llama_kv_cell & src = cache.cells[i];
+    llama_kv_cell & dst = cache.cells[j];
+
+    dst.pos   = pos;
+    dst.delta = src.delta + (pos - src.pos);
+    dst.seq_id.insert(seq_id);
+
+    src.seq_id.erase(seq_id);
+
+    cache.used++;
+    cache.has_shift = true;
+    cache.cow_copies.emplace_back(i, j);
+
+    return true;
 }
 
 static void llama_kv_cache_seq_add(
@@ -4086,8 +4805,19 @@ static void llama_kv_cache_seq_add(
         return;
     }
 
+    // cells shared with other sequences are copied on write
+    std::vector<uint32_t> shared;
+
+    // blocks of the paged cache with dropped cells
+    std::set<uint32_t> blocks;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            if (cache.cells[i].seq_id.size() > 1) {
+                shared.push_back(i);
+                continue;
+            }
+
             cache.has_shift = true;
             cache.cells[i].pos   += delta;
             cache.cells[i].delta += delta;
@@ -4101,13 +4831,31 @@ static void llama_kv_cache_seq_add(
                 if (new_head == cache.size) {
                     new_head = i;
                 }
+                if (cache.paged()) {
+                    blocks.insert(i / cache.block_size);
+                }
             }
         }
     }
 
+    uint32_t next_free = 0;
+
+    for (const uint32_t i : shared) {
+        if (!llama_kv_cache_cow_move(cache, i, seq_id, cache.cells[i].pos + delta, next_free)) {
+            LLAMA_LOG_WARN("%s: no free cell to copy shared cell %u - shifting it for all its sequences\n", __func__, i);
+            cache.has_shift = true;
+            cache.cells[i].pos   += delta;
+            cache.cells[i].delta += delta;
+        } else if (cache.paged()) {
+            blocks.insert(i / cache.block_size);
+        }
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     cache.head = new_head != cache.size ? new_head : 0;
+
+    llama_kv_cache_blocks_update(cache, blocks);
 }
 
 static void llama_kv_cache_seq_div(
@@ -4135,8 +4883,16 @@ static void llama_kv_cache_seq_div(
         return;
     }
 
+    // cells shared with other sequences are copied on write
+    std::vector<uint32_t> shared;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            if (cache.cells[i].seq_id.size() > 1) {
+                shared.push_back(i);
+                continue;
+            }
+
             cache.has_shift = true;
 
             {
@@ -4146,6 +4902,25 @@ static void llama_kv_cache_seq_div(
             }
         }
     }
+
+    uint32_t next_free = 0;
+
+    std::set<uint32_t> blocks;
+
+    for (const uint32_t i : shared) {
+        if (!llama_kv_cache_cow_move(cache, i, seq_id, cache.cells[i].pos / d, next_free)) {
+            LLAMA_LOG_WARN("%s: no free cell to copy shared cell %u - shifting it for all its sequences\n", __func__, i);
+            cache.has_shift = true;
+
+            llama_pos p_old = cache.cells[i].pos;
+            cache.cells[i].pos   /= d;
+            cache.cells[i].delta += cache.cells[i].pos - p_old;
+        } else if (cache.paged()) {
+            blocks.insert(i / cache.block_size);
+        }
+    }
+
+    llama_kv_cache_blocks_update(cache, blocks);
 }
 
 static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
@@ -4161,11 +4936,62 @@ static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama
 }
 
 static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
-    if (!cache.recurrent) {
+    // the paged cache does not need to be defragmented: it can use any free block
+    if (!cache.recurrent && !cache.paged()) {
         cache.do_defrag = true;
     }
 }
 
+// keep the cells of a tree batch at the given batch indices and free the others
+static void llama_kv_cache_tree_accept(
+              struct llama_kv_cache & cache,
+         const std::vector<int32_t> & cells,
+                      const int32_t * ids,
+                            int32_t   n_ids) {
+    std::vector<bool> keep(cells.size(), false);
+
+    for (int32_t i = 0; i < n_ids; ++i) {
+        if (ids[i] >= 0 && ids[i] < (int32_t) cells.size()) {
+            keep[ids[i]] = true;
+        }
+    }
+
+    uint32_t new_head = cache.size;
+
+    std::set<uint32_t> blocks;
+
+    for (size_t k = 0; k < cells.size(); ++k) {
+        llama_kv_cell & cell = cache.cells[cells[k]];
+
+        if (keep[k] || cell.pos < 0) {
+            continue;
+        }
+
+        cell.pos = -1;
+        cell.src = -1;
+        cell.seq_id.clear();
+        cache.used--;
+
+        new_head = std::min(new_head, (uint32_t) cells[k]);
+
+        if (cache.paged()) {
+            blocks.insert(cells[k] / cache.block_size);
+        }
+    }
+
+    if (new_head == cache.size) {
+        return;
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head < cache.head) cache.head = new_head;
+
+    llama_kv_cache_blocks_update(cache, blocks);
+
+    // move the kept cells into the holes left by the rejected branches
+    llama_kv_cache_defrag(cache);
+}
+
 static uint32_t llama_kv_cache_get_padding(const struct llama_cparams & cparams) {
     // the FA kernels require padding to avoid extra runtime boundary checks
     return cparams.flash_attn ? 256u : 32u;
@@ -5031,6 +5857,145 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    // tensors skipped by load_all_data: loaded later in the background (lazy loading) or mapped from the repack cache
+    std::unordered_set<const ggml_tensor *> skip;
+
+    // Reads the tensors that live in CPU memory with a pool of threads, in file order across the split files.
+    // Host tensors are read directly into their buffer in chunks, tensors in other CPU buffers (e.g. repacked weights)
+    // are read whole into a staging buffer and set from the reader thread. The other tensors are left to load_all_data.
+    // Returns false if cancelled by progress_callback
+    bool load_data_parallel(
+            const std::vector<ggml_tensor *> & tensors,
+            std::unordered_set<const ggml_tensor *> & loaded,
+            llama_progress_callback progress_callback,
+            void * progress_callback_user_data) {
+        // large enough to keep the per-read overhead low, small enough to balance the readers
+        constexpr size_t chunk_size = 16*1024*1024;
+
+        struct load_chunk {
+            ggml_tensor * tensor;
+            uint16_t idx;  // index of the file
+            size_t   offs; // offset in the file
+            size_t   offs_tensor;
+            size_t   size;
+            bool     host; // read directly into the tensor data
+        };
+
+        std::vector<load_chunk> chunks;
+        for (ggml_tensor * cur : tensors) {
+            const auto * weight = get_weight(ggml_get_name(cur));
+            if (weight == nullptr || cur->buffer == nullptr) {
+                continue;
+            }
+
+            const size_t n_size = ggml_nbytes(cur);
+
+            if (ggml_backend_buffer_is_host(cur->buffer)) {
+                for (size_t offs = 0; offs < n_size; offs += chunk_size) {
+                    chunks.push_back({ cur, weight->idx, weight->offs + offs, offs, std::min(chunk_size, n_size - offs), true });
+                }
+            } else {
+                auto * dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(cur->buffer));
+                if (dev == nullptr || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU) {
+                    continue;
+                }
+                chunks.push_back({ cur, weight->idx, weight->offs, 0, n_size, false });
+            }
+            loaded.insert(cur);
+        }
+
+        if (chunks.empty()) {
+            return true;
+        }
+
+        std::sort(chunks.begin(), chunks.end(), [](const load_chunk & a, const load_chunk & b) {
+            return a.idx != b.idx ? a.idx < b.idx : a.offs < b.offs;
+        });
+
+        // the readers are mostly waiting on the storage, more of them keep more requests in flight
+        const int n_threads = (int) std::min<size_t>(chunks.size(), std::min(8u, std::max(1u, std::thread::hardware_concurrency())));
+
+        LLAMA_LOG_DEBUG("%s: reading %zu chunks with %d threads\n", __func__, chunks.size(), n_threads);
+
+        std::atomic<size_t> next_chunk(0);
+        std::atomic<size_t> bytes_done(0);
+        std::atomic<bool>   stop(false);
+        std::mutex          mutex;
+        std::string         error;
+        std::vector<const ggml_tensor *> invalid;
+
+        // returns false if the loading has to stop
+        auto read_chunk = [&](std::vector<no_init<uint8_t>> & buf) -> bool {
+            const size_t i = next_chunk++;
+            if (stop || i >= chunks.size()) {
+                return false;
+            }
+            const auto & chunk = chunks[i];
+            try {
+                const auto & file = files.at(chunk.idx);
+                if (chunk.host) {
+                    file->read_raw_at((uint8_t *) chunk.tensor->data + chunk.offs_tensor, chunk.size, chunk.offs);
+                } else {
+                    buf.resize(chunk.size);
+                    file->read_raw_at(buf.data(), chunk.size, chunk.offs);
+                    // validate before ggml_backend_tensor_set, which may repack the data and change the type
+                    if (check_tensors && !ggml_validate_row_data(chunk.tensor->type, buf.data(), chunk.size)) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        invalid.push_back(chunk.tensor);
+                    }
+                    ggml_backend_tensor_set(chunk.tensor, buf.data(), 0, chunk.size);
+                }
+            } catch (const std::exception & e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error.empty()) {
+                    error = e.what();
+                }
+                stop = true;
+                return false;
+            }
+            bytes_done += chunk.size;
+            return true;
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(n_threads - 1);
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back([&]() {
+                std::vector<no_init<uint8_t>> buf;
+                while (read_chunk(buf)) { }
+            });
+        }
+
+        // the main thread reads too and reports the progress between its chunks
+        bool cancelled = false;
+        {
+            std::vector<no_init<uint8_t>> buf;
+            do {
+                if (progress_callback && !progress_callback((float) (size_done + bytes_done) / size_data, progress_callback_user_data)) {
+                    stop = true;
+                    cancelled = true;
+                    break;
+                }
+            } while (read_chunk(buf));
+        }
+
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+        if (!invalid.empty()) {
+            for (const auto * t : invalid) {
+                LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(t));
+            }
+            throw std::runtime_error("found tensors with invalid data");
+        }
+
+        return !cancelled;
+    }
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct ggml_context * ctx,
@@ -5132,6 +6097,29 @@ struct llama_model_loader {
                 ggml_backend_name(upload_backend));
         }
 
+        // without mmap, the tensors in CPU memory are read first by several threads
+        std::unordered_set<const ggml_tensor *> loaded;
+        std::vector<ggml_tensor *> tensors;
+        for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            if (skip.count(cur) == 0) {
+                tensors.push_back(cur);
+            }
+        }
+        if (!use_mmap && !load_data_parallel(tensors, loaded, progress_callback, progress_callback_user_data)) {
+            for (auto * event : events) {
+                ggml_backend_event_free(event);
+            }
+            for (auto * buf : host_buffers) {
+                ggml_backend_buffer_free(buf);
+            }
+            ggml_backend_free(upload_backend);
+            return false;
+        }
+        // the progress of the parallel reads continues from here
+        for (const ggml_tensor * cur : loaded) {
+            size_done += ggml_nbytes(cur);
+        }
+
         for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
             const auto * weight = get_weight(ggml_get_name(cur));
             if (weight == nullptr) {
@@ -5147,6 +6135,21 @@ struct llama_model_loader {
 
             size_t n_size = ggml_nbytes(cur);
 
+            if (skip.count(cur)) {
+                size_done += n_size;
+                continue;
+            }
+
+            if (loaded.count(cur)) {
+                // read by load_data_parallel and already counted, only the host tensors are left to validate
+                if (check_tensors && ggml_backend_buffer_is_host(cur->buffer)) {
+                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
+                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
+                    }));
+                }
+                continue;
+            }
+
             if (use_mmap) {
                 const auto & mapping = mappings.at(weight->idx);
                 ggml_backend_buffer_t buf_mmap = nullptr;
@@ -5156,8 +6159,9 @@ struct llama_model_loader {
                 uint8_t * data = (uint8_t *) mapping->addr + weight->offs;
 
                 if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
+                    // the type is read here because buffers that repack the data change it in ggml_backend_tensor_set
+                    validation_result.emplace_back(std::async(std::launch::async, [cur, type = cur->type, data, n_size] {
+                        return std::make_pair(cur, ggml_validate_row_data(type, data, n_size));
                     }));
                 }
 
@@ -5209,10 +6213,10 @@ struct llama_model_loader {
                         read_buf.resize(n_size);
                         file->seek(weight->offs, SEEK_SET);
                         file->read_raw(read_buf.data(), n_size);
-                        ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
                         if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
                             throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
                         }
+                        ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
                     }
                 }
             }
@@ -6951,6 +7955,251 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     }
 }
 
+//
+// weight cache
+//
+
+// The CPU weights are saved to a file after they are loaded, so that the next loads map them directly instead of
+// reading and transforming them again. The file is specific to the model and to the host. It is used for:
+//  - the repack cache: the weights repacked for the CPU kernels, in a file next to the model
+//  - the shared weights: all the CPU weights, in a shared memory object mapped by all the processes using the model
+//
+// layout: magic, version, key, n_tensors, then the name, type, offset and size of each tensor
+//         the data of each tensor is at its offset in the file, aligned to LLAMA_WEIGHT_CACHE_ALIGN
+
+#define LLAMA_WEIGHT_CACHE_MAGIC   0x67677263u // 'ggrc'
+#define LLAMA_WEIGHT_CACHE_VERSION 1           // bump when the layout of the repacked types changes
+#define LLAMA_WEIGHT_CACHE_ALIGN   4096
+
+static uint64_t llama_weight_cache_hash(uint64_t h, const void * data, size_t size) {
+    // FNV-1a
+    for (size_t i = 0; i < size; ++i) {
+        h ^= ((const uint8_t *) data)[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// identifies the tensors of the model and the host: the CPU features and the build options, the size and modification
+// time of the model files, the tensor infos and the first and last bytes of the data of each tensor in the model file
+// the model files are not hashed entirely, that would read them again on every load - a model file rewritten in place
+// with the same size and in the same second as the previous one is not detected
+static uint64_t llama_weight_cache_key(const llama_model_loader & ml, const std::vector<ggml_tensor *> & tensors) {
+    constexpr size_t n_sample = 4096;
+
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    const char * system_info = llama_print_system_info();
+    h = llama_weight_cache_hash(h, system_info, strlen(system_info));
+
+    for (const auto & file : ml.files) {
+        const uint64_t size  = file->size;
+        const int64_t  mtime = file->mtime();
+        h = llama_weight_cache_hash(h, &size,  sizeof(size));
+        h = llama_weight_cache_hash(h, &mtime, sizeof(mtime));
+    }
+
+    std::vector<uint8_t> sample(n_sample);
+    for (const ggml_tensor * cur : tensors) {
+        const auto & w = ml.require_weight(ggml_get_name(cur));
+        const size_t n_size = ggml_nbytes(cur);
+
+        h = llama_weight_cache_hash(h, cur->name, strlen(cur->name));
+        h = llama_weight_cache_hash(h, &cur->type, sizeof(cur->type));
+        h = llama_weight_cache_hash(h, cur->ne, sizeof(cur->ne));
+        h = llama_weight_cache_hash(h, &w.offs, sizeof(w.offs));
+
+        const size_t n = std::min(n_sample, n_size);
+        ml.files.at(w.idx)->read_raw_at(sample.data(), n, w.offs);
+        h = llama_weight_cache_hash(h, sample.data(), n);
+        ml.files.at(w.idx)->read_raw_at(sample.data(), n, w.offs + n_size - n);
+        h = llama_weight_cache_hash(h, sample.data(), n);
+    }
+
+    return h;
+}
+
+// maps the tensors from the cache file into a new CPU buffer, returns nullptr if the file is missing or does not match
+// check_owner: only map a file owned by this user that the other users cannot modify
+static ggml_backend_buffer_t llama_weight_cache_load(
+        const std::string & path,
+                 uint64_t   key,
+        const std::vector<ggml_tensor *> & tensors,
+              llama_model & model,
+                     bool   check_owner) {
+    if (!llama_mmap::SUPPORTED) {
+        return nullptr;
+    }
+
+    std::unique_ptr<llama_file> file;
+    try {
+        file.reset(new llama_file(path.c_str(), "rb"));
+    } catch (const std::exception &) {
+        return nullptr; // not written yet
+    }
+
+#ifndef _WIN32
+    if (check_owner) {
+        struct stat st;
+        if (fstat(fileno(file->fp), &st) != 0 || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+            LLAMA_LOG_WARN("%s: %s is not owned by this user or is writable by other users, not using it\n", __func__, path.c_str());
+            return nullptr;
+        }
+    }
+#else
+    GGML_UNUSED(check_owner);
+#endif
+
+    struct entry {
+        ggml_type type;
+        uint64_t  offs;
+        uint64_t  size;
+    };
+
+    try {
+        const uint32_t magic   = file->read_u32();
+        const uint32_t version = file->read_u32();
+        uint64_t key_file;
+        file->read_raw(&key_file, sizeof(key_file));
+        if (magic != LLAMA_WEIGHT_CACHE_MAGIC || version != LLAMA_WEIGHT_CACHE_VERSION || key_file != key) {
+            LLAMA_LOG_INFO("%s: %s does not match this model or host\n", __func__, path.c_str());
+            return nullptr;
+        }
+
+        const uint32_t n_tensors = file->read_u32();
+        if (n_tensors != tensors.size()) {
+            throw std::runtime_error("unexpected number of tensors");
+        }
+
+        std::unordered_map<std::string, entry> entries;
+        for (uint32_t i = 0; i < n_tensors; ++i) {
+            std::string name(file->read_u32(), '\0');
+            file->read_raw(&name[0], name.size());
+            entry e;
+            e.type = (ggml_type) file->read_u32();
+            file->read_raw(&e.offs, sizeof(e.offs));
+            file->read_raw(&e.size, sizeof(e.size));
+            entries.emplace(name, e);
+        }
+
+        uint64_t first = UINT64_MAX;
+        uint64_t last  = 0;
+        for (const ggml_tensor * cur : tensors) {
+            const auto it = entries.find(ggml_get_name(cur));
+            if (it == entries.end()) {
+                throw std::runtime_error(format("tensor '%s' is missing", ggml_get_name(cur)));
+            }
+            const entry & e = it->second;
+            if (e.type >= GGML_TYPE_COUNT || ggml_row_size(e.type, cur->ne[0]) != ggml_row_size(cur->type, cur->ne[0]) ||
+                e.size != ggml_nbytes(cur) || e.offs % LLAMA_WEIGHT_CACHE_ALIGN != 0 || e.offs + e.size > file->size) {
+                throw std::runtime_error(format("tensor '%s' does not match", ggml_get_name(cur)));
+            }
+            first = std::min(first, e.offs);
+            last  = std::max(last,  e.offs + e.size);
+        }
+
+        std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), (size_t) -1, ggml_is_numa()));
+
+        ggml_backend_buffer_t buf = ggml_backend_cpu_buffer_from_ptr((char *) mapping->addr + first, last - first);
+        if (buf == nullptr) {
+            throw std::runtime_error("unable to allocate backend CPU buffer");
+        }
+
+        for (ggml_tensor * cur : tensors) {
+            const entry & e = entries.at(ggml_get_name(cur));
+            cur->type = e.type;
+            ggml_backend_tensor_alloc(buf, cur, (char *) mapping->addr + e.offs);
+        }
+
+        model.mappings.emplace_back(std::move(mapping));
+
+        return buf;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to read %s: %s\n", __func__, path.c_str(), err.what());
+        return nullptr;
+    }
+}
+
+// writes the loaded tensors to the cache file, returns false on failure
+static bool llama_weight_cache_save(const std::string & path, uint64_t key, const std::vector<ggml_tensor *> & tensors) {
+    // write to a temporary file first, so that a partial cache is never used, unique to the process in case several
+    // processes load the same model at the same time
+#ifdef _WIN32
+    const std::string path_tmp = format("%s.tmp.%lu", path.c_str(), (unsigned long) GetCurrentProcessId());
+#else
+    const std::string path_tmp = format("%s.tmp.%ld", path.c_str(), (long) getpid());
+#endif
+
+    try {
+#ifndef _WIN32
+        {
+            // create the file exclusively, so that an existing file or link is never written through, and not writable
+            // by the other users whatever the umask - the next loads map it
+            const int fd = open(path_tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd == -1) {
+                throw std::runtime_error(format("failed to create %s: %s", path_tmp.c_str(), strerror(errno)));
+            }
+            close(fd);
+        }
+#endif
+        llama_file file(path_tmp.c_str(), "wb");
+
+        size_t offs = 4 + 4 + 8 + 4;
+        for (const ggml_tensor * cur : tensors) {
+            offs += 4 + strlen(cur->name) + 4 + 8 + 8;
+        }
+
+        file.write_u32(LLAMA_WEIGHT_CACHE_MAGIC);
+        file.write_u32(LLAMA_WEIGHT_CACHE_VERSION);
+        file.write_raw(&key, sizeof(key));
+        file.write_u32((uint32_t) tensors.size());
+
+        std::vector<uint64_t> offsets;
+        for (const ggml_tensor * cur : tensors) {
+            const uint64_t size = ggml_nbytes(cur);
+            offs = GGML_PAD(offs, LLAMA_WEIGHT_CACHE_ALIGN);
+            offsets.push_back(offs);
+
+            file.write_u32((uint32_t) strlen(cur->name));
+            file.write_raw(cur->name, strlen(cur->name));
+            file.write_u32((uint32_t) cur->type);
+            file.write_raw(&offsets.back(), sizeof(uint64_t));
+            file.write_raw(&size, sizeof(size));
+
+            offs += size;
+        }
+
+        std::vector<no_init<uint8_t>> buf;
+        const std::vector<uint8_t> zeros(LLAMA_WEIGHT_CACHE_ALIGN, 0);
+        for (size_t i = 0; i < tensors.size(); ++i) {
+            file.write_raw(zeros.data(), offsets[i] - file.tell());
+
+            buf.resize(ggml_nbytes(tensors[i]));
+            ggml_backend_tensor_get(tensors[i], buf.data(), 0, buf.size());
+            file.write_raw(buf.data(), buf.size());
+        }
+
+        // the data must be on the disk before the rename, or a crash can leave a complete name with partial data
+        file.sync();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to write %s: %s\n", __func__, path.c_str(), err.what());
+        std::remove(path_tmp.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    std::remove(path.c_str()); // rename does not replace an existing file
+#endif
+    if (std::rename(path_tmp.c_str(), path.c_str()) != 0) {
+        LLAMA_LOG_WARN("%s: failed to write %s: %s\n", __func__, path.c_str(), strerror(errno));
+        std::remove(path_tmp.c_str());
+        return false;
+    }
+
+    LLAMA_LOG_INFO("%s: saved the weights to %s\n", __func__, path.c_str());
+    return true;
+}
+
 // Returns false if cancelled by progress_callback
 static bool llm_load_tensors(
         llama_model_loader & ml,
@@ -6960,6 +8209,10 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        bool use_repack,
+        const std::string & repack_cache,
+        const std::string & shm_path,
+        bool lazy_load,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     auto & hparams = model.hparams;
@@ -6983,11 +8236,29 @@ static bool llm_load_tensors(
     model.buft_input = llama_default_buffer_type_cpu(model, true);
     //model.buft_input = llama_default_buffer_type_offload(main_gpu);
 
+    // matrices of CPU layers are repacked into the interleaved layout of the CPU kernels when loaded
+    // this is skipped when a GPU host buffer type is used, so that these weights can still be offloaded for large batches
+    // the repacked weights are copied to anonymous memory, so with mmap they are only repacked when they can be mapped
+    // from the repack cache or the shared weights - otherwise the model would be loaded twice in the page cache and memory
+    llama_model::layer_buft buft_cpu = llama_default_buffer_type_cpu(model, true);
+    if (use_repack && ml.use_mmap && repack_cache.empty() && shm_path.empty()) {
+        LLAMA_LOG_INFO("%s: the weights are mapped without a repack cache, not repacking them\n", __func__);
+        use_repack = false;
+    }
+    if (use_repack && buft_cpu.buft == llama_buffer_type_cpu(model)) {
+        for (const auto & w : ml.weights) {
+            if (ggml_backend_cpu_repack_supported(w.tensor)) {
+                buft_cpu.buft_matrix = llama_buffer_type_cpu_repack(model);
+                break;
+            }
+        }
+    }
+
     model.buft_layer.resize(n_layer);
 
     // assign cpu layers
     for (int i = 0; i < i_gpu_start; ++i) {
-        model.buft_layer[i] = llama_default_buffer_type_cpu(model, true);
+        model.buft_layer[i] = buft_cpu;
     }
 
     if (split_mode == LLAMA_SPLIT_MODE_LAYER) {
@@ -7025,7 +8296,7 @@ static bool llm_load_tensors(
             int layer_gpu = std::upper_bound(splits.begin(), splits.begin() + device_count, float(act_gpu_layers - 1)/act_gpu_layers) - splits.begin();
             model.buft_output = llama_default_buffer_type_offload(model, layer_gpu);
         } else {
-            model.buft_output = llama_default_buffer_type_cpu(model, true);
+            model.buft_output = buft_cpu;
         }
     } else {
         ggml_backend_buffer_type_t split_buft;
@@ -7049,7 +8320,7 @@ static bool llm_load_tensors(
                 llama_default_buffer_type_offload(model, main_gpu)
             };
         } else {
-            model.buft_output = llama_default_buffer_type_cpu(model, true);
+            model.buft_output = buft_cpu;
         }
     }
 
@@ -8903,6 +10174,54 @@ static bool llm_load_tensors(
     ml.init_mappings(true, use_mlock ? &model.mlock_mmaps : nullptr);
     model.mappings.reserve(ml.mappings.size());
 
+    if (model.use_huge_pages) {
+        for (const auto & mapping : ml.mappings) {
+            mapping->advise_huge_pages();
+        }
+    }
+
+    // the repacked weights are mapped from the repack cache if it matches, or saved to it after loading
+    std::vector<ggml_tensor *> repack_tensors;
+    uint64_t repack_key = 0;
+    ggml_backend_buffer_t buf_repack_cache = nullptr;
+
+    // the CPU weights are mapped from the shared weights if they match, or moved to them after loading
+    std::vector<ggml_tensor *> shm_tensors;
+    uint64_t shm_key = 0;
+    ggml_backend_buffer_t buf_shm = nullptr;
+    if (!shm_path.empty()) {
+        for (ggml_backend_buffer_type_t buft : { llama_buffer_type_cpu(model), llama_buffer_type_cpu_repack(model) }) {
+            if (!ctx_map.count(buft)) {
+                continue;
+            }
+            ggml_context * ctx = ctx_map.at(buft);
+            for (auto * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+                shm_tensors.push_back(cur);
+            }
+        }
+        if (!shm_tensors.empty()) {
+            shm_key = llama_weight_cache_key(ml, shm_tensors);
+            buf_shm = llama_weight_cache_load(shm_path, shm_key, shm_tensors, model, true);
+            if (buf_shm) {
+                LLAMA_LOG_INFO("%s: mapped the weights from %s\n", __func__, shm_path.c_str());
+                ml.skip.insert(shm_tensors.begin(), shm_tensors.end());
+            }
+        }
+    }
+
+    if (!buf_shm && !repack_cache.empty() && ctx_map.count(llama_buffer_type_cpu_repack(model))) {
+        ggml_context * ctx = ctx_map.at(llama_buffer_type_cpu_repack(model));
+        for (auto * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            repack_tensors.push_back(cur);
+        }
+        repack_key = llama_weight_cache_key(ml, repack_tensors);
+        buf_repack_cache = llama_weight_cache_load(repack_cache, repack_key, repack_tensors, model, false);
+        if (buf_repack_cache) {
+            LLAMA_LOG_INFO("%s: mapped the repacked weights from %s\n", __func__, repack_cache.c_str());
+            ml.skip.insert(repack_tensors.begin(), repack_tensors.end());
+        }
+    }
+
     // create the backend buffers
     std::vector<std::pair<ggml_context *, llama_buf_map>> ctx_bufs;
     ctx_bufs.reserve(ctx_map.size());
@@ -8918,10 +10237,19 @@ static bool llm_load_tensors(
         llama_buf_map bufs;
         bufs.reserve(n_max_backend_buffer);
 
+        if (buf_shm && (buft == llama_buffer_type_cpu(model) || buft == llama_buffer_type_cpu_repack(model))) {
+            // a single buffer for the CPU and the repacked weights
+            if (std::find(model.bufs.begin(), model.bufs.end(), buf_shm) == model.bufs.end()) {
+                model.bufs.push_back(buf_shm);
+            }
+            for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
+                bufs.emplace(idx, buf_shm);
+            }
+        }
         // only the mmap region containing the tensors in the model is mapped to the backend buffer
         // this is important for metal with apple silicon: if the entire model could be mapped to a metal buffer, then we could just use metal for all layers
         // this allows using partial offloading when the model size exceeds the metal buffer size, but not the RAM size
-        if (ml.use_mmap && use_mmap_buffer && buft == llama_default_buffer_type_cpu(model, true)) {
+        else if (ml.use_mmap && use_mmap_buffer && buft == llama_default_buffer_type_cpu(model, true)) {
             for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
                 void * addr = nullptr;
                 size_t first, last;
@@ -8956,6 +10284,12 @@ static bool llm_load_tensors(
             }
         }
 #endif
+        else if (buf_repack_cache && buft == llama_buffer_type_cpu_repack(model)) {
+            model.bufs.push_back(buf_repack_cache);
+            for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
+                bufs.emplace(idx, buf_repack_cache);
+            }
+        }
         else {
             ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
             if (buf == nullptr) {
@@ -9012,6 +10346,34 @@ static bool llm_load_tensors(
         }
     }
 
+    // the tensors in CPU memory of all the layers but the first are loaded in the background by llama_model_load_lazy
+    if (lazy_load && ml.use_mmap) {
+        LLAMA_LOG_WARN("%s: lazy loading is only used without mmap\n", __func__);
+    } else if (lazy_load && !shm_path.empty()) {
+        LLAMA_LOG_WARN("%s: lazy loading is not used with shared weights\n", __func__);
+    } else if (lazy_load && n_layer > 1) {
+        for (const auto & it : model.tensors_by_name) {
+            ggml_tensor * cur = it.second;
+            int il = -1;
+            if (cur->buffer == nullptr || sscanf(ggml_get_name(cur), "blk.%d.", &il) != 1 || il < 1 || il >= n_layer) {
+                continue;
+            }
+            // mapped from the repack cache, or needed to write it
+            if (ml.skip.count(cur) || (!repack_cache.empty() && ggml_backend_buft_is_cpu_repack(ggml_backend_buffer_get_type(cur->buffer)))) {
+                continue;
+            }
+            auto * dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(cur->buffer));
+            if (!ggml_backend_buffer_is_host(cur->buffer) && (dev == nullptr || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU)) {
+                continue;
+            }
+            ml.skip.insert(cur);
+            model.lazy_layer.emplace(cur, il);
+        }
+        if (!model.lazy_layer.empty()) {
+            model.lazy_n_layer_ready = 1;
+        }
+    }
+
     // load tensor data
     for (auto & it : ctx_bufs) {
         ggml_context * ctx = it.first;
@@ -9021,21 +10383,148 @@ static bool llm_load_tensors(
         }
     }
 
+    if (!repack_tensors.empty() && !buf_repack_cache) {
+        llama_weight_cache_save(repack_cache, repack_key, repack_tensors);
+    }
+
+    // first process using the shared weights: write them and map them in place of the private buffers
+    if (!shm_tensors.empty() && !buf_shm && llama_weight_cache_save(shm_path, shm_key, shm_tensors)) {
+        std::vector<std::pair<ggml_backend_buffer_t, void *>> old;
+        for (ggml_tensor * cur : shm_tensors) {
+            old.emplace_back(cur->buffer, cur->data);
+            cur->buffer = nullptr;
+            cur->data   = nullptr;
+        }
+        buf_shm = llama_weight_cache_load(shm_path, shm_key, shm_tensors, model, true);
+        if (buf_shm == nullptr) {
+            for (size_t i = 0; i < shm_tensors.size(); ++i) {
+                shm_tensors[i]->buffer = old[i].first;
+                shm_tensors[i]->data   = old[i].second;
+            }
+        } else {
+            std::set<ggml_backend_buffer_t> bufs_old;
+            for (const auto & it : old) {
+                bufs_old.insert(it.first);
+            }
+            for (ggml_backend_buffer_t buf : bufs_old) {
+                const void * base = ggml_backend_buffer_get_base(buf);
+                model.mlock_bufs.erase(std::remove_if(model.mlock_bufs.begin(), model.mlock_bufs.end(),
+                        [base](const std::unique_ptr<llama_mlock> & mlock) { return mlock->addr == base; }), model.mlock_bufs.end());
+                model.bufs.erase(std::find(model.bufs.begin(), model.bufs.end(), buf));
+                ggml_backend_buffer_free(buf);
+            }
+            ggml_backend_buffer_set_usage(buf_shm, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+            model.bufs.push_back(buf_shm);
+            LLAMA_LOG_INFO("%s: mapped the weights from %s in place of the loaded buffers\n", __func__, shm_path.c_str());
+        }
+    }
+
+    if (model.use_huge_pages) {
+        for (ggml_backend_buffer_t buf : model.bufs) {
+            if (!ggml_backend_buffer_is_host(buf) && !ggml_backend_buft_is_cpu_repack(ggml_backend_buffer_get_type(buf))) {
+                continue;
+            }
+            const size_t size = ggml_backend_buffer_get_size(buf);
+            LLAMA_LOG_INFO("%s: %10s buffer in huge pages = %8.2f MiB of %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf),
+                    llama_huge_page_bytes(ggml_backend_buffer_get_base(buf), size) / 1024.0 / 1024.0, size / 1024.0 / 1024.0);
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             model.mappings.emplace_back(std::move(mapping));
         }
     }
 
+    // split the matrices in CPU memory across the NUMA nodes, matching the rows computed by the threads of each node
+    if (ggml_is_numa()) {
+        for (const auto & it : model.tensors_by_name) {
+            const ggml_tensor * cur = it.second;
+            if (model.lazy_layer.count(cur)) {
+                continue;
+            }
+            if (cur->buffer && (ggml_backend_buffer_is_host(cur->buffer) || ggml_backend_buft_is_cpu_repack(ggml_backend_buffer_get_type(cur->buffer)))) {
+                ggml_numa_distribute_tensor(cur);
+            }
+        }
+    }
+
     return true;
 }
 
+static bool llama_model_lazy_progress(float progress, void * user_data) {
+    return !((const llama_model *) user_data)->lazy_abort;
+
+    GGML_UNUSED(progress);
+}
+
+// load the tensors of model.lazy_layer in a background thread, one layer after the other
+static void llama_model_load_lazy(llama_model & model, std::unique_ptr<llama_model_loader> && ml_ptr) {
+    const int32_t n_layer = model.hparams.n_layer;
+
+    std::vector<std::vector<ggml_tensor *>> layers(n_layer);
+    for (const auto & it : model.tensors_by_name) {
+        const auto lazy = model.lazy_layer.find(it.second);
+        if (lazy != model.lazy_layer.end()) {
+            layers[lazy->second].push_back(it.second);
+        }
+    }
+
+    LLAMA_LOG_INFO("%s: loading layers %d to %d in the background\n", __func__, (int) model.lazy_n_layer_ready, n_layer - 1);
+
+    llama_model_loader * ml = ml_ptr.release();
+
+    const char * func = __func__;
+
+    model.lazy_thread = std::thread([&model, ml, layers, n_layer, func]() {
+        const int64_t t_start_us = ggml_time_us();
+        try {
+            for (int32_t il = model.lazy_n_layer_ready; il < n_layer; ++il) {
+                std::unordered_set<const ggml_tensor *> loaded;
+                if (!ml->load_data_parallel(layers[il], loaded, llama_model_lazy_progress, &model)) {
+                    break;
+                }
+                for (const ggml_tensor * cur : layers[il]) {
+                    if (loaded.count(cur) == 0) {
+                        continue;
+                    }
+                    // the tensors in other CPU buffers are validated by load_data_parallel
+                    if (ml->check_tensors && ggml_backend_buffer_is_host(cur->buffer) &&
+                        !ggml_validate_row_data(cur->type, cur->data, ggml_nbytes(cur))) {
+                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+                    }
+                    if (ggml_is_numa()) {
+                        ggml_numa_distribute_tensor(cur);
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(model.lazy_mutex);
+                    model.lazy_n_layer_ready = il + 1;
+                }
+                model.lazy_cv.notify_all();
+            }
+            if (model.lazy_n_layer_ready == n_layer) {
+                LLAMA_LOG_INFO("%s: loaded the layers in the background in %.2f ms\n", func, (ggml_time_us() - t_start_us) / 1000.0);
+            }
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: error loading model: %s\n", func, err.what());
+            {
+                std::lock_guard<std::mutex> lock(model.lazy_mutex);
+                model.lazy_failed = true;
+            }
+            model.lazy_cv.notify_all();
+        }
+        delete ml;
+    });
+}
+
 // Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
 static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params) {
     model.t_start_us = ggml_time_us();
 
     try {
-        llama_model_loader ml(fname, params.use_mmap, params.check_tensors, params.kv_overrides);
+        std::unique_ptr<llama_model_loader> ml_ptr(new llama_model_loader(fname, params.use_mmap, params.check_tensors, params.kv_overrides));
+        llama_model_loader & ml = *ml_ptr;
 
         model.hparams.vocab_only = params.vocab_only;
 
@@ -9084,12 +10573,30 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
         }
 #endif
 
+        // the shared memory objects are files in /dev/shm, they are mapped like any other file
+        std::string shm_path;
+        if (params.shm_name != nullptr && params.shm_name[0] != '\0') {
+#ifdef __linux__
+            if (strchr(params.shm_name, '/') != nullptr) {
+                throw std::runtime_error(format("invalid shared memory name '%s'", params.shm_name));
+            }
+            shm_path = std::string("/dev/shm/") + params.shm_name;
+#else
+            LLAMA_LOG_WARN("%s: shared weights are not supported on this system\n", __func__);
+#endif
+        }
+
         if (!llm_load_tensors(
-            ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
+            ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock, params.use_repack,
+            params.use_repack && params.use_repack_cache ? fname + ".repack" : std::string(), shm_path, params.lazy_load,
             params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
         }
+
+        if (!model.lazy_layer.empty()) {
+            llama_model_load_lazy(model, std::move(ml_ptr));
+        }
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading model: %s\n", __func__, err.what());
         return -1;
@@ -9159,6 +10666,81 @@ static struct ggml_tensor * llm_build_inp_embd(
     return inpL;
 }
 
+// paged KV cache: copy row i of b into row kv.slot_cells[i] of dst
+static void llm_kv_store_rows(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata) {
+    const llama_kv_cache & kv = *(const llama_kv_cache *) userdata;
+
+    const int64_t n_tokens = b->ne[1];
+
+    GGML_ASSERT((int64_t) kv.slot_cells.size() == n_tokens);
+    GGML_ASSERT(b->ne[0] == dst->ne[0]);
+    GGML_ASSERT(b->type == dst->type || b->type == GGML_TYPE_F32);
+
+    const ggml_from_float_t from_float = ggml_internal_get_type_traits(dst->type).from_float;
+    const size_t row_size = ggml_row_size(dst->type, dst->ne[0]);
+
+    for (int64_t i = ith; i < n_tokens; i += nth) {
+        const char * src_row = (const char *) b->data + i*b->nb[1];
+              char * dst_row = (char *) dst->data + kv.slot_cells[i]*dst->nb[1];
+
+        if (b->type == dst->type) {
+            memcpy(dst_row, src_row, row_size);
+        } else {
+            GGML_ASSERT(from_float != nullptr);
+            from_float((const float *) src_row, dst_row, dst->ne[0]);
+        }
+    }
+
+    GGML_UNUSED(a);
+}
+
+// paged KV cache: copy row i of b into column kv.slot_cells[i] of the transposed V cache dst
+static void llm_kv_store_cols(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata) {
+    const llama_kv_cache & kv = *(const llama_kv_cache *) userdata;
+
+    const int64_t n_embd   = b->ne[0];
+    const int64_t n_tokens = b->ne[1];
+
+    GGML_ASSERT((int64_t) kv.slot_cells.size() == n_tokens);
+    GGML_ASSERT(n_embd == dst->ne[1]);
+    GGML_ASSERT(b->type == GGML_TYPE_F32);
+    GGML_ASSERT(dst->type == GGML_TYPE_F16 || dst->type == GGML_TYPE_F32);
+
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        const float * src_row = (const float *) ((const char *) b->data + i*b->nb[1]);
+        char * dst_col = (char *) dst->data + kv.slot_cells[i]*dst->nb[0];
+
+        for (int64_t j = ith; j < n_embd; j += nth) {
+            if (dst->type == GGML_TYPE_F16) {
+                *(ggml_fp16_t *) (dst_col + j*dst->nb[1]) = ggml_fp32_to_fp16(src_row[j]);
+            } else {
+                *(float *) (dst_col + j*dst->nb[1]) = src_row[j];
+            }
+        }
+    }
+
+    GGML_UNUSED(a);
+}
+
+// rotate the heads of Q or K with the Hadamard matrix of the KV cache, if any - the KQ products are unchanged
+static struct ggml_tensor * llm_build_k_rot(
+        struct ggml_context * ctx,
+       const llama_kv_cache & kv,
+         struct ggml_tensor * cur) {
+    if (kv.k_rot == nullptr) {
+        return cur;
+    }
+
+    const int64_t n_embd_head = kv.k_rot->ne[0];
+
+    struct ggml_tensor * res = ggml_is_contiguous(cur) ? cur : ggml_cont(ctx, cur);
+
+    res = ggml_reshape_2d(ctx, res, n_embd_head, ggml_nelements(res)/n_embd_head);
+    res = ggml_mul_mat(ctx, kv.k_rot, res);
+
+    return ggml_reshape(ctx, res, cur);
+}
+
 static void llm_build_kv_store(
         struct ggml_context * ctx,
         const llama_hparams & hparams,
@@ -9178,6 +10760,46 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
+    if (kv.paged()) {
+        // the cells of the new tokens are not contiguous - scatter the rows
+        void * kv_ptr = const_cast<llama_kv_cache *>(&kv);
+
+        struct ggml_tensor * k_cache = ggml_view_2d(ctx, kv.k_l[il], n_embd_k_gqa, n_ctx, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa), 0);
+        cb(k_cache, "k_cache_view", il);
+
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+        k_cur = ggml_reshape_2d(ctx, k_cur, n_embd_k_gqa, n_tokens);
+
+        ggml_build_forward_expand(graph, ggml_map_custom2_inplace(ctx, k_cache, k_cur, llm_kv_store_rows, GGML_N_TASKS_MAX, kv_ptr));
+
+        assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
+
+        if (!ggml_is_contiguous(v_cur)) {
+            v_cur = ggml_cont(ctx, v_cur);
+        }
+
+        struct ggml_tensor * v_cache = nullptr;
+
+        if (cparams.flash_attn) {
+            v_cache = ggml_view_2d(ctx, kv.v_l[il], n_embd_v_gqa, n_ctx, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa), 0);
+            cb(v_cache, "v_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_map_custom2_inplace(ctx, v_cache, v_cur, llm_kv_store_rows, GGML_N_TASKS_MAX, kv_ptr));
+        } else {
+            // note: the V cache is transposed when not using flash attention
+            v_cache = ggml_view_2d(ctx, kv.v_l[il], n_ctx, n_embd_v_gqa, n_ctx*ggml_element_size(kv.v_l[il]), 0);
+            cb(v_cache, "v_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_map_custom2_inplace(ctx, v_cache, v_cur, llm_kv_store_cols, GGML_N_TASKS_MAX, kv_ptr));
+        }
+
+        GGML_UNUSED(kv_head);
+
+        return;
+    }
+
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
     cb(k_cache_view, "k_cache_view", il);
 
@@ -9204,6 +10826,59 @@ static void llm_build_kv_store(
 }
 
 // do mat_mul, while optionally apply lora
+// the adapters of the sequences of the tokens (rows of cur), from the stack of the context
+// the tokens are grouped by adapter inside mul_mat_id, so each adapter is applied with one matmul over its tokens
+static struct ggml_tensor * llm_build_lora_seq_mm(
+        struct llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * w,
+          struct ggml_tensor * cur) {
+    const auto it = lctx.lora_stack.weights.find(w->name);
+    if (it == lctx.lora_stack.weights.end()) {
+        return nullptr;
+    }
+
+    // the output layer only sees the rows of the outputs
+    const int64_t n_rows = ggml_nrows(cur);
+    const bool    is_out = n_rows != lctx.n_lora_seq_tokens;
+    if (is_out && n_rows != lctx.n_outputs) {
+        return nullptr;
+    }
+
+    struct ggml_tensor *& ids    = is_out ? lctx.inp_lora_ids_out    : lctx.inp_lora_ids;
+    struct ggml_tensor *& scales = is_out ? lctx.inp_lora_scales_out : lctx.inp_lora_scales;
+
+    if (ids == nullptr) {
+        ids = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, lctx.n_lora_seq, n_rows);
+        ggml_set_name(ids, is_out ? "inp_lora_ids_out" : "inp_lora_ids");
+        ggml_set_input(ids);
+
+        scales = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 1, lctx.n_lora_seq, n_rows);
+        ggml_set_name(scales, is_out ? "inp_lora_scales_out" : "inp_lora_scales");
+        ggml_set_input(scales);
+    }
+
+    if (!ggml_is_contiguous(cur)) {
+        cur = ggml_cont(ctx0, cur);
+    }
+    cur = ggml_reshape_3d(ctx0, cur, cur->ne[0], 1, n_rows);
+
+    // {n_in, 1, n_rows} => {rank, n_lora_seq, n_rows} => {n_out, n_lora_seq, n_rows}
+    struct ggml_tensor * ab_cur = ggml_mul_mat_id(
+        ctx0, it->second.b,
+        ggml_mul_mat_id(ctx0, it->second.a, cur, ids),
+        ids
+    );
+    ab_cur = ggml_mul(ctx0, ab_cur, scales);
+
+    if (lctx.n_lora_seq > 1) {
+        // sum the adapters of each token => {1, n_out, n_rows}
+        ab_cur = ggml_sum_rows(ctx0, ggml_cont(ctx0, ggml_permute(ctx0, ab_cur, 1, 0, 2, 3)));
+    }
+
+    return ab_cur;
+}
+
 static struct ggml_tensor * llm_build_lora_mm(
         struct llama_context & lctx,
          struct ggml_context * ctx0,
@@ -9225,6 +10900,12 @@ static struct ggml_tensor * llm_build_lora_mm(
         ab_cur = ggml_scale(ctx0, ab_cur, scale);
         res = ggml_add(ctx0, res, ab_cur);
     }
+    if (lctx.n_lora_seq > 0) {
+        struct ggml_tensor * ab_cur = llm_build_lora_seq_mm(lctx, ctx0, w, cur);
+        if (ab_cur != nullptr) {
+            res = ggml_add(ctx0, res, ggml_reshape(ctx0, ab_cur, res));
+        }
+    }
     return res;
 }
 
@@ -9666,6 +11347,9 @@ static struct ggml_tensor * llm_build_kv(
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
+    q_cur = llm_build_k_rot(ctx, kv, q_cur);
+    k_cur = llm_build_k_rot(ctx, kv, k_cur);
+
     // these nodes are added to the graph together so that they are not reordered
     // by doing so, the number of splits in the graph is reduced
     ggml_build_forward_expand(graph, q_cur);
@@ -10133,6 +11817,25 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.inp_lora_ids        = nullptr;
+        lctx.inp_lora_scales     = nullptr;
+        lctx.inp_lora_ids_out    = nullptr;
+        lctx.inp_lora_scales_out = nullptr;
+
+        // the per-sequence adapters are only built into the graph when a token of the ubatch uses one
+        lctx.n_lora_seq        = 0;
+        lctx.n_lora_seq_tokens = 0;
+        if (!lctx.lora_adapters_seq.empty() && batch.seq_id) {
+            for (uint32_t s = 0; s < batch.n_seqs; ++s) {
+                const auto it = lctx.lora_adapters_seq.find(batch.seq_id[s][0]);
+                if (it != lctx.lora_adapters_seq.end()) {
+                    lctx.n_lora_seq = std::max(lctx.n_lora_seq, (int32_t) it->second.size());
+                }
+            }
+            if (lctx.n_lora_seq > 0) {
+                lctx.n_lora_seq_tokens = n_tokens;
+            }
+        }
     }
 
     void free() {
@@ -10174,10 +11877,13 @@ struct llm_build_context {
                         break;
                     }
                 }
+                // the rotation of the heads is its own inverse
+                tmp = llm_build_k_rot(ctx0, kv_self, tmp);
                 tmp = ggml_rope_ext_inplace(ctx0, tmp,
                         lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(tmp, "K_shifted_f32", il);
+                tmp = llm_build_k_rot(ctx0, kv_self, tmp);
                 tmp = ggml_cpy(ctx0, tmp, k);
             } else {
                 // we rotate only the first n_rot dimensions
@@ -10193,7 +11899,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        std::vector<std::pair<uint32_t, uint32_t>> moves;
 
         for (uint32_t i = 0; i < ids.size(); ++i) {
             const uint32_t id = ids[i];
@@ -10202,9 +11908,24 @@ struct llm_build_context {
                 continue;
             }
 
+            moves.emplace_back(i, id);
+        }
+
+        return build_kv_copy(moves);
+    }
+
+    // copy the KV data of the cells copies[i].first into the cells copies[i].second
+    // consecutive copies of consecutive cells are merged into a single ggml_cpy
+    struct ggml_cgraph * build_kv_copy(const std::vector<std::pair<uint32_t, uint32_t>> & copies) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+
+        for (size_t c = 0; c < copies.size(); ++c) {
+            const uint32_t i  = copies[c].first;
+            const uint32_t id = copies[c].second;
+
             uint32_t nm = 1;
 
-            while (i + nm < ids.size() && ids[i + nm] == id + nm) {
+            while (c + nm < copies.size() && copies[c + nm].first == i + nm && copies[c + nm].second == id + nm) {
                 nm++;
             }
 
@@ -10252,7 +11973,7 @@ struct llm_build_context {
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
             }
 
-            i += nm - 1;
+            c += nm - 1;
         }
 
         //LLAMA_LOG_INFO("gf->n_nodes = %d\n", gf->n_nodes);
@@ -10404,6 +12125,38 @@ struct llm_build_context {
         return gf;
     }
 
+    // selects the top-k candidates of each output, so that only their ids and logits are copied from the backend
+    struct ggml_cgraph * append_top_k(struct ggml_cgraph * gf) {
+        struct ggml_tensor * logits = ggml_graph_node(gf, -1);
+        GGML_ASSERT(strcmp(logits->name, "result_output") == 0 && "missing result_output tensor");
+
+        const int32_t top_k = cparams.top_k;
+
+        struct ggml_tensor * ids;
+        if (top_k == 1) {
+            // greedy - argmax is available on more backends
+            ids = ggml_reshape_2d(ctx0, ggml_argmax(ctx0, logits), 1, logits->ne[1]);
+        } else {
+            ids = ggml_argsort_top_k(ctx0, logits, top_k);
+        }
+        cb(ids, "result_top_k_ids", -1);
+
+        struct ggml_tensor * cur = ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, logits, 1, logits->ne[0], logits->ne[1]), ids);
+        if (cparams.top_k_temp > 0.0f && cparams.top_k_temp != 1.0f) {
+            cur = ggml_scale(ctx0, cur, 1.0f/cparams.top_k_temp);
+        }
+        cb(cur, "result_top_k_logits", -1);
+
+        // the ids are read after the graph is computed, their memory must not be reused by the later nodes
+        ggml_set_output(ids);
+        ggml_set_output(cur);
+
+        ggml_build_forward_expand(gf, ids);
+        ggml_build_forward_expand(gf, cur);
+
+        return gf;
+    }
+
     struct ggml_tensor * llm_build_pos_bucket(bool causal) {
         if (causal) {
             lctx.inp_pos_bucket = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, n_kv,     n_tokens);
@@ -15326,6 +17079,9 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
+                Qcur = llm_build_k_rot(ctx0, kv_self, Qcur);
+                Kcur = llm_build_k_rot(ctx0, kv_self, Kcur);
+
                 llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, cb, il);
 
                 struct ggml_tensor * k =
@@ -16248,6 +18004,23 @@ static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const
     return result;
 }
 
+static struct ggml_cgraph * llama_build_graph_kv_copy(llama_context & lctx, const std::vector<std::pair<uint32_t, uint32_t>> & copies) {
+    llama_ubatch dummy = {};
+    dummy.equal_seqs = true;
+
+    llm_build_cb cb = [&](struct ggml_tensor * , const char * , int ) { };
+
+    struct llm_build_context llm(lctx, dummy, cb, false);
+
+    llm.init();
+
+    struct ggml_cgraph * result = llm.build_kv_copy(copies);
+
+    llm.free();
+
+    return result;
+}
+
 static struct ggml_cgraph * llama_build_graph_k_shift(llama_context & lctx) {
     llama_ubatch dummy = {};
     dummy.equal_seqs = true;
@@ -16500,6 +18273,8 @@ static struct ggml_cgraph * llama_build_graph(
     // add on pooling layer
     if (lctx.cparams.embeddings) {
         result = llm.append_pooling(result);
+    } else if (lctx.cparams.top_k > 0) {
+        result = llm.append_top_k(result);
     }
 
     llm.free();
@@ -16693,6 +18468,30 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
                     }
                 }
             }
+
+            // tree attention: the tokens of the batch only see their ancestors among the other tokens of the batch
+            if (!lctx.tree_cells.empty()) {
+                std::vector<bool> is_ancestor(n_tokens);
+
+                for (int j = 0; j < n_tokens; ++j) {
+                    std::fill(is_ancestor.begin(), is_ancestor.end(), false);
+                    for (int32_t k = j; k >= 0; k = lctx.tree_parent[k]) {
+                        is_ancestor[k] = true;
+                    }
+
+                    for (int k = 0; k < n_tokens; ++k) {
+                        if (is_ancestor[k]) {
+                            continue;
+                        }
+                        if (data) {
+                            data[j*n_kv + lctx.tree_cells[k]] = -INFINITY;
+                        }
+                        if (data_swa) {
+                            data_swa[j*n_kv + lctx.tree_cells[k]] = -INFINITY;
+                        }
+                    }
+                }
+            }
         } else {
             const int64_t n_tokens     = batch.n_tokens;
             const int64_t n_seq_tokens = batch.n_seq_tokens;
@@ -16955,6 +18754,63 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
             }
         }
     }
+
+    if (lctx.inp_lora_ids || lctx.inp_lora_ids_out) {
+        const int64_t n_tokens   = batch.n_tokens;
+        const int64_t n_lora_seq = lctx.n_lora_seq;
+
+        const auto & slots = lctx.lora_stack.slots;
+
+        // stack slot and scale of the adapters of each token
+        // the unused entries have a zero scale and other slots, mul_mat_id expects distinct slots per token
+        std::vector<int32_t> ids   (n_lora_seq*n_tokens);
+        std::vector<float>   scales(n_lora_seq*n_tokens, 0.0f);
+
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            int32_t * ids_i = ids.data() + i*n_lora_seq;
+
+            int64_t n_used = 0;
+
+            const auto it = lctx.lora_adapters_seq.find(batch.seq_id[i / batch.n_seq_tokens][0]);
+            if (it != lctx.lora_adapters_seq.end()) {
+                for (const auto & lora : it->second) {
+                    const auto slot = std::find(slots.begin(), slots.end(), lora.first->id);
+                    GGML_ASSERT(slot != slots.end());
+
+                    ids_i[n_used] = slot - slots.begin();
+                    scales[i*n_lora_seq + n_used] = lora.second;
+                    n_used++;
+                }
+            }
+
+            for (int32_t slot = 0; n_used < n_lora_seq; ++slot) {
+                if (std::find(ids_i, ids_i + n_used, slot) == ids_i + n_used) {
+                    ids_i[n_used++] = slot;
+                }
+            }
+        }
+
+        if (lctx.inp_lora_ids) {
+            ggml_backend_tensor_set(lctx.inp_lora_ids,    ids.data(),    0, ggml_nbytes(lctx.inp_lora_ids));
+            ggml_backend_tensor_set(lctx.inp_lora_scales, scales.data(), 0, ggml_nbytes(lctx.inp_lora_scales));
+        }
+
+        if (lctx.inp_lora_ids_out) {
+            // keep the rows of the outputs, in the order of inp_out_ids
+            int64_t n_outputs = 0;
+            for (int64_t i = 0; i < n_tokens; ++i) {
+                if (lctx.n_outputs == n_tokens || batch.output[i]) {
+                    std::copy_n(ids.begin()    + i*n_lora_seq, n_lora_seq, ids.begin()    + n_outputs*n_lora_seq);
+                    std::copy_n(scales.begin() + i*n_lora_seq, n_lora_seq, scales.begin() + n_outputs*n_lora_seq);
+                    n_outputs++;
+                }
+            }
+            GGML_ASSERT(n_outputs == lctx.n_outputs);
+
+            ggml_backend_tensor_set(lctx.inp_lora_ids_out,    ids.data(),    0, ggml_nbytes(lctx.inp_lora_ids_out));
+            ggml_backend_tensor_set(lctx.inp_lora_scales_out, scales.data(), 0, ggml_nbytes(lctx.inp_lora_scales_out));
+        }
+    }
 }
 
 // Make sure enough space is available for outputs.
@@ -16970,11 +18826,15 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     const auto n_embd  = hparams.n_embd;
 
     // TODO: use a per-batch flag for logits presence instead
-    const bool has_logits = !cparams.embeddings;
+    const bool has_top_k  = !cparams.embeddings && cparams.top_k > 0;
+    const bool has_logits = !cparams.embeddings && !has_top_k;
     const bool has_embd   =  cparams.embeddings && (cparams.pooling_type == LLAMA_POOLING_TYPE_NONE);
 
     const size_t logits_size = has_logits ? n_vocab*n_outputs_max : 0;
     const size_t embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
+    const size_t top_k_size  = has_top_k  ? cparams.top_k*n_outputs_max : 0;
+
+    static_assert(sizeof(llama_token) == sizeof(float), "the top-k ids are stored in the float output buffer");
 
     if (lctx.output_ids.empty()) {
         // init, never resized afterwards
@@ -16982,7 +18842,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     }
 
     const size_t prev_size = lctx.buf_output ? ggml_backend_buffer_get_size(lctx.buf_output) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size + 2*top_k_size) * sizeof(float);
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -16996,6 +18856,8 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
             lctx.buf_output = nullptr;
             lctx.logits = nullptr;
             lctx.embd = nullptr;
+            lctx.top_k_ids = nullptr;
+            lctx.top_k_logits = nullptr;
         }
 
         lctx.buf_output = ggml_backend_buft_alloc_buffer(llama_default_buffer_type_cpu(lctx.model, true), new_size);
@@ -17010,9 +18872,14 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     lctx.logits = has_logits ? output_base               : nullptr;
     lctx.embd   = has_embd   ? output_base + logits_size : nullptr;
 
+    lctx.top_k_ids    = has_top_k ? (llama_token *) (output_base + logits_size + embd_size) : nullptr;
+    lctx.top_k_logits = has_top_k ? output_base + logits_size + embd_size + top_k_size     : nullptr;
+
     lctx.output_size = n_outputs_max;
     lctx.logits_size = logits_size;
     lctx.embd_size   = embd_size;
+    lctx.top_k_size  = top_k_size;
+    lctx.n_top_k     = has_top_k ? cparams.top_k : 0;
 
     // set all ids as invalid (negative)
     std::fill(lctx.output_ids.begin(), lctx.output_ids.end(), -1);
@@ -17053,6 +18920,13 @@ static void llama_output_reorder(struct llama_context * ctx) {
                     std::swap(ctx->embd[i*n_embd + k], ctx->embd[j_min*n_embd + k]);
                 }
             }
+            if (ctx->top_k_size > 0) {
+                const int32_t top_k = ctx->n_top_k;
+                for (int32_t k = 0; k < top_k; k++) {
+                    std::swap(ctx->top_k_ids   [i*top_k + k], ctx->top_k_ids   [j_min*top_k + k]);
+                    std::swap(ctx->top_k_logits[i*top_k + k], ctx->top_k_logits[j_min*top_k + k]);
+                }
+            }
         }
         std::fill(ctx->output_ids.begin(), ctx->output_ids.end(), -1);
         for (int32_t i = 0; i < n_outputs; ++i) {
@@ -17076,11 +18950,107 @@ static void llama_graph_compute(
     if (lctx.backend_blas != nullptr) {
         ggml_backend_blas_set_n_threads(lctx.backend_blas, n_threads);
     }
-#endif
+#endif
+
+    ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+
+    // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+}
+
+// waits until the layer il of the model is loaded, returns false if the lazy loading failed
+static bool llama_model_wait_layer(const llama_model & model, int32_t il) {
+    if (il < model.lazy_n_layer_ready) {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(model.lazy_mutex);
+    model.lazy_cv.wait(lock, [&] { return il < model.lazy_n_layer_ready || model.lazy_failed; });
+
+    return !model.lazy_failed;
+}
+
+// the last layer of the weights used by t that are loaded in the background, -1 if none
+static int32_t llama_lazy_layer_of(const llama_model & model, const ggml_tensor * t) {
+    int32_t il = -1;
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        const ggml_tensor * src = t->src[i];
+        if (src == nullptr) {
+            continue;
+        }
+        const auto it = model.lazy_layer.find(src->view_src ? src->view_src : src);
+        if (it != model.lazy_layer.end()) {
+            il = std::max(il, it->second);
+        }
+    }
+    return il;
+}
+
+static bool llama_lazy_load_eval_callback(struct ggml_tensor * t, bool ask, void * user_data) {
+    auto & lazy = *(llama_lazy_load_eval *) user_data;
+
+    if (ask) {
+        // the nodes before t are computed when the previous node is a sync node
+        if (!llama_model_wait_layer(*lazy.model, llama_lazy_layer_of(*lazy.model, t))) {
+            lazy.user_asked = false;
+            return true; // the evaluation stops after t
+        }
+        lazy.user_asked = lazy.cb_eval && lazy.cb_eval(t, true, lazy.cb_eval_user_data);
+        return lazy.user_asked || lazy.sync_nodes.count(t) > 0;
+    }
+
+    if (lazy.model->lazy_failed) {
+        return false;
+    }
+
+    return !lazy.user_asked || lazy.cb_eval(t, false, lazy.cb_eval_user_data);
+}
+
+// while the model is loaded in the background, make the evaluation of gf wait for the layers that are not loaded yet
+// returns false if the loading failed
+static bool llama_lazy_load_prepare(llama_context & lctx, ggml_cgraph * gf) {
+    const auto & model = lctx.model;
+
+    const int32_t n_layer = model.hparams.n_layer;
+    const int32_t n_ready = model.lazy_n_layer_ready;
+
+    if (n_ready >= n_layer) {
+        return true;
+    }
+    if (model.lazy_failed) {
+        return false;
+    }
+
+    // the scheduler may copy weights in CPU memory to a GPU at the start of a split, before any callback
+    for (auto * backend : lctx.backends) {
+        auto * dev = ggml_backend_get_device(backend);
+        if (dev && (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU || ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU_FULL)) {
+            return llama_model_wait_layer(model, n_layer - 1);
+        }
+    }
+
+    auto & lazy = lctx.lazy_eval;
+
+    lazy.model             = &model;
+    lazy.cb_eval           = lctx.cparams.cb_eval;
+    lazy.cb_eval_user_data = lctx.cparams.cb_eval_user_data;
+    lazy.user_asked        = false;
+
+    // compute the nodes before the first node using the weights of each layer, then wait for them
+    lazy.sync_nodes.clear();
+    int32_t il_max = n_ready - 1;
+    for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+        const int32_t il = llama_lazy_layer_of(model, ggml_graph_node(gf, i));
+        if (il > il_max) {
+            if (i > 0) {
+                lazy.sync_nodes.insert(ggml_graph_node(gf, i - 1));
+            }
+            il_max = il;
+        }
+    }
 
-    ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+    ggml_backend_sched_set_eval_callback(lctx.sched, llama_lazy_load_eval_callback, &lazy);
 
-    // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+    return true;
 }
 
 // decode a batch of tokens by evaluating the transformer
@@ -17092,6 +19062,196 @@ static void llama_graph_compute(
 // return positive int on warning
 // return negative int on error
 //
+// copy the adapter into a slot of the stack, zeros for the weights it does not have
+static void llama_lora_stack_write(struct llama_lora_stack & stack, size_t slot, const struct llama_lora_adapter & adapter) {
+    std::vector<uint8_t> read_buf;
+
+    const auto to_f32 = [&](const struct ggml_tensor * t) {
+        read_buf.resize(ggml_nbytes(t));
+        ggml_backend_tensor_get(t, read_buf.data(), 0, read_buf.size());
+
+        std::vector<float> res(ggml_nelements(t));
+        if (t->type == GGML_TYPE_F32) {
+            memcpy(res.data(), read_buf.data(), read_buf.size());
+        } else if (t->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) read_buf.data(), res.data(), res.size());
+        } else if (t->type == GGML_TYPE_BF16) {
+            ggml_bf16_to_fp32_row((const ggml_bf16_t *) read_buf.data(), res.data(), res.size());
+        } else {
+            ggml_type_traits_t qtype = ggml_internal_get_type_traits(t->type);
+            GGML_ASSERT(qtype.to_float != NULL);
+            qtype.to_float(read_buf.data(), res.data(), res.size());
+        }
+        return res;
+    };
+
+    const auto write = [&](struct ggml_tensor * t, const std::vector<float> & data) {
+        const size_t offs = slot*t->nb[2];
+        if (t->type == GGML_TYPE_F32) {
+            ggml_backend_tensor_set(t, data.data(), offs, data.size()*sizeof(float));
+        } else {
+            std::vector<ggml_fp16_t> data_f16(data.size());
+            ggml_fp32_to_fp16_row(data.data(), data_f16.data(), data.size());
+            ggml_backend_tensor_set(t, data_f16.data(), offs, data_f16.size()*sizeof(ggml_fp16_t));
+        }
+    };
+
+    const int64_t rank = stack.rank;
+
+    for (const auto & it : stack.weights) {
+        struct ggml_tensor * sa = it.second.a;
+        struct ggml_tensor * sb = it.second.b;
+
+        const int64_t n_in  = sa->ne[0];
+        const int64_t n_out = sb->ne[1];
+
+        std::vector<float> a(n_in*rank,  0.0f);
+        std::vector<float> b(rank*n_out, 0.0f);
+
+        const auto lw = adapter.ab_map.find(it.first);
+        if (lw != adapter.ab_map.end()) {
+            const int64_t r = lw->second.a->ne[1];
+            const float scale = adapter.alpha ? adapter.alpha / r : 1.0f;
+
+            // the rows of a beyond r stay zero
+            const std::vector<float> a_r = to_f32(lw->second.a);
+            std::copy(a_r.begin(), a_r.end(), a.begin());
+
+            // the rows of b are padded from r to rank
+            const std::vector<float> b_r = to_f32(lw->second.b);
+            for (int64_t o = 0; o < n_out; ++o) {
+                for (int64_t k = 0; k < r; ++k) {
+                    b[o*rank + k] = b_r[o*r + k]*scale;
+                }
+            }
+        }
+
+        write(sa, a);
+        write(sb, b);
+    }
+}
+
+// make sure that the adapters of all sequences are in the stack
+// the slots of adapters that are no longer used are reused, the stack is reallocated when it misses a weight, a rank or slots
+static bool llama_lora_stack_update(struct llama_context & lctx) {
+    lctx.lora_stack_dirty = false;
+
+    auto & stack = lctx.lora_stack;
+
+    std::vector<const struct llama_lora_adapter *> adapters;
+    for (const auto & it : lctx.lora_adapters_seq) {
+        for (const auto & lora : it.second) {
+            if (std::find(adapters.begin(), adapters.end(), lora.first) == adapters.end()) {
+                adapters.push_back(lora.first);
+            }
+        }
+    }
+
+    const auto is_used = [&](uint64_t id) {
+        return std::any_of(adapters.begin(), adapters.end(), [id](const struct llama_lora_adapter * adapter) {
+            return adapter->id == id;
+        });
+    };
+    const auto is_stacked = [&](uint64_t id) {
+        return std::find(stack.slots.begin(), stack.slots.end(), id) != stack.slots.end();
+    };
+
+    bool realloc = false;
+
+    int64_t   rank  = stack.rank;
+    ggml_type type  = stack.type;
+    size_t    n_new = 0;
+    for (const auto * adapter : adapters) {
+        for (const auto & it : adapter->ab_map) {
+            rank = std::max(rank, it.second.a->ne[1]);
+            if (it.second.a->type == GGML_TYPE_F32 || it.second.b->type == GGML_TYPE_F32) {
+                type = GGML_TYPE_F32;
+            }
+            realloc = realloc || stack.weights.find(it.first) == stack.weights.end();
+        }
+        n_new += !is_stacked(adapter->id);
+    }
+
+    const size_t n_free = std::count_if(stack.slots.begin(), stack.slots.end(), [&](uint64_t id) {
+        return !is_used(id);
+    });
+
+    realloc = realloc || rank > stack.rank || type != stack.type || n_new > n_free;
+
+    if (realloc) {
+        stack.clear();
+
+        size_t n_slots = 1;
+        while (n_slots < adapters.size()) {
+            n_slots *= 2;
+        }
+
+        // the stacked weights go to the buffer types of the adapters, which follow the base model
+        std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+        for (const auto * adapter : adapters) {
+            for (const auto & it : adapter->ab_map) {
+                if (stack.weights.find(it.first) != stack.weights.end()) {
+                    continue;
+                }
+
+                ggml_backend_buffer_type_t buft = ggml_backend_buffer_get_type(it.second.a->buffer);
+                if (ctx_map.find(buft) == ctx_map.end()) {
+                    struct ggml_init_params params = {
+                        /*.mem_size   =*/ 2*lctx.model.tensors_by_name.size()*ggml_tensor_overhead(),
+                        /*.mem_buffer =*/ NULL,
+                        /*.no_alloc   =*/ true,
+                    };
+                    ctx_map[buft] = ggml_init(params);
+                }
+                ggml_context * ctx = ctx_map.at(buft);
+
+                llama_lora_stack_weight sw;
+                sw.a = ggml_new_tensor_3d(ctx, type, it.second.a->ne[0], rank, n_slots);
+                sw.b = ggml_new_tensor_3d(ctx, type, rank, it.second.b->ne[1], n_slots);
+                ggml_format_name(sw.a, "%s.lora_stack_a", it.first.c_str());
+                ggml_format_name(sw.b, "%s.lora_stack_b", it.first.c_str());
+                stack.weights[it.first] = sw;
+            }
+        }
+
+        for (auto & it : ctx_map) {
+            stack.ctxs.push_back(it.second);
+
+            ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first);
+            if (!buf) {
+                LLAMA_LOG_ERROR("%s: failed to allocate buffer for the LoRA adapters of the sequences\n", __func__);
+                stack.clear();
+                return false;
+            }
+            // the free slots are read with a zero scale, they must not hold NaNs
+            ggml_backend_buffer_clear(buf, 0);
+            LLAMA_LOG_INFO("%s: %10s LoRA stack buffer size = %8.2f MiB, n_slots = %zu, rank = %" PRId64 ", type = %s\n", __func__,
+                    ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0, n_slots, rank, ggml_type_name(type));
+            stack.bufs.push_back(buf);
+        }
+
+        stack.rank = rank;
+        stack.type = type;
+        stack.slots.assign(n_slots, 0);
+    }
+
+    for (const auto * adapter : adapters) {
+        if (is_stacked(adapter->id)) {
+            continue;
+        }
+
+        const auto slot = std::find_if(stack.slots.begin(), stack.slots.end(), [&](uint64_t id) {
+            return !is_used(id);
+        });
+        GGML_ASSERT(slot != stack.slots.end());
+
+        llama_lora_stack_write(stack, slot - stack.slots.begin(), *adapter);
+        *slot = adapter->id;
+    }
+
+    return true;
+}
+
 static int llama_decode_internal(
          llama_context & lctx,
            llama_batch   batch_all) { // TODO: rename back to batch
@@ -17110,6 +19270,10 @@ static int llama_decode_internal(
 
     GGML_ASSERT((!batch_all.token && batch_all.embd) || (batch_all.token && !batch_all.embd)); // NOLINT
 
+    if (lctx.lora_stack_dirty && !llama_lora_stack_update(lctx)) {
+        return -2;
+    }
+
     if (batch_all.token) {
         for (uint32_t i = 0; i < n_tokens_all; ++i) {
             if (batch_all.token[i] < 0 || (uint32_t)batch_all.token[i] >= model.vocab.n_vocab) {
@@ -17143,6 +19307,17 @@ static int llama_decode_internal(
 
     lctx.embd_seq.clear();
 
+    // the mask of a tree batch needs the KV cells of all its tokens at once
+    lctx.tree_cells.clear();
+
+    if (!lctx.tree_parent.empty()) {
+        if (lctx.tree_parent.size() != n_tokens_all || n_tokens_all > n_ubatch || kv_self.recurrent || !cparams.causal_attn) {
+            LLAMA_LOG_ERROR("%s: the tree has %zu tokens but the batch has %u tokens - a tree batch must fit in a single ubatch (n_ubatch = %u)\n",
+                    __func__, lctx.tree_parent.size(), n_tokens_all, n_ubatch);
+            return -1;
+        }
+    }
+
     // count outputs
     if (batch_all.logits && !embd_pooled) {
         for (uint32_t i = 0; i < n_tokens_all; ++i) {
@@ -17209,7 +19384,7 @@ static int llama_decode_internal(
 
             // if we have enough unused cells before the current head ->
             //   better to start searching from the beginning of the cache, hoping to fill it
-            if (kv_self.head > kv_self.used + 2*n_tokens) {
+            if (!kv_self.paged() && kv_self.head > kv_self.used + 2*n_tokens) {
                 kv_self.head = 0;
             }
 
@@ -17217,6 +19392,13 @@ static int llama_decode_internal(
                 return 1;
             }
 
+            if (!lctx.tree_parent.empty()) {
+                lctx.tree_cells.resize(n_tokens);
+                for (uint32_t i = 0; i < n_tokens; ++i) {
+                    lctx.tree_cells[i] = kv_self.paged() ? kv_self.slot_cells[i] : kv_self.head + i;
+                }
+            }
+
             if (!kv_self.recurrent) {
                 // a heuristic, to avoid attending the full cache if it is not yet utilized
                 // after enough generations, the benefit from this heuristic disappears
@@ -17238,10 +19420,20 @@ static int llama_decode_internal(
         struct ggml_tensor * res  = ggml_graph_node(gf, -1);
         struct ggml_tensor * embd = ggml_graph_node(gf, -2);
 
+        struct ggml_tensor * res_top_k_ids    = nullptr;
+        struct ggml_tensor * res_top_k_logits = nullptr;
+
         if (lctx.n_outputs == 0) {
             // no output
             res  = nullptr;
             embd = nullptr;
+        } else if (!cparams.embeddings && cparams.top_k > 0) {
+            res  = nullptr; // the full logits stay on the backend
+            embd = nullptr;
+            res_top_k_logits = ggml_graph_node(gf, -1);
+            res_top_k_ids    = ggml_graph_get_tensor(gf, "result_top_k_ids");
+            GGML_ASSERT(strcmp(res_top_k_logits->name, "result_top_k_logits") == 0 && "missing result_top_k_logits tensor");
+            GGML_ASSERT(res_top_k_ids != nullptr && "missing result_top_k_ids tensor");
         } else if (cparams.embeddings) {
             res  = nullptr; // do not extract logits for embedding case
             embd = nullptr;
@@ -17258,14 +19450,24 @@ static int llama_decode_internal(
         }
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
+        if (!llama_lazy_load_prepare(lctx, gf)) {
+            LLAMA_LOG_ERROR("%s: failed to load the model\n", __func__);
+            return -3;
+        }
+
         ggml_backend_sched_alloc_graph(lctx.sched, gf);
 
         llama_set_inputs(lctx, ubatch);
 
         llama_graph_compute(lctx, gf, n_threads, threadpool);
 
+        if (lctx.model.lazy_failed) {
+            LLAMA_LOG_ERROR("%s: failed to load the model\n", __func__);
+            return -3;
+        }
+
         // update the kv ring buffer
-        {
+        if (!kv_self.paged()) {
             kv_self.head += n_tokens;
 
             // Ensure kv cache head points to a valid index.
@@ -17295,6 +19497,24 @@ static int llama_decode_internal(
             }
         }
 
+        // extract top-k candidates
+        if (res_top_k_ids) {
+            const int32_t top_k = lctx.n_top_k;
+            const int32_t n_outputs_new = lctx.n_outputs;
+
+            GGML_ASSERT(lctx.top_k_ids != nullptr);
+            GGML_ASSERT( n_outputs_prev + n_outputs_new <= n_outputs);
+            GGML_ASSERT((n_outputs_prev + n_outputs_new)*top_k <= (int64_t) lctx.top_k_size);
+            GGML_ASSERT(res_top_k_ids->ne[0] == top_k);
+
+            ggml_backend_t backend_ids    = ggml_backend_sched_get_tensor_backend(lctx.sched, res_top_k_ids);
+            ggml_backend_t backend_logits = ggml_backend_sched_get_tensor_backend(lctx.sched, res_top_k_logits);
+            GGML_ASSERT(backend_ids != nullptr && backend_logits != nullptr);
+
+            ggml_backend_tensor_get_async(backend_ids,    res_top_k_ids,    lctx.top_k_ids    + n_outputs_prev*top_k, 0, n_outputs_new*top_k*sizeof(llama_token));
+            ggml_backend_tensor_get_async(backend_logits, res_top_k_logits, lctx.top_k_logits + n_outputs_prev*top_k, 0, n_outputs_new*top_k*sizeof(float));
+        }
+
         // extract embeddings
         if (embd) {
             ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(lctx.sched, embd);
@@ -17425,6 +19645,10 @@ static int llama_encode_internal(
 
     GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
 
+    if (lctx.lora_stack_dirty && !llama_lora_stack_update(lctx)) {
+        return -2;
+    }
+
     if (batch.token) {
         for (uint32_t i = 0; i < n_tokens; ++i) {
             if (batch.token[i] < 0 || (uint32_t)batch.token[i] >= model.vocab.n_vocab) {
@@ -17492,12 +19716,22 @@ static int llama_encode_internal(
         }
     }
 
+    if (!llama_lazy_load_prepare(lctx, gf)) {
+        LLAMA_LOG_ERROR("%s: failed to load the model\n", __func__);
+        return -3;
+    }
+
     ggml_backend_sched_alloc_graph(lctx.sched, gf);
 
     llama_set_inputs(lctx, ubatch);
 
     llama_graph_compute(lctx, gf, n_threads, threadpool);
 
+    if (lctx.model.lazy_failed) {
+        LLAMA_LOG_ERROR("%s: failed to load the model\n", __func__);
+        return -3;
+    }
+
     // extract embeddings
     if (embd) {
         ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(lctx.sched, embd);
@@ -17796,6 +20030,29 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
+    // give the sequences detached from shared cells their own copy of the KV data
+    // this has to happen before the K-shift, which is applied to the copies only
+    if (!lctx.kv_self.cow_copies.empty()) {
+        auto & copies = lctx.kv_self.cow_copies;
+
+        // each copy needs 6 graph nodes per layer (view, view, cpy for K and for V)
+        const size_t max_copies = std::max<size_t>(1, (llama_model_max_nodes(lctx.model) - 2*lctx.model.hparams.n_layer)/(6*lctx.model.hparams.n_layer));
+
+        for (size_t i = 0; i < copies.size(); i += max_copies) {
+            const std::vector<std::pair<uint32_t, uint32_t>> chunk(copies.begin() + i, copies.begin() + std::min(copies.size(), i + max_copies));
+
+            ggml_backend_sched_reset(lctx.sched);
+
+            ggml_cgraph * gf = llama_build_graph_kv_copy(lctx, chunk);
+
+            llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+        }
+
+        copies.clear();
+
+        need_reserve = true;
+    }
+
     // apply K-shift if needed
     if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
         if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
@@ -18924,22 +21181,71 @@ int32_t llama_lora_adapter_set(
 int32_t llama_lora_adapter_remove(
             struct llama_context * ctx,
             struct llama_lora_adapter * adapter) {
+    bool found = false;
+    for (auto it = ctx->lora_adapters_seq.begin(); it != ctx->lora_adapters_seq.end();) {
+        auto & loras = it->second;
+        for (auto lora = loras.begin(); lora != loras.end(); ++lora) {
+            if (lora->first == adapter) {
+                loras.erase(lora);
+                found = true;
+                break;
+            }
+        }
+        it = loras.empty() ? ctx->lora_adapters_seq.erase(it) : std::next(it);
+    }
     auto pos = ctx->lora_adapters.find(adapter);
     if (pos != ctx->lora_adapters.end()) {
         ctx->lora_adapters.erase(pos);
         return 0;
     }
-    return -1;
+    return found ? 0 : -1;
 }
 
 void llama_lora_adapter_clear(struct llama_context * ctx) {
     ctx->lora_adapters.clear();
 }
 
+int32_t llama_lora_adapter_set_seq(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            float scale,
+            llama_seq_id seq_id) {
+    if (ctx->cparams.flash_attn) {
+        LLAMA_LOG_ERROR("%s: flash_attn is not compatible with LoRA\n", __func__);
+        return -1;
+    }
+    auto & loras = ctx->lora_adapters_seq[seq_id];
+    for (auto & lora : loras) {
+        if (lora.first == adapter) {
+            lora.second = scale;
+            return 0;
+        }
+    }
+    loras.emplace_back(adapter, scale);
+    ctx->lora_stack_dirty = true;
+    return 0;
+}
+
+void llama_lora_adapter_clear_seq(struct llama_context * ctx, llama_seq_id seq_id) {
+    if (seq_id < 0) {
+        ctx->lora_adapters_seq.clear();
+    } else {
+        ctx->lora_adapters_seq.erase(seq_id);
+    }
+}
+
 void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
     delete adapter;
 }
 
+uint64_t llama_lora_adapter_size(const struct llama_lora_adapter * adapter) {
+    uint64_t size = 0;
+    for (ggml_backend_buffer_t buf : adapter->bufs) {
+        size += ggml_backend_buffer_get_size(buf);
+    }
+    return size;
+}
+
 //
 // interface implementation
 //
@@ -18950,6 +21256,7 @@ struct llama_model_params llama_model_default_params() {
         /*.main_gpu                    =*/ 0,
         /*.tensor_split                =*/ nullptr,
         /*.rpc_servers                 =*/ nullptr,
+        /*.shm_name                    =*/ nullptr,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
@@ -18957,6 +21264,10 @@ struct llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_repack                  =*/ true,
+        /*.use_repack_cache            =*/ false,
+        /*.lazy_load                   =*/ false,
+        /*.use_huge_pages              =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -18986,6 +21297,7 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.kv_block_size               =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -19096,6 +21408,14 @@ struct llama_model * llama_load_model_from_file(
 
     llama_model * model = new llama_model;
 
+    if (params.use_huge_pages) {
+        if (ggml_backend_cpu_huge_page_buffer_type() != nullptr) {
+            model->use_huge_pages = true;
+        } else {
+            LLAMA_LOG_WARN("%s: huge pages are not supported on this system\n", __func__);
+        }
+    }
+
     unsigned cur_percentage = 0;
     if (params.progress_callback == NULL) {
         params.progress_callback_user_data = &cur_percentage;
@@ -19202,11 +21522,14 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.kv_block_size    = params.kv_block_size;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
     cparams.pooling_type     = params.pooling_type;
+    cparams.top_k            = 0;
+    cparams.top_k_temp       = 1.0f;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
@@ -19572,6 +21895,20 @@ struct llama_context * llama_new_context_with_model(
                 }
             }
 
+            if (model->use_huge_pages) {
+                for (ggml_backend_buffer_t buf : ctx->kv_self.bufs) {
+                    if (!ggml_backend_buffer_is_host(buf)) {
+                        continue;
+                    }
+                    const size_t size = ggml_backend_buffer_get_size(buf);
+                    LLAMA_LOG_INFO("%s: %10s KV buffer in huge pages = %8.2f MiB of %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf),
+                            llama_huge_page_bytes(ggml_backend_buffer_get_base(buf), size) / 1024.0 / 1024.0, size / 1024.0 / 1024.0);
+                }
+                // the compute buffers are not exposed by the scheduler, report the whole process instead
+                LLAMA_LOG_INFO("%s: process memory in huge pages = %8.2f MiB\n", __func__,
+                        llama_huge_page_bytes(nullptr, SIZE_MAX) / 1024.0 / 1024.0);
+            }
+
             // note: the number of splits during measure is higher than during inference due to the kv shift
             int n_splits = ggml_backend_sched_get_n_splits(ctx->sched);
             LLAMA_LOG_INFO("%s: graph nodes  = %d\n", __func__, ggml_graph_n_nodes(gf));
@@ -20073,6 +22410,11 @@ void llama_kv_cache_update(struct llama_context * ctx) {
     llama_kv_cache_update_internal(*ctx);
 }
 
+void llama_kv_cache_tree_accept(struct llama_context * ctx, const int32_t * ids, int32_t n_ids) {
+    llama_kv_cache_tree_accept(ctx->kv_self, ctx->tree_cells, ids, n_ids);
+    ctx->tree_cells.clear();
+}
+
 // deprecated
 size_t llama_get_state_size(struct llama_context * ctx) {
     return llama_state_get_size(ctx);
@@ -20178,6 +22520,20 @@ struct llama_data_write {
         }
     }
 
+    // candidates selected in the graph instead of the logits, see llama_set_output_top_k
+    void write_top_k(const struct llama_context * ctx) {
+        const int32_t  n_top_k    = ctx->n_top_k;
+        const uint64_t top_k_size = std::min((uint64_t) ctx->top_k_size, (uint64_t) ctx->n_outputs * n_top_k);
+
+        write(&n_top_k,    sizeof(n_top_k));
+        write(&top_k_size, sizeof(top_k_size));
+
+        if (top_k_size) {
+            write(ctx->top_k_ids,    top_k_size * sizeof(llama_token));
+            write(ctx->top_k_logits, top_k_size * sizeof(float));
+        }
+    }
+
     void write_kv_cache_meta(const llama_kv_cache & kv_self, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) {
 
         for (const auto & range : cell_ranges) {
@@ -20327,6 +22683,9 @@ struct llama_data_read {
     virtual size_t get_size_read() = 0;
     virtual ~llama_data_read() = default;
 
+    // (first cell, n cells) ranges of the KV cells being restored, set by read_kv_cache_meta
+    std::vector<std::pair<uint32_t, uint32_t>> cell_ranges;
+
     void read_string(std::string & str) {
         uint32_t str_size;
         read_to(&str_size, sizeof(str_size));
@@ -20409,6 +22768,27 @@ struct llama_data_read {
         }
     }
 
+    void read_top_k(struct llama_context * ctx) {
+        int32_t  n_top_k;
+        uint64_t top_k_size;
+        read_to(&n_top_k,    sizeof(n_top_k));
+        read_to(&top_k_size, sizeof(top_k_size));
+
+        if (top_k_size == 0) {
+            return;
+        }
+
+        if (n_top_k != ctx->n_top_k) {
+            throw std::runtime_error(format("the state has %d candidates per output, the context %d - see llama_set_output_top_k", n_top_k, ctx->n_top_k));
+        }
+        if (ctx->top_k_size < top_k_size) {
+            throw std::runtime_error("top-k candidates buffer too small");
+        }
+
+        read_to(ctx->top_k_ids,    top_k_size * sizeof(llama_token));
+        read_to(ctx->top_k_logits, top_k_size * sizeof(float));
+    }
+
     bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
         struct llama_kv_cache & kv_self = ctx->kv_self;
 
@@ -20443,13 +22823,28 @@ struct llama_data_read {
                 return false;
             }
 
-            // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-            // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            if (kv_self.paged()) {
+                // the cells are scattered over the blocks of the sequence
+                cell_ranges.clear();
+                for (uint32_t i = 0; i < cell_count; ++i) {
+                    const uint32_t cell_id = kv_self.slot_cells[i];
+                    if (!cell_ranges.empty() && cell_ranges.back().first + cell_ranges.back().second == cell_id) {
+                        cell_ranges.back().second++;
+                    } else {
+                        cell_ranges.emplace_back(cell_id, 1);
+                    }
+                }
+            } else {
+                // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
+                // Assume that this is one contiguous block of cells
+                GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
+                GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
+                GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
+                GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
+                GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+
+                cell_ranges = { { kv_self.head, cell_count } };
+            }
         } else {
             // whole KV cache restore
 
@@ -20495,6 +22890,10 @@ struct llama_data_read {
 
             kv_self.head = 0;
             kv_self.used = cell_count;
+
+            llama_kv_cache_blocks_rebuild(kv_self);
+
+            cell_ranges = { { 0, cell_count } };
         }
 
         if (kv_self.recurrent) {
@@ -20553,7 +22952,11 @@ struct llama_data_read {
 
             if (cell_count) {
                 // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                const uint8_t * src = read(cell_count * k_size_row);
+                for (const auto & range : cell_ranges) {
+                    ggml_backend_tensor_set(kv_self.k_l[il], src, range.first * k_size_row, range.second * k_size_row);
+                    src += range.second * k_size_row;
+                }
             }
         }
 
@@ -20581,7 +22984,11 @@ struct llama_data_read {
 
                 if (cell_count) {
                     // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    const uint8_t * src = read(cell_count * v_size_row);
+                    for (const auto & range : cell_ranges) {
+                        ggml_backend_tensor_set(kv_self.v_l[il], src, range.first * v_size_row, range.second * v_size_row);
+                        src += range.second * v_size_row;
+                    }
                 }
             }
         } else {
@@ -20618,8 +23025,12 @@ struct llama_data_read {
                 if (cell_count) {
                     // For each row in the transposed matrix, read the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                        const size_t dst_offset = (kv_self.head + j * kv_self.size) * v_size_el;
-                        ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                        const uint8_t * src = read(cell_count * v_size_el);
+                        for (const auto & range : cell_ranges) {
+                            const size_t dst_offset = (range.first + j * kv_self.size) * v_size_el;
+                            ggml_backend_tensor_set(kv_self.v_l[il], src, dst_offset, range.second * v_size_el);
+                            src += range.second * v_size_el;
+                        }
                     }
                 }
             }
@@ -20789,6 +23200,7 @@ static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_da
     data_ctx.write_output_ids(ctx);
     data_ctx.write_logits(ctx);
     data_ctx.write_embeddings(ctx);
+    data_ctx.write_top_k(ctx);
 
     data_ctx.write_kv_cache(ctx);
 
@@ -20826,6 +23238,7 @@ static size_t llama_state_set_data_internal(struct llama_context * ctx, llama_da
     data_ctx.read_output_ids(ctx);
     data_ctx.read_logits(ctx);
     data_ctx.read_embeddings(ctx);
+    data_ctx.read_top_k(ctx);
 
     data_ctx.read_kv_cache(ctx);
 
@@ -21054,6 +23467,23 @@ int32_t llama_n_threads_batch(struct llama_context * ctx) {
     return ctx->cparams.n_threads_batch;
 }
 
+void llama_parallel_for(struct llama_context * ctx, int32_t n, void (*fn)(int32_t i, void * user_data), void * user_data) {
+    if (n <= 0) {
+        return;
+    }
+
+    const int32_t n_threads = std::max(1, ctx->cparams.n_threads);
+
+    if (n_threads == 1 || n == 1) {
+        for (int32_t i = 0; i < n; ++i) {
+            fn(i, user_data);
+        }
+        return;
+    }
+
+    ctx->worker_pool.run(n_threads, n, fn, user_data);
+}
+
 void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
     ctx->abort_callback      = abort_callback;
     ctx->abort_callback_data = abort_callback_data;
@@ -21063,6 +23493,11 @@ void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
     ctx->cparams.embeddings = embeddings;
 }
 
+void llama_set_output_top_k(struct llama_context * ctx, int32_t top_k, float temp) {
+    ctx->cparams.top_k      = std::max(0, std::min<int32_t>(top_k, ctx->model.hparams.n_vocab));
+    ctx->cparams.top_k_temp = temp;
+}
+
 void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
 }
@@ -21152,12 +23587,44 @@ int32_t llama_decode(
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
     }
 
+    // the tree only applies to a single batch
+    ctx->tree_parent.clear();
+
     return ret;
 }
 
+int32_t llama_set_tree(
+        struct llama_context * ctx,
+               const int32_t * parent,
+                     int32_t   n_tokens) {
+    ctx->tree_parent.clear();
+
+    if (parent == nullptr) {
+        return 0;
+    }
+
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        if (parent[i] < -1 || parent[i] >= i) {
+            LLAMA_LOG_ERROR("%s: invalid parent[%d] = %d - parents must come before their children\n", __func__, i, parent[i]);
+            return -1;
+        }
+    }
+
+    ctx->tree_parent.assign(parent, parent + n_tokens);
+
+    return 0;
+}
+
 void llama_synchronize(struct llama_context * ctx) {
     ggml_backend_sched_synchronize(ctx->sched);
 
+    // nothing was evaluated since the last synchronization
+    // note: this keeps the output getters free of writes to the context, so that they can be called
+    //       from multiple threads once the context has been synchronized (see llama_sampler_sample_batch)
+    if (ctx->n_queued_tokens == 0) {
+        return;
+    }
+
     // FIXME: if multiple single tokens are evaluated without a synchronization,
     // the stats will be added to the prompt evaluation stats
     // this should only happen when using batch size 1 to evaluate a batch
@@ -21234,6 +23701,51 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     }
 }
 
+int32_t llama_get_output_top_k_ith(struct llama_context * ctx, int32_t i, llama_token_data * cur) {
+    if (ctx->top_k_ids == nullptr) {
+        return -1;
+    }
+
+    int32_t j = -1;
+    llama_synchronize(ctx);
+
+    try {
+        if (i < 0) {
+            j = ctx->n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", ctx->n_outputs));
+            }
+        } else if ((size_t) i >= ctx->output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %lu)", ctx->output_ids.size()));
+        } else {
+            j = ctx->output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= ctx->n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, ctx->n_outputs));
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid output id %d, reason: %s\n", __func__, i, err.what());
+#ifndef NDEBUG
+        GGML_ABORT("fatal error");
+#else
+        return -1;
+#endif
+    }
+
+    const int32_t top_k = ctx->n_top_k;
+
+    for (int32_t k = 0; k < top_k; ++k) {
+        cur[k] = llama_token_data{ ctx->top_k_ids[j*top_k + k], ctx->top_k_logits[j*top_k + k], 0.0f };
+    }
+
+    return top_k;
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     llama_synchronize(ctx);
 
@@ -21403,6 +23915,33 @@ int32_t llama_detokenize(
     return llama_detokenize_impl(model->vocab, tokens, n_tokens, text, text_len_max, remove_special, unparse_special);
 }
 
+struct llama_detokenizer * llama_detokenizer_init(const struct llama_model * model, bool special) {
+    return new llama_detokenizer(model->vocab, special);
+}
+
+void llama_detokenizer_free(struct llama_detokenizer * detok) {
+    delete detok;
+}
+
+void llama_detokenizer_reset(struct llama_detokenizer * detok) {
+    detok->pending.clear();
+}
+
+int32_t llama_detokenizer_push(
+    struct llama_detokenizer * detok,
+                 llama_token   token,
+                        char * buf,
+                     int32_t   length) {
+    return llama_detokenizer_push_impl(*detok, token, buf, length);
+}
+
+int32_t llama_detokenizer_flush(
+    struct llama_detokenizer * detok,
+                        char * buf,
+                     int32_t   length) {
+    return llama_detokenizer_flush_impl(*detok, buf, length);
+}
+
 //
 // chat templates
 //
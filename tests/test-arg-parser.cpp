@@ -68,9 +68,9 @@ int main(void) {
     argv = {"binary_name", "-sm", "hello"};
     assert(false == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_COMMON));
 
-    // non-existence arg in specific example (--draft cannot be used outside llama-speculative)
+    // non-existence arg in specific example (--draft cannot be used outside llama-speculative, llama-lookup and llama-server)
     argv = {"binary_name", "--draft", "123"};
-    assert(false == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_SERVER));
+    assert(false == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_MAIN));
 
 
     printf("test-arg-parser: test valid usage\n\n");
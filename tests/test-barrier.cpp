@@ -6,10 +6,95 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
+#include <random>
 #include <vector>
 
 #define MAX_NARGS 2
 
+static void compute(struct ggml_cgraph * gf, int n_threads) {
+    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads, nullptr);
+
+    std::vector<uint8_t> work_data(cplan.work_size);
+    cplan.work_data = work_data.data();
+
+    ggml_graph_compute(gf, &cplan);
+}
+
+// a mul_mat with a quantized src0 keeps reading its quantized src1 from the work buffer until all the threads are done,
+// the independent nodes using per-thread slices of the work buffer (rope, soft_max) must wait for it
+static bool test_work_buffer_nodes(int n_threads, int n_rounds) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 256*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    const int n_embd   = 512;
+    const int n_tokens = 32;
+    const int n_rot    = 64;
+
+    struct ggml_tensor * w   = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, n_embd, 4*n_embd);
+    struct ggml_tensor * x   = ggml_new_tensor_2d(ctx, GGML_TYPE_F32,  n_embd, n_tokens);
+    struct ggml_tensor * q   = ggml_new_tensor_3d(ctx, GGML_TYPE_F32,  n_rot, n_embd/n_rot, n_tokens);
+    struct ggml_tensor * pos = ggml_new_tensor_1d(ctx, GGML_TYPE_I32,  n_tokens);
+    struct ggml_tensor * kq  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32,  4*n_embd, n_tokens);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    std::vector<float> w_f32(ggml_nelements(w));
+    for (auto & v : w_f32) {
+        v = dist(rng);
+    }
+    ggml_quantize_chunk(GGML_TYPE_Q4_0, w_f32.data(), w->data, 0, w->ne[1], w->ne[0], nullptr);
+
+    for (struct ggml_tensor * t : { x, q, kq }) {
+        for (int64_t i = 0; i < ggml_nelements(t); i++) {
+            ((float *) t->data)[i] = dist(rng);
+        }
+    }
+    for (int i = 0; i < n_tokens; i++) {
+        ((int32_t *) pos->data)[i] = i;
+    }
+
+    struct ggml_tensor * y = ggml_mul_mat(ctx, w, x);
+    struct ggml_tensor * r = ggml_rope(ctx, q, pos, n_rot, 0);
+    struct ggml_tensor * s = ggml_soft_max(ctx, kq);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, y);
+    ggml_build_forward_expand(gf, r);
+    ggml_build_forward_expand(gf, s);
+
+    // a single thread computes the nodes one after the other, as with a barrier after each node
+    compute(gf, 1);
+
+    std::vector<std::vector<uint8_t>> ref;
+    for (struct ggml_tensor * t : { y, r, s }) {
+        ref.emplace_back((uint8_t *) t->data, (uint8_t *) t->data + ggml_nbytes(t));
+    }
+
+    bool ok = true;
+    for (int i = 0; i < n_rounds && ok; i++) {
+        compute(gf, n_threads);
+
+        int k = 0;
+        for (struct ggml_tensor * t : { y, r, s }) {
+            if (memcmp(t->data, ref[k++].data(), ggml_nbytes(t)) != 0) {
+                fprintf(stderr, "%s: %s differs from the single thread result in round %d\n", __func__, ggml_op_desc(t), i);
+                ok = false;
+            }
+        }
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
 
     int n_threads = 4;
@@ -23,6 +108,10 @@ int main(int argc, char *argv[]) {
         n_rounds  = std::atoi(argv[2]);
     }
 
+    if (!test_work_buffer_nodes(n_threads, n_rounds)) {
+        return 1;
+    }
+
     struct ggml_init_params params = {
         /* .mem_size   = */ 1024*1024*1024,
         /* .mem_buffer = */ NULL,
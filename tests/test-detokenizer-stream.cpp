@@ -0,0 +1,158 @@
+// tests the streaming detokenizer: the tokens of texts with multi-byte UTF-8 characters are pushed one at a time,
+// each output must be complete UTF-8, and the whole output must be the same as one llama_detokenize of the tokens
+
+#include "llama.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static std::vector<llama_token> tokenize(const llama_model * model, const std::string & text) {
+    std::vector<llama_token> tokens(text.size() + 2);
+    const int32_t n = llama_tokenize(model, text.c_str(), text.size(), tokens.data(), tokens.size(), true, true);
+    assert(n >= 0);
+    tokens.resize(n);
+    return tokens;
+}
+
+static std::string detokenize(const llama_model * model, const std::vector<llama_token> & tokens) {
+    std::string text(tokens.size() * 16 + 16, '\0');
+    int32_t n = llama_detokenize(model, tokens.data(), tokens.size(), &text[0], text.size(), false, true);
+    if (n < 0) {
+        text.resize(-n);
+        n = llama_detokenize(model, tokens.data(), tokens.size(), &text[0], text.size(), false, true);
+    }
+    assert(n >= 0);
+    text.resize(n);
+    return text;
+}
+
+// true if the text is valid UTF-8 and does not end in the middle of a character
+static bool is_complete_utf8(const std::string & text) {
+    size_t i = 0;
+    while (i < text.size()) {
+        const uint8_t c = text[i];
+        const size_t n = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 0;
+        if (n == 0 || i + n > text.size()) {
+            return false;
+        }
+        for (size_t j = 1; j < n; ++j) {
+            if (((uint8_t) text[i + j] >> 6) != 0x2) {
+                return false;
+            }
+        }
+        i += n;
+    }
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_load_model_from_file(argv[1], mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const std::vector<std::string> texts = {
+        "Hello world",
+        "llama 🦙 and 🦙🦙 with emoji",
+        "中文字符的测试，以及一些罕见的字：𠀀𪚥",
+        "mixed ascii, Ελληνικά, русский, and 𝕊𝕡𝕖𝕔𝕚𝕒𝕝 letters",
+    };
+
+    llama_detokenizer * detok = llama_detokenizer_init(model, true);
+
+    // the pieces of some tokens end in the middle of a character: the streaming has to hold them back
+    int n_held_back = 0;
+
+    for (const auto & text : texts) {
+        const std::vector<llama_token> tokens = tokenize(model, text);
+
+        llama_detokenizer_reset(detok);
+
+        std::string output;
+        char buf[256];
+        for (const llama_token token : tokens) {
+            // too small: the token is not consumed
+            int32_t n = llama_detokenizer_push(detok, token, buf, 0);
+            if (n < 0) {
+                n = llama_detokenizer_push(detok, token, buf, -n);
+            }
+            assert(n >= 0);
+
+            const std::string piece(buf, n);
+            if (!is_complete_utf8(piece)) {
+                fprintf(stderr, "%s: \"%s\": the output of token %d is not complete UTF-8\n", __func__, text.c_str(), token);
+            }
+            assert(is_complete_utf8(piece));
+
+            char piece_token[256];
+            const int32_t n_token = llama_token_to_piece(model, token, piece_token, sizeof(piece_token), 0, true);
+            assert(n_token >= 0);
+            if (!is_complete_utf8(std::string(piece_token, n_token))) {
+                n_held_back++;
+            }
+
+            output += piece;
+        }
+
+        const int32_t n = llama_detokenizer_flush(detok, buf, sizeof(buf));
+        assert(n == 0); // the texts end with complete characters
+
+        const std::string expected = detokenize(model, tokens);
+        if (output != expected) {
+            fprintf(stderr, "%s: the streamed text \"%s\" differs from \"%s\"\n", __func__, output.c_str(), expected.c_str());
+        }
+        assert(output == expected);
+    }
+
+    // the incomplete character at the end of a text is written by the flush
+    {
+        const std::string text = "🦙";
+        const std::vector<llama_token> tokens = tokenize(model, text);
+
+        llama_detokenizer_reset(detok);
+
+        std::string output;
+        char buf[256];
+        for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+            const int32_t n = llama_detokenizer_push(detok, tokens[i], buf, sizeof(buf));
+            assert(n >= 0);
+            output += std::string(buf, n);
+        }
+
+        const int32_t n = llama_detokenizer_flush(detok, buf, sizeof(buf));
+        assert(n >= 0);
+        output += std::string(buf, n);
+
+        const std::vector<llama_token> tokens_head(tokens.begin(), tokens.end() - 1);
+        const std::string expected = detokenize(model, tokens_head);
+        assert(output == expected);
+        assert(n > 0 || is_complete_utf8(expected));
+        assert(llama_detokenizer_flush(detok, buf, sizeof(buf)) == 0);
+    }
+
+    llama_detokenizer_free(detok);
+
+    fprintf(stderr, "%s: %d tokens ended in the middle of a character\n", __func__, n_held_back);
+    assert(n_held_back > 0);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    return 0;
+}
@@ -4,9 +4,13 @@
 
 #include "unicode.h"
 #include "llama-grammar.h"
+#include "llama-vocab.h"
 #include "json-schema-to-grammar.h"
 
 #include <cassert>
+#include <cmath>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -56,6 +60,122 @@ static bool match_string(const std::string & input, llama_grammar * grammar) {
     return false;
 }
 
+// vocab of the printable ASCII characters and of the substrings of up to 4 code points of the test strings,
+// with an end-of-generation token and an empty piece
+static void build_vocab(llama_vocab & vocab, const std::vector<std::string> & strings) {
+    std::set<std::string> pieces;
+    for (char c = 0x20; c < 0x7f; ++c) {
+        pieces.insert(std::string(1, c));
+    }
+    for (const auto & str : strings) {
+        const auto cpts = unicode_cpts_from_utf8(str);
+        for (size_t i = 0; i < cpts.size(); ++i) {
+            std::string piece;
+            for (size_t n = 0; n < 4 && i + n < cpts.size(); ++n) {
+                piece += unicode_cpt_to_utf8(cpts[i + n]);
+                pieces.insert(piece);
+            }
+        }
+    }
+
+    vocab.cache_token_to_piece = { "</s>", "" };
+    vocab.cache_token_to_piece.insert(vocab.cache_token_to_piece.end(), pieces.begin(), pieces.end());
+    vocab.n_vocab = vocab.cache_token_to_piece.size();
+    vocab.special_eog_ids = { 0 };
+}
+
+// greedy longest match of the pieces of the vocab
+static std::vector<llama_token> tokenize(const llama_vocab & vocab, const std::string & str) {
+    std::map<std::string, llama_token> piece_to_id;
+    for (uint32_t id = 2; id < vocab.n_vocab; ++id) {
+        piece_to_id[vocab.cache_token_to_piece[id]] = id;
+    }
+
+    const auto cpts = unicode_cpts_from_utf8(str);
+
+    std::vector<llama_token> tokens;
+    for (size_t i = 0; i < cpts.size();) {
+        std::string piece;
+        llama_token id   = -1;
+        size_t      n_id = 0;
+        for (size_t n = 0; n < 4 && i + n < cpts.size(); ++n) {
+            piece += unicode_cpt_to_utf8(cpts[i + n]);
+            const auto it = piece_to_id.find(piece);
+            if (it != piece_to_id.end()) {
+                id   = it->second;
+                n_id = n + 1;
+            }
+        }
+        assert(id != -1);
+        tokens.push_back(id);
+        i += n_id;
+    }
+
+    return tokens;
+}
+
+// samples the tokens of each string with a grammar over a vocab, and checks at every step that the masks path and the
+// per-candidate path of llama_grammar_apply_impl allow the same tokens
+static void test_apply_paths(const std::string & grammar_str, const std::vector<std::string> & passing_strings, const std::vector<std::string> & failing_strings) {
+    std::vector<std::string> strings = passing_strings;
+    strings.insert(strings.end(), failing_strings.begin(), failing_strings.end());
+
+    llama_vocab vocab;
+    build_vocab(vocab, strings);
+
+    llama_grammar * grammar = llama_grammar_init_impl(&vocab, grammar_str.c_str(), "root");
+    assert(grammar != nullptr);
+
+    for (size_t i_str = 0; i_str < strings.size(); ++i_str) {
+        const bool passing = i_str < passing_strings.size();
+        const auto tokens  = tokenize(vocab, strings[i_str]);
+
+        llama_grammar * g = llama_grammar_clone_impl(*grammar);
+
+        for (size_t i = 0; i <= tokens.size(); ++i) {
+            std::vector<llama_token_data> cur_masks;
+            for (llama_token id = 0; id < (llama_token) vocab.n_vocab; ++id) {
+                cur_masks.push_back({ id, 0.0f, 0.0f });
+            }
+            std::vector<llama_token_data> cur_cands = cur_masks;
+
+            llama_token_data_array cur_p_masks = { cur_masks.data(), cur_masks.size(), -1, false };
+            llama_token_data_array cur_p_cands = { cur_cands.data(), cur_cands.size(), -1, false };
+
+            assert(llama_grammar_apply_masks_impl(*g, &cur_p_masks));
+            llama_grammar_apply_candidates_impl(*g, &cur_p_cands);
+
+            for (size_t j = 0; j < cur_masks.size(); ++j) {
+                const bool allowed_masks = !std::isinf(cur_masks[j].logit);
+                const bool allowed_cands = !std::isinf(cur_cands[j].logit);
+                if (allowed_masks != allowed_cands) {
+                    fprintf(stderr, "  ❌ \"%s\" after %zu tokens: the token \"%s\" is %s by the masks and %s by the candidates\n",
+                            strings[i_str].c_str(), i, vocab.cache_token_to_piece[j].c_str(),
+                            allowed_masks ? "allowed" : "rejected", allowed_cands ? "allowed" : "rejected");
+                }
+                assert(allowed_masks == allowed_cands);
+            }
+
+            if (i == tokens.size()) {
+                // a complete match allows the end of generation
+                assert(!passing || !std::isinf(cur_masks[0].logit));
+                break;
+            }
+
+            if (std::isinf(cur_masks[tokens[i]].logit)) {
+                assert(!passing);
+                break;
+            }
+
+            llama_grammar_accept_impl(*g, tokens[i]);
+        }
+
+        llama_grammar_free_impl(g);
+    }
+
+    llama_grammar_free_impl(grammar);
+}
+
 static void test(const std::string & test_desc, const std::string & grammar_str, const std::vector<std::string> & passing_strings, const std::vector<std::string> & failing_strings) {
     fprintf(stderr, "⚫ Testing %s\n%s\n", test_desc.c_str(), grammar_str.c_str());
     fflush(stderr);
@@ -127,6 +247,8 @@ static void test(const std::string & test_desc, const std::string & grammar_str,
 
     // Clean up allocated memory
     llama_grammar_free_impl(grammar);
+
+    test_apply_paths(grammar_str, passing_strings, failing_strings);
 }
 static void test_grammar(const std::string & test_desc, const std::string & grammar_str, const std::vector<std::string> & passing_strings, const std::vector<std::string> & failing_strings) {
     test(test_desc + ". Grammar: " + grammar_str, grammar_str, passing_strings, failing_strings);
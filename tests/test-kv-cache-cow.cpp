@@ -0,0 +1,173 @@
+// tests the copy on write of the KV cells shared by several sequences: a fork made with llama_kv_cache_seq_cp is
+// shifted with seq_add or seq_div, and the sequence it was forked from must keep its positions and its K/V data,
+// while the shifted fork gets copies of the cells that give the same logits as a sequence shifted on its own
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <set>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const int n_seq_max = 4;
+static const int n_prompt  = 32;
+
+static llama_context * init_ctx(llama_model * model, uint32_t kv_block_size) {
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx         = 256;
+    cparams.n_batch       = 64;
+    cparams.n_seq_max     = n_seq_max;
+    cparams.kv_block_size = kv_block_size;
+    return llama_new_context_with_model(model, cparams);
+}
+
+static llama_token token_at(int pos) {
+    return 1 + (pos * 13) % 200;
+}
+
+// decodes the tokens at [p0, p0 + n) in seq_id and returns the logits of the last one
+static std::vector<float> decode(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, int n) {
+    llama_batch batch = llama_batch_init(64, 0, 1);
+    for (int i = 0; i < n; ++i) {
+        llama_batch_add(batch, token_at(p0 + i), p0 + i, { seq_id }, i == n - 1);
+    }
+    assert(llama_decode(ctx, batch) == 0);
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    std::vector<float> res(logits, logits + llama_n_vocab(llama_get_model(ctx)));
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+static std::vector<uint8_t> seq_state(llama_context * ctx, llama_seq_id seq_id) {
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, seq_id));
+    assert(llama_state_seq_get_data(ctx, state.data(), state.size(), seq_id) == state.size());
+    return state;
+}
+
+// the cells of each sequence, as (cell, pos) pairs
+static std::vector<std::set<std::pair<int32_t, llama_pos>>> seq_cells(const llama_context * ctx) {
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, n_seq_max);
+    llama_kv_cache_view_update(ctx, &view);
+
+    std::vector<std::set<std::pair<int32_t, llama_pos>>> res(n_seq_max);
+    for (int32_t i = 0; i < view.n_cells; ++i) {
+        for (int32_t s = 0; s < view.n_seq_max; ++s) {
+            const llama_seq_id seq_id = view.cells_sequences[i*view.n_seq_max + s];
+            if (seq_id >= 0) {
+                res[seq_id].insert({ i, view.cells[i].pos });
+            }
+        }
+    }
+
+    llama_kv_cache_view_free(&view);
+
+    return res;
+}
+
+static void check_logits(const std::vector<float> & a, const std::vector<float> & b) {
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        max_diff = std::max(max_diff, std::fabs(a[i] - b[i]));
+    }
+    if (max_diff > 1e-3f) {
+        fprintf(stderr, "%s: the logits differ by %f\n", __func__, max_diff);
+    }
+    assert(max_diff <= 1e-3f);
+}
+
+// shift applies the shift to a sequence, the next token of the shifted sequence is decoded at pos_next
+static void test_shift(llama_model * model, uint32_t kv_block_size, const char * name, void (*shift)(llama_context * ctx, llama_seq_id seq_id), llama_pos pos_next) {
+    fprintf(stderr, "%s: %s, kv_block_size = %u\n", __func__, name, kv_block_size);
+
+    // reference: the prompt is shifted in a sequence that shares nothing
+    std::vector<float> ref;
+    {
+        llama_context * ctx = init_ctx(model, kv_block_size);
+        decode(ctx, 1, 0, n_prompt);
+        shift(ctx, 1);
+        ref = decode(ctx, 1, pos_next, 1);
+        llama_free(ctx);
+    }
+
+    llama_context * ctx = init_ctx(model, kv_block_size);
+
+    decode(ctx, 0, 0, n_prompt);
+    llama_kv_cache_seq_cp(ctx, 0, 1, -1, -1);
+
+    const auto cells_before = seq_cells(ctx);
+    const auto state_before = seq_state(ctx, 0);
+    assert(cells_before[0] == cells_before[1]);
+
+    shift(ctx, 1);
+    llama_kv_cache_update(ctx);
+
+    const auto cells_after = seq_cells(ctx);
+
+    // the forked sequence keeps its cells, positions and K/V data
+    assert(cells_after[0] == cells_before[0]);
+    assert(seq_state(ctx, 0) == state_before);
+
+    // the shifted cells of the fork are copies: none of its cells with a new position is a cell of the other sequence
+    std::set<int32_t> cells_0;
+    for (const auto & c : cells_after[0]) {
+        cells_0.insert(c.first);
+    }
+    int n_copied = 0;
+    for (const auto & c : cells_after[1]) {
+        if (cells_before[1].count(c) == 0) {
+            assert(cells_0.count(c.first) == 0);
+            n_copied++;
+        }
+    }
+    assert(n_copied > 0);
+    assert(llama_get_kv_cache_used_cells(ctx) == (int32_t) (cells_0.size() + n_copied));
+
+    // the copies were shifted like the cells of a sequence of its own
+    check_logits(ref, decode(ctx, 1, pos_next, 1));
+
+    // and the forked sequence still continues as before the fork
+    llama_context * ctx_ref = init_ctx(model, kv_block_size);
+    decode(ctx_ref, 0, 0, n_prompt);
+    check_logits(decode(ctx_ref, 0, n_prompt, 1), decode(ctx, 0, n_prompt, 1));
+    llama_free(ctx_ref);
+
+    llama_free(ctx);
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(model_path, llama_model_default_params());
+    assert(model != nullptr);
+
+    for (uint32_t kv_block_size : { 0, 16 }) {
+        // context shift: drop [4, 12) and move the rest back
+        test_shift(model, kv_block_size, "seq_add", [](llama_context * ctx, llama_seq_id seq_id) {
+            assert(llama_kv_cache_seq_rm(ctx, seq_id, 4, 12));
+            llama_kv_cache_seq_add(ctx, seq_id, 12, -1, -8);
+        }, n_prompt - 8);
+
+        // self-extend style division of the positions after the first 8
+        test_shift(model, kv_block_size, "seq_div", [](llama_context * ctx, llama_seq_id seq_id) {
+            llama_kv_cache_seq_div(ctx, seq_id, 8, n_prompt, 2);
+        }, n_prompt / 2);
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
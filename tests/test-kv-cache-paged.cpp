@@ -0,0 +1,202 @@
+// runs the same decodes and sequence operations on a contiguous and on a paged KV cache: the cells can be placed
+// differently, but each cache must hold the same positions for each sequence and give the same logits
+// also checks that the state of a sequence can be saved and restored in the paged cache
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const int n_seq_max = 4;
+
+static llama_context * init_ctx(llama_model * model, uint32_t kv_block_size) {
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx         = 256;
+    cparams.n_batch       = 64;
+    cparams.n_seq_max     = n_seq_max;
+    cparams.kv_block_size = kv_block_size;
+    return llama_new_context_with_model(model, cparams);
+}
+
+// the positions and sequences of the used cells, in a canonical order
+static std::vector<std::pair<llama_pos, std::vector<llama_seq_id>>> cells(const llama_context * ctx) {
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, n_seq_max);
+    llama_kv_cache_view_update(ctx, &view);
+
+    std::vector<std::pair<llama_pos, std::vector<llama_seq_id>>> res;
+    for (int32_t i = 0; i < view.n_cells; ++i) {
+        std::vector<llama_seq_id> seqs;
+        for (int32_t s = 0; s < view.n_seq_max; ++s) {
+            const llama_seq_id seq_id = view.cells_sequences[i*view.n_seq_max + s];
+            if (seq_id >= 0) {
+                seqs.push_back(seq_id);
+            }
+        }
+        if (!seqs.empty()) {
+            std::sort(seqs.begin(), seqs.end());
+            res.emplace_back(view.cells[i].pos, seqs);
+        }
+    }
+    std::sort(res.begin(), res.end());
+
+    llama_kv_cache_view_free(&view);
+
+    return res;
+}
+
+// the positions of each sequence
+static std::vector<std::vector<llama_pos>> seq_positions(const llama_context * ctx) {
+    std::vector<std::vector<llama_pos>> res(n_seq_max);
+    for (const auto & cell : cells(ctx)) {
+        for (const llama_seq_id seq_id : cell.second) {
+            res[seq_id].push_back(cell.first);
+        }
+    }
+    return res;
+}
+
+static llama_token token_at(int seq, int pos) {
+    return 1 + (seq * 37 + pos * 11) % 200;
+}
+
+struct decode_item {
+    llama_seq_id seq_id;
+    llama_pos    p0;
+    int          n;
+};
+
+// decodes the tokens of each item in one batch and returns the logits of the last token of each item
+static std::vector<float> decode(llama_context * ctx, const std::vector<decode_item> & items) {
+    llama_batch batch = llama_batch_init(64, 0, 1);
+    for (const auto & item : items) {
+        for (int i = 0; i < item.n; ++i) {
+            llama_batch_add(batch, token_at(item.seq_id, item.p0 + i), item.p0 + i, { item.seq_id }, i == item.n - 1);
+        }
+    }
+    assert(llama_decode(ctx, batch) == 0);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    std::vector<float> res;
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        if (batch.logits[i]) {
+            const float * logits = llama_get_logits_ith(ctx, i);
+            res.insert(res.end(), logits, logits + n_vocab);
+        }
+    }
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+static void check_logits(const char * what, const std::vector<float> & a, const std::vector<float> & b) {
+    assert(a.size() == b.size());
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        max_diff = std::max(max_diff, std::fabs(a[i] - b[i]));
+    }
+    if (max_diff > 1e-3f) {
+        fprintf(stderr, "%s: %s: the logits differ by %f\n", __func__, what, max_diff);
+    }
+    assert(max_diff <= 1e-3f);
+}
+
+static void check_cells(const char * what, const llama_context * ctx_a, const llama_context * ctx_b) {
+    const auto cells_a = cells(ctx_a);
+    const auto cells_b = cells(ctx_b);
+    if (cells_a != cells_b) {
+        fprintf(stderr, "%s: %s: the caches hold different cells (%zu and %zu used)\n", __func__, what, cells_a.size(), cells_b.size());
+    }
+    assert(cells_a == cells_b);
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(model_path, llama_model_default_params());
+    assert(model != nullptr);
+
+    llama_context * ctx_cont  = init_ctx(model, 0);
+    llama_context * ctx_paged = init_ctx(model, 16);
+    assert(ctx_cont != nullptr && ctx_paged != nullptr);
+
+    llama_context * ctxs[2] = { ctx_cont, ctx_paged };
+
+    // applies the same step to both caches and compares them
+    auto step = [&](const char * what, auto && fn) {
+        const std::vector<float> res_cont  = fn(ctx_cont);
+        const std::vector<float> res_paged = fn(ctx_paged);
+        check_cells(what, ctx_cont, ctx_paged);
+        check_logits(what, res_cont, res_paged);
+    };
+
+    step("prompt", [](llama_context * ctx) { return decode(ctx, { { 0, 0, 40 } }); });
+
+    step("seq_cp of a prefix", [](llama_context * ctx) {
+        llama_kv_cache_seq_cp(ctx, 0, 1, 0, 20);
+        return std::vector<float>();
+    });
+
+    step("mixed batch", [](llama_context * ctx) { return decode(ctx, { { 1, 20, 6 }, { 2, 0, 9 }, { 0, 40, 1 } }); });
+
+    step("seq_rm", [](llama_context * ctx) {
+        assert(llama_kv_cache_seq_rm(ctx, 0, 5, 12));
+        return decode(ctx, { { 0, 41, 3 } });
+    });
+
+    step("seq_add", [](llama_context * ctx) {
+        llama_kv_cache_seq_add(ctx, 1, 10, -1, 7);
+        llama_kv_cache_seq_add(ctx, 2, 4, -1, -2);
+        return decode(ctx, { { 1, 33, 2 }, { 2, 7, 2 } });
+    });
+
+    step("seq_cp of a whole sequence", [](llama_context * ctx) {
+        llama_kv_cache_seq_cp(ctx, 1, 3, -1, -1);
+        return decode(ctx, { { 3, 35, 4 }, { 1, 35, 1 } });
+    });
+
+    // the state of a sequence is saved, the sequence is removed and restored
+    for (llama_context * ctx : ctxs) {
+        const std::vector<float> ref = decode(ctx, { { 3, 39, 1 } });
+        assert(llama_kv_cache_seq_rm(ctx, 3, 39, -1));
+        const auto positions_ref = seq_positions(ctx);
+
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, 3));
+        assert(llama_state_seq_get_data(ctx, state.data(), state.size(), 3) == state.size());
+
+        assert(llama_kv_cache_seq_rm(ctx, 3, -1, -1));
+        assert(llama_state_seq_set_data(ctx, state.data(), state.size(), 3) == state.size());
+
+        // the restored cells are no longer shared with the sequence it was copied from
+        assert(seq_positions(ctx) == positions_ref);
+        check_logits("state restored", ref, decode(ctx, { { 3, 39, 1 } }));
+    }
+    check_cells("state restored", ctx_cont, ctx_paged);
+
+    step("seq_keep", [](llama_context * ctx) {
+        llama_kv_cache_seq_keep(ctx, 1);
+        return decode(ctx, { { 1, 36, 5 } });
+    });
+
+    step("reuse of the freed cells", [](llama_context * ctx) { return decode(ctx, { { 0, 0, 30 }, { 2, 0, 12 } }); });
+
+    llama_free(ctx_paged);
+    llama_free(ctx_cont);
+    llama_free_model(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
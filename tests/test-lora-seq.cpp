@@ -0,0 +1,224 @@
+// tests the LoRA adapters of the sequences: a sequence with llama_lora_adapter_set_seq must give the same logits as
+// a context with the same adapter and scale set with llama_lora_adapter_set, also in a batch mixed with sequences that
+// use another adapter or none, and llama_lora_adapter_clear_seq must restore the logits of the base model
+// the adapters are random and of different ranks, so that the lower rank is zero padded in the stack of the context
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const int n_seq_max = 4;
+static const int n_prompt  = 12;
+
+// the weights with an adapter, the output layer is applied to the rows of the outputs only
+static const char * lora_weights[] = { "attn_q", "attn_v", "ffn_up", "output" };
+
+// writes an adapter of the given rank with random A and B for the weights above, and loads it
+static llama_lora_adapter * init_adapter(llama_model * model, int64_t rank, float alpha, uint32_t seed) {
+    const std::string fname = "test-lora-seq-rank" + std::to_string(rank) + ".gguf.tmp";
+
+    char arch[64];
+    assert(llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) > 0);
+
+    std::vector<std::string> names;
+    for (const char * weight : lora_weights) {
+        if (std::string(weight) == "output") {
+            names.push_back("output.weight");
+            continue;
+        }
+        for (int il = 0; il < llama_n_layer(model); ++il) {
+            names.push_back("blk." + std::to_string(il) + "." + weight + ".weight");
+        }
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 2*names.size()*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct gguf_context * gguf = gguf_init_empty();
+    gguf_set_val_str(gguf, "general.type", "adapter");
+    gguf_set_val_str(gguf, "general.architecture", arch);
+    gguf_set_val_str(gguf, "adapter.type", "lora");
+    gguf_set_val_f32(gguf, "adapter.lora.alpha", alpha);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 0.05f);
+
+    std::vector<std::vector<float>> data;
+    for (const auto & name : names) {
+        const struct ggml_tensor * w = llama_get_model_tensor(model, name.c_str());
+        assert(w != nullptr);
+
+        struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, w->ne[0], rank);
+        struct ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, rank, w->ne[1]);
+        ggml_set_name(a, (name + ".lora_a").c_str());
+        ggml_set_name(b, (name + ".lora_b").c_str());
+
+        for (struct ggml_tensor * t : { a, b }) {
+            data.emplace_back(ggml_nelements(t));
+            std::generate(data.back().begin(), data.back().end(), [&]() { return dist(rng); });
+            gguf_add_tensor(gguf, t);
+            gguf_set_tensor_data(gguf, t->name, data.back().data(), ggml_nbytes(t));
+        }
+    }
+
+    gguf_write_to_file(gguf, fname.c_str(), false);
+    gguf_free(gguf);
+    ggml_free(ctx);
+
+    llama_lora_adapter * adapter = llama_lora_adapter_init(model, fname.c_str());
+    assert(adapter != nullptr);
+
+    std::remove(fname.c_str());
+
+    return adapter;
+}
+
+static llama_context * init_ctx(llama_model * model) {
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 64;
+    cparams.n_seq_max = n_seq_max;
+    return llama_new_context_with_model(model, cparams);
+}
+
+// decodes the same prompt in each sequence, in one batch, and returns the logits of the last token of each sequence
+static std::vector<std::vector<float>> decode(llama_context * ctx, const std::vector<llama_seq_id> & seq_ids) {
+    llama_kv_cache_clear(ctx);
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+    for (const llama_seq_id seq_id : seq_ids) {
+        for (int i = 0; i < n_prompt; ++i) {
+            llama_batch_add(batch, 1 + (i * 17) % 200, i, { seq_id }, i == n_prompt - 1);
+        }
+    }
+    assert(llama_decode(ctx, batch) == 0);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    std::vector<std::vector<float>> res;
+    for (size_t s = 0; s < seq_ids.size(); ++s) {
+        const float * logits = llama_get_logits_ith(ctx, (s + 1)*n_prompt - 1);
+        res.emplace_back(logits, logits + n_vocab);
+    }
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+static float max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    assert(a.size() == b.size());
+    float res = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        res = std::max(res, std::fabs(a[i] - b[i]));
+    }
+    return res;
+}
+
+static void check_logits(const char * what, const std::vector<float> & a, const std::vector<float> & b) {
+    const float diff = max_diff(a, b);
+    if (diff > 1e-3f) {
+        fprintf(stderr, "%s: %s: the logits differ by %f\n", __func__, what, diff);
+    }
+    assert(diff <= 1e-3f);
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(model_path, llama_model_default_params());
+    assert(model != nullptr);
+
+    llama_lora_adapter * lora_a = init_adapter(model, 4, 8.0f, 1);
+    llama_lora_adapter * lora_b = init_adapter(model, 8, 0.0f, 2);
+
+    const float scale_a = 0.7f;
+    const float scale_b = 1.0f;
+
+    // references: the base model and the adapters of the context
+    std::vector<float> ref_base;
+    std::vector<float> ref_a;
+    std::vector<float> ref_b;
+    std::vector<float> ref_ab;
+    {
+        llama_context * ctx = init_ctx(model);
+
+        ref_base = decode(ctx, { 0 })[0];
+
+        llama_lora_adapter_set(ctx, lora_a, scale_a);
+        ref_a = decode(ctx, { 0 })[0];
+
+        llama_lora_adapter_set(ctx, lora_b, scale_b);
+        ref_ab = decode(ctx, { 0 })[0];
+
+        assert(llama_lora_adapter_remove(ctx, lora_a) == 0);
+        ref_b = decode(ctx, { 0 })[0];
+
+        llama_free(ctx);
+    }
+
+    // the adapters must change the logits for the comparisons to mean anything
+    assert(max_diff(ref_base, ref_a) > 1e-2f);
+    assert(max_diff(ref_base, ref_b) > 1e-2f);
+    assert(max_diff(ref_a,    ref_b) > 1e-2f);
+
+    llama_context * ctx = init_ctx(model);
+
+    // one sequence with an adapter
+    assert(llama_lora_adapter_set_seq(ctx, lora_a, scale_a, 0) == 0);
+    check_logits("one sequence", ref_a, decode(ctx, { 0 })[0]);
+
+    // a mixed batch: the adapter of rank 4 is padded to rank 8 in the stack, and sequence 2 has no adapter
+    assert(llama_lora_adapter_set_seq(ctx, lora_b, scale_b, 1) == 0);
+    assert(llama_lora_adapter_set_seq(ctx, lora_a, scale_a, 3) == 0);
+    assert(llama_lora_adapter_set_seq(ctx, lora_b, scale_b, 3) == 0);
+    {
+        const auto res = decode(ctx, { 0, 1, 2, 3 });
+        check_logits("mixed batch, rank 4",     ref_a,    res[0]);
+        check_logits("mixed batch, rank 8",     ref_b,    res[1]);
+        check_logits("mixed batch, no adapter", ref_base, res[2]);
+        check_logits("mixed batch, both",       ref_ab,   res[3]);
+    }
+
+    // clearing the adapters of a sequence restores the base model for it only
+    llama_lora_adapter_clear_seq(ctx, 0);
+    {
+        const auto res = decode(ctx, { 0, 1 });
+        check_logits("cleared sequence", ref_base, res[0]);
+        check_logits("other sequence",   ref_b,    res[1]);
+    }
+
+    llama_lora_adapter_clear_seq(ctx, -1);
+    {
+        const auto res = decode(ctx, { 0, 1, 3 });
+        check_logits("all cleared, sequence 0", ref_base, res[0]);
+        check_logits("all cleared, sequence 1", ref_base, res[1]);
+        check_logits("all cleared, sequence 3", ref_base, res[2]);
+    }
+
+    llama_free(ctx);
+    llama_lora_adapter_free(lora_b);
+    llama_lora_adapter_free(lora_a);
+    llama_free_model(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
@@ -15,6 +15,28 @@ int main(int argc, char *argv[] ) {
     fclose(file);
 
     llama_backend_init();
+
+    // the progress of a complete load only increases, from the parallel reads to the end
+    {
+        static float progress_last = 0.0f;
+        auto params = llama_model_default_params();
+        params.use_mmap = false;
+        params.progress_callback = [](float progress, void * ctx){
+            (void) ctx;
+            if (progress < progress_last) {
+                fprintf(stderr, "progress went back from %f to %f\n", progress_last, progress);
+                exit(EXIT_FAILURE);
+            }
+            progress_last = progress;
+            return true;
+        };
+        auto * model = llama_load_model_from_file(model_path, params);
+        if (model == nullptr || progress_last != 1.0f) {
+            return EXIT_FAILURE;
+        }
+        llama_free_model(model);
+    }
+
     auto params = llama_model_params{};
     params.use_mmap = false;
     params.progress_callback = [](float progress, void * ctx){
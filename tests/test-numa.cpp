@@ -0,0 +1,135 @@
+// smoke test of the NUMA distribute strategy: the matrices are split across the nodes with ggml_numa_distribute_tensor
+// and the mul_mat threads compute the rows of their node - the results must not depend on the number of threads
+// on a single node system, the split is disabled and the test only checks that the calls are harmless
+
+#include "ggml.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static std::vector<float> compute(struct ggml_context * ctx, struct ggml_tensor * out, int n_threads) {
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads, nullptr);
+
+    std::vector<uint8_t> work_data(cplan.work_size);
+    cplan.work_data = work_data.data();
+
+    ggml_graph_compute(gf, &cplan);
+
+    const float * data = (const float *) out->data;
+    return std::vector<float>(data, data + ggml_nelements(out));
+}
+
+// w * x with the data of w at w_data, or in the context if null
+static bool test_mul_mat(ggml_type type, void * w_data, const std::vector<uint8_t> & w_src, int64_t n_embd, int64_t n_rows) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 256*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx, type, n_embd, n_rows);
+    if (w_data != nullptr) {
+        w->data = w_data;
+    } else {
+        memcpy(w->data, w_src.data(), ggml_nbytes(w));
+    }
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, 1);
+
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (int64_t i = 0; i < n_embd; i++) {
+        ((float *) x->data)[i] = dist(rng);
+    }
+
+    struct ggml_tensor * out = ggml_mul_mat(ctx, w, x);
+
+    // one thread computes all the rows, whatever the number of nodes
+    const std::vector<float> ref = compute(ctx, out, 1);
+
+    ggml_numa_distribute_tensor(w);
+
+    bool ok = true;
+    for (int n_threads : { 2, 3, 4, 8 }) {
+        const std::vector<float> res = compute(ctx, out, n_threads);
+        if (res != ref) {
+            fprintf(stderr, "%s: %s, %s: the results with %d threads differ from 1 thread\n", __func__,
+                    ggml_type_name(type), w_data ? "mapped file" : "heap", n_threads);
+            ok = false;
+        }
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    ggml_numa_init(GGML_NUMA_STRATEGY_DISTRIBUTE);
+
+    fprintf(stderr, "%s: NUMA nodes: %s\n", __func__, ggml_is_numa() ? "several" : "one");
+
+    const int64_t n_embd = 1024;
+    const int64_t n_rows = 1024;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    std::vector<float> w_f32(n_embd*n_rows);
+    for (auto & v : w_f32) {
+        v = dist(rng);
+    }
+
+    bool ok = true;
+
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_Q4_0 }) {
+        std::vector<uint8_t> w_src(ggml_row_size(type, n_embd)*n_rows);
+        if (type == GGML_TYPE_F32) {
+            memcpy(w_src.data(), w_f32.data(), w_src.size());
+        } else {
+            ggml_quantize_chunk(type, w_f32.data(), w_src.data(), 0, n_rows, n_embd, nullptr);
+        }
+
+        ok = test_mul_mat(type, nullptr, w_src, n_embd, n_rows) && ok;
+
+#ifdef __linux__
+        // the weights of a model loaded with mmap are in a shared file mapping
+        char path[] = "/tmp/test-numa-XXXXXX";
+        const int fd = mkstemp(path);
+        if (fd == -1 || write(fd, w_src.data(), w_src.size()) != (ssize_t) w_src.size()) {
+            fprintf(stderr, "%s: failed to write %s\n", __func__, path);
+            return 1;
+        }
+        void * addr = mmap(NULL, w_src.size(), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        unlink(path);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "%s: failed to map %s\n", __func__, path);
+            return 1;
+        }
+
+        ok = test_mul_mat(type, addr, w_src, n_embd, n_rows) && ok;
+
+        munmap(addr, w_src.size());
+#endif
+    }
+
+    fprintf(stderr, "%s: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
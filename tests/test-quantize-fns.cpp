@@ -21,6 +21,7 @@ constexpr float MAX_QUANTIZATION_TOTAL_ERROR_3BITS = 0.0040f;
 constexpr float MAX_QUANTIZATION_TOTAL_ERROR_3BITS_XXS = 0.0050f;
 constexpr float MAX_DOT_PRODUCT_ERROR = 0.02f;
 constexpr float MAX_DOT_PRODUCT_ERROR_LOWBIT = 0.04f;
+constexpr float MAX_DOT_PRODUCT_ERROR_Q2_1 = 0.05f; // 4 levels per block of 32, without sub-block scales
 constexpr float MAX_DOT_PRODUCT_ERROR_TERNARY = 0.15f;
 
 static const char* RESULT_STR[] = {"ok", "FAILED"};
@@ -68,6 +69,27 @@ static float reference_quantization_error(ggml_type_traits_t & qfns, size_t test
     return array_rmse(tmp_out.data(), tmp_out_ref.data(), test_size);
 }
 
+// Error of the fused dequantize + accumulate against dequantizing first
+static float vec_mad_error(ggml_type_traits_t & qfns, size_t test_size, const float * test_data1, const float * test_data2) {
+    std::vector<uint8_t> tmp_q(2*test_size);
+    std::vector<float> tmp_out(test_size);
+    std::vector<float> tmp_out_ref(test_size);
+
+    const float v = 0.7f;
+
+    qfns.from_float(test_data1, tmp_q.data(), test_size);
+    qfns.to_float(tmp_q.data(), tmp_out_ref.data(), test_size);
+
+    for (size_t i = 0; i < test_size; i++) {
+        tmp_out[i]     = test_data2[i];
+        tmp_out_ref[i] = test_data2[i] + v*tmp_out_ref[i];
+    }
+
+    qfns.vec_mad(tmp_q.data(), tmp_out.data(), test_size, v);
+
+    return array_rmse(tmp_out.data(), tmp_out_ref.data(), test_size);
+}
+
 static float dot_product(const float * a1, const float * a2, size_t test_size) {
     double sum = 0;
     for (size_t i = 0; i < test_size; i++) {
@@ -149,8 +171,10 @@ int main(int argc, char * argv[]) {
                 type == GGML_TYPE_TQ1_0   ? MAX_QUANTIZATION_TOTAL_ERROR_TERNARY :
                 type == GGML_TYPE_TQ2_0   ? MAX_QUANTIZATION_TOTAL_ERROR_TERNARY :
                 type == GGML_TYPE_Q2_K    ? MAX_QUANTIZATION_TOTAL_ERROR_2BITS :
+                type == GGML_TYPE_Q2_1    ? MAX_QUANTIZATION_TOTAL_ERROR_2BITS :
                 type == GGML_TYPE_IQ2_S   ? MAX_QUANTIZATION_TOTAL_ERROR_2BITS :
                 type == GGML_TYPE_Q3_K    ? MAX_QUANTIZATION_TOTAL_ERROR_3BITS :
+                type == GGML_TYPE_Q3_1    ? MAX_QUANTIZATION_TOTAL_ERROR_3BITS :
                 type == GGML_TYPE_IQ3_S   ? MAX_QUANTIZATION_TOTAL_ERROR_3BITS :
                 type == GGML_TYPE_IQ3_XXS ? MAX_QUANTIZATION_TOTAL_ERROR_3BITS_XXS : MAX_QUANTIZATION_TOTAL_ERROR;
             failed = !(total_error < max_quantization_error);
@@ -172,12 +196,23 @@ int main(int argc, char * argv[]) {
                                           ? MAX_DOT_PRODUCT_ERROR_LOWBIT
                                           : type == GGML_TYPE_TQ1_0 || type == GGML_TYPE_TQ2_0
                                           ? MAX_DOT_PRODUCT_ERROR_TERNARY
+                                          : type == GGML_TYPE_Q2_1
+                                          ? MAX_DOT_PRODUCT_ERROR_Q2_1
                                           : MAX_DOT_PRODUCT_ERROR;
             failed = !(vec_dot_error < max_allowed_error);
             num_failed += failed;
             if (failed || verbose) {
                 printf("%5s dot product error:              %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], vec_dot_error);
             }
+
+            if (qfns.vec_mad) {
+                const float mad_error = vec_mad_error(qfns, test_size, test_data.data(), test_data2.data());
+                failed = !(mad_error < MAX_QUANTIZATION_REFERENCE_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s fused dequantize + mad error:   %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], mad_error);
+                }
+            }
         }
     }
 
@@ -0,0 +1,104 @@
+// compares the mul_mat results of Q4_0 weights in the repack buffer type with the same weights in a plain CPU buffer,
+// for one column (gemv) and several columns (gemm, with and without a remainder of columns)
+// on a CPU without repacked kernels, the weights are stored unchanged and the test only checks that they still work
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static std::vector<float> mul_mat(ggml_backend_t backend, ggml_backend_buffer_type_t buft_w,
+        const std::vector<uint8_t> & w_data, const std::vector<float> & x_data, int64_t n_embd, int64_t n_rows, int64_t n_cols) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ ggml_tensor_overhead()*8 + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+
+    struct ggml_context * ctx_w = ggml_init(params);
+    struct ggml_context * ctx   = ggml_init(params);
+
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx_w, GGML_TYPE_Q4_0, n_embd, n_rows);
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx,   GGML_TYPE_F32,  n_embd, n_cols);
+
+    struct ggml_tensor * out = ggml_mul_mat(ctx, w, x);
+
+    ggml_backend_buffer_t buf_w = ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, buft_w);
+    ggml_backend_buffer_t buf   = ggml_backend_alloc_ctx_tensors(ctx, backend);
+
+    ggml_backend_tensor_set(w, w_data.data(), 0, w_data.size());
+    ggml_backend_tensor_set(x, x_data.data(), 0, ggml_nbytes(x));
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_backend_graph_compute(backend, gf);
+
+    std::vector<float> res(ggml_nelements(out));
+    ggml_backend_tensor_get(out, res.data(), 0, ggml_nbytes(out));
+
+    ggml_backend_buffer_free(buf);
+    ggml_backend_buffer_free(buf_w);
+    ggml_free(ctx);
+    ggml_free(ctx_w);
+
+    return res;
+}
+
+// normalized mean squared error, as in test-backend-ops
+static double nmse(const std::vector<float> & a, const std::vector<float> & b) {
+    double mse_a_b = 0.0;
+    double mse_a_0 = 0.0;
+    for (size_t i = 0; i < a.size(); i++) {
+        mse_a_b += (a[i] - b[i]) * (a[i] - b[i]);
+        mse_a_0 += a[i] * a[i];
+    }
+    return mse_a_b / mse_a_0;
+}
+
+int main(void) {
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_backend_cpu_set_n_threads(backend, 2);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    bool ok = true;
+
+    // 60 rows cannot be repacked into groups of 8 rows
+    for (int64_t n_rows : { 64, 256, 60 }) {
+        const int64_t n_embd = 512;
+
+        std::vector<float> w_f32(n_embd*n_rows);
+        for (auto & v : w_f32) {
+            v = dist(rng);
+        }
+        std::vector<uint8_t> w_q(ggml_row_size(GGML_TYPE_Q4_0, n_embd)*n_rows);
+        ggml_quantize_chunk(GGML_TYPE_Q4_0, w_f32.data(), w_q.data(), 0, n_rows, n_embd, nullptr);
+
+        for (int64_t n_cols : { 1, 4, 7, 32 }) {
+            std::vector<float> x(n_embd*n_cols);
+            for (auto & v : x) {
+                v = dist(rng);
+            }
+
+            const std::vector<float> ref = mul_mat(backend, ggml_backend_cpu_buffer_type(),        w_q, x, n_embd, n_rows, n_cols);
+            const std::vector<float> res = mul_mat(backend, ggml_backend_cpu_repack_buffer_type(), w_q, x, n_embd, n_rows, n_cols);
+
+            const double err = nmse(ref, res);
+            const bool   ok_case = err < 1e-7;
+            fprintf(stderr, "%s: rows = %3lld, cols = %2lld: nmse = %.3g %s\n", __func__,
+                    (long long) n_rows, (long long) n_cols, err, ok_case ? "OK" : "FAILED");
+            ok = ok && ok_case;
+        }
+    }
+
+    ggml_backend_free(backend);
+
+    fprintf(stderr, "%s: %s\n", __func__, ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+// tests that sampling several outputs at once with llama_sampler_sample_batch and gpt_sampler_sample_batch gives the
+// same tokens as sampling each output on its own, with identical samplers, over a few steps of generation
+
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "get-model.h"
+
+#include <cstdio>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static llama_sampler * init_sampler(uint32_t seed) {
+    llama_sampler * smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(1.5f));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+    return smpl;
+}
+
+static gpt_sampler * init_gpt_sampler(const llama_model * model, uint32_t seed) {
+    gpt_sampler_params params;
+    params.seed  = seed;
+    params.temp  = 1.5f;
+    params.top_k = 40;
+    return gpt_sampler_init(model, params);
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(model_path, mparams);
+    assert(model != nullptr);
+
+    const int n_seq   = 6;
+    const int n_steps = 8;
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_seq_max = n_seq;
+    cparams.n_threads = 4;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx != nullptr);
+
+    std::vector<llama_sampler *> smpls_batch;
+    std::vector<llama_sampler *> smpls_single;
+    std::vector<gpt_sampler *>   gsmpls_batch;
+    std::vector<gpt_sampler *>   gsmpls_single;
+    for (int s = 0; s < n_seq; ++s) {
+        smpls_batch.push_back(init_sampler(100 + s));
+        smpls_single.push_back(init_sampler(100 + s));
+        gsmpls_batch.push_back(init_gpt_sampler(model, 200 + s));
+        gsmpls_single.push_back(init_gpt_sampler(model, 200 + s));
+    }
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    // a different prompt for each sequence
+    std::vector<int> n_past(n_seq, 0);
+    for (int s = 0; s < n_seq; ++s) {
+        for (int i = 0; i < 4; ++i) {
+            const llama_token token = (llama_token) ((s * 31 + i * 7 + 1) % llama_n_vocab(model));
+            llama_batch_add(batch, token, n_past[s]++, { s }, i == 3);
+        }
+    }
+
+    for (int step = 0; step < n_steps; ++step) {
+        assert(llama_decode(ctx, batch) == 0);
+
+        std::vector<int32_t> idxs;
+        for (int32_t i = 0; i < batch.n_tokens; ++i) {
+            if (batch.logits[i]) {
+                idxs.push_back(i);
+            }
+        }
+        assert((int) idxs.size() == n_seq);
+
+        std::vector<llama_token> tokens(n_seq);
+        llama_sampler_sample_batch(smpls_batch.data(), ctx, idxs.data(), n_seq, tokens.data());
+
+        const std::vector<llama_token> gtokens = gpt_sampler_sample_batch(gsmpls_batch, ctx, std::vector<int>(idxs.begin(), idxs.end()));
+
+        for (int s = 0; s < n_seq; ++s) {
+            const llama_token token = llama_sampler_sample(smpls_single[s], ctx, idxs[s]);
+            if (token != tokens[s]) {
+                fprintf(stderr, "%s: step %d, sequence %d: llama_sampler_sample_batch sampled %d instead of %d\n", __func__, step, s, tokens[s], token);
+            }
+            assert(token == tokens[s]);
+
+            const llama_token gtoken = gpt_sampler_sample(gsmpls_single[s], ctx, idxs[s]);
+            if (gtoken != gtokens[s]) {
+                fprintf(stderr, "%s: step %d, sequence %d: gpt_sampler_sample_batch sampled %d instead of %d\n", __func__, step, s, gtokens[s], gtoken);
+            }
+            assert(gtoken == gtokens[s]);
+
+            gpt_sampler_accept(gsmpls_batch[s],  gtokens[s], true);
+            gpt_sampler_accept(gsmpls_single[s], gtoken,     true);
+        }
+
+        llama_batch_clear(batch);
+        for (int s = 0; s < n_seq; ++s) {
+            llama_batch_add(batch, tokens[s], n_past[s]++, { s }, true);
+        }
+    }
+
+    llama_batch_free(batch);
+
+    for (int s = 0; s < n_seq; ++s) {
+        llama_sampler_free(smpls_batch[s]);
+        llama_sampler_free(smpls_single[s]);
+        gpt_sampler_free(gsmpls_batch[s]);
+        gpt_sampler_free(gsmpls_single[s]);
+    }
+
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include "ggml.h"
 #include "llama.h"
+#include "sampling.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -7,6 +8,8 @@
 
 #include <algorithm>
 #include <cmath>
+#include <numeric>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -248,6 +251,144 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+// the candidates selected in the graph with llama_set_output_top_k must be the first k of a full argsort of the logits,
+// with the ties ordered by token id
+static void test_argsort_top_k(int64_t n_vocab, int64_t n_rows, int k, bool ties) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ (size_t) (n_vocab*n_rows*sizeof(float) + n_rows*k*sizeof(int32_t)) + 1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * logits = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_vocab, n_rows);
+    struct ggml_tensor * ids    = ggml_argsort_top_k(ctx, logits, k);
+
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    float * data = (float *) logits->data;
+    for (int64_t i = 0; i < n_vocab*n_rows; i++) {
+        // few distinct values with ties, negative values included
+        data[i] = ties ? std::round(dist(rng)) : dist(rng);
+    }
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, ids);
+    ggml_graph_compute_with_ctx(ctx, gf, 4);
+
+    std::vector<int32_t> expected(n_vocab);
+    for (int64_t r = 0; r < n_rows; r++) {
+        const float * row = data + r*n_vocab;
+
+        std::iota(expected.begin(), expected.end(), 0);
+        std::stable_sort(expected.begin(), expected.end(), [row](int32_t a, int32_t b) { return row[a] > row[b]; });
+
+        const int32_t * result = (const int32_t *) ((const char *) ids->data + r*ids->nb[1]);
+        for (int i = 0; i < k; i++) {
+            if (result[i] != expected[i]) {
+                printf("%s: n_vocab = %lld, k = %d, ties = %d: row %lld, candidate %d is %d instead of %d\n",
+                        __func__, (long long) n_vocab, k, ties, (long long) r, i, result[i], expected[i]);
+                GGML_ASSERT(false);
+            }
+        }
+    }
+
+    ggml_free(ctx);
+}
+
+// large arrays of candidates are sorted with a radix sort over the bits of the logits: the order must be the one of
+// a stable sort, with negative and infinite logits, and ties kept in the order of the candidates
+static void test_sort_large(size_t n_vocab, bool ties) {
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    std::vector<llama_token> ids(n_vocab);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::shuffle(ids.begin(), ids.end(), rng);
+
+    std::vector<llama_token_data> data(n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        const float logit = ties ? std::round(dist(rng)) : dist(rng);
+        data[i] = { ids[i], logit, 0.0f };
+    }
+    data[n_vocab/3].logit = -INFINITY;
+    if (ties) {
+        data[n_vocab/2].logit     =  1e30f;
+        data[n_vocab/2 + 1].logit = -1e30f;
+    }
+
+    std::vector<llama_token_data> expected = data;
+    std::stable_sort(expected.begin(), expected.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    std::vector<llama_token_data> cur = data;
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+    APPLY(llama_sampler_init_softmax(), &cur_p);
+
+    GGML_ASSERT(cur_p.sorted && cur_p.size == n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        if (cur[i].id != expected[i].id || cur[i].logit != expected[i].logit) {
+            printf("%s: n_vocab = %zu, ties = %d: candidate %zu is %d (%f) instead of %d (%f)\n", __func__,
+                    n_vocab, ties, i, cur[i].id, cur[i].logit, expected[i].id, expected[i].logit);
+            GGML_ASSERT(false);
+        }
+    }
+
+    // the partial sort of top-p keeps the same tokens as the cut of the sorted softmax
+    if (!ties) {
+        double sum = 0.0;
+        for (const auto & td : data) {
+            sum += expf(td.logit - expected[0].logit);
+        }
+        size_t n_keep = 0;
+        double cum_sum = 0.0;
+        while (n_keep < n_vocab && cum_sum < 0.9) {
+            cum_sum += (float) (expf(expected[n_keep].logit - expected[0].logit) / sum);
+            n_keep++;
+        }
+
+        cur = data;
+        cur_p = { cur.data(), cur.size(), -1, false };
+        APPLY(llama_sampler_init_top_p(0.9f, 1), &cur_p);
+
+        GGML_ASSERT(cur_p.size == n_keep);
+        for (size_t i = 0; i < n_keep; i++) {
+            GGML_ASSERT(cur[i].id == expected[i].id);
+        }
+    }
+}
+
+// the candidates selected in the graph are not used when the grammar resampling or the other samplers need all the tokens
+static void test_needs_full_logits() {
+    const int32_t n_top_k = 40;
+
+    gpt_sampler_params params;
+    params.penalty_repeat = 1.0f;
+    GGML_ASSERT(!gpt_sampler_needs_full_logits(params, n_top_k));
+
+    params.n_probs = n_top_k;
+    GGML_ASSERT(!gpt_sampler_needs_full_logits(params, n_top_k));
+    params.n_probs = n_top_k + 1;
+    GGML_ASSERT( gpt_sampler_needs_full_logits(params, n_top_k));
+    params.n_probs = 0;
+
+    params.grammar = "root ::= \"a\"";
+    GGML_ASSERT( gpt_sampler_needs_full_logits(params, n_top_k));
+    params.grammar.clear();
+
+    params.logit_bias.push_back({ 0, -INFINITY });
+    GGML_ASSERT( gpt_sampler_needs_full_logits(params, n_top_k));
+    params.logit_bias.clear();
+
+    params.penalty_present = 0.5f;
+    GGML_ASSERT( gpt_sampler_needs_full_logits(params, n_top_k));
+    params.penalty_last_n = 0;
+    GGML_ASSERT(!gpt_sampler_needs_full_logits(params, n_top_k));
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -352,6 +493,19 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_needs_full_logits();
+
+    test_sort_large(  4096, false);
+    test_sort_large(  4096, true);
+    test_sort_large(152064, false);
+    test_sort_large(152064, true);
+
+    test_argsort_top_k(32000, 5,    1, false);
+    test_argsort_top_k(32000, 5,   40, false);
+    test_argsort_top_k(32000, 5,   40, true);
+    test_argsort_top_k(32000, 3, 1000, true);
+    test_argsort_top_k(   50, 7,   50, true);
+
     printf("OK\n");
 
     test_perf();
@@ -0,0 +1,163 @@
+// tests the token prefix tree of the server prompt cache: insertion with edge splits, longest prefix lookup,
+// and removal with the merge of the nodes that no longer branch, against a brute force lookup over the entries
+
+#include "prefix-tree.hpp"
+
+#include <cstdio>
+#include <random>
+#include <set>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static size_t find_brute_force(const token_prefix_tree & tree, const std::vector<llama_token> & tokens, std::set<int32_t> & ids) {
+    size_t best = 0;
+    ids.clear();
+    for (const auto & entry : tree.entries) {
+        size_t n = 0;
+        while (n < entry.second.size() && n < tokens.size() && entry.second[n] == tokens[n]) {
+            n++;
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (n > best) {
+            best = n;
+            ids.clear();
+        }
+        if (n == best) {
+            ids.insert(entry.first);
+        }
+    }
+    return best;
+}
+
+// the number of nodes, and checks that every node except the root has a non-empty edge and at least one entry,
+// and that a node with a single child has more entries than the child (otherwise they should be merged)
+static size_t check_nodes(const token_prefix_tree::node & nd, bool is_root) {
+    size_t n = 1;
+    if (!is_root) {
+        assert(!nd.edge.empty());
+        assert(!nd.ids.empty());
+    }
+    if (!is_root && nd.children.size() == 1) {
+        assert(nd.children.begin()->second->ids != nd.ids);
+    }
+    for (const auto & child : nd.children) {
+        assert(child.first == child.second->edge[0]);
+        for (int32_t id : child.second->ids) {
+            assert(is_root || nd.ids.count(id) == 1);
+        }
+        n += check_nodes(*child.second, false);
+    }
+    return n;
+}
+
+static void test_basic() {
+    token_prefix_tree tree;
+
+    std::set<int32_t> ids;
+
+    assert(tree.find({ 1, 2, 3 }, ids) == 0 && ids.empty());
+
+    tree.insert(1, { 1, 2, 3, 4 });
+    assert(tree.find({ 1, 2, 3, 4, 5 }, ids) == 4 && ids == std::set<int32_t>({ 1 }));
+    assert(tree.find({ 1, 2, 7 },       ids) == 2 && ids == std::set<int32_t>({ 1 }));
+    assert(tree.find({ 2, 3 },          ids) == 0 && ids.empty());
+
+    // splits the edge of the first entry after 2 tokens
+    tree.insert(2, { 1, 2, 5 });
+    assert(tree.find({ 1, 2, 9 },    ids) == 2 && ids == std::set<int32_t>({ 1, 2 }));
+    assert(tree.find({ 1, 2, 5, 6 }, ids) == 3 && ids == std::set<int32_t>({ 2 }));
+    assert(tree.find({ 1, 2, 3 },    ids) == 3 && ids == std::set<int32_t>({ 1 }));
+
+    // an entry that is a prefix of another one
+    tree.insert(3, { 1, 2 });
+    assert(tree.find({ 1, 2 }, ids) == 2 && ids == std::set<int32_t>({ 1, 2, 3 }));
+    assert(tree.size() == 3);
+
+    // inserting an existing id replaces its tokens
+    tree.insert(1, { 7, 8 });
+    assert(tree.get(1) == std::vector<llama_token>({ 7, 8 }));
+    assert(tree.find({ 1, 2, 3, 4 }, ids) == 2 && ids == std::set<int32_t>({ 2, 3 }));
+    assert(tree.find({ 7, 8, 9 },    ids) == 2 && ids == std::set<int32_t>({ 1 }));
+    check_nodes(tree.root, true);
+
+    // removing the branching entries merges the nodes back into one edge
+    tree.remove(3);
+    tree.remove(1);
+    assert(!tree.contains(1) && !tree.contains(3) && tree.contains(2));
+    assert(tree.root.children.size() == 1);
+    assert(tree.root.children.begin()->second->edge == std::vector<llama_token>({ 1, 2, 5 }));
+    assert(check_nodes(tree.root, true) == 2);
+
+    // removing an unknown id does nothing
+    tree.remove(42);
+    assert(tree.size() == 1);
+
+    tree.remove(2);
+    assert(tree.size() == 0 && tree.root.children.empty());
+    assert(tree.find({ 1, 2, 5 }, ids) == 0 && ids.empty());
+
+    // an empty sequence is not an entry
+    tree.insert(4, {});
+    assert(!tree.contains(4));
+}
+
+// random sequences over a small vocabulary, so that they share many prefixes
+static void test_random() {
+    std::mt19937 rng(1234);
+
+    token_prefix_tree tree;
+
+    const int32_t n_ids = 16;
+
+    auto rand_tokens = [&]() {
+        std::vector<llama_token> tokens(rng() % 12);
+        for (auto & t : tokens) {
+            t = rng() % 3;
+        }
+        return tokens;
+    };
+
+    for (int it = 0; it < 20000; ++it) {
+        const int32_t id = rng() % n_ids;
+        if (rng() % 3 == 0) {
+            tree.remove(id);
+            assert(!tree.contains(id));
+        } else {
+            const auto tokens = rand_tokens();
+            tree.insert(id, tokens);
+            assert(tree.contains(id) == !tokens.empty());
+        }
+
+        const auto query = rand_tokens();
+
+        std::set<int32_t> ids;
+        std::set<int32_t> ids_ref;
+        const size_t n     = tree.find(query, ids);
+        const size_t n_ref = find_brute_force(tree, query, ids_ref);
+        assert(n == n_ref);
+        assert(ids == ids_ref);
+
+        if (it % 100 == 0) {
+            check_nodes(tree.root, true);
+        }
+    }
+
+    // once all the entries are removed, no node is left
+    for (int32_t id = 0; id < n_ids; ++id) {
+        tree.remove(id);
+    }
+    assert(tree.size() == 0 && tree.root.children.empty());
+}
+
+int main(void) {
+    test_basic();
+    test_random();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
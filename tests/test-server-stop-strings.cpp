@@ -0,0 +1,157 @@
+// tests the stop string matcher of the server: the text is fed in chunks and each result is compared with a naive
+// search of the stop strings in the whole text with std::string::find
+
+#include "stop-strings.hpp"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+// earliest stop string in text, the shortest one if several start at the same position
+static size_t find_naive(const std::string & text, const std::vector<std::string> & words, std::string & word) {
+    size_t result = std::string::npos;
+    for (const auto & w : words) {
+        const size_t pos = text.find(w);
+        if (pos == std::string::npos) {
+            continue;
+        }
+        if (pos < result || (pos == result && w.size() < word.size())) {
+            result = pos;
+            word   = w;
+        }
+    }
+    return result;
+}
+
+// length of the longest suffix of text that is a prefix of a stop string
+static size_t partial_naive(const std::string & text, const std::vector<std::string> & words) {
+    size_t result = 0;
+    for (const auto & w : words) {
+        for (size_t n = std::min(text.size(), w.size()); n > result; --n) {
+            if (text.compare(text.size() - n, n, w, 0, n) == 0) {
+                result = n;
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+// feeds the chunks until a stop string is found, checking the matcher against the naive search after each chunk
+// returns the position of the stop string, or std::string::npos
+static size_t feed_chunks(stop_string_matcher & matcher, const std::vector<std::string> & words, const std::vector<std::string> & chunks, std::string & word) {
+    matcher.reset();
+
+    std::string text;
+    for (const auto & chunk : chunks) {
+        text += chunk;
+
+        std::string word_ref;
+        const size_t pos_ref = find_naive(text, words, word_ref);
+
+        word.clear();
+        const size_t pos = matcher.feed(chunk, text.size() - chunk.size(), word);
+
+        if (pos != pos_ref || word != word_ref) {
+            fprintf(stderr, "%s: \"%s\": found \"%s\" at %zu instead of \"%s\" at %zu\n", __func__,
+                    text.c_str(), word.c_str(), pos, word_ref.c_str(), pos_ref);
+        }
+        assert(pos == pos_ref && word == word_ref);
+
+        if (pos != std::string::npos) {
+            return pos;
+        }
+
+        const size_t n_partial = partial_naive(text, words);
+        if (matcher.partial() != n_partial) {
+            fprintf(stderr, "%s: \"%s\": partial %zu instead of %zu\n", __func__, text.c_str(), matcher.partial(), n_partial);
+        }
+        assert(matcher.partial() == n_partial);
+    }
+
+    return std::string::npos;
+}
+
+static void test_cases() {
+    stop_string_matcher matcher;
+    std::string word;
+
+    // no stop strings: nothing is found or held back
+    matcher.init({});
+    assert(feed_chunks(matcher, {}, { "hello", " world" }, word) == std::string::npos);
+    assert(matcher.partial() == 0);
+
+    // overlapping stop strings: the earliest start wins when both end in the same chunk
+    const std::vector<std::string> words = { "abcd", "bc" };
+    matcher.init(words);
+    assert(feed_chunks(matcher, words, { "xxabcd" }, word) == 2 && word == "abcd");
+    // but a stop string that ends in an earlier chunk stops the text first
+    assert(feed_chunks(matcher, words, { "xxab", "c", "d" }, word) == 3 && word == "bc");
+
+    // stop strings that share a prefix: the shortest completes first
+    const std::vector<std::string> words_prefix = { "<|end|>", "<|e" };
+    matcher.init(words_prefix);
+    assert(feed_chunks(matcher, words_prefix, { "ok <", "|", "end|>" }, word) == 3 && word == "<|e");
+
+    // the partial stop string is held back across the chunks, and released when the text diverges
+    const std::vector<std::string> words_eos = { "</s>" };
+    matcher.init(words_eos);
+    matcher.reset();
+    assert(matcher.feed("hello <", 0, word) == std::string::npos && matcher.partial() == 1);
+    assert(matcher.feed("/",       7, word) == std::string::npos && matcher.partial() == 2);
+    assert(matcher.feed("x",       8, word) == std::string::npos && matcher.partial() == 0);
+    assert(matcher.feed("</",      9, word) == std::string::npos && matcher.partial() == 2);
+    assert(matcher.feed("s> more", 11, word) == 9 && word == "</s>");
+
+    // a new text starts from the initial state
+    matcher.reset();
+    assert(matcher.partial() == 0);
+    assert(feed_chunks(matcher, words_eos, { "<", "/s", ">" }, word) == 0 && word == "</s>");
+}
+
+// random stop strings and texts over a small alphabet, so that the stop strings overlap and share prefixes
+static void test_random() {
+    std::mt19937 rng(1234);
+
+    auto rand_string = [&](size_t n_min, size_t n_max) {
+        std::string str(n_min + rng() % (n_max - n_min + 1), ' ');
+        for (auto & c : str) {
+            c = 'a' + rng() % 3;
+        }
+        return str;
+    };
+
+    stop_string_matcher matcher;
+
+    for (int it = 0; it < 2000; ++it) {
+        std::vector<std::string> words(rng() % 4);
+        for (auto & w : words) {
+            w = rand_string(1, 6);
+        }
+        matcher.init(words);
+
+        // several texts with the same matcher
+        for (int i_text = 0; i_text < 4; ++i_text) {
+            std::vector<std::string> chunks(1 + rng() % 8);
+            for (auto & chunk : chunks) {
+                chunk = rand_string(0, 5);
+            }
+
+            std::string word;
+            feed_chunks(matcher, words, chunks, word);
+        }
+    }
+}
+
+int main(void) {
+    test_cases();
+    test_random();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+#
+# Measure the tokenizer throughput on the test-tokenizer-0 corpora
+#
+# Usage:
+#
+#   test-tokenizer-0-bench.sh <build-dir> [repeat]
+#
+# Each models/ggml-vocab-<name>.gguf.inp corpus is repeated <repeat> times (default: 512) and tokenized twice,
+# the second time with the words already in the cache of the tokenizer
+#
+
+if [ $# -lt 1 ]; then
+    printf "Usage: $0 <build-dir> [repeat]\n"
+    exit 1
+fi
+
+build=$1
+repeat=${2:-512}
+
+set -e
+
+input=$(mktemp)
+trap 'rm -f $input $input.tokcpp' EXIT
+
+for vocab in ./models/ggml-vocab-*.gguf; do
+    name=$(basename $vocab .gguf)
+
+    if [ ! -f $vocab.inp ]; then
+        continue
+    fi
+
+    : > $input
+    for i in $(seq 1 $repeat); do
+        cat $vocab.inp >> $input
+    done
+
+    printf "%s:\n" $name
+    $build/bin/test-tokenizer-0 $vocab $input 2>&1 | grep "tokenized"
+done
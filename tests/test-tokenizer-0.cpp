@@ -3,6 +3,7 @@
 #include "console.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <map>
 #include <vector>
@@ -123,6 +124,14 @@ static llama_tests read_tests(const std::string & fname_inp, const std::string &
     return tests;
 }
 
+static void set_tokenize_threads(const char * value) {
+#ifdef _WIN32
+    _putenv_s("LLAMA_TOKENIZE_THREADS", value);
+#else
+    setenv("LLAMA_TOKENIZE_THREADS", value, 1);
+#endif
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         fprintf(stderr, "Usage: %s vocab-file [text-file]\n", argv[0]);
@@ -252,6 +261,32 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // long texts are split in chunks tokenized on several threads, the tokens must be the same as in one piece
+    // the text repeats the test inputs, so that the chunk boundaries fall among the cases of the pre-tokenizer
+    if (fname_text.empty()) {
+        std::string text;
+        while (text.size() < 256*1024) {
+            for (const auto & test_kv : k_tests) {
+                text += test_kv.first;
+            }
+        }
+
+        set_tokenize_threads("1");
+        const std::vector<llama_token> res_one = llama_tokenize(ctx, text, add_special, false);
+        set_tokenize_threads("4");
+        const std::vector<llama_token> res_split = llama_tokenize(ctx, text, add_special, false);
+        set_tokenize_threads("");
+
+        if (res_split != res_one) {
+            size_t i = 0;
+            while (i < res_one.size() && i < res_split.size() && res_one[i] == res_split[i]) {
+                i++;
+            }
+            fprintf(stderr, "%s : error: the tokens of a %zu bytes text split in chunks differ from token %zu\n", __func__, text.size(), i);
+            success = false;
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
@@ -277,7 +312,23 @@ int main(int argc, char **argv) {
 
             const auto t_end = ggml_time_us();
 
-            fprintf(stderr, "%s : tokenized in %.3f ms (cpp)\n", __func__, (t_end - t_start) / 1000.0);
+            fprintf(stderr, "%s : tokenized in %.3f ms (cpp), %.3f MB/s\n", __func__, (t_end - t_start) / 1000.0, text.size() / (double) (t_end - t_start));
+        }
+
+        // the second pass finds the words in the cache of the tokenizer
+        {
+            const auto t_start = ggml_time_us();
+
+            const auto res_warm = llama_tokenize(ctx, text, add_special, false);
+
+            const auto t_end = ggml_time_us();
+
+            fprintf(stderr, "%s : tokenized again in %.3f ms (cpp, warm cache), %.3f MB/s\n", __func__, (t_end - t_start) / 1000.0, text.size() / (double) (t_end - t_start));
+
+            if (res_warm != res) {
+                fprintf(stderr, "%s : error: tokens differ between the two passes\n", __func__);
+                success = false;
+            }
         }
 
         fprintf(stderr, "%s : tokens: %zu\n", __func__, res.size());
@@ -0,0 +1,240 @@
+// tests the tree attention of llama_set_tree: the branches of a draft tree are decoded in one batch of a single
+// sequence, and the logits of each token must be the same as decoding its branch alone as a linear sequence
+// llama_kv_cache_tree_accept must then keep only the accepted path, for both the contiguous and the paged cache
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const int n_prompt  = 10;
+static const int n_ubatch  = 16;
+static const int n_seq_max = 2;
+
+static llama_context * init_ctx(llama_model * model, uint32_t kv_block_size) {
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx         = 256;
+    cparams.n_batch       = 64;
+    cparams.n_ubatch      = n_ubatch;
+    cparams.n_seq_max     = n_seq_max;
+    cparams.kv_block_size = kv_block_size;
+    return llama_new_context_with_model(model, cparams);
+}
+
+static llama_token prompt_token(int pos) {
+    return 1 + (pos * 19) % 200;
+}
+
+// the draft tree, all in sequence 0 after the prompt:
+//
+//   0 - 1 - 3
+//     \ 2 - 4 - 5
+//   6
+//
+static const llama_token tree_tokens[] = { 21, 34, 55, 89, 144, 233, 42 };
+static const int32_t     tree_parent[] = { -1,  0,  0,  1,   2,   4, -1 };
+static const int         n_tree        = 7;
+
+// the path from the prompt to token i of the tree
+static std::vector<int32_t> tree_path(int32_t i) {
+    std::vector<int32_t> res;
+    for (int32_t k = i; k >= 0; k = tree_parent[k]) {
+        res.push_back(k);
+    }
+    std::reverse(res.begin(), res.end());
+    return res;
+}
+
+static std::vector<float> logits_ith(llama_context * ctx, int32_t i) {
+    const float * logits = llama_get_logits_ith(ctx, i);
+    return std::vector<float>(logits, logits + llama_n_vocab(llama_get_model(ctx)));
+}
+
+// decodes the prompt, the tokens of a branch and then each of the next tokens in sequence 0 of a new context, and
+// returns the logits of the last token
+// the results of the matmuls depend on the number of rows of the batch, so the batches are the same as with the tree:
+// the branch is padded to the size of the tree batch with tokens of sequence 1
+static std::vector<float> decode_linear(llama_model * model, uint32_t kv_block_size, const std::vector<llama_token> & tokens, const std::vector<llama_token> & tokens_next = {}) {
+    llama_context * ctx = init_ctx(model, kv_block_size);
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+    for (int i = 0; i < n_prompt; ++i) {
+        llama_batch_add(batch, prompt_token(i), i, { 0 }, false);
+    }
+    assert(llama_decode(ctx, batch) == 0);
+
+    llama_batch_clear(batch);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        llama_batch_add(batch, tokens[i], n_prompt + i, { 0 }, true);
+    }
+    for (int i = 0; batch.n_tokens < n_tree; ++i) {
+        llama_batch_add(batch, prompt_token(i), i, { 1 }, false);
+    }
+    assert(llama_decode(ctx, batch) == 0);
+
+    for (size_t i = 0; i < tokens_next.size(); ++i) {
+        llama_batch_clear(batch);
+        llama_batch_add(batch, tokens_next[i], n_prompt + tokens.size() + i, { 0 }, true);
+        assert(llama_decode(ctx, batch) == 0);
+    }
+
+    std::vector<float> res = logits_ith(ctx, -1);
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+// the positions of the cells of each sequence, sorted
+static std::vector<std::vector<llama_pos>> seq_positions(const llama_context * ctx) {
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, n_seq_max);
+    llama_kv_cache_view_update(ctx, &view);
+
+    std::vector<std::vector<llama_pos>> res(n_seq_max);
+    for (int32_t i = 0; i < view.n_cells; ++i) {
+        for (int32_t s = 0; s < view.n_seq_max; ++s) {
+            const llama_seq_id seq_id = view.cells_sequences[i*view.n_seq_max + s];
+            if (seq_id >= 0) {
+                res[seq_id].push_back(view.cells[i].pos);
+            }
+        }
+    }
+    for (auto & positions : res) {
+        std::sort(positions.begin(), positions.end());
+    }
+
+    llama_kv_cache_view_free(&view);
+
+    return res;
+}
+
+static void check_logits(const char * what, int32_t i, const std::vector<float> & a, const std::vector<float> & b) {
+    float max_diff = 0.0f;
+    for (size_t k = 0; k < a.size(); ++k) {
+        max_diff = std::max(max_diff, std::fabs(a[k] - b[k]));
+    }
+    if (max_diff > 1e-3f) {
+        fprintf(stderr, "%s: %s %d: the logits differ by %f\n", __func__, what, i, max_diff);
+    }
+    assert(max_diff <= 1e-3f);
+}
+
+static void test_tree(llama_model * model, uint32_t kv_block_size) {
+    fprintf(stderr, "%s: kv_block_size = %u\n", __func__, kv_block_size);
+
+    llama_context * ctx = init_ctx(model, kv_block_size);
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    for (int i = 0; i < n_prompt; ++i) {
+        llama_batch_add(batch, prompt_token(i), i, { 0 }, false);
+    }
+    assert(llama_decode(ctx, batch) == 0);
+
+    // the whole tree in one batch, the branches share the sequence and the positions
+    llama_batch_clear(batch);
+    for (int i = 0; i < n_tree; ++i) {
+        llama_batch_add(batch, tree_tokens[i], n_prompt + tree_path(i).size() - 1, { 0 }, true);
+    }
+    assert(llama_set_tree(ctx, tree_parent, n_tree) == 0);
+    assert(llama_decode(ctx, batch) == 0);
+
+    for (int32_t i = 0; i < n_tree; ++i) {
+        std::vector<llama_token> tokens;
+        for (const int32_t k : tree_path(i)) {
+            tokens.push_back(tree_tokens[k]);
+        }
+        check_logits("tree token", i, decode_linear(model, kv_block_size, tokens), logits_ith(ctx, i));
+    }
+
+    // accept the path 0 - 2 - 4 - 5
+    const std::vector<int32_t> accepted = tree_path(5);
+    llama_kv_cache_tree_accept(ctx, accepted.data(), accepted.size());
+    llama_kv_cache_update(ctx);
+
+    const int n_past = n_prompt + accepted.size();
+
+    std::vector<llama_pos> positions_ref;
+    for (llama_pos pos = 0; pos < n_past; ++pos) {
+        positions_ref.push_back(pos);
+    }
+    const auto positions = seq_positions(ctx);
+    if (positions[0] != positions_ref) {
+        fprintf(stderr, "%s: the cache holds %zu cells instead of %d after the tree accept\n", __func__, positions[0].size(), n_past);
+    }
+    assert(positions[0] == positions_ref);
+    assert(llama_get_kv_cache_used_cells(ctx) == n_past);
+
+    // the kept cells continue the accepted path like a linear sequence
+    std::vector<llama_token> tokens;
+    for (const int32_t k : accepted) {
+        tokens.push_back(tree_tokens[k]);
+    }
+
+    llama_batch_clear(batch);
+    llama_batch_add(batch, 7, n_past, { 0 }, true);
+    assert(llama_decode(ctx, batch) == 0);
+    check_logits("after the accept, token", n_past, decode_linear(model, kv_block_size, tokens, { 7 }), logits_ith(ctx, -1));
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+}
+
+static void test_invalid(llama_model * model) {
+    llama_context * ctx = init_ctx(model, 0);
+
+    // parents must come before their children
+    const int32_t parent_self[]  = { -1, 1 };
+    const int32_t parent_after[] = { -1, 2, 0 };
+    const int32_t parent_range[] = { -2 };
+    assert(llama_set_tree(ctx, parent_self,  2) == -1);
+    assert(llama_set_tree(ctx, parent_after, 3) == -1);
+    assert(llama_set_tree(ctx, parent_range, 1) == -1);
+
+    // a tree batch larger than n_ubatch is rejected by the decode, and the tree is cleared
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    std::vector<int32_t> parent_chain(n_ubatch + 1);
+    for (int i = 0; i <= n_ubatch; ++i) {
+        parent_chain[i] = i - 1;
+        llama_batch_add(batch, prompt_token(i), i, { 0 }, i == n_ubatch);
+    }
+    assert(llama_set_tree(ctx, parent_chain.data(), parent_chain.size()) == 0);
+    assert(llama_decode(ctx, batch) < 0);
+    assert(llama_get_kv_cache_used_cells(ctx) == 0);
+
+    assert(llama_decode(ctx, batch) == 0);
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(model_path, llama_model_default_params());
+    assert(model != nullptr);
+
+    for (uint32_t kv_block_size : { 0, 16 }) {
+        test_tree(model, kv_block_size);
+    }
+
+    test_invalid(model);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+// tests the weight cache files: the repack cache is written by the first load, mapped by the next loads, and ignored
+// and written again when it does not match the model - the same for the shared weights, that the first load also maps
+// in place of its own buffers
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#undef NDEBUG
+#include <cassert>
+
+static std::string g_log;
+
+static void log_callback(ggml_log_level level, const char * text, void * user_data) {
+    (void) level;
+    (void) user_data;
+    g_log += text;
+}
+
+static bool log_has(const char * str) {
+    return g_log.find(str) != std::string::npos;
+}
+
+static void copy_file(const std::string & src, const std::string & dst, size_t n_extra = 0) {
+    std::ifstream fin(src, std::ios::binary);
+    std::ofstream fout(dst, std::ios::binary);
+    assert(fin && fout);
+    fout << fin.rdbuf();
+    const std::vector<char> extra(n_extra, 0);
+    fout.write(extra.data(), extra.size());
+}
+
+// loads the model with the repack cache or the shared weights and returns the logits of the last token of a short prompt
+static std::vector<float> eval(const std::string & path, const char * shm_name = nullptr) {
+    g_log.clear();
+
+    auto mparams = llama_model_default_params();
+    mparams.use_repack       = true;
+    mparams.use_repack_cache = shm_name == nullptr;
+    mparams.shm_name         = shm_name;
+    mparams.use_mlock        = shm_name != nullptr; // the buffers replaced by the shared weights are unlocked
+
+    llama_model * model = llama_load_model_from_file(path.c_str(), mparams);
+    assert(model != nullptr);
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 64;
+    cparams.n_threads = 2;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx != nullptr);
+
+    std::vector<llama_token> tokens(8);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        tokens[i] = (llama_token) ((i * 7 + 1) % llama_n_vocab(model));
+    }
+    assert(llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size(), 0, 0)) == 0);
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    std::vector<float> res(logits, logits + llama_n_vocab(model));
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+    llama_log_set(log_callback, nullptr);
+
+    // work on a copy, the test modifies the model file
+    const std::string path  = "test-weight-cache.gguf";
+    const std::string cache = path + ".repack";
+    copy_file(model_path, path);
+    std::remove(cache.c_str());
+
+    // first load: the cache is written, if the model has repacked weights on this host
+    const std::vector<float> ref = eval(path);
+    if (!log_has("saved the weights")) {
+        fprintf(stderr, "%s: the model has no repacked weights on this host, skipping the repack cache\n", __func__);
+    } else {
+        // second load: the cache is mapped
+        assert(eval(path) == ref);
+        assert(log_has("mapped the repacked weights"));
+
+        // the key in the cache does not match: the cache is ignored and written again
+        {
+            std::fstream f(cache, std::ios::in | std::ios::out | std::ios::binary);
+            assert(f);
+            f.seekp(8);
+            const uint64_t key = 0;
+            f.write((const char *) &key, sizeof(key));
+        }
+        assert(eval(path) == ref);
+        assert(log_has("does not match") && log_has("saved the weights"));
+        assert(eval(path) == ref);
+        assert(log_has("mapped the repacked weights"));
+
+        // the model file changed: the cache is ignored and written again
+        copy_file(model_path, path, 32);
+        assert(eval(path) == ref);
+        assert(log_has("does not match") && log_has("saved the weights"));
+
+        std::remove(cache.c_str());
+    }
+
+#ifdef __linux__
+    // shared weights: the first load writes them and maps them in place of its buffers, the next loads map them
+    {
+        const std::string shm_name = "test-weight-cache-" + std::to_string(getpid());
+        const std::string shm_path = "/dev/shm/" + shm_name;
+
+        assert(eval(path, shm_name.c_str()) == ref);
+        assert(log_has("saved the weights") && log_has("mapped the weights"));
+
+        struct stat st;
+        assert(stat(shm_path.c_str(), &st) == 0);
+        assert((st.st_mode & (S_IWGRP | S_IWOTH)) == 0);
+
+        assert(eval(path, shm_name.c_str()) == ref);
+        assert(!log_has("saved the weights") && log_has("mapped the weights"));
+
+        // writable by the other users: not used, written again
+        assert(chmod(shm_path.c_str(), 0666) == 0);
+        assert(eval(path, shm_name.c_str()) == ref);
+        assert(log_has("writable by other users") && log_has("saved the weights"));
+        assert(stat(shm_path.c_str(), &st) == 0);
+        assert((st.st_mode & (S_IWGRP | S_IWOTH)) == 0);
+
+        std::remove(shm_path.c_str());
+    }
+#endif
+
+    std::remove(path.c_str());
+
+    llama_log_set(nullptr, nullptr);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}